@@ -0,0 +1,294 @@
+/*	@file main-async.c
+**	@brief Checks that async responses answer the request they were started for.
+**
+**	Copyright (C) 2011,2012 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// The server keeps every request with smcp_start_async_response()
+// and answers it later from a transaction of its own. While answering,
+// it describes the request as smcp_outbound_set_async_response() gave
+// it back: the options a handler may look at must all be there, the
+// ones describing the request body and its preconditions must not,
+// and the answer must reach the client's transaction.
+//
+// A request whose options don't fit in a record must get 4.13.
+//
+// A record must hold nothing but the address, the two lengths and the
+// buffer, and the test reports how big that makes it.
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <smcp/assert-macros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <smcp/smcp.h>
+
+#define ASYNC_TIMEOUT			(5)	// Seconds
+
+typedef struct {
+	const char* path;
+	const char* expected;
+	int expected_code;
+
+	smcp_t client;
+	char url[128];
+	struct smcp_transaction_s transaction;
+	bool finished;
+	int code;
+	char payload[128];
+} async_client_s;
+
+static struct smcp_async_response_s gAsyncResponse;
+static struct smcp_transaction_s gAnswer;
+static bool gHolding;
+
+static smcp_status_t
+hold_request_handler(void* context) {
+	smcp_status_t status;
+
+	if(smcp_inbound_is_dupe()) {
+		smcp_outbound_begin_response(COAP_CODE_EMPTY);
+		smcp_outbound_send();
+		return SMCP_STATUS_OK;
+	}
+
+	// Sends the empty ACK, or 4.13 if the request doesn't fit.
+	status = smcp_start_async_response(&gAsyncResponse, 0);
+
+	if(status == SMCP_STATUS_OK)
+		gHolding = true;
+
+	return status;
+}
+
+static smcp_status_t
+answer_resend(void* context) {
+	char path[SMCP_MAX_URI_LENGTH + 1];
+	const uint8_t* value;
+	size_t value_len;
+	int accept = -1;
+	smcp_status_t status;
+
+	status = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_set_async_response(&gAsyncResponse);
+	require_noerr(status, bail);
+
+	smcp_inbound_get_path(path, SMCP_GET_PATH_LEADING_SLASH|SMCP_GET_PATH_INCLUDE_QUERY);
+
+	if(smcp_inbound_find_option(COAP_OPTION_ACCEPT, &value, &value_len))
+		accept = (int)coap_decode_uint32(value, (uint8_t)value_len);
+
+	status = smcp_outbound_set_content_formatted(
+		"%s %s accept=%d%s%s",
+		coap_code_to_cstr(smcp_inbound_get_code()),
+		path,
+		accept,
+		smcp_inbound_find_option(COAP_OPTION_CONTENT_TYPE, NULL, NULL) ? " content-format" : "",
+		smcp_inbound_find_option(COAP_OPTION_IF_MATCH, NULL, NULL) ? " if-match" : ""
+	);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_send();
+
+bail:
+	return status;
+}
+
+static smcp_status_t
+answer_response(int statuscode, void* context) {
+	smcp_finish_async_response(&gAsyncResponse);
+	gHolding = false;
+	return SMCP_STATUS_OK;
+}
+
+static smcp_status_t
+resend_request(void* context) {
+	async_client_s* const self = context;
+	smcp_status_t status;
+
+	status = smcp_outbound_begin(smcp_get_current_instance(), COAP_METHOD_POST, COAP_TRANS_TYPE_CONFIRMABLE);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_set_uri(self->url, 0);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_add_option(COAP_OPTION_IF_MATCH, "\x01\x02\x03\x04", 4);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_add_option_uint(COAP_OPTION_CONTENT_TYPE, COAP_CONTENT_TYPE_TEXT_PLAIN);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_add_option_uint(COAP_OPTION_ACCEPT, COAP_CONTENT_TYPE_APPLICATION_JSON);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_append_content("This body isn't kept.", SMCP_CSTR_LEN);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_send();
+
+bail:
+	return status;
+}
+
+static smcp_status_t
+response_handler(int statuscode, void* context) {
+	async_client_s* const self = context;
+
+	if(statuscode >= 0) {
+		self->code = statuscode;
+		snprintf(self->payload, sizeof(self->payload), "%.*s",
+			(int)smcp_inbound_get_content_len(), smcp_inbound_get_content_ptr());
+	} else if(!self->code) {
+		self->code = statuscode;
+	}
+
+	self->finished = true;
+
+	return SMCP_STATUS_OK;
+}
+
+static bool
+run_request(smcp_t server, async_client_s* self) {
+	time_t give_up = time(NULL) + ASYNC_TIMEOUT;
+	bool answering = false;
+
+	snprintf(self->url, sizeof(self->url), "coap://[::1]:%d%s", smcp_get_port(server), self->path);
+
+	smcp_transaction_init(
+		&self->transaction,
+		0,
+		&resend_request,
+		&response_handler,
+		self
+	);
+	smcp_transaction_begin(self->client, &self->transaction, ASYNC_TIMEOUT*MSEC_PER_SEC);
+
+	while(!self->finished && time(NULL) < give_up) {
+		smcp_process(self->client, 0);
+		smcp_process(server, 0);
+
+		if(gHolding && !answering) {
+			answering = true;
+			smcp_transaction_init(
+				&gAnswer,
+				0,
+				&answer_resend,
+				&answer_response,
+				NULL
+			);
+			smcp_transaction_begin(server, &gAnswer, ASYNC_TIMEOUT*MSEC_PER_SEC);
+		}
+	}
+
+	// Let the server see the ACK for its answer.
+	while(gHolding && time(NULL) < give_up) {
+		smcp_process(self->client, 0);
+		smcp_process(server, 0);
+	}
+
+	smcp_transaction_end(self->client, &self->transaction);
+
+	if(self->code != self->expected_code) {
+		fprintf(stderr, "async: %s: got %d, expected %d\n", self->path, self->code, self->expected_code);
+		return false;
+	}
+
+	if(self->expected && strcmp(self->payload, self->expected)) {
+		fprintf(stderr, "async: %s: expected \"%s\"\n", self->path, self->expected);
+		fprintf(stderr, "async: %s:      got \"%s\"\n", self->path, self->payload);
+		return false;
+	}
+
+	return true;
+}
+
+//!	Checks that nothing but padding for request_len is added around the buffer.
+static bool
+check_record_size(void) {
+	// The address, the one-byte socklen, a byte of padding and request_len.
+	const size_t expected = sizeof(struct sockaddr_in6) + 4 + SMCP_CONF_ASYNC_RESPONSE_MAX_LENGTH;
+
+	fprintf(stderr, "async: a record is %d bytes\n", (int)sizeof(struct smcp_async_response_s));
+
+	if(sizeof(struct smcp_async_response_s) != expected) {
+		fprintf(stderr, "async: expected %d bytes\n", (int)expected);
+		return false;
+	}
+
+	return true;
+}
+
+int
+main(int argc, char * argv[]) {
+	smcp_t server = NULL;
+	smcp_t client = NULL;
+	int ret = EXIT_FAILURE;
+	async_client_s fits = {
+		// Kept, this comes to more than 64 bytes but no more than 80.
+		.path = "/sensors/outdoor-temperature-north-side/temp?unit=c&fmt=json",
+		.expected = "POST /sensors/outdoor-temperature-north-side/temp?unit=c;fmt=json accept=50",
+		.expected_code = COAP_RESULT_205_CONTENT,
+	};
+	async_client_s too_big = {
+		.path = "/a-rather-long-path-segment/and-another-long-one/and-then-one-more-on-top-of-it",
+		.expected = NULL,
+		.expected_code = COAP_RESULT_413_REQUEST_ENTITY_TOO_LARGE,
+	};
+
+	require(check_record_size(), bail);
+
+	server = smcp_create(0);
+	client = smcp_create(0);
+	require(server && client, bail);
+
+	smcp_set_default_request_handler(server, &hold_request_handler, NULL);
+
+	fits.client = client;
+	too_big.client = client;
+
+	require(run_request(server, &fits), bail);
+	require(run_request(server, &too_big), bail);
+
+	ret = EXIT_SUCCESS;
+
+bail:
+	if(client)
+		smcp_release(client);
+
+	if(server)
+		smcp_release(server);
+
+	fprintf(stderr, "async: %s\n", (ret == EXIT_SUCCESS) ? "ok" : "FAILED");
+
+	return ret;
+}
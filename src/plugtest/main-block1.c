@@ -0,0 +1,275 @@
+/*	@file main-block1.c
+**	@brief Checks that Block1 uploads are put back together.
+**
+**	Copyright (C) 2011,2012 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Two clients upload different bodies to the same resource at the same
+// time, one from a buffer and one through a reader, each in several
+// Block1 blocks. The server collects them with
+// smcp_inbound_collect_block1(), and must see each body exactly once,
+// whole and unmixed. A body over SMCP_CONF_BLOCK1_UPLOAD_MAX_SIZE must
+// get 4.13, and a block that arrives without the ones before it 4.08.
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <smcp/assert-macros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <smcp/smcp.h>
+#include "test-helpers.h"
+
+#define BLOCK1_TIMEOUT			(10)	// Seconds
+#define RECEIVED_MAX			(4)
+
+typedef struct {
+	smcp_t client;
+	char* body;
+	size_t len;
+	bool use_reader;
+	int expected_code;
+
+	test_request_s request;
+} upload_s;
+
+static struct {
+	char* body;
+	size_t len;
+} gReceived[RECEIVED_MAX];
+static int gReceivedCount;
+
+static smcp_status_t
+upload_request_handler(void* context) {
+	smcp_status_t status;
+
+	if(smcp_inbound_get_code() != COAP_METHOD_POST)
+		return SMCP_STATUS_NOT_ALLOWED;
+
+	status = smcp_inbound_collect_block1();
+	if(status)
+		return status;
+
+	if(gReceivedCount < RECEIVED_MAX) {
+		gReceived[gReceivedCount].len = smcp_inbound_get_content_len();
+		gReceived[gReceivedCount].body = malloc(smcp_inbound_get_content_len());
+		if(gReceived[gReceivedCount].body)
+			memcpy(gReceived[gReceivedCount].body, smcp_inbound_get_content_ptr(), smcp_inbound_get_content_len());
+	}
+	gReceivedCount++;
+
+	status = smcp_outbound_begin_response(COAP_RESULT_204_CHANGED);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_send();
+
+bail:
+	return status;
+}
+
+static smcp_status_t
+read_body(void* context, size_t offset, char* buffer, size_t len) {
+	upload_s* const self = context;
+
+	require(offset + len <= self->len, bail);
+
+	memcpy(buffer, self->body + offset, len);
+	return SMCP_STATUS_OK;
+
+bail:
+	return SMCP_STATUS_FAILURE;
+}
+
+static bool
+start_upload(smcp_t server, upload_s* self, size_t len, unsigned int seed) {
+	size_t i;
+
+	self->body = malloc(len);
+	require(self->body, bail);
+
+	self->len = len;
+
+	// Different for every block and every upload.
+	for(i = 0; i < len; i++)
+		self->body[i] = (char)(seed * 31 + i * 7 + i / 251);
+
+	test_request_init(&self->request, COAP_METHOD_POST, 0, "coap://[::1]:%d/upload", smcp_get_port(server));
+
+	if(self->use_reader)
+		smcp_transaction_set_block1_reader(&self->request.transaction, &read_body, self, len);
+	else
+		smcp_transaction_set_block1_buffer(&self->request.transaction, self->body, len);
+
+	return smcp_transaction_begin(self->client, &self->request.transaction, BLOCK1_TIMEOUT*MSEC_PER_SEC) == SMCP_STATUS_OK;
+
+bail:
+	return false;
+}
+
+static bool
+finish_upload(upload_s* self, const char* label) {
+	smcp_transaction_end(self->client, &self->request.transaction);
+
+	if(!self->request.finished) {
+		fprintf(stderr, "block1: %s upload never finished\n", label);
+		return false;
+	}
+
+	if(self->request.code != self->expected_code) {
+		fprintf(stderr, "block1: %s upload finished with %d, expected %d\n", label, self->request.code, self->expected_code);
+		return false;
+	}
+
+	return true;
+}
+
+//!	Returns how many of the bodies the server got are exactly `self->body`.
+static int
+count_received(const upload_s* self) {
+	int i, ret = 0;
+
+	for(i = 0; i < gReceivedCount && i < RECEIVED_MAX; i++) {
+		if((gReceived[i].len == self->len) && gReceived[i].body && !memcmp(gReceived[i].body, self->body, self->len))
+			ret++;
+	}
+
+	return ret;
+}
+
+//!	Sends block 1 of an upload whose block 0 the server never saw.
+static bool
+check_missing_block(smcp_t server) {
+	uint8_t packet[128];
+	struct coap_header_s* const header = (struct coap_header_s*)packet;
+	uint8_t* iter;
+	const uint8_t block1 = (1 << 4) | (1 << 3) | 2;	// num 1, more, 64 bytes
+	ssize_t len = -1;
+	int fd;
+	bool ret = false;
+
+	fd = test_raw_open();
+	require(fd >= 0, bail);
+
+	memset(header, 0, sizeof(*header));
+	header->version = COAP_VERSION;
+	header->tt = COAP_TRANS_TYPE_CONFIRMABLE;
+	header->code = COAP_METHOD_POST;
+	header->msg_id = htons(0x4242);
+
+	iter = coap_encode_option(header->token, 0, COAP_OPTION_URI_PATH, (const uint8_t*)"upload", 6);
+	iter = coap_encode_option(iter, COAP_OPTION_URI_PATH, COAP_OPTION_BLOCK1, &block1, 1);
+	*iter++ = 0xFF;
+	memset(iter, 'x', 64);
+	iter += 64;
+
+	len = test_raw_exchange(server, fd, packet, iter - packet, packet, sizeof(packet), BLOCK1_TIMEOUT);
+
+	if(len < (ssize_t)sizeof(*header)) {
+		fprintf(stderr, "block1: no answer to a block out of nowhere\n");
+	} else if(header->code != COAP_RESULT_408_REQUEST_INCOMPLETE) {
+		fprintf(stderr, "block1: a block out of nowhere got %s\n", coap_code_to_cstr(header->code));
+	} else {
+		ret = true;
+	}
+
+bail:
+	if(fd >= 0)
+		close(fd);
+	return ret;
+}
+
+int
+main(int argc, char * argv[]) {
+	smcp_t server = NULL;
+	upload_s from_buffer = { .expected_code = COAP_RESULT_204_CHANGED };
+	upload_s from_reader = { .expected_code = COAP_RESULT_204_CHANGED, .use_reader = true };
+	upload_s too_big = { .expected_code = COAP_RESULT_413_REQUEST_ENTITY_TOO_LARGE };
+	int ret = EXIT_FAILURE;
+	int i;
+
+	server = smcp_create(0);
+	from_buffer.client = smcp_create(0);
+	from_reader.client = smcp_create(0);
+	require(server && from_buffer.client && from_reader.client, bail);
+
+	smcp_set_default_request_handler(server, &upload_request_handler, NULL);
+
+	// Neither is a whole number of blocks.
+	require(start_upload(server, &from_buffer, 5000, 1), bail);
+	require(start_upload(server, &from_reader, 3333, 2), bail);
+
+	// Both keep going while waiting for either.
+	test_process_until(&from_buffer.request.finished, BLOCK1_TIMEOUT, from_buffer.client, from_reader.client, server, NULL);
+	test_process_until(&from_reader.request.finished, BLOCK1_TIMEOUT, from_buffer.client, from_reader.client, server, NULL);
+
+	require(finish_upload(&from_buffer, "buffer"), bail);
+	require(finish_upload(&from_reader, "reader"), bail);
+
+	if((gReceivedCount != 2) || (count_received(&from_buffer) != 1) || (count_received(&from_reader) != 1)) {
+		fprintf(stderr, "block1: server got %d bodies, %d matching the buffer and %d the reader\n",
+			gReceivedCount, count_received(&from_buffer), count_received(&from_reader));
+		goto bail;
+	}
+
+	too_big.client = from_buffer.client;
+	require(start_upload(server, &too_big, SMCP_CONF_BLOCK1_UPLOAD_MAX_SIZE + 1, 3), bail);
+
+	test_process_until(&too_big.request.finished, BLOCK1_TIMEOUT, too_big.client, server, NULL);
+
+	require(finish_upload(&too_big, "oversized"), bail);
+
+	if(gReceivedCount != 2) {
+		fprintf(stderr, "block1: the oversized body reached the handler\n");
+		goto bail;
+	}
+
+	require(check_missing_block(server), bail);
+
+	ret = EXIT_SUCCESS;
+
+bail:
+	if(from_buffer.client)
+		smcp_release(from_buffer.client);
+
+	if(from_reader.client)
+		smcp_release(from_reader.client);
+
+	if(server)
+		smcp_release(server);
+
+	free(from_buffer.body);
+	free(from_reader.body);
+	free(too_big.body);
+
+	for(i = 0; i < gReceivedCount && i < RECEIVED_MAX; i++)
+		free(gReceived[i].body);
+
+	return test_finish("block1", ret);
+}
@@ -0,0 +1,256 @@
+/*	@file main-block2.c
+**	@brief Checks that Block2 transfers are put back together.
+**
+**	Copyright (C) 2011,2012 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+// A client fetches a representation of many small Block2 blocks with
+// SMCP_TRANSACTION_BLOCK2_AUTO into a buffer. The server answers each
+// block by hand, so every request reaches its handler. With a window
+// of four, the client must ask for four blocks at once as soon as it
+// knows the size, and must still put them together in order. Then the
+// representation changes in the middle of a transfer: the client must
+// see SMCP_STATUS_ETAG_MISMATCH once, start over, and end up with the
+// new representation only.
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <smcp/assert-macros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <smcp/smcp.h>
+#include "test-helpers.h"
+
+#define BLOCK2_TIMEOUT			(10)	// Seconds
+#define BLOCK2_LEN				(1000)	// Not a whole number of blocks
+#define BLOCK2_SZX				(2)		// 64 bytes
+#define BLOCK2_WINDOW			(4)
+
+static int gVersion;
+static int gRequests;
+static bool gFirstServed;
+
+//!	The version changes right after this block is served, if not negative.
+static int gChangeAfterBlock = -1;
+
+static char
+body_byte(int version, size_t i) {
+	return (char)('a' + (i * 7 + i / 26 + version * 11) % 26);
+}
+
+static smcp_status_t
+block2_request_handler(void* context) {
+	smcp_status_t status;
+	const uint8_t* value = NULL;
+	size_t value_len = 0;
+	uint32_t block2 = BLOCK2_SZX;	// Block zero, if not asked for
+	uint8_t szx;
+	size_t offset, len, i;
+	char etag = (char)gVersion;
+	char content[1 << (BLOCK2_SZX + 4)];
+
+	if(smcp_inbound_get_code() != COAP_METHOD_GET)
+		return SMCP_STATUS_NOT_ALLOWED;
+
+	if(smcp_inbound_find_option(COAP_OPTION_BLOCK2, &value, &value_len))
+		block2 = coap_decode_uint32(value, (uint8_t)value_len);
+
+	szx = MIN(block2 & 0x7, BLOCK2_SZX);
+	offset = (size_t)(block2 >> 4) << ((block2 & 0x7) + 4);
+	if(offset >= BLOCK2_LEN)
+		return SMCP_STATUS_BAD_OPTION;
+
+	len = MIN(BLOCK2_LEN - offset, (size_t)1 << (szx + 4));
+	for(i = 0; i < len; i++)
+		content[i] = body_byte(gVersion, offset + i);
+
+	block2 = (uint32_t)((offset >> (szx + 4)) << 4) | szx;
+	if(offset + len < BLOCK2_LEN)
+		block2 |= (1 << 3);
+
+	gRequests++;
+	gFirstServed = true;
+
+	status = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_add_option(COAP_OPTION_ETAG, &etag, sizeof(etag));
+	require_noerr(status, bail);
+
+	status = smcp_outbound_add_option_uint(COAP_OPTION_BLOCK2, block2);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_add_option_uint(COAP_OPTION_SIZE, BLOCK2_LEN);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_append_content(content, len);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_send();
+
+	if((int)(block2 >> 4) == gChangeAfterBlock) {
+		gChangeAfterBlock = -1;
+		gVersion++;
+	}
+
+bail:
+	return status;
+}
+
+static bool
+check_body(const test_request_s* request, int version, const char* label) {
+	size_t i;
+
+	if(!request->finished || (request->code != COAP_RESULT_205_CONTENT)) {
+		fprintf(stderr, "block2: %s fetch finished with %d\n", label, request->code);
+		return false;
+	}
+
+	if(request->content_len != BLOCK2_LEN) {
+		fprintf(stderr, "block2: %s fetch got %d bytes\n", label, (int)request->content_len);
+		return false;
+	}
+
+	for(i = 0; i < BLOCK2_LEN; i++) {
+		if(request->content[i] != body_byte(version, i)) {
+			fprintf(stderr, "block2: %s fetch differs at byte %d\n", label, (int)i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+//!	Fetches with a window, pausing once to see how many blocks are asked for at once.
+static bool
+check_window(smcp_t server, smcp_t client, char* buffer, char* content) {
+	test_request_s request = {};
+	bool ret = false;
+	int i;
+
+	test_request_init(&request, COAP_METHOD_GET, SMCP_TRANSACTION_BLOCK2_AUTO, "coap://[::1]:%d/block2", smcp_get_port(server));
+	request.content = content;
+	request.content_size = BLOCK2_LEN;
+	smcp_transaction_set_block2_buffer(&request.transaction, buffer, BLOCK2_LEN);
+	smcp_transaction_set_block2_window(&request.transaction, BLOCK2_WINDOW);
+	require_noerr(smcp_transaction_begin(client, &request.transaction, BLOCK2_TIMEOUT*MSEC_PER_SEC), bail);
+
+	// Stop as soon as the server has answered block zero. The client
+	// then learns the size and asks for the window in one go, which
+	// the server only gets to read once the client has had its turn.
+	require(test_process_until(&gFirstServed, BLOCK2_TIMEOUT, client, server, NULL), bail);
+
+	for(i = 0; i < 10; i++)
+		smcp_process(client, 10);
+
+	for(i = 0; i < 10; i++)
+		smcp_process(server, 10);
+
+	if(gRequests != 1 + BLOCK2_WINDOW) {
+		fprintf(stderr, "block2: %d requests were outstanding at once, expected %d\n", gRequests - 1, BLOCK2_WINDOW);
+		goto bail;
+	}
+
+	test_process_until(&request.finished, BLOCK2_TIMEOUT, client, server, NULL);
+
+	ret = check_body(&request, gVersion, "windowed");
+
+	if(request.etag_mismatches) {
+		fprintf(stderr, "block2: windowed fetch started over %d times\n", request.etag_mismatches);
+		ret = false;
+	}
+
+bail:
+	smcp_transaction_end(client, &request.transaction);
+	return ret;
+}
+
+//!	Changes the representation after block three and expects a restart.
+static bool
+check_etag_change(smcp_t server, smcp_t client, char* buffer, char* content) {
+	test_request_s request = {};
+	bool ret = false;
+
+	gChangeAfterBlock = 3;
+
+	test_request_init(&request, COAP_METHOD_GET, SMCP_TRANSACTION_BLOCK2_AUTO, "coap://[::1]:%d/block2", smcp_get_port(server));
+	request.content = content;
+	request.content_size = BLOCK2_LEN;
+	smcp_transaction_set_block2_buffer(&request.transaction, buffer, BLOCK2_LEN);
+	smcp_transaction_set_block2_window(&request.transaction, BLOCK2_WINDOW);
+	require_noerr(smcp_transaction_begin(client, &request.transaction, BLOCK2_TIMEOUT*MSEC_PER_SEC), bail);
+
+	test_process_until(&request.finished, BLOCK2_TIMEOUT, client, server, NULL);
+
+	if(gChangeAfterBlock >= 0) {
+		fprintf(stderr, "block2: block %d was never served\n", gChangeAfterBlock);
+		goto bail;
+	}
+
+	if(request.etag_mismatches != 1) {
+		fprintf(stderr, "block2: changed fetch started over %d times, expected once\n", request.etag_mismatches);
+		goto bail;
+	}
+
+	ret = check_body(&request, gVersion, "changed");
+
+bail:
+	smcp_transaction_end(client, &request.transaction);
+	return ret;
+}
+
+int
+main(int argc, char * argv[]) {
+	smcp_t server = NULL;
+	smcp_t client = NULL;
+	static char buffer[BLOCK2_LEN];
+	static char content[BLOCK2_LEN];
+	int ret = EXIT_FAILURE;
+
+	server = smcp_create(0);
+	client = smcp_create(0);
+	require(server && client, bail);
+
+	smcp_set_default_request_handler(server, &block2_request_handler, NULL);
+
+	require(check_window(server, client, buffer, content), bail);
+	require(check_etag_change(server, client, buffer, content), bail);
+
+	ret = EXIT_SUCCESS;
+
+bail:
+	if(client)
+		smcp_release(client);
+
+	if(server)
+		smcp_release(server);
+
+	return test_finish("block2", ret);
+}
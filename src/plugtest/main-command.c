@@ -0,0 +1,407 @@
+/*	@file main-command.c
+**	@brief Checks commands posted to an instance from other threads.
+**
+**	Copyright (C) 2011,2012 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Several threads post numbered commands to an instance while the main
+// thread runs smcp_process() on it. Every command must run exactly
+// once, on the main thread, and each thread's commands must run in the
+// order it posted them.
+//
+// Then the main thread waits in smcp_process() with nothing else to do,
+// and a command posted from another thread must wake it right away.
+//
+// Last, a client observes a resource on a second instance and makes a
+// request that the server answers asynchronously. Another thread posts
+// the trigger for the observable, and a command that sends the async
+// response. The notification and the response must both reach the
+// client.
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <smcp/assert-macros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <smcp/smcp.h>
+#include <smcp/smcp-observable.h>
+#include "test-helpers.h"
+
+#define POSTER_COUNT			4
+#define COMMANDS_PER_POSTER		5000
+#define COMMAND_TIMEOUT			(10)	// Seconds
+#define WAKEUP_WAIT				(5*MSEC_PER_SEC)
+
+typedef struct {
+	smcp_t instance;
+	int index;
+	pthread_t thread;
+} poster_s;
+
+static pthread_t gProtocolThread;
+static int gNextSeq[POSTER_COUNT];
+static int gRun;
+static bool gFailed;
+static bool gWoken;
+
+static struct smcp_observable_s gObservable;
+static int gVersion;
+static struct smcp_async_response_s gAsyncResponse;
+static struct smcp_transaction_s gAnswer;
+static bool gHolding;
+static bool gAnswered;
+
+static void
+numbered_command(smcp_t self, void* context) {
+	const intptr_t value = (intptr_t)context;
+	const int index = (int)(value >> 24);
+	const int seq = (int)(value & 0xFFFFFF);
+
+	if(!pthread_equal(pthread_self(), gProtocolThread)) {
+		fprintf(stderr, "command: ran on the wrong thread\n");
+		gFailed = true;
+	}
+
+	if(seq != gNextSeq[index]) {
+		fprintf(stderr, "command: poster %d's command %d ran when %d was next\n", index, seq, gNextSeq[index]);
+		gFailed = true;
+	}
+
+	gNextSeq[index] = seq + 1;
+	gRun++;
+}
+
+static void*
+poster_main(void* context) {
+	poster_s* const self = context;
+	int i;
+
+	for(i = 0; i < COMMANDS_PER_POSTER; i++) {
+		const intptr_t value = ((intptr_t)self->index << 24) | i;
+
+		if(smcp_post_command(self->instance, &numbered_command, (void*)value) != SMCP_STATUS_OK) {
+			fprintf(stderr, "command: poster %d couldn't post\n", self->index);
+			gFailed = true;
+			break;
+		}
+
+		// Give the main thread a chance to take a batch now and then.
+		if(!(i % 500))
+			usleep(100);
+	}
+
+	return NULL;
+}
+
+static void
+wakeup_command(smcp_t self, void* context) {
+	gWoken = true;
+}
+
+static void*
+late_poster_main(void* context) {
+	usleep(100*1000);
+	smcp_post_command((smcp_t)context, &wakeup_command, NULL);
+	return NULL;
+}
+
+static smcp_timestamp_t
+elapsed_ms(const struct timespec* start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (smcp_timestamp_t)(now.tv_sec - start->tv_sec) * MSEC_PER_SEC
+		+ (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static smcp_status_t
+server_request_handler(void* context) {
+	char path[16] = "";
+	smcp_status_t status;
+
+	smcp_inbound_get_path(path, 0);
+
+	if(!strcmp(path, "async")) {
+		if(smcp_inbound_is_dupe()) {
+			smcp_outbound_begin_response(COAP_CODE_EMPTY);
+			smcp_outbound_send();
+			return SMCP_STATUS_OK;
+		}
+
+		status = smcp_start_async_response(&gAsyncResponse, 0);
+		if(status == SMCP_STATUS_OK)
+			gHolding = true;
+		return status;
+	}
+
+	status = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
+	require_noerr(status, bail);
+
+	status = smcp_observable_update(&gObservable, 0);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_set_content_formatted("%d", gVersion);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_send();
+
+bail:
+	return status;
+}
+
+static smcp_status_t
+answer_resend(void* context) {
+	smcp_status_t status;
+
+	status = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_set_async_response(&gAsyncResponse);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_append_content("later", SMCP_CSTR_LEN);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_send();
+
+bail:
+	return status;
+}
+
+static smcp_status_t
+answer_response(int statuscode, void* context) {
+	smcp_finish_async_response(&gAsyncResponse);
+	gAnswered = true;
+	return SMCP_STATUS_OK;
+}
+
+//!	Runs on the server's thread, like a request handler would.
+static void
+send_answer_command(smcp_t self, void* context) {
+	if(!pthread_equal(pthread_self(), gProtocolThread))
+		gFailed = true;
+
+	smcp_transaction_init(&gAnswer, 0, &answer_resend, &answer_response, NULL);
+	smcp_transaction_begin(self, &gAnswer, COMMAND_TIMEOUT*MSEC_PER_SEC);
+}
+
+static void
+set_version_command(smcp_t self, void* context) {
+	gVersion = (int)(intptr_t)context;
+}
+
+//!	What a sensor thread would do when it has something new for the server.
+static void*
+sensor_main(void* context) {
+	smcp_t const server = context;
+
+	// Commands run in order, so the trigger sees the new version.
+	smcp_post_command(server, &set_version_command, (void*)(intptr_t)1);
+	smcp_post_observable_trigger(server, &gObservable, 0, 0);
+	smcp_post_command(server, &send_answer_command, NULL);
+
+	return NULL;
+}
+
+typedef struct {
+	struct smcp_transaction_s transaction;
+	char url[64];
+	int responses;
+	int version;
+	bool notified;
+} observe_client_s;
+
+static smcp_status_t
+observe_resend(void* context) {
+	observe_client_s* const self = context;
+	smcp_status_t status;
+
+	status = smcp_outbound_begin(smcp_get_current_instance(), COAP_METHOD_GET, COAP_TRANS_TYPE_CONFIRMABLE);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_set_uri(self->url, 0);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_send();
+
+bail:
+	return status;
+}
+
+static smcp_status_t
+observe_response(int statuscode, void* context) {
+	observe_client_s* const self = context;
+	char payload[16] = "";
+
+	if(statuscode != COAP_RESULT_205_CONTENT || smcp_inbound_get_content_len() >= sizeof(payload))
+		return SMCP_STATUS_OK;
+
+	memcpy(payload, smcp_inbound_get_content_ptr(), smcp_inbound_get_content_len());
+	self->version = atoi(payload);
+
+	if(self->responses++)
+		self->notified = true;
+
+	return SMCP_STATUS_OK;
+}
+
+static bool
+check_posted_from_sensor(void) {
+	smcp_t server = NULL;
+	smcp_t client = NULL;
+	observe_client_s observer = {};
+	test_request_s request = {};
+	char content[16] = "";
+	pthread_t sensor;
+	bool sensor_started = false;
+	bool ret = false;
+
+	server = smcp_create(0);
+	client = smcp_create(0);
+	require(server && client, bail);
+
+	smcp_set_default_request_handler(server, &server_request_handler, NULL);
+
+	snprintf(observer.url, sizeof(observer.url), "coap://[::1]:%d/obs", smcp_get_port(server));
+	smcp_transaction_init(&observer.transaction, SMCP_TRANSACTION_OBSERVE, &observe_resend, &observe_response, &observer);
+	smcp_transaction_begin(client, &observer.transaction, 30*MSEC_PER_SEC);
+
+	test_request_init(&request, COAP_METHOD_GET, 0, "coap://[::1]:%d/async", smcp_get_port(server));
+	request.content = content;
+	request.content_size = sizeof(content) - 1;
+	smcp_transaction_begin(client, &request.transaction, COMMAND_TIMEOUT*MSEC_PER_SEC);
+
+	if(!test_process_until(&gHolding, COMMAND_TIMEOUT, client, server, NULL) || !observer.responses) {
+		fprintf(stderr, "command: client never got through to the server\n");
+		goto bail;
+	}
+
+	require(0 == pthread_create(&sensor, NULL, &sensor_main, server), bail);
+	sensor_started = true;
+
+	test_process_until(&observer.notified, COMMAND_TIMEOUT, client, server, NULL);
+
+	if(!observer.notified || (observer.version != 1)) {
+		fprintf(stderr, "command: posted trigger didn't notify the observer (version %d)\n", observer.version);
+		goto bail;
+	}
+
+	test_process_until(&request.finished, COMMAND_TIMEOUT, client, server, NULL);
+
+	if((request.code != COAP_RESULT_205_CONTENT) || strcmp(content, "later")) {
+		fprintf(stderr, "command: posted async response finished with %d \"%s\"\n", request.code, content);
+		goto bail;
+	}
+
+	// Let the server see the acknowledgement.
+	test_process_until(&gAnswered, COMMAND_TIMEOUT, client, server, NULL);
+
+	ret = !gFailed;
+
+bail:
+	if(sensor_started)
+		pthread_join(sensor, NULL);
+
+	if(client) {
+		smcp_transaction_end(client, &observer.transaction);
+		smcp_transaction_end(client, &request.transaction);
+		smcp_release(client);
+	}
+
+	if(server)
+		smcp_release(server);
+
+	return ret;
+}
+
+int
+main(int argc, char * argv[]) {
+	smcp_t instance = NULL;
+	poster_s posters[POSTER_COUNT] = {};
+	pthread_t late_poster;
+	struct timespec start;
+	time_t give_up = time(NULL) + COMMAND_TIMEOUT;
+	int ret = EXIT_FAILURE;
+	int i;
+
+	gProtocolThread = pthread_self();
+
+	instance = smcp_create(0);
+	require(instance, bail);
+
+	for(i = 0; i < POSTER_COUNT; i++) {
+		posters[i].instance = instance;
+		posters[i].index = i;
+		require(0 == pthread_create(&posters[i].thread, NULL, &poster_main, &posters[i]), bail);
+	}
+
+	while((gRun < POSTER_COUNT*COMMANDS_PER_POSTER) && !gFailed && time(NULL) < give_up)
+		smcp_process(instance, 100);
+
+	for(i = 0; i < POSTER_COUNT; i++)
+		pthread_join(posters[i].thread, NULL);
+
+	fprintf(stderr, "command: %d/%d run, %d at most in a batch\n",
+		gRun, POSTER_COUNT*COMMANDS_PER_POSTER, (int)smcp_get_stats(instance)->command_batch_max);
+
+	require(!gFailed, bail);
+
+	if((gRun != POSTER_COUNT*COMMANDS_PER_POSTER) || (smcp_get_stats(instance)->commands_run != (uint32_t)gRun)) {
+		fprintf(stderr, "command: not every command ran\n");
+		goto bail;
+	}
+
+	// Nothing else will wake the instance up.
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	require(0 == pthread_create(&late_poster, NULL, &late_poster_main, instance), bail);
+
+	while(!gWoken && (elapsed_ms(&start) < WAKEUP_WAIT))
+		smcp_process(instance, WAKEUP_WAIT);
+
+	pthread_join(late_poster, NULL);
+
+	if(!gWoken || (elapsed_ms(&start) >= WAKEUP_WAIT)) {
+		fprintf(stderr, "command: a posted command didn't wake the instance\n");
+		goto bail;
+	}
+
+	require(check_posted_from_sensor(), bail);
+
+	ret = EXIT_SUCCESS;
+
+bail:
+	if(instance)
+		smcp_release(instance);
+
+	return test_finish("command", ret);
+}
@@ -0,0 +1,133 @@
+/*	@file main-dns.c
+**	@brief Checks that host names are looked up without blocking.
+**
+**	Copyright (C) 2011,2012 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// A client sends to "localhost", which the resolver thread answers from
+// the hosts file. The client's clock is frozen, so the 100ms retry that
+// transactions fall back on never comes due: the request only goes out
+// if the finished lookup is handed back to the instance. A second
+// request must be answered from the cache.
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <smcp/assert-macros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <smcp/smcp.h>
+#include "test-helpers.h"
+
+#define DNS_TIMEOUT				(5)	// Seconds
+
+static smcp_status_t
+hello_request_handler(void* context) {
+	smcp_status_t status;
+
+	status = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_append_content("hello", SMCP_CSTR_LEN);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_send();
+
+bail:
+	return status;
+}
+
+static smcp_timestamp_t
+frozen_clock(void* context) {
+	return 1000;
+}
+
+static bool
+run_request(smcp_t server, smcp_t client, const char* label) {
+	test_request_s request;
+
+	test_request_init(&request, COAP_METHOD_GET, 0, "coap://localhost:%d/dns", smcp_get_port(server));
+	smcp_transaction_begin(client, &request.transaction, DNS_TIMEOUT*MSEC_PER_SEC);
+
+	test_process_until(&request.finished, DNS_TIMEOUT, client, server, NULL);
+
+	smcp_transaction_end(client, &request.transaction);
+
+	if(!request.finished) {
+		fprintf(stderr, "dns: %s request never went out\n", label);
+		return false;
+	}
+
+	if(request.code != COAP_RESULT_205_CONTENT) {
+		fprintf(stderr, "dns: %s request finished with %d\n", label, request.code);
+		return false;
+	}
+
+	return true;
+}
+
+int
+main(int argc, char * argv[]) {
+	smcp_t server = NULL;
+	smcp_t client = NULL;
+	const struct smcp_stats_s* stats;
+	int ret = EXIT_FAILURE;
+
+	server = smcp_create(0);
+	client = smcp_create(0);
+	require(server && client, bail);
+
+	smcp_set_default_request_handler(server, &hello_request_handler, NULL);
+	smcp_set_clock(client, &frozen_clock, NULL);
+	stats = smcp_get_stats(client);
+
+	require(run_request(server, client, "first"), bail);
+
+	if(stats->dns_cache_misses != 1) {
+		fprintf(stderr, "dns: %d lookups for the first request\n", (int)stats->dns_cache_misses);
+		goto bail;
+	}
+
+	require(run_request(server, client, "second"), bail);
+
+	if((stats->dns_cache_misses != 1) || !stats->dns_cache_hits) {
+		fprintf(stderr, "dns: second request wasn't answered from the cache\n");
+		goto bail;
+	}
+
+	ret = EXIT_SUCCESS;
+
+bail:
+	if(client)
+		smcp_release(client);
+
+	if(server)
+		smcp_release(server);
+
+	return test_finish("dns", ret);
+}
@@ -0,0 +1,198 @@
+/*	@file main-inbound.c
+**	@brief Checks that requests with lots of options are handled.
+**
+**	Copyright (C) 2011,2012 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Sends a hand-built request with more Uri-Path segments than
+// SMCP_CONF_MAX_INBOUND_OPTIONS, followed by a Uri-Query and an
+// Accept option, straight from a UDP socket. The server answers with
+// the path and query it saw and the Accept value it found, which
+// must all include the options that didn't fit in the option index.
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <smcp/assert-macros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <smcp/smcp.h>
+
+#define PATH_SEGMENT_COUNT		40
+#define INBOUND_TIMEOUT			(5)	// Seconds
+
+static smcp_status_t
+echo_path_request_handler(void* context) {
+	char path[SMCP_MAX_URI_LENGTH + 1];
+	const uint8_t* value = NULL;
+	size_t value_len = 0;
+	smcp_status_t status;
+
+	smcp_inbound_get_path(path, SMCP_GET_PATH_LEADING_SLASH|SMCP_GET_PATH_INCLUDE_QUERY);
+
+	if(!smcp_inbound_find_option(COAP_OPTION_ACCEPT, &value, &value_len))
+		value_len = 0;
+
+	status = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_set_content_formatted(
+		"%s accept=%d",
+		path,
+		value_len ? (int)coap_decode_uint32(value, (uint8_t)value_len) : -1
+	);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_send();
+
+bail:
+	return status;
+}
+
+//!	Builds a GET for /s0/s1/.../?q=1 with an Accept option.
+static size_t
+build_request(uint8_t* packet, char* expected, size_t expected_size) {
+	struct coap_header_s* const header = (struct coap_header_s*)packet;
+	uint8_t* iter;
+	coap_option_key_t prev_key = 0;
+	char segment[8];
+	const uint8_t accept = COAP_CONTENT_TYPE_APPLICATION_JSON;
+	int i;
+
+	memset(header, 0, sizeof(*header));
+	header->version = COAP_VERSION;
+	header->tt = COAP_TRANS_TYPE_CONFIRMABLE;
+	header->code = COAP_METHOD_GET;
+	header->msg_id = htons(0x1234);
+
+	iter = (uint8_t*)header->token;
+	expected[0] = 0;
+
+	for(i = 0; i < PATH_SEGMENT_COUNT; i++) {
+		snprintf(segment, sizeof(segment), "s%d", i);
+		iter = coap_encode_option(iter, prev_key, COAP_OPTION_URI_PATH, (const uint8_t*)segment, strlen(segment));
+		prev_key = COAP_OPTION_URI_PATH;
+		strlcat(expected, "/", expected_size);
+		strlcat(expected, segment, expected_size);
+	}
+
+	iter = coap_encode_option(iter, prev_key, COAP_OPTION_URI_QUERY, (const uint8_t*)"q=1", 3);
+	prev_key = COAP_OPTION_URI_QUERY;
+	strlcat(expected, "?q=1", expected_size);
+
+	iter = coap_encode_option(iter, prev_key, COAP_OPTION_ACCEPT, &accept, 1);
+	snprintf(expected + strlen(expected), expected_size - strlen(expected), " accept=%d", accept);
+
+	return iter - packet;
+}
+
+int
+main(int argc, char * argv[]) {
+	smcp_t server = NULL;
+	int fd = -1;
+	struct sockaddr_in6 saddr = {};
+	uint8_t packet[SMCP_MAX_PACKET_LENGTH];
+	char expected[SMCP_MAX_URI_LENGTH];
+	size_t packet_len;
+	ssize_t response_len = -1;
+	time_t give_up = time(NULL) + INBOUND_TIMEOUT;
+	int ret = EXIT_FAILURE;
+
+	server = smcp_create(0);
+	require(server, bail);
+
+	smcp_set_default_request_handler(server, &echo_path_request_handler, NULL);
+
+	fd = socket(AF_INET6, SOCK_DGRAM, 0);
+	require(fd >= 0, bail);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+
+	saddr.sin6_family = AF_INET6;
+	saddr.sin6_port = htons(smcp_get_port(server));
+	saddr.sin6_addr = in6addr_loopback;
+
+	packet_len = build_request(packet, expected, sizeof(expected));
+	require(coap_verify_packet((const char*)packet, packet_len), bail);
+
+	require(sendto(fd, packet, packet_len, 0, (struct sockaddr*)&saddr, sizeof(saddr)) == (ssize_t)packet_len, bail);
+
+	while(response_len < 0 && time(NULL) < give_up) {
+		smcp_process(server, 0);
+		response_len = recv(fd, packet, sizeof(packet), 0);
+	}
+
+	if(response_len < 0) {
+		fprintf(stderr, "inbound: no response to a request with %d path segments\n", PATH_SEGMENT_COUNT);
+		goto bail;
+	}
+
+	{
+		const struct coap_header_s* const header = (const struct coap_header_s*)packet;
+		const uint8_t* iter = header->token + header->token_len;
+		const uint8_t* const end = packet + response_len;
+		coap_option_key_t key = 0;
+		const uint8_t* value;
+		size_t value_len;
+
+		require(coap_verify_packet((const char*)packet, response_len), bail);
+
+		if(header->code != COAP_RESULT_205_CONTENT) {
+			fprintf(stderr, "inbound: got %s\n", coap_code_to_cstr(header->code));
+			goto bail;
+		}
+
+		while(iter < end && iter[0] != 0xFF)
+			iter = coap_decode_option(iter, &key, &value, &value_len);
+
+		if(iter < end)
+			iter++;
+
+		if(((size_t)(end - iter) != strlen(expected)) || (0 != memcmp(iter, expected, end - iter))) {
+			fprintf(stderr, "inbound: expected \"%s\"\n", expected);
+			fprintf(stderr, "inbound:      got \"%.*s\"\n", (int)(end - iter), iter);
+			goto bail;
+		}
+	}
+
+	ret = EXIT_SUCCESS;
+
+bail:
+	if(fd >= 0)
+		close(fd);
+
+	if(server)
+		smcp_release(server);
+
+	return ret;
+}
@@ -0,0 +1,198 @@
+/*	@file main-iov.c
+**	@brief Checks that gathered content goes out as if it were contiguous.
+**
+**	Copyright (C) 2011,2012 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+// A handler answers either with content appended the usual way or with
+// the same content in several buffers given to
+// smcp_outbound_set_content_iov(). Both answers must be the same bytes
+// on the wire, whether sent directly, replayed from the response cache
+// for a duplicate request, or sent later from the send queue. The
+// handler scribbles over its buffers as soon as smcp_outbound_send()
+// returns, so any copy made too late shows up.
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <smcp/assert-macros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <smcp/smcp.h>
+#include "test-helpers.h"
+
+#define IOV_TIMEOUT			(5)	// Seconds
+
+static const char* const gPieces[] = { "Gathered ", "from ", "several buffers, ", "", "not one." };
+#define PIECE_COUNT			(int)(sizeof(gPieces) / sizeof(*gPieces))
+
+static bool gUseIov;
+static int gHandlerCalls;
+
+//!	How many packets the socket got during the handler's last send.
+static uint32_t gSentBySend;
+
+static smcp_status_t
+iov_request_handler(void* context) {
+	smcp_status_t status;
+	char buffers[PIECE_COUNT][32];
+	struct iovec iov[PIECE_COUNT];
+	uint32_t sent;
+	int i;
+
+	gHandlerCalls++;
+
+	status = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_add_option_uint(COAP_OPTION_CONTENT_TYPE, COAP_CONTENT_TYPE_TEXT_PLAIN);
+	require_noerr(status, bail);
+
+	for(i = 0; i < PIECE_COUNT; i++) {
+		if(gUseIov) {
+			strcpy(buffers[i], gPieces[i]);
+			iov[i].iov_base = buffers[i];
+			iov[i].iov_len = strlen(gPieces[i]);
+		} else {
+			status = smcp_outbound_append_content(gPieces[i], strlen(gPieces[i]));
+			require_noerr(status, bail);
+		}
+	}
+
+	if(gUseIov) {
+		status = smcp_outbound_set_content_iov(iov, PIECE_COUNT);
+		require_noerr(status, bail);
+	}
+
+	sent = smcp_get_stats(smcp_get_current_instance())->send_packets;
+
+	status = smcp_outbound_send();
+
+	gSentBySend = smcp_get_stats(smcp_get_current_instance())->send_packets - sent;
+
+	memset(buffers, 'X', sizeof(buffers));
+
+bail:
+	return status;
+}
+
+static ssize_t
+request(smcp_t server, int fd, coap_msg_id_t msg_id, uint8_t* response, size_t response_size) {
+	uint8_t packet[64];
+	struct coap_header_s* const header = (struct coap_header_s*)packet;
+	uint8_t* iter;
+
+	memset(header, 0, sizeof(*header));
+	header->version = COAP_VERSION;
+	header->tt = COAP_TRANS_TYPE_CONFIRMABLE;
+	header->code = COAP_METHOD_GET;
+	header->msg_id = htons(msg_id);
+
+	iter = coap_encode_option(header->token, 0, COAP_OPTION_URI_PATH, (const uint8_t*)"data", 4);
+
+	return test_raw_exchange(server, fd, packet, iter - packet, response, response_size, IOV_TIMEOUT);
+}
+
+//!	True if `len` bytes of `response` are `expected` with a different message ID.
+static bool
+same_but_msg_id(const uint8_t* expected, ssize_t expected_len, uint8_t* response, ssize_t len, const char* label) {
+	if(len < (ssize_t)sizeof(struct coap_header_s)) {
+		fprintf(stderr, "iov: no answer %s\n", label);
+		return false;
+	}
+
+	((struct coap_header_s*)response)->msg_id = ((const struct coap_header_s*)expected)->msg_id;
+
+	if((len != expected_len) || memcmp(response, expected, len)) {
+		fprintf(stderr, "iov: %d bytes %s differ from the %d contiguous ones\n", (int)len, label, (int)expected_len);
+		return false;
+	}
+
+	return true;
+}
+
+int
+main(int argc, char * argv[]) {
+	smcp_t server = NULL;
+	uint8_t flat[128];
+	uint8_t gathered[128];
+	ssize_t flat_len, len;
+	int fd = -1;
+	int ret = EXIT_FAILURE;
+
+	server = smcp_create(0);
+	require(server, bail);
+
+	fd = test_raw_open();
+	require(fd >= 0, bail);
+
+	smcp_set_default_request_handler(server, &iov_request_handler, NULL);
+
+	flat_len = request(server, fd, 0x100, flat, sizeof(flat));
+	require(flat_len > (ssize_t)sizeof(struct coap_header_s), bail);
+
+	gUseIov = true;
+
+	len = request(server, fd, 0x101, gathered, sizeof(gathered));
+	require(same_but_msg_id(flat, flat_len, gathered, len, "sent directly"), bail);
+
+	// The same request again is answered from the response cache.
+	len = request(server, fd, 0x101, gathered, sizeof(gathered));
+	require(same_but_msg_id(flat, flat_len, gathered, len, "from the response cache"), bail);
+
+	if((gHandlerCalls != 2) || (smcp_get_stats(server)->response_cache_hits != 1)) {
+		fprintf(stderr, "iov: handler ran %d times for three requests, with %u cache hits\n",
+			gHandlerCalls, (unsigned)smcp_get_stats(server)->response_cache_hits);
+		goto bail;
+	}
+
+	smcp_set_send_queue_enabled(server, true);
+
+	len = request(server, fd, 0x102, gathered, sizeof(gathered));
+	require(same_but_msg_id(flat, flat_len, gathered, len, "from the send queue"), bail);
+
+	if(gSentBySend) {
+		fprintf(stderr, "iov: the answer didn't go through the send queue\n");
+		goto bail;
+	}
+
+	ret = EXIT_SUCCESS;
+
+bail:
+	if(fd >= 0)
+		close(fd);
+
+	if(server)
+		smcp_release(server);
+
+	return test_finish("iov", ret);
+}
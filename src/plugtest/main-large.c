@@ -0,0 +1,229 @@
+/*	@file main-large.c
+**	@brief Checks that large responses are served from the block cache.
+**
+**	Copyright (C) 2011,2012 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+// A client fetches a representation several Block2 blocks long from a
+// handler that uses smcp_outbound_send_large(). Every block must carry
+// the same ETag and a Size2 of the whole length, and together they
+// must add up to what the handler generated. Only the first block may
+// call the handler: the others must come from the large response
+// cache, which counts them in `large_response_hits`.
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <smcp/assert-macros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <smcp/smcp.h>
+#include "test-helpers.h"
+
+#define LARGE_TIMEOUT			(10)	// Seconds
+#define LARGE_LEN				(5000)	// Not a whole number of blocks
+
+typedef struct {
+	char url[128];
+	struct smcp_transaction_s transaction;
+
+	char content[LARGE_LEN + 1];
+	size_t content_len;
+
+	uint8_t etag[8];
+	size_t etag_len;
+	uint32_t size2;
+	int blocks;
+	bool mismatch;
+
+	bool finished;
+	int code;
+} fetch_s;
+
+static char gBody[LARGE_LEN];
+static int gHandlerCalls;
+
+static smcp_status_t
+generate_body(smcp_large_content_t content, void* context) {
+	return smcp_large_content_append(content, gBody, sizeof(gBody));
+}
+
+static smcp_status_t
+large_request_handler(void* context) {
+	smcp_status_t status;
+
+	if(smcp_inbound_get_code() != COAP_METHOD_GET)
+		return SMCP_STATUS_NOT_ALLOWED;
+
+	gHandlerCalls++;
+
+	status = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_send_large(&generate_body, NULL);
+
+bail:
+	return status;
+}
+
+static smcp_status_t
+fetch_resend(void* context) {
+	fetch_s* const self = context;
+	smcp_status_t status;
+
+	status = smcp_outbound_begin(smcp_get_current_instance(), COAP_METHOD_GET, COAP_TRANS_TYPE_CONFIRMABLE);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_set_uri(self->url, 0);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_send();
+
+bail:
+	return status;
+}
+
+//!	Called once per block, since the transaction has no Block2 buffer.
+static smcp_status_t
+fetch_response(int statuscode, void* context) {
+	fetch_s* const self = context;
+	const uint8_t* value = NULL;
+	size_t value_len = 0;
+	size_t len;
+
+	if(statuscode == SMCP_STATUS_TRANSACTION_INVALIDATED)
+		return SMCP_STATUS_OK;
+
+	if(statuscode != COAP_RESULT_205_CONTENT) {
+		self->code = statuscode;
+		self->finished = true;
+		return SMCP_STATUS_OK;
+	}
+
+	smcp_inbound_find_option(COAP_OPTION_ETAG, &value, &value_len);
+	if(!self->blocks) {
+		self->etag_len = MIN(value_len, sizeof(self->etag));
+		memcpy(self->etag, value, self->etag_len);
+	} else if((value_len != self->etag_len) || memcmp(value, self->etag, value_len)) {
+		self->mismatch = true;
+	}
+
+	if(smcp_inbound_find_option(COAP_OPTION_SIZE, &value, &value_len))
+		self->size2 = coap_decode_uint32(value, (uint8_t)value_len);
+	else
+		self->size2 = 0;
+
+	len = MIN(smcp_inbound_get_content_len(), sizeof(self->content) - self->content_len);
+	memcpy(self->content + self->content_len, smcp_inbound_get_content_ptr(), len);
+	self->content_len += len;
+	self->blocks++;
+
+	// The last block is the one without the "more" flag.
+	if(	!smcp_inbound_find_option(COAP_OPTION_BLOCK2, &value, &value_len)
+		|| !(coap_decode_uint32(value, (uint8_t)value_len) & (1<<3))
+	) {
+		self->code = statuscode;
+		self->finished = true;
+	}
+
+	return SMCP_STATUS_OK;
+}
+
+int
+main(int argc, char * argv[]) {
+	smcp_t server = NULL;
+	smcp_t client = NULL;
+	static fetch_s fetch;
+	int ret = EXIT_FAILURE;
+	size_t i;
+
+	for(i = 0; i < sizeof(gBody); i++)
+		gBody[i] = (char)('a' + (i * 7 + i / 26) % 26);
+
+	server = smcp_create(0);
+	client = smcp_create(0);
+	require(server && client, bail);
+
+	smcp_set_default_request_handler(server, &large_request_handler, NULL);
+
+	snprintf(fetch.url, sizeof(fetch.url), "coap://[::1]:%d/large", smcp_get_port(server));
+	smcp_transaction_init(
+		&fetch.transaction,
+		SMCP_TRANSACTION_BLOCK2_AUTO,
+		&fetch_resend,
+		&fetch_response,
+		&fetch
+	);
+	require_noerr(smcp_transaction_begin(client, &fetch.transaction, LARGE_TIMEOUT*MSEC_PER_SEC), bail);
+
+	test_process_until(&fetch.finished, LARGE_TIMEOUT, client, server, NULL);
+	smcp_transaction_end(client, &fetch.transaction);
+
+	if(!fetch.finished || (fetch.code != COAP_RESULT_205_CONTENT)) {
+		fprintf(stderr, "large: fetch finished with %d after %d blocks\n", fetch.code, fetch.blocks);
+		goto bail;
+	}
+
+	if(fetch.blocks < 2) {
+		fprintf(stderr, "large: %d bytes came in %d block\n", LARGE_LEN, fetch.blocks);
+		goto bail;
+	}
+
+	if((fetch.etag_len != 4) || fetch.mismatch) {
+		fprintf(stderr, "large: ETag was %d bytes long and %s\n", (int)fetch.etag_len, fetch.mismatch ? "changed" : "the same throughout");
+		goto bail;
+	}
+
+	if(fetch.size2 != LARGE_LEN) {
+		fprintf(stderr, "large: Size2 was %u, expected %d\n", (unsigned)fetch.size2, LARGE_LEN);
+		goto bail;
+	}
+
+	if((fetch.content_len != LARGE_LEN) || memcmp(fetch.content, gBody, LARGE_LEN)) {
+		fprintf(stderr, "large: got %d bytes back, not the %d generated\n", (int)fetch.content_len, LARGE_LEN);
+		goto bail;
+	}
+
+	if((gHandlerCalls != 1) || (smcp_get_stats(server)->large_response_hits != (uint32_t)fetch.blocks - 1)) {
+		fprintf(stderr, "large: handler ran %d times and the cache served %u of %d blocks\n",
+			gHandlerCalls, (unsigned)smcp_get_stats(server)->large_response_hits, fetch.blocks);
+		goto bail;
+	}
+
+	ret = EXIT_SUCCESS;
+
+bail:
+	if(client)
+		smcp_release(client);
+
+	if(server)
+		smcp_release(server);
+
+	return test_finish("large", ret);
+}
@@ -0,0 +1,628 @@
+/*	@file main-notify.c
+**	@brief Checks that notifications are rendered once and copied to each observer.
+**
+**	Copyright (C) 2011,2012 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+// Several observers, each a plain socket with its own token, observe
+// the same resource. A trigger must call the resource handler once,
+// and every observer must get a copy with its own token, message ID
+// and Observe value. An observer that registered later has a lower
+// Observe value than the others. With SMCP_OBSERVABLE_FLAG_PER_OBSERVER
+// the handler must instead render each observer's notification itself.
+//
+// The server runs on a virtual clock. With a minimum period, triggers
+// that come too soon must be folded into one later notification. A
+// confirmable notification that hasn't been acknowledged must be
+// replaced by the next one, which stays confirmable and takes a new
+// message ID. An observer that never acknowledges anything must be
+// dropped when its confirmable notification times out, however often
+// the resource keeps changing.
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <smcp/assert-macros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <smcp/smcp.h>
+#include <smcp/smcp-observable.h>
+#include "test-helpers.h"
+
+#define NOTIFY_TIMEOUT			(5)	// Seconds
+#define OBSERVER_COUNT			(3)
+#define DEAD_KEY				(1)
+
+typedef struct {
+	int fd;
+	uint8_t token[2];
+
+	//!	Set for observers that don't acknowledge confirmable notifications.
+	bool silent;
+
+	//!	The latest notification.
+	int count;
+	coap_transaction_type_t tt;
+	coap_msg_id_t msg_id;
+	uint32_t observe;
+	char content[32];
+} observer_s;
+
+static struct smcp_observable_s gObservable;
+static int gVersion;
+static int gRenders;
+static bool gPerObserver;
+static smcp_timestamp_t gNow = 1000000;
+
+static smcp_timestamp_t
+virtual_clock(void* context) {
+	return gNow;
+}
+
+static smcp_status_t
+notify_request_handler(void* context) {
+	smcp_status_t status;
+	const struct coap_header_s* const inbound = smcp_inbound_get_packet();
+	const uint8_t* path = NULL;
+	size_t path_len = 0;
+	uint8_t key = 0;
+
+	gRenders++;
+
+	smcp_inbound_find_option(COAP_OPTION_URI_PATH, &path, &path_len);
+	if((path_len == 4) && !memcmp(path, "dead", 4))
+		key = DEAD_KEY;
+
+	status = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
+	require_noerr(status, bail);
+
+	status = smcp_observable_update(&gObservable, key);
+	require_noerr(status, bail);
+
+	// Only right for the observer that asked when rendered per observer.
+	if(gPerObserver && inbound->token_len)
+		status = smcp_outbound_set_content_formatted("%d/%02x", gVersion, inbound->token[0]);
+	else
+		status = smcp_outbound_set_content_formatted("%d", gVersion);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_send();
+
+bail:
+	return status;
+}
+
+//!	Takes `len` bytes of `packet` apart, if they are for `self`.
+static bool
+observer_parse(observer_s* self, const uint8_t* packet, ssize_t len) {
+	const struct coap_header_s* const header = (const struct coap_header_s*)packet;
+	const uint8_t* iter = header->token + header->token_len;
+	const uint8_t* const end = packet + len;
+	coap_option_key_t key = 0;
+	const uint8_t* value;
+	size_t value_len;
+	bool has_observe = false;
+
+	if(	(len < (ssize_t)sizeof(*header))
+		|| (header->code != COAP_RESULT_205_CONTENT)
+		|| (header->token_len != sizeof(self->token))
+		|| memcmp(header->token, self->token, sizeof(self->token))
+	) {
+		return false;
+	}
+
+	while(iter && (iter < end) && (*iter != 0xFF)) {
+		iter = coap_decode_option(iter, &key, &value, &value_len);
+		if(key == COAP_OPTION_OBSERVE) {
+			self->observe = coap_decode_uint32(value, (uint8_t)value_len);
+			has_observe = true;
+		}
+	}
+
+	if(!has_observe)
+		return false;
+
+	memset(self->content, 0, sizeof(self->content));
+	if(iter && (iter < end))
+		memcpy(self->content, iter + 1, MIN(end - iter - 1, (ssize_t)sizeof(self->content) - 1));
+
+	self->tt = header->tt;
+	self->msg_id = header->msg_id;
+	self->count++;
+
+	return true;
+}
+
+//!	Registers `self` as an observer of `path`, which must answer with `version`.
+static bool
+observer_register(smcp_t server, observer_s* self, uint8_t id, const char* path, int version) {
+	uint8_t packet[128];
+	struct coap_header_s* const header = (struct coap_header_s*)packet;
+	uint8_t* iter;
+	ssize_t len;
+	char expected[16];
+
+	self->fd = test_raw_open();
+	require(self->fd >= 0, bail);
+
+	self->token[0] = id;
+	self->token[1] = 0x5A;
+
+	memset(header, 0, sizeof(*header));
+	header->version = COAP_VERSION;
+	header->tt = COAP_TRANS_TYPE_CONFIRMABLE;
+	header->code = COAP_METHOD_GET;
+	header->msg_id = htons(0x7000 + id);
+	header->token_len = sizeof(self->token);
+	memcpy(header->token, self->token, sizeof(self->token));
+
+	iter = coap_encode_option(header->token + header->token_len, 0, COAP_OPTION_OBSERVE, NULL, 0);
+	iter = coap_encode_option(iter, COAP_OPTION_OBSERVE, COAP_OPTION_URI_PATH, (const uint8_t*)path, strlen(path));
+
+	len = test_raw_exchange(server, self->fd, packet, iter - packet, packet, sizeof(packet), NOTIFY_TIMEOUT);
+
+	snprintf(expected, sizeof(expected), "%d", version);
+
+	if(!observer_parse(self, packet, len) || strcmp(self->content, expected)) {
+		fprintf(stderr, "notify: observer %02x didn't register\n", id);
+		goto bail;
+	}
+
+	self->count = 0;
+	return true;
+
+bail:
+	return false;
+}
+
+//!	Acknowledges the latest notification, if it needs it and `self` isn't silent.
+static void
+observer_ack(smcp_t server, const observer_s* self) {
+	struct coap_header_s header = {};
+	struct sockaddr_in6 saddr = {};
+
+	if(self->silent || (self->tt != COAP_TRANS_TYPE_CONFIRMABLE))
+		return;
+
+	header.version = COAP_VERSION;
+	header.tt = COAP_TRANS_TYPE_ACK;
+	header.msg_id = self->msg_id;
+
+	saddr.sin6_family = AF_INET6;
+	saddr.sin6_port = htons(smcp_get_port(server));
+	saddr.sin6_addr = in6addr_loopback;
+
+	sendto(self->fd, &header, sizeof(header), 0, (struct sockaddr*)&saddr, sizeof(saddr));
+}
+
+//!	Reads whatever has arrived for `self`, acknowledging it as needed.
+static void
+observer_drain(smcp_t server, observer_s* self) {
+	uint8_t packet[128];
+	ssize_t len;
+
+	while((len = recv(self->fd, packet, sizeof(packet), 0)) > 0) {
+		if(observer_parse(self, packet, len))
+			observer_ack(server, self);
+	}
+}
+
+//!	Runs the server until each observer has `count` more notifications, or time is up.
+/*!	The virtual clock moves ahead 10ms at a time meanwhile. */
+static bool
+collect(smcp_t server, observer_s* observers, int n, int count) {
+	const time_t give_up = time(NULL) + NOTIFY_TIMEOUT;
+	int expected[OBSERVER_COUNT + 1];
+	bool done = false;
+	int i;
+
+	for(i = 0; i < n; i++)
+		expected[i] = observers[i].count + count;
+
+	while(!done && time(NULL) < give_up) {
+		smcp_process(server, 0);
+
+		done = true;
+		for(i = 0; i < n; i++) {
+			observer_drain(server, &observers[i]);
+
+			if(observers[i].count < expected[i])
+				done = false;
+		}
+
+		if(!done)
+			gNow += 10;
+	}
+
+	for(i = 0; i < n; i++) {
+		if(observers[i].count != expected[i]) {
+			fprintf(stderr, "notify: observer %02x got %d notifications, expected %d\n",
+				observers[i].token[0], observers[i].count - expected[i] + count, count);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+//!	Triggers a new version and checks that it was rendered once for everyone.
+static bool
+check_rendered_once(smcp_t server, observer_s* observers) {
+	const struct smcp_stats_s* const stats = smcp_get_stats(server);
+	const uint32_t renders = stats->notification_renders;
+	const uint32_t replays = stats->notification_replays;
+	const int handled = gRenders;
+	int i;
+
+	// The third observer comes in late, so its count is behind.
+	gVersion = 1;
+	smcp_observable_trigger(&gObservable, SMCP_OBSERVABLE_BROADCAST_KEY, 0);
+	require(collect(server, observers, 2, 1), bail);
+
+	require(observer_register(server, &observers[2], 0x33, "obs", 1), bail);
+
+	gVersion = 2;
+	smcp_observable_trigger(&gObservable, SMCP_OBSERVABLE_BROADCAST_KEY, 0);
+	require(collect(server, observers, OBSERVER_COUNT, 1), bail);
+
+	for(i = 0; i < OBSERVER_COUNT; i++) {
+		if(strcmp(observers[i].content, "2") || (observers[i].observe != ((i < 2) ? 2u : 1u))) {
+			fprintf(stderr, "notify: observer %02x got \"%s\" with Observe %u\n",
+				observers[i].token[0], observers[i].content, (unsigned)observers[i].observe);
+			goto bail;
+		}
+	}
+
+	if(	(observers[0].msg_id == observers[1].msg_id)
+		|| (observers[0].msg_id == observers[2].msg_id)
+		|| (observers[1].msg_id == observers[2].msg_id)
+	) {
+		fprintf(stderr, "notify: observers got copies with the same message ID\n");
+		goto bail;
+	}
+
+	// One render for each trigger, and a copy for everyone else.
+	if(	(gRenders - handled != 3)	// Including the late registration
+		|| (stats->notification_renders - renders != 2)
+		|| (stats->notification_replays - replays != 1 + 2)
+	) {
+		fprintf(stderr, "notify: handler ran %d times, with %u renders kept and %u replayed\n",
+			gRenders - handled,
+			(unsigned)(stats->notification_renders - renders),
+			(unsigned)(stats->notification_replays - replays));
+		goto bail;
+	}
+
+	return true;
+
+bail:
+	return false;
+}
+
+//!	Triggers with SMCP_OBSERVABLE_FLAG_PER_OBSERVER and checks that everyone got their own rendering.
+static bool
+check_per_observer(smcp_t server, observer_s* observers) {
+	const struct smcp_stats_s* const stats = smcp_get_stats(server);
+	const uint32_t renders = stats->notification_renders;
+	const uint32_t replays = stats->notification_replays;
+	const int handled = gRenders;
+	char expected[16];
+	int i;
+
+	gPerObserver = true;
+	gVersion = 3;
+	smcp_observable_trigger(&gObservable, SMCP_OBSERVABLE_BROADCAST_KEY, SMCP_OBSERVABLE_FLAG_PER_OBSERVER);
+	require(collect(server, observers, OBSERVER_COUNT, 1), bail);
+	gPerObserver = false;
+
+	for(i = 0; i < OBSERVER_COUNT; i++) {
+		snprintf(expected, sizeof(expected), "3/%02x", observers[i].token[0]);
+		if(strcmp(observers[i].content, expected)) {
+			fprintf(stderr, "notify: observer %02x got \"%s\", expected \"%s\"\n",
+				observers[i].token[0], observers[i].content, expected);
+			goto bail;
+		}
+	}
+
+	if(	(gRenders - handled != OBSERVER_COUNT)
+		|| (stats->notification_renders != renders)
+		|| (stats->notification_replays != replays)
+	) {
+		fprintf(stderr, "notify: handler ran %d times for %d observers\n", gRenders - handled, OBSERVER_COUNT);
+		goto bail;
+	}
+
+	return true;
+
+bail:
+	return false;
+}
+
+//!	Triggers three times within the minimum period and expects a single notification.
+static bool
+check_coalesced(smcp_t server, observer_s* observers) {
+	const struct smcp_stats_s* const stats = smcp_get_stats(server);
+	const uint32_t renders = stats->notification_renders;
+	const uint32_t coalesced = stats->notifications_coalesced;
+	const int handled = gRenders;
+	uint32_t observe[OBSERVER_COUNT];
+	int i;
+
+	// Let the last notifications run their course.
+	gNow += 2000;
+	smcp_process(server, 0);
+
+	for(i = 0; i < OBSERVER_COUNT; i++)
+		observe[i] = observers[i].observe;
+
+	// Everyone was notified two seconds ago, so the first trigger
+	// has to wait three more, and the others fold into it.
+	gObservable.min_period = 5000;
+
+	gVersion = 4;
+	smcp_observable_trigger(&gObservable, SMCP_OBSERVABLE_BROADCAST_KEY, 0);
+	gVersion = 5;
+	smcp_observable_trigger(&gObservable, SMCP_OBSERVABLE_BROADCAST_KEY, 0);
+	gVersion = 6;
+	smcp_observable_trigger(&gObservable, SMCP_OBSERVABLE_BROADCAST_KEY, 0);
+
+	smcp_process(server, 0);
+	for(i = 0; i < OBSERVER_COUNT; i++) {
+		observer_drain(server, &observers[i]);
+		if(observers[i].observe != observe[i]) {
+			fprintf(stderr, "notify: observer %02x was notified before the minimum period was up\n", observers[i].token[0]);
+			goto bail;
+		}
+	}
+
+	require(collect(server, observers, OBSERVER_COUNT, 1), bail);
+
+	for(i = 0; i < OBSERVER_COUNT; i++) {
+		if(strcmp(observers[i].content, "6") || (observers[i].observe != observe[i] + 3)) {
+			fprintf(stderr, "notify: observer %02x got \"%s\" with Observe %u after %u\n",
+				observers[i].token[0], observers[i].content, (unsigned)observers[i].observe, (unsigned)observe[i]);
+			goto bail;
+		}
+	}
+
+	if(	(gRenders - handled != 1)
+		|| (stats->notification_renders - renders != 1)
+		|| (stats->notifications_coalesced - coalesced != 2 * OBSERVER_COUNT)
+	) {
+		fprintf(stderr, "notify: handler ran %d times for three triggers, with %u triggers coalesced\n",
+			gRenders - handled, (unsigned)(stats->notifications_coalesced - coalesced));
+		goto bail;
+	}
+
+	gObservable.min_period = 0;
+	return true;
+
+bail:
+	gObservable.min_period = 0;
+	return false;
+}
+
+//!	Triggers again while a confirmable notification waits for its acknowledgement.
+static bool
+check_superseded(smcp_t server, observer_s* observers) {
+	const struct smcp_stats_s* const stats = smcp_get_stats(server);
+	uint32_t superseded;
+	coap_msg_id_t msg_id[2];
+	int i;
+
+	// The first two observers are at Observe 6 and the third at 5.
+	// Their eighth notification is the first confirmable one.
+	gNow += 2000;
+	gVersion = 7;
+	smcp_observable_trigger(&gObservable, SMCP_OBSERVABLE_BROADCAST_KEY, 0);
+	require(collect(server, observers, OBSERVER_COUNT, 1), bail);
+	gNow += 2000;
+	smcp_process(server, 0);
+
+	observers[0].silent = true;
+	observers[1].silent = true;
+
+	gVersion = 8;
+	smcp_observable_trigger(&gObservable, SMCP_OBSERVABLE_BROADCAST_KEY, 0);
+	require(collect(server, observers, OBSERVER_COUNT, 1), bail);
+
+	for(i = 0; i < 2; i++) {
+		if((observers[i].tt != COAP_TRANS_TYPE_CONFIRMABLE) || (observers[i].observe != 8)) {
+			fprintf(stderr, "notify: observer %02x got Observe %u as type %d\n",
+				observers[i].token[0], (unsigned)observers[i].observe, observers[i].tt);
+			goto bail;
+		}
+		msg_id[i] = observers[i].msg_id;
+	}
+
+	// The unacknowledged notifications to the first two are replaced,
+	// and the non-confirmable one to the third is started over.
+	superseded = stats->notifications_superseded;
+	gVersion = 9;
+	smcp_observable_trigger(&gObservable, SMCP_OBSERVABLE_BROADCAST_KEY, 0);
+
+	if(stats->notifications_superseded - superseded != OBSERVER_COUNT) {
+		fprintf(stderr, "notify: %u of %d notifications were superseded\n",
+			(unsigned)(stats->notifications_superseded - superseded), OBSERVER_COUNT);
+		goto bail;
+	}
+
+	// The replacements keep the retransmission timeout, so nothing
+	// goes to the first two until it is up.
+	require(collect(server, observers + 2, 1, 1), bail);
+	for(i = 0; i < 2; i++) {
+		observer_drain(server, &observers[i]);
+		if(observers[i].observe != 8) {
+			fprintf(stderr, "notify: observer %02x got a replacement right away\n", observers[i].token[0]);
+			goto bail;
+		}
+		observers[i].silent = false;
+	}
+
+	require(collect(server, observers, 2, 1), bail);
+
+	for(i = 0; i < OBSERVER_COUNT; i++) {
+		if(	strcmp(observers[i].content, "9")
+			|| (observers[i].tt != COAP_TRANS_TYPE_CONFIRMABLE)
+			|| (observers[i].observe != ((i < 2) ? 9u : 8u))
+			|| ((i < 2) && (observers[i].msg_id == msg_id[i]))
+		) {
+			fprintf(stderr, "notify: observer %02x got \"%s\" with Observe %u as type %d\n",
+				observers[i].token[0], observers[i].content, (unsigned)observers[i].observe, observers[i].tt);
+			goto bail;
+		}
+	}
+
+	// Once acknowledged, the next trigger is sent as usual.
+	gVersion = 10;
+	smcp_observable_trigger(&gObservable, SMCP_OBSERVABLE_BROADCAST_KEY, 0);
+	require(collect(server, observers, OBSERVER_COUNT, 1), bail);
+
+	return true;
+
+bail:
+	return false;
+}
+
+//!	Keeps changing a resource whose observer never acknowledges anything.
+static bool
+check_dead_observer(smcp_t server) {
+	const struct smcp_stats_s* const stats = smcp_get_stats(server);
+	const uint32_t superseded = stats->notifications_superseded;
+	const smcp_timestamp_t start = gNow;
+	smcp_timestamp_t last_heard = 0;
+	observer_s dead = { .fd = -1, .silent = true };
+	int count = 0;
+	int confirmable = 0;
+	uint32_t observe = 0;
+	coap_msg_id_t msg_id = 0;
+	bool ret = false;
+
+	require(observer_register(server, &dead, 0x44, "dead", gVersion), bail);
+
+	// A minute of a change every half second.
+	while(gNow - start < 60 * MSEC_PER_SEC) {
+		if((gNow - start) % 500 == 0)
+			smcp_observable_trigger(&gObservable, DEAD_KEY, 0);
+
+		smcp_process(server, 0);
+		observer_drain(server, &dead);
+
+		if(dead.count != count) {
+			count = dead.count;
+			last_heard = gNow;
+
+			if(confirmable && (dead.tt != COAP_TRANS_TYPE_CONFIRMABLE)) {
+				fprintf(stderr, "notify: unacknowledged notification was replaced by a non-confirmable one\n");
+				goto bail;
+			}
+
+			if(dead.tt == COAP_TRANS_TYPE_CONFIRMABLE) {
+				if(confirmable && (dead.observe != observe) && (dead.msg_id == msg_id)) {
+					fprintf(stderr, "notify: Observe %u went out under the message ID of Observe %u\n", (unsigned)dead.observe, (unsigned)observe);
+					goto bail;
+				}
+				confirmable++;
+			}
+
+			observe = dead.observe;
+			msg_id = dead.msg_id;
+		}
+
+		gNow += 10;
+	}
+
+	if(last_heard - start > SMCP_OBSERVER_CON_EVENT_EXPIRATION + 10 * MSEC_PER_SEC) {
+		fprintf(stderr, "notify: observer that never answers was still notified after %ums\n", (unsigned)(last_heard - start));
+		goto bail;
+	}
+
+	// The first confirmable notification is the eighth. Its
+	// retransmissions carry newer state, and back off as usual.
+	if((confirmable < 2) || (confirmable > COAP_MAX_RETRANSMIT + 1) || (observe <= 8)) {
+		fprintf(stderr, "notify: %d confirmable notifications sent, the last with Observe %u\n", confirmable, (unsigned)observe);
+		goto bail;
+	}
+
+	if(stats->notifications_superseded == superseded) {
+		fprintf(stderr, "notify: no notification was superseded\n");
+		goto bail;
+	}
+
+	ret = true;
+
+bail:
+	if(dead.fd >= 0)
+		close(dead.fd);
+	return ret;
+}
+
+int
+main(int argc, char * argv[]) {
+	smcp_t server = NULL;
+	observer_s observers[OBSERVER_COUNT] = {};
+	int ret = EXIT_FAILURE;
+	int i;
+
+	for(i = 0; i < OBSERVER_COUNT; i++)
+		observers[i].fd = -1;
+
+	server = smcp_create(0);
+	require(server, bail);
+
+	smcp_set_default_request_handler(server, &notify_request_handler, NULL);
+	smcp_set_clock(server, &virtual_clock, NULL);
+
+	require(observer_register(server, &observers[0], 0x11, "obs", 0), bail);
+	require(observer_register(server, &observers[1], 0x22, "obs", 0), bail);
+
+	require(check_rendered_once(server, observers), bail);
+	require(check_per_observer(server, observers), bail);
+	require(check_coalesced(server, observers), bail);
+	require(check_superseded(server, observers), bail);
+	require(check_dead_observer(server), bail);
+
+	ret = EXIT_SUCCESS;
+
+bail:
+	// Releasing the server frees whatever observers it still has.
+	if(server)
+		smcp_release(server);
+
+	for(i = 0; i < OBSERVER_COUNT; i++) {
+		if(observers[i].fd >= 0)
+			close(observers[i].fd);
+	}
+
+	return test_finish("notify", ret);
+}
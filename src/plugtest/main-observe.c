@@ -0,0 +1,267 @@
+/*	@file main-observe.c
+**	@brief Checks observers of one observable served by several instances.
+**
+**	Copyright (C) 2011,2012 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Two server instances on the same thread serve the same observable,
+// and a client observes it through each of them. An observer belongs
+// to the instance whose request made it, no matter which instance
+// used the observable last: notifications must come from the port
+// the client registered with, and deregistering through one instance
+// must leave the other one's observers alone.
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <smcp/assert-macros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <smcp/smcp.h>
+#include <smcp/smcp-observable.h>
+
+#define CLIENT_COUNT			2
+#define OBSERVE_TIMEOUT			(10)	// Seconds
+
+typedef struct {
+	int index;
+	smcp_t server;
+	smcp_t client;
+	char url[64];
+
+	struct smcp_transaction_s transaction;
+	bool registered;
+	int version;
+	int notifications;
+	bool failed;
+} observe_client_s;
+
+static struct smcp_observable_s gObservable;
+static int gVersion;
+
+static smcp_status_t
+observe_request_handler(void* context) {
+	smcp_status_t status;
+
+	status = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
+	require_noerr(status, bail);
+
+	status = smcp_observable_update(&gObservable, 0);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_set_content_formatted("%d", gVersion);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_send();
+
+bail:
+	return status;
+}
+
+static smcp_status_t
+resend_observe_request(void* context) {
+	observe_client_s* const self = context;
+	smcp_status_t status;
+
+	status = smcp_outbound_begin(smcp_get_current_instance(), COAP_METHOD_GET, COAP_TRANS_TYPE_CONFIRMABLE);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_set_uri(self->url, 0);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_send();
+
+bail:
+	return status;
+}
+
+static smcp_status_t
+observe_response_handler(int statuscode, void* context) {
+	observe_client_s* const self = context;
+	char payload[16] = "";
+
+	if(statuscode < 0) {
+		if(statuscode != SMCP_STATUS_TRANSACTION_INVALIDATED)
+			self->failed = true;
+		return SMCP_STATUS_OK;
+	}
+
+	if(statuscode != COAP_RESULT_205_CONTENT
+		|| smcp_inbound_get_content_len() >= sizeof(payload)
+	) {
+		self->failed = true;
+		return SMCP_STATUS_OK;
+	}
+
+	if(ntohs(((const struct sockaddr_in6*)smcp_inbound_get_saddr())->sin6_port) != smcp_get_port(self->server)) {
+		fprintf(stderr, "client %d: response didn't come from port %d\n",
+			self->index, smcp_get_port(self->server));
+		self->failed = true;
+	}
+
+	memcpy(payload, smcp_inbound_get_content_ptr(), smcp_inbound_get_content_len());
+	self->version = atoi(payload);
+
+	if(self->registered)
+		self->notifications++;
+
+	self->registered = true;
+
+	return SMCP_STATUS_OK;
+}
+
+//!	Asks the server to forget about `self`, the way a client that lost interest would.
+static smcp_status_t
+send_deregister(observe_client_s* self) {
+	const coap_msg_id_t token = self->transaction.token;
+	smcp_status_t status;
+
+	smcp_transaction_end(self->client, &self->transaction);
+
+	status = smcp_outbound_begin(self->client, COAP_METHOD_GET, COAP_TRANS_TYPE_NONCONFIRMABLE);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_set_token((const uint8_t*)&token, sizeof(token));
+	require_noerr(status, bail);
+
+	status = smcp_outbound_set_uri(self->url, 0);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_send();
+
+bail:
+	return status;
+}
+
+static void
+process_all(observe_client_s* clients, cms_t ms) {
+	const time_t give_up = time(NULL) + OBSERVE_TIMEOUT;
+	smcp_timestamp_t end;
+	int i;
+
+	end = smcp_get_time(clients[0].client) + ms;
+
+	while((cms_t)(end - smcp_get_time(clients[0].client)) > 0 && time(NULL) < give_up) {
+		for(i = 0; i < CLIENT_COUNT && clients[i].client; i++) {
+			smcp_process(clients[i].client, 0);
+			smcp_process(clients[i].server, 0);
+		}
+	}
+}
+
+int
+main(int argc, char * argv[]) {
+	observe_client_s clients[CLIENT_COUNT] = {};
+	int ret = EXIT_FAILURE;
+	int i;
+
+	for(i = 0; i < CLIENT_COUNT; i++) {
+		clients[i].index = i;
+		clients[i].server = smcp_create(0);
+		clients[i].client = smcp_create(0);
+
+		require(clients[i].server && clients[i].client, bail);
+
+		smcp_set_default_request_handler(clients[i].server, &observe_request_handler, NULL);
+
+		snprintf(clients[i].url, sizeof(clients[i].url), "coap://[::1]:%d/obs", smcp_get_port(clients[i].server));
+
+		smcp_transaction_init(
+			&clients[i].transaction,
+			SMCP_TRANSACTION_OBSERVE,
+			&resend_observe_request,
+			&observe_response_handler,
+			&clients[i]
+		);
+
+		// Register one client at a time, so that the last server
+		// to see the observable isn't the first client's.
+		smcp_transaction_begin(clients[i].client, &clients[i].transaction, 30*MSEC_PER_SEC);
+		process_all(clients, 200);
+
+		if(!clients[i].registered) {
+			fprintf(stderr, "client %d: never registered\n", i);
+			goto bail;
+		}
+	}
+
+	gVersion = 1;
+	smcp_observable_trigger(&gObservable, SMCP_OBSERVABLE_BROADCAST_KEY, 0);
+	process_all(clients, 200);
+
+	for(i = 0; i < CLIENT_COUNT; i++) {
+		if(clients[i].version != 1) {
+			fprintf(stderr, "client %d: wasn't notified of version 1\n", i);
+			goto bail;
+		}
+	}
+
+	// The first client deregisters through its own server, which
+	// wasn't the last one to see the observable.
+	require_noerr(send_deregister(&clients[0]), bail);
+	process_all(clients, 200);
+
+	gVersion = 2;
+	smcp_observable_trigger(&gObservable, SMCP_OBSERVABLE_BROADCAST_KEY, 0);
+	process_all(clients, 200);
+
+	if(clients[0].version != 1) {
+		fprintf(stderr, "client 0: was notified after deregistering\n");
+		goto bail;
+	}
+
+	if(clients[1].version != 2) {
+		fprintf(stderr, "client 1: wasn't notified of version 2\n");
+		goto bail;
+	}
+
+	ret = EXIT_SUCCESS;
+
+	for(i = 0; i < CLIENT_COUNT; i++) {
+		if(clients[i].failed)
+			ret = EXIT_FAILURE;
+	}
+
+bail:
+	for(i = 0; i < CLIENT_COUNT; i++) {
+		if(clients[i].client) {
+			smcp_transaction_end(clients[i].client, &clients[i].transaction);
+			smcp_release(clients[i].client);
+		}
+		// Releasing the servers frees whatever observers they still have.
+		if(clients[i].server)
+			smcp_release(clients[i].server);
+	}
+
+	fprintf(stderr, "observe: %s\n", (ret == EXIT_SUCCESS) ? "ok" : "FAILED");
+
+	return ret;
+}
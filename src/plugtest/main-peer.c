@@ -0,0 +1,358 @@
+/*	@file main-peer.c
+**	@brief Checks the per-peer RTO estimate and NSTART queueing.
+**
+**	Copyright (C) 2011,2012 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// The client runs on a virtual clock, so every round trip takes exactly
+// as long as the test says, and the peer's RTO must follow the estimator
+// in smcp-peer.c to the millisecond: two exchanges answered on the first
+// try, then one answered only after a retransmission.
+//
+// NSTART is 1 by default, as RFC7252 asks. Four requests started at
+// once must reach the server one at a time and in order, and one ended
+// while queued must never be sent. With the limit lifted, queued
+// requests must go right away.
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <smcp/assert-macros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <smcp/smcp.h>
+#include "test-helpers.h"
+
+#define PEER_TIMEOUT			(5)	// Seconds
+#define QUEUED_COUNT			4
+
+typedef struct {
+	int index;
+	test_request_s request;
+} peer_request_s;
+
+static smcp_timestamp_t gNow = 1000000;
+static int gArrived[QUEUED_COUNT + 1];
+static int gArrivedCount;
+
+static smcp_timestamp_t
+virtual_clock(void* context) {
+	return gNow;
+}
+
+static smcp_status_t
+answer_request_handler(void* context) {
+	char path[16] = "";
+	smcp_status_t status;
+
+	if(!smcp_inbound_is_dupe()) {
+		smcp_inbound_get_path(path, 0);
+		if(gArrivedCount < QUEUED_COUNT + 1)
+			gArrived[gArrivedCount] = atoi(path);
+		gArrivedCount++;
+	}
+
+	status = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_send();
+
+bail:
+	return status;
+}
+
+static void
+begin_request(smcp_t server, smcp_t client, peer_request_s* self, int index) {
+	self->index = index;
+	test_request_init(&self->request, COAP_METHOD_GET, 0, "coap://[::1]:%d/%d", smcp_get_port(server), index);
+	smcp_transaction_begin(client, &self->request.transaction, 60*MSEC_PER_SEC);
+}
+
+//!	Lets the server answer and the client take the answer in, without time passing.
+static bool
+finish_request(smcp_t server, smcp_t client, peer_request_s* self) {
+	test_process_until(&self->request.finished, PEER_TIMEOUT, server, client, NULL);
+
+	smcp_transaction_end(client, &self->request.transaction);
+
+	if(self->request.code != COAP_RESULT_205_CONTENT) {
+		fprintf(stderr, "peer: request %d finished with %d\n", self->index, self->request.code);
+		return false;
+	}
+
+	return true;
+}
+
+static bool
+get_peer_stats(smcp_t client, struct smcp_peer_stats_s* stats) {
+	if(smcp_get_peer_stats(client, stats, 1) != 1) {
+		fprintf(stderr, "peer: client doesn't know about the server\n");
+		return false;
+	}
+	return true;
+}
+
+//!	Checks the round-trip estimate after an exchange that took `rtt` milliseconds.
+static bool
+check_rto(smcp_t client, cms_t rtt, int transmissions, cms_t* rto, cms_t* srtt, cms_t* rttvar) {
+	struct smcp_peer_stats_s stats;
+	cms_t expected = *rto;
+
+	if(!get_peer_stats(client, &stats))
+		return false;
+
+	if(transmissions == 1) {
+		if(*srtt < 0) {
+			*srtt = rtt;
+			*rttvar = rtt / 2;
+		} else {
+			*rttvar = (3 * *rttvar + ((*srtt > rtt) ? (*srtt - rtt) : (rtt - *srtt))) / 4;
+			*srtt = (7 * *srtt + rtt) / 8;
+		}
+		expected = (expected + *srtt + 4 * *rttvar) / 2;
+	} else {
+		// The first weak sample.
+		expected = (3 * expected + rtt + rtt / 2) / 4;
+	}
+
+	if((stats.rto != expected) || ((transmissions == 1) && ((stats.srtt != *srtt) || (stats.rttvar != *rttvar)))) {
+		fprintf(stderr, "peer: after a %dms round trip in %d transmissions, rto=%d srtt=%d rttvar=%d; expected rto=%d srtt=%d rttvar=%d\n",
+			(int)rtt, transmissions, (int)stats.rto, (int)stats.srtt, (int)stats.rttvar,
+			(int)expected, (int)*srtt, (int)*rttvar);
+		return false;
+	}
+
+	*rto = expected;
+	return true;
+}
+
+static bool
+check_rto_estimate(smcp_t server, smcp_t client) {
+	struct smcp_peer_stats_s stats;
+	peer_request_s request;
+	cms_t rto = (cms_t)(COAP_ACK_TIMEOUT * MSEC_PER_SEC);
+	cms_t srtt = -1, rttvar = 0;
+	smcp_timestamp_t sent;
+	int i;
+
+	// Answered on the first try, 200ms after being sent.
+	for(i = 0; i < 2; i++) {
+		begin_request(server, client, &request, 0);
+		smcp_process(client, 0);
+		gNow += 200;
+
+		if(!finish_request(server, client, &request) || !check_rto(client, 200, 1, &rto, &srtt, &rttvar))
+			return false;
+	}
+
+	// Only answered after the client has sent it again. The timeout
+	// may come early, but never after the retransmission is due.
+	begin_request(server, client, &request, 0);
+	smcp_process(client, 0);
+	sent = gNow;
+
+	for(i = 0; i < 100; i++) {
+		gNow += smcp_get_timeout(client);
+		smcp_process(client, 0);
+
+		if(!get_peer_stats(client, &stats) || stats.retransmissions)
+			break;
+	}
+
+	if(stats.retransmissions != 1) {
+		fprintf(stderr, "peer: %d retransmissions, expected 1\n", (int)stats.retransmissions);
+		smcp_transaction_end(client, &request.request.transaction);
+		return false;
+	}
+
+	if(!finish_request(server, client, &request) || !check_rto(client, (cms_t)(gNow - sent), 2, &rto, &srtt, &rttvar))
+		return false;
+
+	if(!get_peer_stats(client, &stats))
+		return false;
+
+	if((stats.strong_samples != 2) || (stats.weak_samples != 1)) {
+		fprintf(stderr, "peer: %d strong and %d weak samples, expected 2 and 1\n",
+			(int)stats.strong_samples, (int)stats.weak_samples);
+		return false;
+	}
+
+	return true;
+}
+
+//!	Lets the server take in everything sent to it so far.
+static void
+drain_server(smcp_t server) {
+	int i;
+
+	for(i = 0; i < 10; i++)
+		smcp_process(server, 0);
+}
+
+static bool
+check_nstart(smcp_t server, smcp_t client) {
+	peer_request_s requests[QUEUED_COUNT];
+	struct smcp_peer_stats_s stats;
+	const int expected[] = { 1, 2, 4 };
+	bool ret = false;
+	int i;
+
+	gArrivedCount = 0;
+
+	for(i = 0; i < QUEUED_COUNT; i++)
+		begin_request(server, client, &requests[i], i + 1);
+
+	smcp_process(client, 0);
+
+	require(get_peer_stats(client, &stats), bail);
+
+	if((stats.outstanding != 1) || (stats.queued != QUEUED_COUNT - 1)) {
+		fprintf(stderr, "peer: %d outstanding and %d queued, expected 1 and %d\n",
+			stats.outstanding, stats.queued, QUEUED_COUNT - 1);
+		goto bail;
+	}
+
+	// Giving up on a queued request takes it off the queue.
+	smcp_transaction_end(client, &requests[2].request.transaction);
+
+	if(!get_peer_stats(client, &stats) || (stats.queued != QUEUED_COUNT - 2)) {
+		fprintf(stderr, "peer: ended request still queued\n");
+		goto bail;
+	}
+
+	for(i = 0; i < 3; i++) {
+		peer_request_s* const request = &requests[expected[i] - 1];
+
+		drain_server(server);
+
+		if(gArrivedCount != i + 1) {
+			fprintf(stderr, "peer: server had %d requests at once, expected %d\n", gArrivedCount, i + 1);
+			goto bail;
+		}
+
+		if(!test_process_until(&request->request.finished, PEER_TIMEOUT, client, server, NULL)) {
+			fprintf(stderr, "peer: request %d never finished\n", request->index);
+			goto bail;
+		}
+	}
+
+	drain_server(server);
+
+	if(gArrivedCount != 3) {
+		fprintf(stderr, "peer: server got %d requests, expected 3\n", gArrivedCount);
+		goto bail;
+	}
+
+	for(i = 0; i < 3; i++) {
+		if(gArrived[i] != expected[i]) {
+			fprintf(stderr, "peer: request %d arrived in place of %d\n", gArrived[i], expected[i]);
+			goto bail;
+		}
+	}
+
+	if(!get_peer_stats(client, &stats) || stats.outstanding || stats.queued) {
+		fprintf(stderr, "peer: slots left taken\n");
+		goto bail;
+	}
+
+	ret = true;
+
+bail:
+	for(i = 0; i < QUEUED_COUNT; i++)
+		smcp_transaction_end(client, &requests[i].request.transaction);
+
+	return ret;
+}
+
+static bool
+check_nstart_lifted(smcp_t server, smcp_t client) {
+	peer_request_s requests[QUEUED_COUNT];
+	struct smcp_peer_stats_s stats;
+	bool ret = false;
+	int i;
+
+	gArrivedCount = 0;
+
+	for(i = 0; i < QUEUED_COUNT; i++)
+		begin_request(server, client, &requests[i], i + 1);
+
+	smcp_process(client, 0);
+
+	require(get_peer_stats(client, &stats), bail);
+	require(stats.queued == QUEUED_COUNT - 1, bail);
+
+	smcp_set_peer_nstart(client, 0);
+	smcp_process(client, 0);
+	drain_server(server);
+
+	if(!get_peer_stats(client, &stats) || stats.queued || (gArrivedCount != QUEUED_COUNT)) {
+		fprintf(stderr, "peer: without a limit, server had %d requests at once and %d were still queued\n",
+			gArrivedCount, stats.queued);
+		goto bail;
+	}
+
+	for(i = 0; i < QUEUED_COUNT; i++)
+		require(finish_request(server, client, &requests[i]), bail);
+
+	ret = true;
+
+bail:
+	for(i = 0; i < QUEUED_COUNT; i++)
+		smcp_transaction_end(client, &requests[i].request.transaction);
+
+	return ret;
+}
+
+int
+main(int argc, char * argv[]) {
+	smcp_t server = NULL;
+	smcp_t client = NULL;
+	int ret = EXIT_FAILURE;
+
+	server = smcp_create(0);
+	client = smcp_create(0);
+	require(server && client, bail);
+
+	smcp_set_default_request_handler(server, &answer_request_handler, NULL);
+	smcp_set_clock(client, &virtual_clock, NULL);
+
+	require(check_rto_estimate(server, client), bail);
+	require(check_nstart(server, client), bail);
+	require(check_nstart_lifted(server, client), bail);
+
+	ret = EXIT_SUCCESS;
+
+bail:
+	if(client)
+		smcp_release(client);
+
+	if(server)
+		smcp_release(server);
+
+	return test_finish("peer", ret);
+}
@@ -0,0 +1,310 @@
+/*	@file main-request-queue.c
+**	@brief Checks the limits and callbacks of the request queue.
+**
+**	Copyright (C) 2011,2012 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// A client queues requests for three servers, with at most two in
+// flight and at most one per server. The servers hold on to every
+// request they get and only answer (separately) once everything the
+// client has in flight has arrived, so the test can see exactly how
+// many requests were outstanding at once.
+//
+// Every request is allocated on its own and freed, after being
+// scribbled over, by its own callback. One request is cancelled while
+// in flight and another while still queued; neither may call back.
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <smcp/assert-macros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <smcp/smcp.h>
+#include <smcp/smcp-request-queue.h>
+
+#define SERVER_COUNT			3
+#define REQUEST_COUNT			12
+#define MAX_IN_FLIGHT			2
+#define MAX_PER_PEER			1
+#define HELD_MAX				4
+#define QUEUE_TIMEOUT			(20)	// Seconds
+
+#define require_test(c, s) \
+	require_action_string(c, bail, fprintf(stderr, "request-queue: %s\n", s), s)
+
+typedef enum {
+	HELD_FREE,
+	HELD_WAITING,
+	HELD_ANSWERING,
+} held_state_t;
+
+typedef struct {
+	held_state_t state;
+	struct smcp_async_response_s async_response;
+	struct smcp_transaction_s transaction;
+} held_request_s;
+
+typedef struct {
+	smcp_t instance;
+	struct smcp_uri_s uri;
+	held_request_s held[HELD_MAX];
+	int waiting;
+	int max_waiting;
+} test_server_s;
+
+static test_server_s gServers[SERVER_COUNT];
+static int gWaitingMax;
+static int gCompleted;
+static int gCancelledCallbacks;
+static bool gFailed;
+
+static int
+waiting_total(void) {
+	int i, ret = 0;
+	for(i = 0; i < SERVER_COUNT; i++)
+		ret += gServers[i].waiting;
+	return ret;
+}
+
+static smcp_status_t
+hold_request_handler(void* context) {
+	test_server_s* const self = context;
+	smcp_status_t status = SMCP_STATUS_FAILURE;
+	int i;
+
+	if(smcp_inbound_is_dupe()) {
+		smcp_outbound_begin_response(COAP_CODE_EMPTY);
+		smcp_outbound_send();
+		return SMCP_STATUS_OK;
+	}
+
+	for(i = 0; i < HELD_MAX; i++) {
+		if(self->held[i].state == HELD_FREE)
+			break;
+	}
+
+	require(i < HELD_MAX, bail);
+
+	// Sends the empty ACK, so the client waits for a separate response.
+	status = smcp_start_async_response(&self->held[i].async_response, 0);
+	require_noerr(status, bail);
+
+	self->held[i].state = HELD_WAITING;
+
+	if(++self->waiting > self->max_waiting)
+		self->max_waiting = self->waiting;
+
+	if(waiting_total() > gWaitingMax)
+		gWaitingMax = waiting_total();
+
+bail:
+	return status;
+}
+
+static smcp_status_t
+held_resend(void* context) {
+	held_request_s* const held = context;
+	smcp_status_t status;
+
+	status = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_set_async_response(&held->async_response);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_send();
+
+bail:
+	return status;
+}
+
+static smcp_status_t
+held_response(int statuscode, void* context) {
+	held_request_s* const held = context;
+
+	smcp_finish_async_response(&held->async_response);
+	held->state = HELD_FREE;
+
+	return SMCP_STATUS_OK;
+}
+
+//!	Answers every request that `server` has been holding on to.
+static void
+answer_held_requests(test_server_s* server) {
+	int i;
+
+	for(i = 0; i < HELD_MAX; i++) {
+		held_request_s* const held = &server->held[i];
+
+		if(held->state != HELD_WAITING)
+			continue;
+
+		held->state = HELD_ANSWERING;
+		server->waiting--;
+
+		smcp_transaction_init(
+			&held->transaction,
+			0,
+			&held_resend,
+			&held_response,
+			held
+		);
+		smcp_transaction_begin(server->instance, &held->transaction, 5*MSEC_PER_SEC);
+	}
+}
+
+static void
+request_done(smcp_request_t request, smcp_status_t status, void* context) {
+	if(status != COAP_RESULT_205_CONTENT) {
+		fprintf(stderr, "request %d: finished with %d\n", (int)(intptr_t)context, status);
+		gFailed = true;
+	}
+
+	gCompleted++;
+
+	// The request, and the transaction inside it, must not be
+	// touched again once it has been handed back to us.
+	memset(request, 0x5A, sizeof(*request));
+	free(request);
+}
+
+static void
+cancelled_request_done(smcp_request_t request, smcp_status_t status, void* context) {
+	fprintf(stderr, "cancelled request called back with %d\n", status);
+	gCancelledCallbacks++;
+}
+
+static void
+process_all(smcp_t client) {
+	int i;
+
+	smcp_process(client, 0);
+	for(i = 0; i < SERVER_COUNT; i++)
+		smcp_process(gServers[i].instance, 0);
+}
+
+int
+main(int argc, char * argv[]) {
+	smcp_t client = NULL;
+	struct smcp_request_queue_s queue;
+	struct smcp_request_s cancel_in_flight;
+	struct smcp_request_s cancel_queued;
+	const struct smcp_request_queue_stats_s* stats;
+	time_t give_up = time(NULL) + QUEUE_TIMEOUT;
+	int ret = EXIT_FAILURE;
+	int i;
+
+	client = smcp_create(0);
+	require(client, bail);
+
+	for(i = 0; i < SERVER_COUNT; i++) {
+		char url[64];
+
+		gServers[i].instance = smcp_create(0);
+		require(gServers[i].instance, bail);
+
+		smcp_set_default_request_handler(gServers[i].instance, &hold_request_handler, &gServers[i]);
+
+		snprintf(url, sizeof(url), "coap://[::1]:%d/hold", smcp_get_port(gServers[i].instance));
+		require_noerr(smcp_uri_init(client, &gServers[i].uri, url, 0), bail);
+	}
+
+	smcp_request_queue_init(client, &queue, MAX_IN_FLIGHT, MAX_PER_PEER);
+	stats = smcp_request_queue_get_stats(&queue);
+
+	// Cancel a request once the server has it.
+	smcp_request_init(&cancel_in_flight, COAP_METHOD_GET, &gServers[0].uri, &cancelled_request_done, NULL);
+	require_noerr(smcp_request_queue_add(&queue, &cancel_in_flight), bail);
+
+	while(gServers[0].waiting == 0 && time(NULL) < give_up)
+		process_all(client);
+
+	require_test(gServers[0].waiting == 1, "first request never arrived");
+
+	smcp_request_queue_cancel(&queue, &cancel_in_flight);
+	require_test(stats->in_flight == 0, "cancelled request still in flight");
+
+	// Its answer now has nowhere to go, and must be ignored.
+	answer_held_requests(&gServers[0]);
+	gWaitingMax = 0;
+	gServers[0].max_waiting = 0;
+
+	for(i = 0; i < REQUEST_COUNT; i++) {
+		smcp_request_t const request = calloc(1, sizeof(*request));
+
+		require(request, bail);
+
+		smcp_request_init(request, COAP_METHOD_GET, &gServers[i % SERVER_COUNT].uri, &request_done, (void*)(intptr_t)i);
+		require_noerr(smcp_request_queue_add(&queue, request), bail);
+	}
+
+	require_test(stats->in_flight == MAX_IN_FLIGHT, "queue didn't fill up");
+
+	smcp_request_init(&cancel_queued, COAP_METHOD_GET, &gServers[1].uri, &cancelled_request_done, NULL);
+	require_noerr(smcp_request_queue_add(&queue, &cancel_queued), bail);
+	smcp_request_queue_cancel(&queue, &cancel_queued);
+
+	while(gCompleted < REQUEST_COUNT && !gFailed && time(NULL) < give_up) {
+		process_all(client);
+
+		// Answer only once all that is in flight has arrived.
+		if(stats->in_flight && (waiting_total() == stats->in_flight)) {
+			for(i = 0; i < SERVER_COUNT; i++)
+				answer_held_requests(&gServers[i]);
+		}
+	}
+
+	fprintf(stderr, "request-queue: %d/%d completed, at most %d in flight, %d queued\n",
+		gCompleted, REQUEST_COUNT, gWaitingMax, stats->max_queued);
+
+	require_test(gCompleted == REQUEST_COUNT, "not every request finished");
+	require_test(gWaitingMax == MAX_IN_FLIGHT, "max_in_flight not honored");
+
+	for(i = 0; i < SERVER_COUNT; i++) {
+		require_test(gServers[i].max_waiting <= MAX_PER_PEER, "max_per_peer not honored");
+	}
+
+	require_test(gCancelledCallbacks == 0, "cancelled request called back");
+	require_test(stats->completed == REQUEST_COUNT, "wrong completed count");
+	require_test(stats->queued == 0 && stats->in_flight == 0, "queue not empty");
+
+	ret = gFailed ? EXIT_FAILURE : EXIT_SUCCESS;
+
+bail:
+	if(client)
+		smcp_release(client);
+
+	for(i = 0; i < SERVER_COUNT; i++) {
+		if(gServers[i].instance)
+			smcp_release(gServers[i].instance);
+	}
+
+	return ret;
+}
@@ -50,6 +50,8 @@ main(int argc, char * argv[]) {
 	// Set up the node router.
 	smcp_set_default_request_handler(smcp, &smcp_node_router_handler, &root_node);
 
+	smcp_set_send_queue_enabled(smcp, true);
+
 #if DEBUG
 	fprintf(stderr,"DEBUG = %d\n",DEBUG);
 #endif
@@ -73,6 +75,8 @@ main(int argc, char * argv[]) {
 	fprintf(stderr,"SMCP_CONF_MAX_ALLOCED_NODES = %d\n",SMCP_CONF_MAX_ALLOCED_NODES);
 	fprintf(stderr,"SMCP_CONF_MAX_TIMEOUT = %d\n",SMCP_CONF_MAX_TIMEOUT);
 	fprintf(stderr,"SMCP_CONF_DUPE_BUFFER_SIZE = %d\n",SMCP_CONF_DUPE_BUFFER_SIZE);
+	fprintf(stderr,"SMCP_CONF_RECV_BATCH_SIZE = %d\n",SMCP_CONF_RECV_BATCH_SIZE);
+	fprintf(stderr,"SMCP_CONF_SEND_QUEUE_SIZE = %d\n",SMCP_CONF_SEND_QUEUE_SIZE);
 	fprintf(stderr,"SMCP_OBSERVATION_KEEPALIVE_INTERVAL = %d\n",SMCP_OBSERVATION_KEEPALIVE_INTERVAL);
 	fprintf(stderr,"SMCP_OBSERVATION_DEFAULT_MAX_AGE = %d\n",SMCP_OBSERVATION_DEFAULT_MAX_AGE);
 	fprintf(stderr,"SMCP_VARIABLE_MAX_VALUE_LENGTH = %d\n",SMCP_VARIABLE_MAX_VALUE_LENGTH);
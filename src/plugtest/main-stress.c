@@ -0,0 +1,477 @@
+/*	@file main-stress.c
+**	@brief Runs independent SMCP instances on several threads at once.
+**
+**	Copyright (C) 2011,2012 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Each thread runs its own server and client instance and fires a
+// stream of requests at its server. The server echoes the payload
+// back, and the client checks that it got back exactly what it sent.
+// If instance state leaked between threads, replies would go missing
+// or come back with somebody else's payload.
+//
+// Then the threads run shards of one server, the way smcpd's workers
+// do: each shard is an instance bound to the same port, with its own
+// observable. Every client observes the server, and once all of them
+// are registered each shard triggers its observable. Every client
+// must then be notified by the shard it registered with.
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <smcp/assert-macros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <smcp/smcp.h>
+
+#ifndef STRESS_THREAD_COUNT
+#define STRESS_THREAD_COUNT		4
+#endif
+
+#ifndef STRESS_REQUEST_COUNT
+#define STRESS_REQUEST_COUNT	500
+#endif
+
+#define STRESS_TIMEOUT			(60)	// Seconds
+
+typedef struct {
+	int index;
+	smcp_t server;
+	smcp_t client;
+	char url[64];
+
+	int request_number;
+	bool finished;
+	bool failed;
+	int good_responses;
+	char payload[32];
+} stress_thread_s;
+
+typedef struct {
+	int index;
+	smcp_t shard;
+	smcp_t client;
+	char url[64];
+
+	struct smcp_observable_s observable;
+	int version;
+	bool triggered;
+
+	struct smcp_transaction_s transaction;
+	int registered_shard;
+	bool registered;
+	bool notified;
+	bool failed;
+} observe_thread_s;
+
+static int gObserveRegistered;
+static int gObserveNotified;
+
+static smcp_status_t
+echo_request_handler(void* context) {
+	smcp_status_t status;
+
+	status = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_append_content(
+		smcp_inbound_get_content_ptr(),
+		smcp_inbound_get_content_len()
+	);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_send();
+
+bail:
+	return status;
+}
+
+static smcp_status_t
+resend_echo_request(void* context) {
+	stress_thread_s* const self = context;
+	smcp_status_t status;
+
+	status = smcp_outbound_begin(smcp_get_current_instance(), COAP_METHOD_POST, COAP_TRANS_TYPE_CONFIRMABLE);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_set_uri(self->url, 0);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_append_content(self->payload, SMCP_CSTR_LEN);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_send();
+
+bail:
+	return status;
+}
+
+static smcp_status_t
+echo_response_handler(int statuscode, void* context) {
+	stress_thread_s* const self = context;
+
+	if(statuscode < 0) {
+		self->finished = true;
+		if(statuscode != SMCP_STATUS_TRANSACTION_INVALIDATED)
+			self->failed = true;
+	} else if(statuscode != COAP_RESULT_205_CONTENT) {
+		self->failed = true;
+	} else if(smcp_inbound_get_content_len() != strlen(self->payload)
+		|| 0 != memcmp(smcp_inbound_get_content_ptr(), self->payload, strlen(self->payload))
+	) {
+		fprintf(stderr, "thread %d: request %d: got back the wrong payload\n", self->index, self->request_number);
+		self->failed = true;
+	} else {
+		self->good_responses++;
+	}
+
+	return SMCP_STATUS_OK;
+}
+
+static void*
+stress_thread_main(void* context) {
+	stress_thread_s* const self = context;
+	time_t give_up = time(NULL) + STRESS_TIMEOUT;
+
+	for(self->request_number = 0; self->request_number < STRESS_REQUEST_COUNT; self->request_number++) {
+		struct smcp_transaction_s transaction;
+
+		snprintf(self->payload, sizeof(self->payload), "t=%d;n=%d", self->index, self->request_number);
+		self->finished = false;
+
+		smcp_transaction_init(
+			&transaction,
+			SMCP_TRANSACTION_ALWAYS_INVALIDATE,
+			&resend_echo_request,
+			&echo_response_handler,
+			self
+		);
+
+		smcp_transaction_begin(self->client, &transaction, 10*MSEC_PER_SEC);
+
+		while(!self->finished && (time(NULL) < give_up)) {
+			smcp_process(self->client, 0);
+			smcp_process(self->server, 0);
+		}
+
+		if(!self->finished) {
+			fprintf(stderr, "thread %d: request %d: timed out\n", self->index, self->request_number);
+			smcp_transaction_end(self->client, &transaction);
+			self->failed = true;
+		}
+
+		if(self->failed)
+			break;
+	}
+
+	return NULL;
+}
+
+static smcp_status_t
+observe_request_handler(void* context) {
+	observe_thread_s* const self = context;
+	smcp_status_t status;
+
+	status = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
+	require_noerr(status, bail);
+
+	status = smcp_observable_update(&self->observable, 0);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_set_content_formatted("%d %d", self->index, self->version);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_send();
+
+bail:
+	return status;
+}
+
+static smcp_status_t
+resend_observe_request(void* context) {
+	observe_thread_s* const self = context;
+	smcp_status_t status;
+
+	status = smcp_outbound_begin(smcp_get_current_instance(), COAP_METHOD_GET, COAP_TRANS_TYPE_CONFIRMABLE);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_set_uri(self->url, 0);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_send();
+
+bail:
+	return status;
+}
+
+static smcp_status_t
+observe_response_handler(int statuscode, void* context) {
+	observe_thread_s* const self = context;
+	int shard = -1;
+	int version = -1;
+	char payload[32] = "";
+
+	if(statuscode < 0) {
+		if(statuscode != SMCP_STATUS_TRANSACTION_INVALIDATED || !self->notified)
+			self->failed = true;
+		return SMCP_STATUS_OK;
+	}
+
+	if(statuscode != COAP_RESULT_205_CONTENT) {
+		self->failed = true;
+		return SMCP_STATUS_OK;
+	}
+
+	if(smcp_inbound_get_content_len() < sizeof(payload))
+		memcpy(payload, smcp_inbound_get_content_ptr(), smcp_inbound_get_content_len());
+
+	if(2 != sscanf(payload, "%d %d", &shard, &version)) {
+		fprintf(stderr, "client %d: unexpected payload \"%s\"\n", self->index, payload);
+		self->failed = true;
+	} else if(!self->registered) {
+		if(!smcp_inbound_find_option(COAP_OPTION_OBSERVE, NULL, NULL) || version != 0) {
+			fprintf(stderr, "client %d: shard %d didn't register the observer\n", self->index, shard);
+			self->failed = true;
+		}
+		self->registered = true;
+		self->registered_shard = shard;
+		__atomic_add_fetch(&gObserveRegistered, 1, __ATOMIC_SEQ_CST);
+	} else if(shard != self->registered_shard) {
+		fprintf(stderr, "client %d: registered with shard %d, notified by shard %d\n", self->index, self->registered_shard, shard);
+		self->failed = true;
+	} else if(version == 1 && !self->notified) {
+		self->notified = true;
+		__atomic_add_fetch(&gObserveNotified, 1, __ATOMIC_SEQ_CST);
+	}
+
+	return SMCP_STATUS_OK;
+}
+
+static void*
+observe_thread_main(void* context) {
+	observe_thread_s* const self = context;
+	time_t give_up = time(NULL) + STRESS_TIMEOUT;
+
+	smcp_transaction_init(
+		&self->transaction,
+		SMCP_TRANSACTION_OBSERVE,
+		&resend_observe_request,
+		&observe_response_handler,
+		self
+	);
+
+	smcp_transaction_begin(self->client, &self->transaction, STRESS_TIMEOUT*MSEC_PER_SEC);
+
+	// Keep serving our shard until every client has been notified,
+	// since other threads' clients may have registered with it.
+	while(__atomic_load_n(&gObserveNotified, __ATOMIC_SEQ_CST) < STRESS_THREAD_COUNT
+		&& (time(NULL) < give_up)
+	) {
+		if(!self->triggered
+			&& __atomic_load_n(&gObserveRegistered, __ATOMIC_SEQ_CST) == STRESS_THREAD_COUNT
+		) {
+			self->triggered = true;
+			self->version++;
+			smcp_observable_trigger(&self->observable, SMCP_OBSERVABLE_BROADCAST_KEY, 0);
+		}
+
+		smcp_process(self->client, 0);
+		smcp_process(self->shard, 0);
+	}
+
+	if(!self->notified) {
+		fprintf(stderr, "client %d: %s\n", self->index, self->registered ? "never notified" : "never registered");
+		self->failed = true;
+	}
+
+	smcp_transaction_end(self->client, &self->transaction);
+
+	return NULL;
+}
+
+//!	Opens a SO_REUSEPORT socket on a port the system picks.
+/*!	The shards join it on that port; once they have, closing this
+**	leaves the port to them. Port zero would be taken by smcp_init()
+**	to mean the well-known CoAP port, where other processes may
+**	already be listening. */
+static int
+open_port_holder(uint16_t* port) {
+	struct sockaddr_in6 saddr = {};
+	socklen_t socklen = sizeof(saddr);
+	int value = 1;
+	int fd;
+
+	fd = socket(AF_INET6, SOCK_DGRAM, 0);
+	require(fd >= 0, bail);
+
+	saddr.sin6_family = AF_INET6;
+
+	if(	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value))
+		|| bind(fd, (struct sockaddr*)&saddr, sizeof(saddr))
+		|| getsockname(fd, (struct sockaddr*)&saddr, &socklen)
+	) {
+		close(fd);
+		fd = -1;
+		goto bail;
+	}
+
+	*port = ntohs(saddr.sin6_port);
+
+bail:
+	return fd;
+}
+
+static int
+run_observe_test(void) {
+	observe_thread_s threads[STRESS_THREAD_COUNT] = {};
+	pthread_t thread_ids[STRESS_THREAD_COUNT];
+	uint16_t port = 0;
+	int holder_fd;
+	int i;
+	int ret = EXIT_FAILURE;
+
+	holder_fd = open_port_holder(&port);
+	if(holder_fd < 0) {
+		fprintf(stderr, "Unable to find a port for the shards\n");
+		goto bail;
+	}
+
+	for(i = 0; i < STRESS_THREAD_COUNT; i++) {
+		threads[i].index = i;
+		threads[i].shard = smcp_create_with_flags(port, SMCP_INIT_FLAG_REUSE_PORT);
+		threads[i].client = smcp_create(0);
+
+		if(!threads[i].shard || !threads[i].client) {
+			fprintf(stderr, "Unable to create instances for shard %d\n", i);
+			goto bail;
+		}
+
+		smcp_set_default_request_handler(threads[i].shard, &observe_request_handler, &threads[i]);
+	}
+
+	close(holder_fd);
+	holder_fd = -1;
+	ret = EXIT_SUCCESS;
+
+	for(i = 0; i < STRESS_THREAD_COUNT; i++) {
+		snprintf(threads[i].url, sizeof(threads[i].url), "coap://[::1]:%d/obs", port);
+		pthread_create(&thread_ids[i], NULL, &observe_thread_main, &threads[i]);
+	}
+
+	for(i = 0; i < STRESS_THREAD_COUNT; i++) {
+		pthread_join(thread_ids[i], NULL);
+
+		if(threads[i].failed)
+			ret = EXIT_FAILURE;
+	}
+
+	fprintf(stderr, "observe: %d/%d registered, %d/%d notified\n",
+		gObserveRegistered, STRESS_THREAD_COUNT,
+		gObserveNotified, STRESS_THREAD_COUNT
+	);
+
+bail:
+	if(holder_fd >= 0)
+		close(holder_fd);
+
+	for(i = 0; i < STRESS_THREAD_COUNT; i++) {
+		if(threads[i].client)
+			smcp_release(threads[i].client);
+		if(threads[i].shard)
+			smcp_release(threads[i].shard);
+	}
+
+	return ret;
+}
+
+static int
+run_echo_test(void) {
+	stress_thread_s threads[STRESS_THREAD_COUNT] = {};
+	pthread_t thread_ids[STRESS_THREAD_COUNT];
+	int i;
+	int ret = EXIT_SUCCESS;
+
+	for(i = 0; i < STRESS_THREAD_COUNT; i++) {
+		threads[i].index = i;
+		threads[i].server = smcp_create(0);
+		threads[i].client = smcp_create(0);
+
+		if(!threads[i].server || !threads[i].client) {
+			fprintf(stderr, "Unable to create instances for thread %d\n", i);
+			ret = EXIT_FAILURE;
+			goto bail;
+		}
+
+		smcp_set_default_request_handler(threads[i].server, &echo_request_handler, NULL);
+
+		snprintf(threads[i].url, sizeof(threads[i].url), "coap://[::1]:%d/echo", smcp_get_port(threads[i].server));
+	}
+
+	for(i = 0; i < STRESS_THREAD_COUNT; i++)
+		pthread_create(&thread_ids[i], NULL, &stress_thread_main, &threads[i]);
+
+	for(i = 0; i < STRESS_THREAD_COUNT; i++) {
+		pthread_join(thread_ids[i], NULL);
+
+		fprintf(stderr, "thread %d: %d/%d good responses%s\n",
+			i,
+			threads[i].good_responses,
+			STRESS_REQUEST_COUNT,
+			threads[i].failed ? " (FAILED)" : ""
+		);
+
+		if(threads[i].failed || (threads[i].good_responses != STRESS_REQUEST_COUNT))
+			ret = EXIT_FAILURE;
+	}
+
+bail:
+	for(i = 0; i < STRESS_THREAD_COUNT; i++) {
+		if(threads[i].client)
+			smcp_release(threads[i].client);
+		if(threads[i].server)
+			smcp_release(threads[i].server);
+	}
+
+	return ret;
+}
+
+int
+main(int argc, char * argv[]) {
+	int ret = run_echo_test();
+
+	if(ret == EXIT_SUCCESS)
+		ret = run_observe_test();
+
+	return ret;
+}
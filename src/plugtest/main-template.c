@@ -0,0 +1,294 @@
+/*	@file main-template.c
+**	@brief Checks that response templates match hand-built responses.
+**
+**	Copyright (C) 2011,2012 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// The server's node router has "/template" served from a response
+// template and "/manual" by a handler that adds the same options and
+// content one at a time, and the same for a template without content.
+// Both answers to the same request must be identical, byte for byte,
+// once the message id is set aside. The template's options are added
+// out of order, and include ones with extended deltas and lengths.
+// A path that goes past the template's node must get 4.04.
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <smcp/assert-macros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <smcp/smcp.h>
+#include <smcp/smcp-node-router.h>
+#include "test-helpers.h"
+
+#define TEMPLATE_TIMEOUT		(5)	// Seconds
+
+#define TEST_CONTENT			"This is a canned response."
+#define TEST_ETAG				"\x12\x34\x56\x78"
+#define TEST_LOCATION			"a-rather-long-location"
+#define TEST_MAX_AGE			3600
+
+static struct smcp_response_template_s gTemplate;
+static struct smcp_response_template_s gEmptyTemplate;
+
+static smcp_status_t
+send_manual(void* context) {
+	smcp_status_t status;
+
+	status = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_add_option(COAP_OPTION_ETAG, TEST_ETAG, 4);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_add_option(COAP_OPTION_LOCATION_PATH, TEST_LOCATION, SMCP_CSTR_LEN);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_add_option_uint(COAP_OPTION_CONTENT_TYPE, COAP_CONTENT_TYPE_TEXT_PLAIN);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_add_option_uint(COAP_OPTION_MAX_AGE, TEST_MAX_AGE);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_add_option_uint(COAP_OPTION_SIZE, sizeof(TEST_CONTENT) - 1);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_append_content(TEST_CONTENT, SMCP_CSTR_LEN);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_send();
+
+bail:
+	return status;
+}
+
+static smcp_status_t
+send_manual_empty(void* context) {
+	smcp_status_t status;
+
+	status = smcp_outbound_begin_response(COAP_RESULT_203_VALID);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_add_option(COAP_OPTION_ETAG, TEST_ETAG, 4);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_send();
+
+bail:
+	return status;
+}
+
+//!	Adds a node called `name` under `root` that answers with `handler`.
+static void
+add_node(smcp_node_t node, smcp_node_t root, const char* name, smcp_request_handler_func handler, void* context) {
+	smcp_node_init(node, root, name);
+	node->request_handler = handler;
+	node->context = context;
+}
+
+static smcp_status_t
+build_templates(void) {
+	smcp_status_t status;
+
+	smcp_response_template_init(&gTemplate, COAP_RESULT_205_CONTENT);
+
+	status = smcp_response_template_add_option_uint(&gTemplate, COAP_OPTION_SIZE, sizeof(TEST_CONTENT) - 1);
+	require_noerr(status, bail);
+
+	status = smcp_response_template_add_option_uint(&gTemplate, COAP_OPTION_MAX_AGE, TEST_MAX_AGE);
+	require_noerr(status, bail);
+
+	status = smcp_response_template_add_option(&gTemplate, COAP_OPTION_LOCATION_PATH, TEST_LOCATION, SMCP_CSTR_LEN);
+	require_noerr(status, bail);
+
+	status = smcp_response_template_add_option_uint(&gTemplate, COAP_OPTION_CONTENT_TYPE, COAP_CONTENT_TYPE_TEXT_PLAIN);
+	require_noerr(status, bail);
+
+	status = smcp_response_template_add_option(&gTemplate, COAP_OPTION_ETAG, TEST_ETAG, 4);
+	require_noerr(status, bail);
+
+	smcp_response_template_set_content(&gTemplate, TEST_CONTENT, SMCP_CSTR_LEN);
+
+	smcp_response_template_init(&gEmptyTemplate, COAP_RESULT_203_VALID);
+
+	status = smcp_response_template_add_option(&gEmptyTemplate, COAP_OPTION_ETAG, TEST_ETAG, 4);
+	require_noerr(status, bail);
+
+bail:
+	return status;
+}
+
+//!	Sends a GET for `path` from `fd` and waits for the answer.
+static ssize_t
+request(smcp_t server, int fd, const char* path, coap_msg_id_t msg_id, uint8_t* response, size_t response_size) {
+	uint8_t packet[64];
+	struct coap_header_s* const header = (struct coap_header_s*)packet;
+	uint8_t* iter = header->token + 2;
+	coap_option_key_t prev_key = 0;
+	const char* segment;
+	ssize_t ret;
+
+	memset(header, 0, sizeof(*header));
+	header->version = COAP_VERSION;
+	header->tt = COAP_TRANS_TYPE_CONFIRMABLE;
+	header->code = COAP_METHOD_GET;
+	header->msg_id = htons(msg_id);
+	header->token_len = 2;
+	header->token[0] = 0xAB;
+	header->token[1] = 0xCD;
+
+	for(segment = path; *segment; segment += strcspn(segment, "/")) {
+		if(*segment == '/')
+			segment++;
+		iter = coap_encode_option(iter, prev_key, COAP_OPTION_URI_PATH, (const uint8_t*)segment, strcspn(segment, "/"));
+		prev_key = COAP_OPTION_URI_PATH;
+	}
+
+	ret = test_raw_exchange(server, fd, packet, iter - packet, response, response_size, TEMPLATE_TIMEOUT);
+
+	if(ret < 0)
+		fprintf(stderr, "template: no response for /%s\n", path);
+
+	return ret;
+}
+
+static void
+dump_packet(const char* label, const uint8_t* packet, ssize_t len) {
+	ssize_t i;
+
+	fprintf(stderr, "template: %s:", label);
+	for(i = 0; i < len; i++)
+		fprintf(stderr, " %02X", packet[i]);
+	fprintf(stderr, "\n");
+}
+
+//!	Checks that the answers to `template_path` and `manual_path` are the same.
+static bool
+compare(smcp_t server, int fd, const char* template_path, const char* manual_path, coap_code_t code) {
+	static coap_msg_id_t msg_id = 0x1000;
+	uint8_t from_template[SMCP_MAX_PACKET_LENGTH];
+	uint8_t by_hand[SMCP_MAX_PACKET_LENGTH];
+	ssize_t template_len, hand_len;
+
+	template_len = request(server, fd, template_path, msg_id++, from_template, sizeof(from_template));
+	hand_len = request(server, fd, manual_path, msg_id++, by_hand, sizeof(by_hand));
+
+	if(template_len < 0 || hand_len < 0)
+		return false;
+
+	if(!coap_verify_packet((const char*)from_template, template_len)) {
+		dump_packet(template_path, from_template, template_len);
+		fprintf(stderr, "template: /%s isn't a valid packet\n", template_path);
+		return false;
+	}
+
+	if(((struct coap_header_s*)from_template)->code != code) {
+		fprintf(stderr, "template: /%s got %s\n", template_path,
+			coap_code_to_cstr(((struct coap_header_s*)from_template)->code));
+		return false;
+	}
+
+	// The message ids are different, since these are different requests.
+	((struct coap_header_s*)from_template)->msg_id = 0;
+	((struct coap_header_s*)by_hand)->msg_id = 0;
+
+	if((template_len != hand_len) || memcmp(from_template, by_hand, hand_len)) {
+		dump_packet(template_path, from_template, template_len);
+		dump_packet(manual_path, by_hand, hand_len);
+		fprintf(stderr, "template: /%s and /%s differ\n", template_path, manual_path);
+		return false;
+	}
+
+	return true;
+}
+
+//!	Checks that a path past the template's node isn't answered from the template.
+static bool
+check_past_template(smcp_t server, int fd) {
+	uint8_t response[SMCP_MAX_PACKET_LENGTH];
+	const struct coap_header_s* const header = (const struct coap_header_s*)response;
+	ssize_t len;
+
+	len = request(server, fd, "template/more", 0x2000, response, sizeof(response));
+
+	if(len < (ssize_t)sizeof(*header))
+		return false;
+
+	if(header->code != COAP_RESULT_404_NOT_FOUND) {
+		fprintf(stderr, "template: /template/more got %s\n", coap_code_to_cstr(header->code));
+		return false;
+	}
+
+	return true;
+}
+
+int
+main(int argc, char * argv[]) {
+	struct smcp_node_s root_node = {};
+	struct smcp_node_s template_node = {};
+	struct smcp_node_s empty_template_node = {};
+	struct smcp_node_s manual_node = {};
+	struct smcp_node_s empty_manual_node = {};
+	smcp_t server = NULL;
+	int fd = -1;
+	int ret = EXIT_FAILURE;
+
+	require_noerr(build_templates(), bail);
+
+	server = smcp_create(0);
+	require(server, bail);
+
+	smcp_node_init(&root_node, NULL, NULL);
+	add_node(&template_node, &root_node, "template", &smcp_response_template_request_handler, &gTemplate);
+	add_node(&empty_template_node, &root_node, "template-empty", &smcp_response_template_request_handler, &gEmptyTemplate);
+	add_node(&manual_node, &root_node, "manual", &send_manual, NULL);
+	add_node(&empty_manual_node, &root_node, "manual-empty", &send_manual_empty, NULL);
+
+	smcp_set_default_request_handler(server, &smcp_node_router_handler, &root_node);
+
+	fd = test_raw_open();
+	require(fd >= 0, bail);
+
+	require(compare(server, fd, "template", "manual", COAP_RESULT_205_CONTENT), bail);
+	require(compare(server, fd, "template-empty", "manual-empty", COAP_RESULT_203_VALID), bail);
+	require(check_past_template(server, fd), bail);
+
+	ret = EXIT_SUCCESS;
+
+bail:
+	if(fd >= 0)
+		close(fd);
+
+	if(server)
+		smcp_release(server);
+
+	return test_finish("template", ret);
+}
@@ -0,0 +1,182 @@
+/*	@file test-helpers.c
+**	@brief Scaffolding shared by the check programs.
+**
+**
+**	Copyright (C) 2011,2012 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <smcp/assert-macros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "test-helpers.h"
+
+static smcp_status_t
+test_request_resend(void* context) {
+	test_request_s* const self = context;
+	smcp_status_t status;
+
+	status = smcp_outbound_begin(smcp_get_current_instance(), self->method, COAP_TRANS_TYPE_CONFIRMABLE);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_set_uri(self->url, 0);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_send();
+
+bail:
+	return status;
+}
+
+static smcp_status_t
+test_request_response(int statuscode, void* context) {
+	test_request_s* const self = context;
+
+	// Ending an unfinished transaction calls back with this.
+	if(statuscode == SMCP_STATUS_TRANSACTION_INVALIDATED)
+		return SMCP_STATUS_OK;
+
+	// A Block2 transfer starting over isn't an answer yet.
+	if(statuscode == SMCP_STATUS_ETAG_MISMATCH) {
+		self->etag_mismatches++;
+		return SMCP_STATUS_OK;
+	}
+
+	if(!self->finished) {
+		self->code = statuscode;
+
+		if((statuscode > 0) && self->content) {
+			self->content_len = smcp_inbound_get_content_len();
+			if(self->content_len > self->content_size)
+				self->content_len = self->content_size;
+			memcpy(self->content, smcp_inbound_get_content_ptr(), self->content_len);
+		}
+	}
+
+	self->finished = true;
+
+	return SMCP_STATUS_OK;
+}
+
+void
+test_request_init(
+	test_request_s* self,
+	coap_code_t method,
+	int flags,
+	const char* format,
+	...
+) {
+	va_list args;
+
+	self->method = method;
+	self->content_len = 0;
+	self->finished = false;
+	self->code = 0;
+	self->etag_mismatches = 0;
+
+	va_start(args, format);
+	vsnprintf(self->url, sizeof(self->url), format, args);
+	va_end(args);
+
+	smcp_transaction_init(
+		&self->transaction,
+		flags,
+		&test_request_resend,
+		&test_request_response,
+		self
+	);
+}
+
+bool
+test_process_until(const bool* done, int seconds, smcp_t instance, ...) {
+	const time_t give_up = time(NULL) + seconds;
+	va_list args;
+	smcp_t iter;
+
+	while(!*done && time(NULL) < give_up) {
+		va_start(args, instance);
+		for(iter = instance; iter; iter = va_arg(args, smcp_t))
+			smcp_process(iter, 0);
+		va_end(args);
+	}
+
+	return *done;
+}
+
+int
+test_raw_open(void) {
+	int fd = socket(AF_INET6, SOCK_DGRAM, 0);
+
+	if(fd >= 0)
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+
+	return fd;
+}
+
+ssize_t
+test_raw_exchange(
+	smcp_t server,
+	int fd,
+	const void* packet,
+	size_t len,
+	void* response,
+	size_t response_size,
+	int seconds
+) {
+	struct sockaddr_in6 saddr = {};
+	const time_t give_up = time(NULL) + seconds;
+	ssize_t ret = -1;
+
+	saddr.sin6_family = AF_INET6;
+	saddr.sin6_port = htons(smcp_get_port(server));
+	saddr.sin6_addr = in6addr_loopback;
+
+	require(sendto(fd, packet, len, 0, (struct sockaddr*)&saddr, sizeof(saddr)) == (ssize_t)len, bail);
+
+	while(ret < 0 && time(NULL) < give_up) {
+		smcp_process(server, 0);
+		ret = recv(fd, response, response_size, 0);
+	}
+
+bail:
+	return ret;
+}
+
+int
+test_finish(const char* name, int ret) {
+	fprintf(stderr, "%s: %s\n", name, (ret == EXIT_SUCCESS) ? "ok" : "FAILED");
+	return ret;
+}
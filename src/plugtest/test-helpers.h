@@ -0,0 +1,92 @@
+/*	@file test-helpers.h
+**	@brief Scaffolding shared by the check programs.
+**
+**
+**	Copyright (C) 2011,2012 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __PLUGTEST_TEST_HELPERS_H__
+#define __PLUGTEST_TEST_HELPERS_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <smcp/smcp.h>
+
+//!	A request that its transaction sends again until it is answered.
+typedef struct test_request_s {
+	coap_code_t method;
+	char url[128];
+	struct smcp_transaction_s transaction;
+
+	//!	Where to copy the content of the answer, if anywhere.
+	char* content;
+	size_t content_size;
+	size_t content_len;
+
+	bool finished;
+
+	//!	The first response code or error the transaction reported.
+	int code;
+
+	//!	How many times a Block2 transfer started over.
+	int etag_mismatches;
+} test_request_s;
+
+//!	Sets up `self` to send `method` to the URL `format` describes.
+/*!	Start it with smcp_transaction_begin(). Anything else about the
+**	transaction, like a Block1 body, can be set up in between. */
+extern void test_request_init(
+	test_request_s* self,
+	coap_code_t method,
+	int flags,
+	const char* format,
+	...
+) __attribute__((format(printf, 4, 5)));
+
+//!	Runs smcp_process() on each of the NULL-terminated instances until `*done` is set.
+/*!	Gives up after `seconds` of real time. Returns the final value
+**	of `*done`. */
+extern bool test_process_until(const bool* done, int seconds, smcp_t instance, ...);
+
+//!	Opens a non-blocking UDP socket for sending requests by hand.
+extern int test_raw_open(void);
+
+//!	Sends `packet` from `fd` to `server` on [::1] and waits for the answer.
+/*!	Runs smcp_process() on `server` while waiting, and gives up
+**	after `seconds`. Returns the length of the answer, or -1. */
+extern ssize_t test_raw_exchange(
+	smcp_t server,
+	int fd,
+	const void* packet,
+	size_t len,
+	void* response,
+	size_t response_size,
+	int seconds
+);
+
+//!	Reports the result of the test called `name` and returns `ret`.
+extern int test_finish(const char* name, int ret);
+
+#endif
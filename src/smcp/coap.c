@@ -382,8 +382,7 @@ coap_content_type_to_cstr(coap_content_type_t content_type) {
 #if SMCP_AVOID_PRINTF
 		content_type_string = "unknown";
 #else
-		// TODO: Make thread safe!
-		static char ret[40];
+		static SMCP_THREAD_LOCAL char ret[40];
 		if(content_type < 20)
 			snprintf(ret,
 				sizeof(ret),
@@ -433,14 +432,15 @@ coap_option_key_to_cstr(
 
 		case COAP_OPTION_BLOCK1: ret = "Block1"; break;
 		case COAP_OPTION_BLOCK2: ret = "Block2"; break;
+		case COAP_OPTION_SIZE1: ret = "Size1"; break;
 
 		default:
 #if SMCP_AVOID_PRINTF
 			ret = "unknown-option";
 #else
 		{
-			// NOTE: Not reentrant or thread safe.
-			static char x[48];
+			// NOTE: Not reentrant.
+			static SMCP_THREAD_LOCAL char x[48];
 
 			sprintf(x, "X-CoAP-%s%s%s-%u",
 				COAP_OPTION_IS_CRITICAL(key)?"critical":"elective",
@@ -573,6 +573,7 @@ http_code_to_cstr(int x) {
 	case HTTP_RESULT_CODE_CONTINUE: return "CONTINUE"; break;
 	case HTTP_RESULT_CODE_OK: return "OK"; break;
 	case HTTP_RESULT_CODE_CONTENT: return "CONTENT"; break;
+	case HTTP_RESULT_CODE_BLOCK_CONTINUE: return "BLOCK_CONTINUE"; break;
 	case HTTP_RESULT_CODE_VALID: return "VALID"; break;
 	case HTTP_RESULT_CODE_CREATED: return "CREATED"; break;
 	case HTTP_RESULT_CODE_CHANGED: return "CHANGED"; break;
@@ -597,6 +598,8 @@ http_code_to_cstr(int x) {
 	case HTTP_RESULT_CODE_GONE: return "GONE"; break;
 	case HTTP_RESULT_CODE_UNSUPPORTED_MEDIA_TYPE: return
 		    "UNSUPPORTED_MEDIA_TYPE"; break;
+	case HTTP_RESULT_CODE_REQUEST_ENTITY_TOO_LARGE: return
+		    "REQUEST_ENTITY_TOO_LARGE"; break;
 
 	case HTTP_RESULT_CODE_INTERNAL_SERVER_ERROR: return
 		    "INTERNAL_SERVER_ERROR"; break;
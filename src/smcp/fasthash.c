@@ -5,6 +5,11 @@
 //  Created by Robert Quattlebaum on 12/23/12.
 //  Copyright (c) 2012 deepdarc. All rights reserved.
 //
+//	To run the consistency check and microbenchmark, compile this
+//	file with the macro FASTHASH_SELF_TEST set to 1. For example:
+//
+//	    cc fasthash.c -O2 -Wall -DFASTHASH_SELF_TEST=1 -o fasthashtest
+//
 
 #include "fasthash.h"
 #include <stdio.h>
@@ -14,49 +19,130 @@
 #pragma mark -
 #pragma mark Fasthash
 
-static struct fasthash_state_s global_fasthash_state;
-
-static void
-fasthash_feed_block(uint32_t blk) {
+static inline void
+fasthash_feed_block_(fasthash_state_t* state, uint32_t blk) {
 	// XOR the block count into the block.
-	blk ^= (global_fasthash_state.bytes>>2);
+	blk ^= (state->bytes>>2);
 
 	// XOR the previous result into the hash state.
-	global_fasthash_state.hash ^= blk;
+	state->hash ^= blk;
 
 	// Mix up the hash state using a linear congruential generator.
-	global_fasthash_state.hash = global_fasthash_state.hash*1664525 + 1013904223;
+	state->hash = state->hash*1664525 + 1013904223;
+}
+
+//! Reads four bytes as a little-endian word, regardless of alignment.
+static inline uint32_t
+fasthash_load_word_(const uint8_t* data) {
+#if defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+	uint32_t ret;
+	memcpy(&ret, data, sizeof(ret));
+	return ret;
+#else
+	return (uint32_t)data[0]
+		| ((uint32_t)data[1]<<8)
+		| ((uint32_t)data[2]<<16)
+		| ((uint32_t)data[3]<<24);
+#endif
 }
 
 void
-fasthash_start(uint32_t salt) {
-	memset((void*)&global_fasthash_state,0,sizeof(global_fasthash_state));
+fasthash_init(fasthash_state_t* state, fasthash_hash_t salt) {
+	memset((void*)state,0,sizeof(*state));
 	// Feed in the salt first.
-	fasthash_feed_block(salt);
+	fasthash_feed_block_(state, salt);
 }
 
 void
-fasthash_feed_byte(uint8_t data) {
-	global_fasthash_state.next |= (data<<(8*(global_fasthash_state.bytes++&3)));
-	if((global_fasthash_state.bytes&3)==0) {
-		fasthash_feed_block(global_fasthash_state.next);
-		global_fasthash_state.next = 0;
+fasthash_update_byte(fasthash_state_t* state, uint8_t data) {
+	state->next |= ((uint32_t)data<<(8*(state->bytes++&3)));
+	if((state->bytes&3)==0) {
+		fasthash_feed_block_(state, state->next);
+		state->next = 0;
 	}
 }
 
 void
-fasthash_feed(const uint8_t* data, uint8_t len) {
+fasthash_update(fasthash_state_t* state, const void* data_, size_t len) {
+	const uint8_t* data = data_;
+
+	// Top off any partial word left over from a previous call.
+	while(len && (state->bytes&3)) {
+		fasthash_update_byte(state, *data++);
+		len--;
+	}
+
+	// Whole words. Produces exactly the same result as feeding
+	// the bytes in one at a time.
+	for(;len>=8;len-=8,data+=8) {
+		state->bytes += 4;
+		fasthash_feed_block_(state, fasthash_load_word_(data));
+		state->bytes += 4;
+		fasthash_feed_block_(state, fasthash_load_word_(data+4));
+	}
+
+	if(len>=4) {
+		state->bytes += 4;
+		fasthash_feed_block_(state, fasthash_load_word_(data));
+		data += 4;
+		len -= 4;
+	}
+
 	while(len--)
-		fasthash_feed_byte(*data++);
+		fasthash_update_byte(state, *data++);
 }
 
 fasthash_hash_t
-fasthash_finish() {
-	if(global_fasthash_state.bytes&3) {
-		fasthash_feed_block(global_fasthash_state.next);
-		global_fasthash_state.bytes = 0;
+fasthash_final(fasthash_state_t* state) {
+	if(state->bytes&3) {
+		fasthash_feed_block_(state, state->next);
+		state->bytes = 0;
 	}
-	return global_fasthash_state.hash;
+	return state->hash;
+}
+
+fasthash_hash_t
+fasthash32(const void* data, size_t len, fasthash_hash_t salt) {
+	fasthash_state_t state;
+	fasthash_init(&state, salt);
+	fasthash_update(&state, data, len);
+	return fasthash_final(&state);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+#pragma mark Legacy API
+
+#if !defined(FASTHASH_THREAD_LOCAL) && (defined(__GNUC__) || defined(__clang__)) && !defined(CONTIKI)
+#define FASTHASH_THREAD_LOCAL __thread
+#endif
+
+#ifndef FASTHASH_THREAD_LOCAL
+#define FASTHASH_THREAD_LOCAL
+#endif
+
+// Kept per-thread so that instances on different threads don't
+// trample each other's hashes.
+static FASTHASH_THREAD_LOCAL struct fasthash_state_s global_fasthash_state;
+
+void
+fasthash_start(uint32_t salt) {
+	fasthash_init(&global_fasthash_state, salt);
+}
+
+void
+fasthash_feed_byte(uint8_t data) {
+	fasthash_update_byte(&global_fasthash_state, data);
+}
+
+void
+fasthash_feed(const uint8_t* data, uint8_t len) {
+	fasthash_update(&global_fasthash_state, data, len);
+}
+
+fasthash_hash_t
+fasthash_finish() {
+	return fasthash_final(&global_fasthash_state);
 }
 
 uint32_t
@@ -73,3 +159,123 @@ uint8_t
 fasthash_finish_uint8() {
 	return fasthash_finish_uint32()>>24;
 }
+
+///////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+#pragma mark Self Test
+
+#if FASTHASH_SELF_TEST
+
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCHMARK_BYTES		(64*1024*1024)
+
+// The original byte-at-a-time implementation, kept here as a
+// reference for both correctness and speed.
+static fasthash_hash_t
+reference_hash(const uint8_t* data, size_t len, fasthash_hash_t salt) {
+	fasthash_state_t state;
+	memset(&state, 0, sizeof(state));
+	fasthash_feed_block_(&state, salt);
+	while(len--) {
+		state.next |= ((uint32_t)*data++<<(8*(state.bytes++&3)));
+		if((state.bytes&3)==0) {
+			fasthash_feed_block_(&state, state.next);
+			state.next = 0;
+		}
+	}
+	if(state.bytes&3)
+		fasthash_feed_block_(&state, state.next);
+	return state.hash;
+}
+
+static double
+benchmark(fasthash_hash_t (*func)(const uint8_t*, size_t, fasthash_hash_t), const uint8_t* data, size_t len) {
+	volatile fasthash_hash_t sink = 0;
+	const int iterations = BENCHMARK_BYTES/len;
+	clock_t start = clock();
+	int i;
+
+	for(i = 0; i < iterations; i++)
+		sink += func(data, len, i);
+
+	(void)sink;
+
+	return (double)(clock() - start) * 1.0e9 / CLOCKS_PER_SEC / iterations;
+}
+
+static fasthash_hash_t
+oneshot_hash(const uint8_t* data, size_t len, fasthash_hash_t salt) {
+	return fasthash32(data, len, salt);
+}
+
+int
+main(void) {
+	uint8_t buffer[256];
+	size_t len, split;
+	int failures = 0;
+
+	srand(1);
+	for(len = 0; len < sizeof(buffer); len++)
+		buffer[len] = rand();
+
+	// Every length, every alignment and every split point must
+	// agree with the byte-at-a-time version.
+	for(len = 0; len <= 64; len++) {
+		size_t offset;
+		for(offset = 0; offset < 8; offset++) {
+			const uint8_t* data = buffer + offset;
+			fasthash_hash_t expected = reference_hash(data, len, 0x1234);
+
+			if(fasthash32(data, len, 0x1234) != expected) {
+				fprintf(stderr, "fasthash32 mismatch: len=%d offset=%d\n", (int)len, (int)offset);
+				failures++;
+			}
+
+			for(split = 0; split <= len; split++) {
+				fasthash_state_t state;
+				fasthash_init(&state, 0x1234);
+				fasthash_update(&state, data, split);
+				fasthash_update(&state, data + split, len - split);
+				if(fasthash_final(&state) != expected) {
+					fprintf(stderr, "fasthash_update mismatch: len=%d offset=%d split=%d\n", (int)len, (int)offset, (int)split);
+					failures++;
+				}
+			}
+		}
+	}
+
+	// The legacy API should still give the same answers.
+	fasthash_start(0);
+	fasthash_feed(buffer, 30);
+	if(fasthash_finish() != reference_hash(buffer, 30, 0)) {
+		fprintf(stderr, "legacy API mismatch\n");
+		failures++;
+	}
+
+	// Per-packet cost: a sockaddr_in6 plus a message id is 30 bytes.
+	{
+		static const size_t sizes[] = { 30, 128, 1024 };
+		unsigned i;
+		for(i = 0; i < sizeof(sizes)/sizeof(*sizes); i++) {
+			uint8_t big[1024];
+			double before, after;
+			memcpy(big, buffer, sizeof(buffer));
+			memcpy(big + 256, buffer, sizeof(buffer));
+			memcpy(big + 512, big, 512);
+
+			before = benchmark(&reference_hash, big, sizes[i]);
+			after = benchmark(&oneshot_hash, big, sizes[i]);
+			printf("%4d bytes: byte-at-a-time %6.1f ns, word-at-a-time %6.1f ns\n",
+				(int)sizes[i], before, after);
+		}
+	}
+
+	if(failures)
+		fprintf(stderr, "%d failures\n", failures);
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#endif
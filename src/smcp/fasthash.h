@@ -10,10 +10,7 @@
 #define SMCP_fasthash_h
 
 #include <stdint.h>
-
-// Warning: This is not reentrant!
-// Justification for non-reentrancy was to avoid extra stack usage on
-// constrainted platforms.
+#include <stddef.h>
 
 typedef uint32_t fasthash_hash_t;
 
@@ -23,6 +20,30 @@ struct fasthash_state_s {
 	fasthash_hash_t next;
 };
 
+typedef struct fasthash_state_s fasthash_state_t;
+
+#pragma mark -
+#pragma mark Reentrant API
+
+// The state lives wherever the caller puts it (usually the stack),
+// so these are safe to use from any number of threads at once.
+// Input is consumed a word at a time where possible.
+
+extern void fasthash_init(fasthash_state_t* state, fasthash_hash_t salt);
+extern void fasthash_update(fasthash_state_t* state, const void* data, size_t len);
+extern void fasthash_update_byte(fasthash_state_t* state, uint8_t data);
+extern fasthash_hash_t fasthash_final(fasthash_state_t* state);
+
+//! Hashes a single buffer in one shot.
+extern fasthash_hash_t fasthash32(const void* data, size_t len, fasthash_hash_t salt);
+
+#pragma mark -
+#pragma mark Legacy API
+
+// Warning: This is not reentrant! (Each thread does get its own state, though.)
+// Justification for non-reentrancy was to avoid extra stack usage on
+// constrainted platforms. New code should use the reentrant API above.
+
 extern void fasthash_start(fasthash_hash_t salt);
 extern void fasthash_feed_byte(uint8_t data);
 extern void fasthash_feed(const uint8_t* data, uint8_t len);
@@ -0,0 +1,300 @@
+/*!	@file hashtable.c
+**	@brief Open-Addressing Hash Table
+**
+**
+**	Copyright (C) 2011,2012 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+**
+**	-------------------------------------------------------------------
+**
+**	To run the self-test, compile this file with the macro
+**	HASHTABLE_SELF_TEST set to 1. For example:
+**
+**	    cc hashtable.c -Wall -DHASHTABLE_SELF_TEST=1 -o hashtabletest
+*/
+
+#include "hashtable.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef HT_MIN_CAPACITY
+#define HT_MIN_CAPACITY		(16)
+#endif
+
+// The table grows once it is three-quarters full.
+#define HT_NEEDS_GROWTH(ht)	(((ht)->count+1)*4 > (ht)->capacity*3)
+
+static bool
+ht_resize_(ht_t* ht, uint32_t capacity) {
+	struct ht_entry_s* const old_entries = ht->entries;
+	const uint32_t old_capacity = ht->capacity;
+	struct ht_entry_s* entries;
+	uint32_t i;
+
+	entries = calloc(capacity, sizeof(*entries));
+
+	if(!entries)
+		return false;
+
+	ht->entries = entries;
+	ht->capacity = capacity;
+
+	for(i = 0; i < old_capacity; i++) {
+		if(old_entries[i].item) {
+			uint32_t j = old_entries[i].hash & (capacity - 1);
+			while(entries[j].item)
+				j = (j + 1) & (capacity - 1);
+			entries[j] = old_entries[i];
+		}
+	}
+
+	free(old_entries);
+
+	return true;
+}
+
+void
+ht_init(ht_t* ht) {
+	memset(ht, 0, sizeof(*ht));
+}
+
+void
+ht_destroy(ht_t* ht) {
+	free(ht->entries);
+	memset(ht, 0, sizeof(*ht));
+}
+
+bool
+ht_insert(ht_t* ht, uint32_t hash, void* item) {
+	uint32_t i;
+
+	if(!item)
+		return false;
+
+	if(HT_NEEDS_GROWTH(ht)) {
+		if(!ht_resize_(ht, ht->capacity ? ht->capacity * 2 : HT_MIN_CAPACITY))
+			return false;
+	}
+
+	for(i = hash & (ht->capacity - 1); ht->entries[i].item; i = (i + 1) & (ht->capacity - 1)) { }
+
+	ht->entries[i].hash = hash;
+	ht->entries[i].item = item;
+	ht->count++;
+
+	return true;
+}
+
+void*
+ht_find(
+	const ht_t* ht,
+	uint32_t hash,
+	const void* key,
+	ht_match_func_t match_func,
+	void* context
+) {
+	uint32_t i;
+
+	if(!ht->count)
+		return NULL;
+
+	for(i = hash & (ht->capacity - 1); ht->entries[i].item; i = (i + 1) & (ht->capacity - 1)) {
+		if(ht->entries[i].hash != hash)
+			continue;
+
+		if(!match_func || (*match_func)(ht->entries[i].item, key, context))
+			return ht->entries[i].item;
+	}
+
+	return NULL;
+}
+
+bool
+ht_remove(ht_t* ht, uint32_t hash, const void* item) {
+	const uint32_t mask = ht->capacity - 1;
+	uint32_t i, j;
+
+	if(!ht->count)
+		return false;
+
+	for(i = hash & mask; ht->entries[i].item != item; i = (i + 1) & mask) {
+		if(!ht->entries[i].item)
+			return false;
+	}
+
+	// Shift back any entries that would become unreachable
+	// when the hole we are about to make is emptied.
+	for(j = (i + 1) & mask; ht->entries[j].item; j = (j + 1) & mask) {
+		const uint32_t home = ht->entries[j].hash & mask;
+
+		// Entry `j` can fill the hole at `i` only if its home slot
+		// isn't (cyclically) between the hole and itself.
+		if(((j - home) & mask) >= ((j - i) & mask)) {
+			ht->entries[i] = ht->entries[j];
+			i = j;
+		}
+	}
+
+	ht->entries[i].item = NULL;
+	ht->entries[i].hash = 0;
+	ht->count--;
+
+	return true;
+}
+
+void
+ht_clear(ht_t* ht) {
+	if(ht->entries)
+		memset(ht->entries, 0, ht->capacity * sizeof(*ht->entries));
+	ht->count = 0;
+}
+
+void*
+ht_next(const ht_t* ht, uint32_t* iter) {
+	while(*iter < ht->capacity) {
+		void* item = ht->entries[(*iter)++].item;
+		if(item)
+			return item;
+	}
+	return NULL;
+}
+
+#if HASHTABLE_SELF_TEST
+
+#include <stdio.h>
+
+#define SELF_TEST_ITEMS		(5000)
+
+struct self_test_item_s {
+	int key;
+	bool present;
+};
+
+static uint32_t
+self_test_hash(int key) {
+	// Deliberately weak so that there are plenty of collisions.
+	return (uint32_t)key % 97;
+}
+
+static bool
+self_test_match(const void* item, const void* key, void* context) {
+	(void)context;
+	return ((const struct self_test_item_s*)item)->key == *(const int*)key;
+}
+
+static int
+self_test_verify(ht_t* ht, struct self_test_item_s* items, int count) {
+	int i;
+	int present = 0;
+	uint32_t iter = 0;
+
+	for(i = 0; i < count; i++) {
+		void* found = ht_find(ht, self_test_hash(items[i].key), &items[i].key, &self_test_match, NULL);
+		if(items[i].present) {
+			present++;
+			if(found != &items[i]) {
+				printf("Item %d missing!\n", i);
+				return -1;
+			}
+		} else if(found) {
+			printf("Item %d should have been removed!\n", i);
+			return -1;
+		}
+	}
+
+	if(ht_count(ht) != (uint32_t)present) {
+		printf("Bad count: %d != %d\n", (int)ht_count(ht), present);
+		return -1;
+	}
+
+	for(i = 0; ht_next(ht, &iter); i++) { }
+
+	if(i != present) {
+		printf("Bad count in traversal: %d != %d\n", i, present);
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+main(void) {
+	static struct self_test_item_s items[SELF_TEST_ITEMS];
+	ht_t ht;
+	int i, round;
+	unsigned int lcg = 1;
+
+	ht_init(&ht);
+
+	printf("Insertion test...");
+	fflush(stdout);
+	for(i = 0; i < SELF_TEST_ITEMS; i++) {
+		items[i].key = i;
+		items[i].present = true;
+		if(!ht_insert(&ht, self_test_hash(i), &items[i])) {
+			printf("Insert failed!\n");
+			return -1;
+		}
+	}
+	if(self_test_verify(&ht, items, SELF_TEST_ITEMS))
+		return -1;
+	printf("OK\n");
+
+	printf("Random removal/insertion test...");
+	fflush(stdout);
+	for(round = 0; round < 20; round++) {
+		for(i = 0; i < SELF_TEST_ITEMS / 4; i++) {
+			int n;
+			lcg = lcg * 1664525 + 1013904223;
+			n = (lcg >> 8) % SELF_TEST_ITEMS;
+			if(items[n].present) {
+				if(!ht_remove(&ht, self_test_hash(n), &items[n])) {
+					printf("Remove of %d failed!\n", n);
+					return -1;
+				}
+			} else {
+				ht_insert(&ht, self_test_hash(n), &items[n]);
+			}
+			items[n].present = !items[n].present;
+		}
+		if(self_test_verify(&ht, items, SELF_TEST_ITEMS))
+			return -1;
+	}
+	printf("OK\n");
+
+	printf("Clear test...");
+	fflush(stdout);
+	ht_clear(&ht);
+	for(i = 0; i < SELF_TEST_ITEMS; i++)
+		items[i].present = false;
+	if(self_test_verify(&ht, items, SELF_TEST_ITEMS))
+		return -1;
+	printf("OK\n");
+
+	ht_destroy(&ht);
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,123 @@
+/*!	@file hashtable.h
+**	@brief Open-Addressing Hash Table
+**
+**	Copyright (C) 2011,2012 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __HASHTABLE_HEADER__
+#define __HASHTABLE_HEADER__ 1
+
+#if !defined(__BEGIN_DECLS) || !defined(__END_DECLS)
+#if defined(__cplusplus)
+#define __BEGIN_DECLS   extern "C" {
+#define __END_DECLS \
+	}
+#else
+#define __BEGIN_DECLS
+#define __END_DECLS
+#endif
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+__BEGIN_DECLS
+
+/*!	@defgroup hashtable Hash Table Functions
+**	@{
+**	A linear-probing hash table of pointers. The table doesn't
+**	know how to hash anything itself: the caller supplies a 32-bit
+**	hash with each item, which the table stores next to the
+**	pointer so that probing rarely has to touch the item. Lookups
+**	take an optional match function to tell apart different items
+**	that have the same hash.
+**
+**	Several items may be stored under the same hash. Deleting an
+**	item shifts its neighbors back instead of leaving a tombstone,
+**	so lookups never slow down as items come and go.
+*/
+
+struct ht_entry_s {
+	uint32_t	hash;
+	void*		item;	//!< NULL if this entry is empty.
+};
+
+struct ht_s {
+	struct ht_entry_s*	entries;
+	uint32_t			capacity;	//!< Always zero or a power of two.
+	uint32_t			count;
+};
+
+typedef struct ht_s ht_t;
+
+//!	Returns true if `item` is the one being looked for.
+typedef bool (*ht_match_func_t)(const void* item, const void* key, void* context);
+
+//!	Initializes an empty table. Doesn't allocate anything.
+extern void ht_init(ht_t* ht);
+
+//!	Frees the table's storage. The items themselves are left alone.
+extern void ht_destroy(ht_t* ht);
+
+//!	Adds `item` to the table under `hash`.
+/*!	@returns false if the table needed to grow and couldn't. */
+extern bool ht_insert(ht_t* ht, uint32_t hash, void* item);
+
+//!	Finds an item stored under `hash`.
+/*!	If `match_func` is NULL, the first item stored under `hash`
+**	is returned. Otherwise `match_func` is called with `key` and
+**	`context` for each candidate until it returns true. */
+extern void* ht_find(
+	const ht_t* ht,
+	uint32_t hash,
+	const void* key,
+	ht_match_func_t match_func,
+	void* context
+);
+
+//!	Removes `item`, which must have been inserted under `hash`.
+/*!	@returns false if the item wasn't in the table. */
+extern bool ht_remove(ht_t* ht, uint32_t hash, const void* item);
+
+//!	Removes every item, keeping the storage for reuse.
+extern void ht_clear(ht_t* ht);
+
+static inline uint32_t
+ht_count(const ht_t* ht) {
+	return ht->count;
+}
+
+//!	Iterates over every item in the table, in no particular order.
+/*!	Set `*iter` to zero before the first call. Returns NULL when
+**	there are no more items. The table must not be changed while
+**	iterating. */
+extern void* ht_next(const ht_t* ht, uint32_t* iter);
+
+/*!	@} */
+
+__END_DECLS
+
+#endif // __HASHTABLE_HEADER__
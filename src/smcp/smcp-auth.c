@@ -173,13 +173,16 @@ void
 smcp_auth_user_set(smcp_auth_user_t auth_user,const char* username,const char* password,const char* realm) {
 	strncpy(auth_user->username,username,sizeof(auth_user->username)-1);
 
-	fasthash_start(0);
-	fasthash_feed((const uint8_t*)auth_user->username, strlen(auth_user->username));
-	fasthash_feed_byte(':');
-	fasthash_feed((const uint8_t*)realm, strlen(realm));
-	fasthash_feed_byte(':');
-	fasthash_feed((const uint8_t*)password, strlen(password));
-	auth_user->ha1 = fasthash_finish();
+	{
+		fasthash_state_t state;
+		fasthash_init(&state, 0);
+		fasthash_update(&state, auth_user->username, strlen(auth_user->username));
+		fasthash_update_byte(&state, ':');
+		fasthash_update(&state, realm, strlen(realm));
+		fasthash_update_byte(&state, ':');
+		fasthash_update(&state, password, strlen(password));
+		auth_user->ha1 = fasthash_final(&state);
+	}
 
 	// Get the compiler to shut up while this code is in development.
 	(void)current_outbound_user;
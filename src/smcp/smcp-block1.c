@@ -0,0 +1,318 @@
+/*	@file smcp-block1.c
+**	@brief Putting Block1 request bodies back together.
+**
+**	Copyright (C) 2011,2012 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Uploads in progress are keyed by the peer's address together with
+// a hash of the request method and URI, for the same reason large
+// responses are: the token may change from one block to the next.
+//
+// Blocks have to arrive in order. A block we already have is simply
+// acknowledged again, since that means our 2.31 got lost.
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef VERBOSE_DEBUG
+#define VERBOSE_DEBUG 0
+#endif
+
+#ifndef DEBUG
+#define DEBUG VERBOSE_DEBUG
+#endif
+
+#include "assert-macros.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "smcp-internal.h"
+#include "smcp-helpers.h"
+#include "smcp-logging.h"
+#include "smcp.h"
+#include "fasthash.h"
+
+#if SMCP_CONF_BLOCK1_UPLOADS
+
+//!	Hashes the peer address, the method, and the options that identify the resource.
+static uint32_t
+smcp_block1_upload_hash_(smcp_t self) {
+	fasthash_state_t state;
+	const coap_code_t code = self->inbound.packet->code;
+	struct smcp_inbound_option_cursor_s cursor;
+	struct smcp_inbound_option_s option;
+
+	fasthash_init(&state, 0);
+
+#if SMCP_USE_BSD_SOCKETS
+	fasthash_update(&state, self->inbound.saddr, self->inbound.socklen);
+#elif CONTIKI
+	fasthash_update(&state, &self->inbound.toaddr, sizeof(self->inbound.toaddr));
+	fasthash_update(&state, &self->inbound.toport, sizeof(self->inbound.toport));
+#endif
+
+	fasthash_update(&state, &code, sizeof(code));
+
+	smcp_inbound_option_cursor_init_(self, &cursor);
+	while(smcp_inbound_option_cursor_next_(self, &cursor, &option)) {
+		switch(option.key) {
+		case COAP_OPTION_URI_HOST:
+		case COAP_OPTION_URI_PORT:
+		case COAP_OPTION_URI_PATH:
+		case COAP_OPTION_URI_QUERY:
+		case COAP_OPTION_PROXY_URI:
+			fasthash_update(&state, &option.key, sizeof(option.key));
+			fasthash_update(&state, (const uint8_t*)self->inbound.packet + option.offset, option.len);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	return fasthash_final(&state);
+}
+
+static bool
+smcp_block1_upload_matches_(
+	smcp_t self, const struct smcp_block1_upload_s* upload, uint32_t hash
+) {
+	return upload->data
+		&& (upload->hash == hash)
+#if SMCP_USE_BSD_SOCKETS
+		&& (upload->socklen == self->inbound.socklen)
+		&& (0 == memcmp(&upload->saddr, self->inbound.saddr, upload->socklen))
+#elif CONTIKI
+		&& (upload->toport == self->inbound.toport)
+		&& uip_ipaddr_cmp(&upload->toaddr, &self->inbound.toaddr)
+#endif
+	;
+}
+
+static void
+smcp_block1_upload_free_(struct smcp_block1_upload_s* upload) {
+	free(upload->data);
+	upload->data = NULL;
+}
+
+void
+smcp_block1_upload_clear(smcp_t self) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	int i;
+
+	for(i = 0; i < SMCP_CONF_BLOCK1_UPLOAD_SLOTS; i++)
+		smcp_block1_upload_free_(&self->block1_upload[i]);
+
+	free(self->block1_body);
+	self->block1_body = NULL;
+}
+
+//!	Finds the upload the current request belongs to, forgetting it if it has expired.
+static struct smcp_block1_upload_s*
+smcp_block1_upload_find_(smcp_t self, uint32_t hash) {
+	const smcp_timestamp_t now = smcp_get_time(self);
+	int i;
+
+	for(i = 0; i < SMCP_CONF_BLOCK1_UPLOAD_SLOTS; i++) {
+		struct smcp_block1_upload_s* const upload = &self->block1_upload[i];
+
+		if(!smcp_block1_upload_matches_(self, upload, hash))
+			continue;
+
+		if(upload->expiration <= now) {
+			smcp_block1_upload_free_(upload);
+			break;
+		}
+
+		return upload;
+	}
+
+	return NULL;
+}
+
+//!	Takes over a free slot, or the one touched longest ago, for a new upload.
+static struct smcp_block1_upload_s*
+smcp_block1_upload_insert_(smcp_t self, uint32_t hash, size_t size) {
+	struct smcp_block1_upload_s* ret = NULL;
+	int i;
+
+	for(i = 0; i < SMCP_CONF_BLOCK1_UPLOAD_SLOTS; i++) {
+		struct smcp_block1_upload_s* const upload = &self->block1_upload[i];
+
+		if(!ret || !upload->data || (ret->data && (upload->expiration < ret->expiration)))
+			ret = upload;
+	}
+
+	smcp_block1_upload_free_(ret);
+
+	ret->data = malloc(size);
+	require(ret->data, bail);
+
+	ret->size = size;
+	ret->len = 0;
+	ret->hash = hash;
+#if SMCP_USE_BSD_SOCKETS
+	memcpy(&ret->saddr, self->inbound.saddr, self->inbound.socklen);
+	ret->socklen = self->inbound.socklen;
+#elif CONTIKI
+	memcpy(&ret->toaddr, &self->inbound.toaddr, sizeof(ret->toaddr));
+	ret->toport = self->inbound.toport;
+#endif
+
+bail:
+	return ret->data ? ret : NULL;
+}
+
+//!	Answers the current block with `code`, echoing its Block1 option.
+static smcp_status_t
+smcp_block1_respond_(coap_code_t code, uint32_t block1) {
+	smcp_status_t ret;
+
+	ret = smcp_outbound_begin_response(code);
+	require_noerr(ret, bail);
+
+	if(code == COAP_RESULT_413_REQUEST_ENTITY_TOO_LARGE) {
+		ret = smcp_outbound_add_option_uint(COAP_OPTION_SIZE1, SMCP_CONF_BLOCK1_UPLOAD_MAX_SIZE);
+	} else {
+		ret = smcp_outbound_add_option_uint(COAP_OPTION_BLOCK1, block1);
+	}
+	require_noerr(ret, bail);
+
+	ret = smcp_outbound_send();
+	require_noerr(ret, bail);
+
+	ret = SMCP_STATUS_RESPONDED;
+
+bail:
+	return ret;
+}
+
+smcp_status_t
+smcp_inbound_collect_block1(void) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+	smcp_t const self = smcp_get_current_instance();
+	struct smcp_block1_upload_s* upload;
+	const uint8_t* value = NULL;
+	size_t value_len = 0;
+	uint32_t block1;
+	uint32_t size1 = 0;
+	size_t offset;
+	uint32_t hash;
+
+	if(!smcp_inbound_find_option(COAP_OPTION_BLOCK1, &value, &value_len))
+		goto bail;
+
+	block1 = coap_decode_uint32(value, (uint8_t)value_len);
+	require_action((block1 & 0x7) != 7, bail, ret = SMCP_STATUS_BAD_OPTION);
+
+	offset = (size_t)(block1 >> 4) << ((block1 & 0x7) + 4);
+
+	if(smcp_inbound_find_option(COAP_OPTION_SIZE1, &value, &value_len))
+		size1 = coap_decode_uint32(value, (uint8_t)value_len);
+
+	hash = smcp_block1_upload_hash_(self);
+	upload = smcp_block1_upload_find_(self, hash);
+
+	if(	(size1 > SMCP_CONF_BLOCK1_UPLOAD_MAX_SIZE)
+		|| (offset + self->inbound.content_len > SMCP_CONF_BLOCK1_UPLOAD_MAX_SIZE)
+	) {
+		if(upload)
+			smcp_block1_upload_free_(upload);
+		ret = smcp_block1_respond_(COAP_RESULT_413_REQUEST_ENTITY_TOO_LARGE, block1);
+		goto bail;
+	}
+
+	if(!offset) {
+		// A new upload, or one starting over.
+		if(upload)
+			upload->len = 0;
+		else
+			upload = smcp_block1_upload_insert_(self, hash, size1 ? size1 : MAX(self->inbound.content_len * 2, 256));
+		require_action(upload, bail, ret = SMCP_STATUS_MALLOC_FAILURE);
+	}
+
+	if(!upload || (offset > upload->len)) {
+		// We missed a block somewhere along the way.
+		if(upload)
+			smcp_block1_upload_free_(upload);
+		ret = smcp_block1_respond_(COAP_RESULT_408_REQUEST_INCOMPLETE, block1);
+		goto bail;
+	}
+
+	if(offset == upload->len) {
+		const size_t len = offset + self->inbound.content_len;
+
+		if(len > upload->size) {
+			size_t size = upload->size ? upload->size : 256;
+			char* data;
+
+			while(size < len)
+				size *= 2;
+
+			data = realloc(upload->data, size);
+			require_action(data, bail, ret = SMCP_STATUS_MALLOC_FAILURE);
+
+			upload->data = data;
+			upload->size = size;
+		}
+
+		memcpy(upload->data + offset, self->inbound.content_ptr, self->inbound.content_len);
+		upload->len = len;
+	}
+
+	upload->expiration = smcp_timestamp_from_cms(self, SMCP_CONF_BLOCK1_UPLOAD_LIFETIME);
+
+	if(block1 & (1<<3)) {
+		ret = smcp_block1_respond_(COAP_RESULT_231_CONTINUE, block1);
+		goto bail;
+	}
+
+	// That was the last block, so the handler gets the whole body.
+	// It is freed once the handler returns.
+	free(self->block1_body);
+	self->block1_body = upload->data;
+	self->inbound.content_ptr = upload->data;
+	self->inbound.content_len = upload->len;
+	upload->data = NULL;
+
+bail:
+	return ret;
+}
+
+#else // SMCP_CONF_BLOCK1_UPLOADS
+
+smcp_status_t
+smcp_inbound_collect_block1(void) {
+	if(smcp_inbound_find_option(COAP_OPTION_BLOCK1, NULL, NULL))
+		return SMCP_STATUS_NOT_IMPLEMENTED;
+
+	return SMCP_STATUS_OK;
+}
+
+#endif // SMCP_CONF_BLOCK1_UPLOADS
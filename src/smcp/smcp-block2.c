@@ -0,0 +1,425 @@
+/*	@file smcp-block2.c
+**	@brief Serving representations larger than a packet with Block2.
+**
+**	Copyright (C) 2011,2012 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// A large response is generated in full the first time it is asked
+// for (block zero, or no Block2 option at all). Its options are
+// encoded once and stored along with the content. Every block,
+// including the first, is then built from that stored copy, so the
+// request handler only ever runs once per transfer.
+//
+// Remembered responses are keyed by the peer's address together with
+// a hash of the options that identify the resource. The token isn't
+// part of the key because clients are free to use a new token for
+// each block request.
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef VERBOSE_DEBUG
+#define VERBOSE_DEBUG 0
+#endif
+
+#ifndef DEBUG
+#define DEBUG VERBOSE_DEBUG
+#endif
+
+#include "assert-macros.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "smcp-internal.h"
+#include "smcp-helpers.h"
+#include "smcp-logging.h"
+#include "smcp.h"
+#include "fasthash.h"
+
+#if SMCP_CONF_LARGE_RESPONSES
+
+struct smcp_large_content_s {
+	char*					data;
+	size_t					len;
+	size_t					size;
+};
+
+//!	Hashes the peer address and the options that identify what was asked for.
+static uint32_t
+smcp_large_response_hash_(smcp_t self) {
+	fasthash_state_t state;
+	struct smcp_inbound_option_cursor_s cursor;
+	struct smcp_inbound_option_s option;
+
+	fasthash_init(&state, 0);
+
+#if SMCP_USE_BSD_SOCKETS
+	fasthash_update(&state, self->inbound.saddr, self->inbound.socklen);
+#elif CONTIKI
+	fasthash_update(&state, &self->inbound.toaddr, sizeof(self->inbound.toaddr));
+	fasthash_update(&state, &self->inbound.toport, sizeof(self->inbound.toport));
+#endif
+
+	smcp_inbound_option_cursor_init_(self, &cursor);
+	while(smcp_inbound_option_cursor_next_(self, &cursor, &option)) {
+		switch(option.key) {
+		case COAP_OPTION_URI_HOST:
+		case COAP_OPTION_URI_PORT:
+		case COAP_OPTION_URI_PATH:
+		case COAP_OPTION_URI_QUERY:
+		case COAP_OPTION_ACCEPT:
+		case COAP_OPTION_PROXY_URI:
+			fasthash_update(&state, &option.key, sizeof(option.key));
+			fasthash_update(&state, (const uint8_t*)self->inbound.packet + option.offset, option.len);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	return fasthash_final(&state);
+}
+
+static bool
+smcp_large_response_matches_(
+	smcp_t self, const struct smcp_large_response_s* entry, uint32_t hash
+) {
+	return entry->data
+		&& (entry->hash == hash)
+#if SMCP_USE_BSD_SOCKETS
+		&& (entry->socklen == self->inbound.socklen)
+		&& (0 == memcmp(&entry->saddr, self->inbound.saddr, entry->socklen))
+#elif CONTIKI
+		&& (entry->toport == self->inbound.toport)
+		&& uip_ipaddr_cmp(&entry->toaddr, &self->inbound.toaddr)
+#endif
+	;
+}
+
+static void
+smcp_large_response_free_(struct smcp_large_response_s* entry) {
+	free(entry->data);
+	entry->data = NULL;
+}
+
+//!	Sends one block of `entry` as the response to the current request.
+static smcp_status_t
+smcp_large_response_send_block_(
+	smcp_t self, struct smcp_large_response_s* entry, uint32_t block2
+) {
+	smcp_status_t ret;
+	const uint8_t max_szx = smcp_max_block_szx_();
+	uint8_t szx = block2 & 0x7;
+	size_t start;
+	size_t len;
+	bool added_block2 = false;
+	const uint8_t* iter = entry->data;
+	const uint8_t* const options_end = entry->data + entry->options_len;
+	coap_option_key_t key = 0;
+
+	require_action(szx != 7, bail, ret = SMCP_STATUS_BAD_OPTION);
+
+	// The block number is in units of the size the client asked
+	// for, which may be bigger than what we are willing to send.
+	start = (size_t)(block2 >> 4) << (szx + 4);
+	szx = MIN(szx, max_szx);
+
+	require_action(
+		(start < entry->content_len) || (start == 0),
+		bail,
+		ret = SMCP_STATUS_BAD_OPTION
+	);
+
+	len = MIN(entry->content_len - start, (size_t)1 << (szx + 4));
+
+	block2 = (uint32_t)((start >> (szx + 4)) << 4) | szx;
+	if(start + len < entry->content_len)
+		block2 |= (1 << 3);
+
+	ret = smcp_outbound_begin_response(entry->code);
+	require_noerr(ret, bail);
+
+	while(iter < options_end) {
+		const uint8_t* value;
+		size_t value_len;
+
+		iter = coap_decode_option(iter, &key, &value, &value_len);
+
+		if(!added_block2 && (key > COAP_OPTION_BLOCK2)) {
+			ret = smcp_outbound_add_option_uint(COAP_OPTION_BLOCK2, block2);
+			require_noerr(ret, bail);
+			added_block2 = true;
+		}
+
+		ret = smcp_outbound_add_option(key, (const char*)value, value_len);
+		require_noerr(ret, bail);
+	}
+
+	if(!added_block2) {
+		ret = smcp_outbound_add_option_uint(COAP_OPTION_BLOCK2, block2);
+		require_noerr(ret, bail);
+	}
+
+#if SMCP_USE_BSD_SOCKETS
+	{
+		// Send the block straight out of the stored copy.
+		const struct iovec iov = {
+			.iov_base = (char*)options_end + start,
+			.iov_len = len,
+		};
+		ret = smcp_outbound_set_content_iov(&iov, 1);
+	}
+#else
+	ret = smcp_outbound_append_content((const char*)options_end + start, len);
+#endif
+	require_noerr(ret, bail);
+
+	entry->expiration = smcp_timestamp_from_cms(self, SMCP_CONF_LARGE_RESPONSE_LIFETIME);
+
+	ret = smcp_outbound_send();
+
+bail:
+	return ret;
+}
+
+smcp_status_t
+smcp_large_response_serve(smcp_t self) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	smcp_status_t ret = SMCP_STATUS_NOT_FOUND;
+	const smcp_timestamp_t now = smcp_get_time(self);
+	uint32_t hash;
+	int i;
+
+	// Only requests for the second block onward are served from
+	// here. Block zero always goes to the handler, so a client
+	// starting a new transfer always gets a fresh representation.
+	if(	!self->inbound.has_block2_option
+		|| ((self->inbound.block2_value >> 4) == 0)
+		|| (self->inbound.packet->code != COAP_METHOD_GET)
+	) {
+		goto bail;
+	}
+
+	hash = smcp_large_response_hash_(self);
+
+	for(i = 0; i < SMCP_CONF_LARGE_RESPONSE_CACHE_SIZE; i++) {
+		struct smcp_large_response_s* const entry = &self->large_response[i];
+
+		if(!smcp_large_response_matches_(self, entry, hash))
+			continue;
+
+		if(entry->expiration <= now) {
+			smcp_large_response_free_(entry);
+			break;
+		}
+
+		self->stats.large_response_hits++;
+
+		ret = smcp_large_response_send_block_(self, entry, self->inbound.block2_value);
+
+		// Let the handler deal with whatever we couldn't.
+		if(ret && !self->did_respond)
+			ret = SMCP_STATUS_NOT_FOUND;
+		else
+			ret = SMCP_STATUS_OK;
+		break;
+	}
+
+bail:
+	return ret;
+}
+
+void
+smcp_large_response_clear(smcp_t self) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	int i;
+
+	for(i = 0; i < SMCP_CONF_LARGE_RESPONSE_CACHE_SIZE; i++)
+		smcp_large_response_free_(&self->large_response[i]);
+}
+
+//!	Picks the slot for a new large response for the current request.
+static struct smcp_large_response_s*
+smcp_large_response_insert_(smcp_t self, uint32_t hash) {
+	struct smcp_large_response_s* ret = NULL;
+	int i;
+
+	for(i = 0; i < SMCP_CONF_LARGE_RESPONSE_CACHE_SIZE; i++) {
+		struct smcp_large_response_s* const entry = &self->large_response[i];
+
+		// Always replace an older copy of the same thing.
+		if(smcp_large_response_matches_(self, entry, hash)) {
+			ret = entry;
+			break;
+		}
+
+		if(!ret || !entry->data || (ret->data && (entry->expiration < ret->expiration)))
+			ret = entry;
+	}
+
+	smcp_large_response_free_(ret);
+
+	ret->hash = hash;
+#if SMCP_USE_BSD_SOCKETS
+	memcpy(&ret->saddr, self->inbound.saddr, self->inbound.socklen);
+	ret->socklen = self->inbound.socklen;
+#elif CONTIKI
+	memcpy(&ret->toaddr, &self->inbound.toaddr, sizeof(ret->toaddr));
+	ret->toport = self->inbound.toport;
+#endif
+
+	return ret;
+}
+
+smcp_status_t
+smcp_large_content_append(smcp_large_content_t content, const char* value, size_t len) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+
+	if(len == SMCP_CSTR_LEN)
+		len = strlen(value);
+
+	if(content->len + len > content->size) {
+		size_t size = content->size ? content->size : 256;
+		char* data;
+
+		while(size < content->len + len)
+			size *= 2;
+
+		data = realloc(content->data, size);
+		require_action(data, bail, ret = SMCP_STATUS_MALLOC_FAILURE);
+
+		content->data = data;
+		content->size = size;
+	}
+
+	memcpy(content->data + content->len, value, len);
+	content->len += len;
+
+bail:
+	return ret;
+}
+
+smcp_status_t
+smcp_outbound_send_large(smcp_large_content_func generator, void* context) {
+	smcp_status_t ret;
+	smcp_t const self = smcp_get_current_instance();
+	struct smcp_large_content_s content = { NULL, 0, 0 };
+	struct smcp_large_response_s* entry;
+	const uint8_t max_szx = smcp_max_block_szx_();
+	uint32_t etag;
+	uint8_t* options;
+	size_t options_len;
+
+	require_action(self->is_processing_message, bail, ret = SMCP_STATUS_FAILURE);
+
+	ret = (*generator)(&content, context);
+	require_noerr(ret, bail);
+
+	if(	!self->inbound.has_block2_option
+		&& (content.len <= ((size_t)1 << (max_szx + 4)))
+	) {
+		// Small enough to send the usual way.
+		ret = smcp_outbound_append_content(content.data, content.len);
+		require_noerr(ret, bail);
+
+		ret = smcp_outbound_send();
+		goto bail;
+	}
+
+	etag = htonl(fasthash32(content.data, content.len, 0));
+
+	ret = smcp_outbound_add_option(COAP_OPTION_ETAG, (const char*)&etag, sizeof(etag));
+	require_noerr(ret, bail);
+
+	ret = smcp_outbound_add_option_uint(COAP_OPTION_SIZE, (uint32_t)content.len);
+	require_noerr(ret, bail);
+
+	// Encode the options so we can keep a copy of them.
+	options = (uint8_t*)smcp_outbound_get_content_ptr(NULL);
+	require_action(options, bail, ret = SMCP_STATUS_FAILURE);
+
+	// Leave out the start-of-payload marker.
+	options--;
+	options_len = options - (self->outbound.packet->token + self->outbound.packet->token_len);
+	options -= options_len;
+
+	entry = smcp_large_response_insert_(self, smcp_large_response_hash_(self));
+
+	entry->data = malloc(options_len + content.len);
+	require_action(entry->data, bail, ret = SMCP_STATUS_MALLOC_FAILURE);
+
+	memcpy(entry->data, options, options_len);
+	memcpy(entry->data + options_len, content.data, content.len);
+	entry->options_len = (uint16_t)options_len;
+	entry->content_len = content.len;
+	entry->code = self->outbound.packet->code;
+
+	ret = smcp_large_response_send_block_(
+		self,
+		entry,
+		self->inbound.has_block2_option ? self->inbound.block2_value : max_szx
+	);
+
+	if(ret)
+		smcp_large_response_free_(entry);
+
+bail:
+	free(content.data);
+	return ret;
+}
+
+#else // SMCP_CONF_LARGE_RESPONSES
+
+// Without malloc, the content goes directly into the outbound
+// packet and whatever doesn't fit is dropped.
+
+smcp_status_t
+smcp_large_content_append(smcp_large_content_t content, const char* value, size_t len) {
+	return smcp_outbound_append_content(value, len);
+}
+
+smcp_status_t
+smcp_outbound_send_large(smcp_large_content_func generator, void* context) {
+	smcp_status_t ret;
+
+	ret = (*generator)(NULL, context);
+
+	if(ret == SMCP_STATUS_MESSAGE_TOO_BIG)
+		ret = SMCP_STATUS_OK;
+
+	require_noerr(ret, bail);
+
+	ret = smcp_outbound_send();
+
+bail:
+	return ret;
+}
+
+#endif // SMCP_CONF_LARGE_RESPONSES
@@ -0,0 +1,242 @@
+/*	@file smcp-command.c
+**	@brief Commands posted to an instance from other threads.
+**
+**	Copyright (C) 2011,2012 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Other threads hand work to the thread running smcp_process() by
+// pushing commands onto `self->commands`, a singly linked stack that
+// is only ever changed with atomic operations. The protocol thread
+// takes the whole stack at once, reverses it so that commands run in
+// the order they were posted, and runs them as a batch.
+//
+// Only a push onto an empty stack writes to the wakeup descriptor. The
+// protocol thread drains the descriptor *before* taking the stack, so
+// a command posted in between can't be left without a wakeup.
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef VERBOSE_DEBUG
+#define VERBOSE_DEBUG 0
+#endif
+
+#ifndef DEBUG
+#define DEBUG VERBOSE_DEBUG
+#endif
+
+#include "assert-macros.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include "smcp-internal.h"
+#include "smcp-logging.h"
+#include "smcp-observable.h"
+
+#if SMCP_CONF_COMMAND_QUEUE
+
+struct smcp_command_s {
+	struct smcp_command_s*	next;
+	smcp_command_func		func;
+	void*					context;
+
+	// Only used by smcp_post_observable_trigger().
+	smcp_observable_t		observable;
+	uint8_t					key;
+	uint8_t					flags;
+};
+
+smcp_status_t
+smcp_command_queue_init_(smcp_t self) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+
+	self->commands = NULL;
+
+#if HAVE_SYS_EVENTFD_H
+	self->command_fd[0] = self->command_fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	require_action_string(self->command_fd[0] >= 0, bail, ret = SMCP_STATUS_ERRNO, strerror(errno));
+#else
+	self->command_fd[0] = self->command_fd[1] = -1;
+	require_action_string(0 == pipe(self->command_fd), bail, ret = SMCP_STATUS_ERRNO, strerror(errno));
+	fcntl(self->command_fd[0], F_SETFL, O_NONBLOCK);
+	fcntl(self->command_fd[1], F_SETFL, O_NONBLOCK);
+	fcntl(self->command_fd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(self->command_fd[1], F_SETFD, FD_CLOEXEC);
+#endif
+
+bail:
+	return ret;
+}
+
+void
+smcp_command_queue_release_(smcp_t self) {
+	struct smcp_command_s* command = __atomic_exchange_n(&self->commands, NULL, __ATOMIC_ACQUIRE);
+
+	// Nobody is left to run these.
+	while(command) {
+		struct smcp_command_s* const next = command->next;
+		free(command);
+		command = next;
+	}
+
+	if(self->command_fd[0] >= 0)
+		close(self->command_fd[0]);
+	if((self->command_fd[1] >= 0) && (self->command_fd[1] != self->command_fd[0]))
+		close(self->command_fd[1]);
+
+	self->command_fd[0] = self->command_fd[1] = -1;
+}
+
+static smcp_status_t
+smcp_command_push_(smcp_t self, struct smcp_command_s* command) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+	struct smcp_command_s* head = __atomic_load_n(&self->commands, __ATOMIC_RELAXED);
+
+	do {
+		command->next = head;
+	} while(!__atomic_compare_exchange_n(&self->commands, &head, command, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	if(!head) {
+		// The protocol thread may be asleep in poll() or select().
+#if HAVE_SYS_EVENTFD_H
+		const uint64_t value = 1;
+#else
+		const uint8_t value = 1;
+#endif
+		// A full pipe already has a wakeup pending, so EAGAIN is fine.
+		if((write(self->command_fd[1], &value, sizeof(value)) < 0) && (errno != EAGAIN))
+			ret = SMCP_STATUS_ERRNO;
+	}
+
+	return ret;
+}
+
+smcp_status_t
+smcp_post_command(smcp_t self, smcp_command_func func, void* context) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+	struct smcp_command_s* command = NULL;
+
+	require_action(self && func, bail, ret = SMCP_STATUS_INVALID_ARGUMENT);
+
+	command = calloc(1, sizeof(*command));
+	require_action(command, bail, ret = SMCP_STATUS_MALLOC_FAILURE);
+
+	command->func = func;
+	command->context = context;
+
+	ret = smcp_command_push_(self, command);
+
+bail:
+	return ret;
+}
+
+static void
+smcp_command_trigger_(smcp_t self, void* context) {
+	const struct smcp_command_s* const command = context;
+
+	smcp_observable_trigger(command->observable, command->key, command->flags);
+}
+
+smcp_status_t
+smcp_post_observable_trigger(smcp_t self, smcp_observable_t context, uint8_t key, uint8_t flags) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+	struct smcp_command_s* command = NULL;
+
+	require_action(self && context, bail, ret = SMCP_STATUS_INVALID_ARGUMENT);
+
+	command = calloc(1, sizeof(*command));
+	require_action(command, bail, ret = SMCP_STATUS_MALLOC_FAILURE);
+
+	command->func = &smcp_command_trigger_;
+	command->context = command;
+	command->observable = context;
+	command->key = key;
+	command->flags = flags;
+
+	ret = smcp_command_push_(self, command);
+
+bail:
+	return ret;
+}
+
+int
+smcp_get_command_fd(smcp_t self) {
+	return self->command_fd[0];
+}
+
+void
+smcp_run_commands_(smcp_t self, bool woken) {
+	struct smcp_command_s* command;
+	struct smcp_command_s* batch = NULL;
+	uint32_t count = 0;
+
+	// A wakeup can arrive after its command has already been run, so
+	// when we were woken we drain it even if there is nothing to do.
+	if(!woken && !__atomic_load_n(&self->commands, __ATOMIC_RELAXED))
+		goto bail;
+
+	// Drain the wakeup first. See the comment at the top of the file.
+	{
+		uint64_t value;
+		while(read(self->command_fd[0], &value, sizeof(value)) > 0) { }
+	}
+
+	command = __atomic_exchange_n(&self->commands, NULL, __ATOMIC_ACQUIRE);
+
+	// The stack is newest-first, so reverse it.
+	while(command) {
+		struct smcp_command_s* const next = command->next;
+		command->next = batch;
+		batch = command;
+		command = next;
+	}
+
+	while((command = batch)) {
+		batch = command->next;
+		(*command->func)(self, command->context);
+		free(command);
+		count++;
+	}
+
+	self->stats.commands_run += count;
+	if(self->stats.command_batch_max < count)
+		self->stats.command_batch_max = count;
+
+bail:
+	return;
+}
+
+#endif // SMCP_CONF_COMMAND_QUEUE
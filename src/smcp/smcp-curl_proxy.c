@@ -108,8 +108,12 @@ resend_async_response(void* context) {
 		}
 	}
 
-	ret = smcp_outbound_append_content(request->content, len);
-	require_noerr(ret,bail);
+	{
+		// Send straight out of the curl buffer rather than copying it.
+		const struct iovec iov = { .iov_base = request->content, .iov_len = len };
+		ret = smcp_outbound_set_content_iov(&iov, 1);
+		require_noerr(ret,bail);
+	}
 
 	ret = smcp_outbound_send();
 	require_noerr(ret,bail);
@@ -0,0 +1,316 @@
+/*	@file smcp-dns.c
+**	@brief Non-blocking host name lookups for BSD sockets.
+**
+**	Copyright (C) 2011,2012 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Each instance gets one resolver thread, started the first time a
+// host name (as opposed to an address literal) needs looking up. The
+// event loop never waits on it: it either finds a finished answer in
+// the cache or gets SMCP_STATUS_WAIT_FOR_DNS and tries again later.
+//
+// Each finished lookup is announced to the instance with a posted
+// command, which retries the transactions that were waiting on it.
+// Without the command queue they find out on their own, a little later.
+//
+// The cache is shared with the thread under `lock`. An entry is only
+// ever written by the thread while it is `in_flight`, and in-flight
+// entries are never evicted, so the thread can use `host` without
+// copying it. When the instance is released while a lookup is in
+// progress, the thread is detached and frees the cache itself once
+// `getaddrinfo()` returns.
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef VERBOSE_DEBUG
+#define VERBOSE_DEBUG 0
+#endif
+
+#ifndef DEBUG
+#define DEBUG VERBOSE_DEBUG
+#endif
+
+#include "assert-macros.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "smcp-internal.h"
+#include "smcp-helpers.h"
+#include "smcp-logging.h"
+#include "smcp.h"
+
+#if SMCP_CONF_ASYNC_DNS
+
+#include <strings.h>
+#include <pthread.h>
+
+struct smcp_dns_entry_s {
+	char*				host;
+
+	//!	SMCP_STATUS_OK, SMCP_STATUS_HOST_LOOKUP_FAILURE, or
+	//!	SMCP_STATUS_WAIT_FOR_DNS while the lookup is pending.
+	smcp_status_t		status;
+	bool				in_flight;
+
+	//!	Zero until the event loop first sees the answer.
+	smcp_timestamp_t	expiration;
+
+	struct sockaddr_in6	saddr;
+};
+
+struct smcp_dns_s {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	pthread_t			thread;
+	bool				has_thread;
+	bool				shutdown;
+#if SMCP_CONF_COMMAND_QUEUE
+	smcp_t				instance;	//!< Only used while not `shutdown`.
+#endif
+	struct smcp_dns_entry_s entry[SMCP_CONF_DNS_CACHE_SIZE];
+};
+
+static void
+smcp_dns_free_(struct smcp_dns_s* dns) {
+	int i;
+
+	for(i = 0; i < SMCP_CONF_DNS_CACHE_SIZE; i++)
+		free(dns->entry[i].host);
+
+	pthread_cond_destroy(&dns->cond);
+	pthread_mutex_destroy(&dns->lock);
+	free(dns);
+}
+
+#if SMCP_CONF_COMMAND_QUEUE
+static void
+smcp_dns_answer_ready_(smcp_t self, void* context) {
+	smcp_transaction_dns_ready_(self);
+}
+#endif
+
+static void*
+smcp_dns_thread_main_(void* context) {
+	struct smcp_dns_s* const dns = context;
+	struct smcp_dns_entry_s* entry = NULL;
+	struct sockaddr_in6 saddr;
+	smcp_status_t status;
+	int i;
+
+	pthread_mutex_lock(&dns->lock);
+
+	while(!dns->shutdown) {
+		for(i = 0, entry = NULL; i < SMCP_CONF_DNS_CACHE_SIZE; i++) {
+			if(dns->entry[i].host
+				&& (dns->entry[i].status == SMCP_STATUS_WAIT_FOR_DNS)
+				&& !dns->entry[i].in_flight
+			) {
+				entry = &dns->entry[i];
+				break;
+			}
+		}
+
+		if(!entry) {
+			pthread_cond_wait(&dns->cond, &dns->lock);
+			continue;
+		}
+
+		entry->in_flight = true;
+		pthread_mutex_unlock(&dns->lock);
+
+		memset(&saddr, 0, sizeof(saddr));
+		status = smcp_resolve_host_(entry->host, &saddr);
+
+		pthread_mutex_lock(&dns->lock);
+
+		entry->in_flight = false;
+		entry->status = status;
+		entry->expiration = 0;
+		memcpy(&entry->saddr, &saddr, sizeof(saddr));
+
+#if SMCP_CONF_COMMAND_QUEUE
+		// Still holding the lock, so the instance can't go away
+		// before the command is queued.
+		if(!dns->shutdown)
+			smcp_post_command(dns->instance, &smcp_dns_answer_ready_, NULL);
+#endif
+	}
+
+	pthread_mutex_unlock(&dns->lock);
+
+	// smcp_dns_release() handed the cache over to us.
+	smcp_dns_free_(dns);
+
+	return NULL;
+}
+
+//!	Finds a slot for a new host, evicting whichever entry is closest to expiring.
+static struct smcp_dns_entry_s*
+smcp_dns_new_entry_(struct smcp_dns_s* dns) {
+	struct smcp_dns_entry_s* ret = NULL;
+	int i;
+
+	for(i = 0; i < SMCP_CONF_DNS_CACHE_SIZE; i++) {
+		struct smcp_dns_entry_s* const entry = &dns->entry[i];
+
+		if(!entry->host) {
+			ret = entry;
+			break;
+		}
+
+		if(entry->in_flight || (entry->status == SMCP_STATUS_WAIT_FOR_DNS))
+			continue;
+
+		if(!ret || (entry->expiration < ret->expiration))
+			ret = entry;
+	}
+
+	if(ret) {
+		free(ret->host);
+		ret->host = NULL;
+	}
+
+	return ret;
+}
+
+smcp_status_t
+smcp_dns_lookup(smcp_t self, const char* host, struct sockaddr_in6* saddr) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	smcp_status_t ret = SMCP_STATUS_WAIT_FOR_DNS;
+	struct smcp_dns_s* dns = self->dns;
+	struct smcp_dns_entry_s* entry = NULL;
+	const smcp_timestamp_t now = smcp_get_time(self);
+	int i;
+
+	if(!dns) {
+		dns = calloc(1, sizeof(*dns));
+		require_action(dns, bail, ret = SMCP_STATUS_MALLOC_FAILURE);
+		pthread_mutex_init(&dns->lock, NULL);
+		pthread_cond_init(&dns->cond, NULL);
+#if SMCP_CONF_COMMAND_QUEUE
+		dns->instance = self;
+#endif
+		self->dns = dns;
+	}
+
+	pthread_mutex_lock(&dns->lock);
+
+	for(i = 0; i < SMCP_CONF_DNS_CACHE_SIZE; i++) {
+		if(dns->entry[i].host && (0 == strcasecmp(dns->entry[i].host, host))) {
+			entry = &dns->entry[i];
+			break;
+		}
+	}
+
+	if(entry && (entry->status != SMCP_STATUS_WAIT_FOR_DNS)) {
+		if(!entry->expiration) {
+			// The thread just finished, so the clock starts now.
+			entry->expiration = now + (
+				entry->status == SMCP_STATUS_OK
+					? SMCP_CONF_DNS_CACHE_TTL
+					: SMCP_CONF_DNS_NEGATIVE_TTL
+			);
+		}
+
+		if(entry->expiration <= now) {
+			// Stale. Look it up again.
+			entry->status = SMCP_STATUS_WAIT_FOR_DNS;
+			entry->expiration = 0;
+			pthread_cond_signal(&dns->cond);
+		}
+	}
+
+	if(!entry) {
+		entry = smcp_dns_new_entry_(dns);
+
+		// Every slot is busy with a lookup, so come back later.
+		require(entry, unlock);
+
+		entry->host = strdup(host);
+		require_action(entry->host, unlock, ret = SMCP_STATUS_MALLOC_FAILURE);
+		entry->status = SMCP_STATUS_WAIT_FOR_DNS;
+		entry->expiration = 0;
+
+		if(!dns->has_thread) {
+			require_action(
+				0 == pthread_create(&dns->thread, NULL, &smcp_dns_thread_main_, dns),
+				unlock,
+				(free(entry->host), entry->host = NULL, ret = SMCP_STATUS_ERRNO)
+			);
+			dns->has_thread = true;
+		}
+
+		pthread_cond_signal(&dns->cond);
+		self->stats.dns_cache_misses++;
+		DEBUG_PRINTF("DNS: Looking up \"%s\"", host);
+	} else if(entry->status != SMCP_STATUS_WAIT_FOR_DNS) {
+		self->stats.dns_cache_hits++;
+	}
+
+	ret = entry->status;
+
+	if(ret == SMCP_STATUS_OK)
+		memcpy(saddr, &entry->saddr, sizeof(*saddr));
+
+unlock:
+	pthread_mutex_unlock(&dns->lock);
+
+bail:
+	return ret;
+}
+
+void
+smcp_dns_release(smcp_t self) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	struct smcp_dns_s* const dns = self->dns;
+
+	require(dns, bail);
+
+	self->dns = NULL;
+
+	pthread_mutex_lock(&dns->lock);
+
+	if(dns->has_thread) {
+		// The thread might be stuck in getaddrinfo(), so don't wait
+		// for it. It frees everything on its way out.
+		dns->shutdown = true;
+		pthread_cond_signal(&dns->cond);
+		pthread_detach(dns->thread);
+		pthread_mutex_unlock(&dns->lock);
+	} else {
+		pthread_mutex_unlock(&dns->lock);
+		smcp_dns_free_(dns);
+	}
+
+bail:
+	return;
+}
+
+#endif // SMCP_CONF_ASYNC_DNS
@@ -144,25 +144,107 @@ smcp_inbound_is_dupe() {
 #pragma mark -
 #pragma mark Option Parsing
 
+smcp_status_t
+smcp_inbound_index_options_(smcp_t self) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+	const uint8_t* const packet = (const uint8_t*)self->inbound.packet;
+	const uint8_t* const end = packet + self->inbound.packet_len;
+	const uint8_t* iter = self->inbound.packet->token + self->inbound.packet->token_len;
+	coap_option_key_t key = 0;
+
+	self->inbound.option_count = 0;
+	self->inbound.option_keys = 0;
+	self->inbound.unindexed_ptr = NULL;
+
+	while((iter < end) && (iter[0] != 0xFF)) {
+		struct smcp_inbound_option_s* option;
+		const uint8_t* value;
+		size_t value_len;
+
+		if(	(self->inbound.option_count == SMCP_CONF_MAX_INBOUND_OPTIONS)
+			&& !self->inbound.unindexed_ptr
+		) {
+			// The rest are decoded again whenever they are needed.
+			self->inbound.unindexed_ptr = iter;
+			self->inbound.unindexed_key = key;
+		}
+
+		iter = coap_decode_option(iter, &key, &value, &value_len);
+
+		if(key < 64)
+			self->inbound.option_keys |= ((uint64_t)1 << key);
+
+		if(self->inbound.unindexed_ptr)
+			continue;
+
+		option = &self->inbound.option[self->inbound.option_count++];
+		option->key = key;
+		option->offset = (uint16_t)(value - packet);
+		option->len = (uint16_t)value_len;
+	}
+
+	self->inbound.content_ptr = (const char*)iter;
+
+	return ret;
+}
+
+void
+smcp_inbound_option_cursor_init_(smcp_t self, struct smcp_inbound_option_cursor_s* cursor) {
+	cursor->index = 0;
+	cursor->ptr = self->inbound.unindexed_ptr;
+	cursor->key = self->inbound.unindexed_key;
+}
+
+bool
+smcp_inbound_option_cursor_next_(
+	smcp_t self,
+	struct smcp_inbound_option_cursor_s* cursor,
+	struct smcp_inbound_option_s* option
+) {
+	const uint8_t* const packet = (const uint8_t*)self->inbound.packet;
+	const uint8_t* value;
+	size_t value_len;
+
+	if(cursor->index < self->inbound.option_count) {
+		*option = self->inbound.option[cursor->index++];
+		return true;
+	}
+
+	if(	!cursor->ptr
+		|| (cursor->ptr >= packet + self->inbound.packet_len)
+		|| (cursor->ptr[0] == 0xFF)
+	) {
+		return false;
+	}
+
+	cursor->ptr = coap_decode_option(cursor->ptr, &cursor->key, &value, &value_len);
+	cursor->index++;
+
+	option->key = cursor->key;
+	option->offset = (uint16_t)(value - packet);
+	option->len = (uint16_t)value_len;
+
+	return true;
+}
+
 void
 smcp_inbound_reset_next_option() {
 	smcp_t const self = smcp_get_current_instance();
 	self->inbound.last_option_key = 0;
-	self->inbound.this_option = self->inbound.packet->token + self->inbound.packet->token_len;
+	smcp_inbound_option_cursor_init_(self, &self->inbound.next_option);
 }
 
 coap_option_key_t
 smcp_inbound_next_option(const uint8_t** value, size_t* len) {
 	smcp_t const self = smcp_get_current_instance();
-	if(self->inbound.this_option < ((uint8_t*)self->inbound.packet+self->inbound.packet_len)
-		&& self->inbound.this_option[0]!=0xFF
-	) {
-		self->inbound.this_option = coap_decode_option(
-			self->inbound.this_option,
-			&self->inbound.last_option_key,
-			value,
-			len
-		);
+	struct smcp_inbound_option_s option;
+
+	if(smcp_inbound_option_cursor_next_(self, &self->inbound.next_option, &option)) {
+		if(value)
+			*value = (const uint8_t*)self->inbound.packet + option.offset;
+		if(len)
+			*len = option.len;
+		self->inbound.last_option_key = option.key;
 	} else {
 		self->inbound.last_option_key = COAP_OPTION_INVALID;
 	}
@@ -172,41 +254,64 @@ smcp_inbound_next_option(const uint8_t** value, size_t* len) {
 coap_option_key_t
 smcp_inbound_peek_option(const uint8_t** value, size_t* len) {
 	smcp_t const self = smcp_get_current_instance();
-	coap_option_key_t ret = self->inbound.last_option_key;
+	coap_option_key_t ret = COAP_OPTION_INVALID;
+	struct smcp_inbound_option_cursor_s cursor = self->inbound.next_option;
+	struct smcp_inbound_option_s option;
+
 	if(self->inbound.last_option_key!=COAP_OPTION_INVALID
-		&& self->inbound.this_option<((uint8_t*)self->inbound.packet+self->inbound.packet_len)
-		&& self->inbound.this_option[0]!=0xFF
+		&& smcp_inbound_option_cursor_next_(self, &cursor, &option)
 	) {
-		coap_decode_option(
-			self->inbound.this_option,
-			&ret,
-			value,
-			len
-		);
-
-	} else {
-		ret = COAP_OPTION_INVALID;
+		if(value)
+			*value = (const uint8_t*)self->inbound.packet + option.offset;
+		if(len)
+			*len = option.len;
+		ret = option.key;
 	}
 	return ret;
 }
 
+bool
+smcp_inbound_find_option(coap_option_key_t key, const uint8_t** value, size_t* len) {
+	smcp_t const self = smcp_get_current_instance();
+	struct smcp_inbound_option_cursor_s cursor;
+	struct smcp_inbound_option_s option;
+
+	if((key < 64) && !(self->inbound.option_keys & ((uint64_t)1 << key)))
+		return false;
+
+	// Options are always in order, so we can stop as soon as we pass it.
+	smcp_inbound_option_cursor_init_(self, &cursor);
+	while(smcp_inbound_option_cursor_next_(self, &cursor, &option)) {
+		if(option.key > key)
+			break;
+		if(option.key == key) {
+			if(value)
+				*value = (const uint8_t*)self->inbound.packet + option.offset;
+			if(len)
+				*len = option.len;
+			return true;
+		}
+	}
+	return false;
+}
+
 bool
 smcp_inbound_option_strequal(coap_option_key_t key,const char* cstr) {
 	smcp_t const self = smcp_get_current_instance();
-	coap_option_key_t curr_key = self->inbound.last_option_key;
+	struct smcp_inbound_option_cursor_s cursor = self->inbound.next_option;
+	struct smcp_inbound_option_s option;
 	const char* value;
-	size_t value_len;
 	size_t i;
 
-	if(!self->inbound.this_option)
+	if(!smcp_inbound_option_cursor_next_(self, &cursor, &option))
 		return false;
 
-	coap_decode_option(self->inbound.this_option, &curr_key, (const uint8_t**)&value, &value_len);
-
-	if(curr_key != key)
+	if(option.key != key)
 		return false;
 
-	for(i=0;i<value_len;i++) {
+	value = (const char*)self->inbound.packet + option.offset;
+
+	for(i=0;i<option.len;i++) {
 		if(!cstr[i] || (value[i]!=cstr[i]))
 			return false;
 	}
@@ -248,7 +353,7 @@ smcp_inbound_get_path(char* where,uint8_t flags) {
 	smcp_t const self = smcp_get_current_instance();
 
 	coap_option_key_t		last_option_key = self->inbound.last_option_key;
-	const uint8_t*			this_option = self->inbound.this_option;
+	struct smcp_inbound_option_cursor_s next_option = self->inbound.next_option;
 
 	char* filename;
 	size_t filename_len;
@@ -318,7 +423,7 @@ smcp_inbound_get_path(char* where,uint8_t flags) {
 	*iter = 0;
 
 	self->inbound.last_option_key = last_option_key;
-	self->inbound.this_option = this_option;
+	self->inbound.next_option = next_option;
 	return where;
 }
 
@@ -406,6 +511,144 @@ smcp_inbound_set_destaddr(SMCP_SOCKET_ARGS) {
 	return SMCP_STATUS_OK;
 }
 
+#if SMCP_CONF_RESPONSE_CACHE
+#pragma mark -
+#pragma mark Response Cache
+
+static bool
+smcp_response_cache_match_(const void* item, const void* key, void* context) {
+	const struct smcp_response_cache_entry_s* const entry = item;
+	smcp_t const self = (smcp_t)key;
+
+	(void)context;
+
+	return (entry->msg_id == self->inbound.packet->msg_id)
+		&& (entry->socklen == self->inbound.socklen)
+		&& (0 == memcmp(&entry->saddr, self->inbound.saddr, entry->socklen));
+}
+
+//!	Removes the oldest entry from the response cache.
+static void
+smcp_response_cache_drop_oldest_(smcp_t self) {
+	struct smcp_response_cache_entry_s* const entry = &self->response_cache.entry[self->response_cache.head];
+
+	ht_remove(&self->response_cache.index, entry->hash, entry);
+
+	self->response_cache.bytes -= entry->response_len;
+	free(entry->response);
+	entry->response = NULL;
+	entry->response_len = 0;
+
+	if(self->response_cache.current == entry)
+		self->response_cache.current = NULL;
+
+	self->response_cache.head = (self->response_cache.head + 1) % SMCP_CONF_RESPONSE_CACHE_SIZE;
+	self->response_cache.count--;
+}
+
+//!	Returns the entry for the inbound packet, or NULL if it hasn't been seen.
+static struct smcp_response_cache_entry_s*
+smcp_response_cache_lookup_(smcp_t self) {
+	const smcp_timestamp_t now = smcp_get_time(self);
+
+	// Entries all live for the same amount of time, so the
+	// oldest entry is always the next one to expire.
+	while(self->response_cache.count
+		&& (self->response_cache.entry[self->response_cache.head].expiration <= now)
+	) {
+		smcp_response_cache_drop_oldest_(self);
+	}
+
+	return (struct smcp_response_cache_entry_s*)ht_find(
+		&self->response_cache.index,
+		self->inbound.transaction_hash,
+		self,
+		&smcp_response_cache_match_,
+		NULL
+	);
+}
+
+//!	Adds an entry for the inbound packet, without a response.
+static struct smcp_response_cache_entry_s*
+smcp_response_cache_insert_(smcp_t self) {
+	struct smcp_response_cache_entry_s* entry;
+
+	if(self->response_cache.count >= SMCP_CONF_RESPONSE_CACHE_SIZE) {
+		self->stats.response_cache_evictions++;
+		smcp_response_cache_drop_oldest_(self);
+	}
+
+	entry = &self->response_cache.entry[
+		(self->response_cache.head + self->response_cache.count) % SMCP_CONF_RESPONSE_CACHE_SIZE
+	];
+
+	entry->hash = self->inbound.transaction_hash;
+	entry->msg_id = self->inbound.packet->msg_id;
+	entry->expiration = smcp_timestamp_from_cms(self, COAP_EXCHANGE_LIFETIME*MSEC_PER_SEC);
+	entry->response = NULL;
+	entry->response_len = 0;
+	memcpy(&entry->saddr, self->inbound.saddr, self->inbound.socklen);
+	entry->socklen = self->inbound.socklen;
+
+	require_action(
+		ht_insert(&self->response_cache.index, entry->hash, entry),
+		bail,
+		entry = NULL
+	);
+
+	self->response_cache.count++;
+
+bail:
+	return entry;
+}
+
+void
+smcp_response_cache_store(smcp_t self, const struct iovec* iov, int iovcnt) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	struct smcp_response_cache_entry_s* const entry = self->response_cache.current;
+	const size_t packet_len = smcp_iov_len_(iov, iovcnt);
+
+	require(entry && !entry->response_len, bail);
+
+	// Make sure this is actually the answer to the inbound packet,
+	// and not some other packet sent while handling it.
+	require(((const struct coap_header_s*)iov[0].iov_base)->msg_id == entry->msg_id, bail);
+	require(self->outbound.socklen == entry->socklen, bail);
+	require(0 == memcmp(&self->outbound.saddr, &entry->saddr, entry->socklen), bail);
+
+	require(packet_len <= SMCP_CONF_RESPONSE_CACHE_MAX_BYTES, bail);
+
+	// The entry is the newest one, so it stays put while
+	// older entries are evicted to make room.
+	while(self->response_cache.bytes + packet_len > SMCP_CONF_RESPONSE_CACHE_MAX_BYTES) {
+		self->stats.response_cache_evictions++;
+		smcp_response_cache_drop_oldest_(self);
+	}
+
+	entry->response = malloc(packet_len);
+	require(entry->response, bail);
+
+	smcp_iov_gather_(entry->response, iov, iovcnt);
+	entry->response_len = (uint16_t)packet_len;
+	self->response_cache.bytes += packet_len;
+
+bail:
+	return;
+}
+
+void
+smcp_response_cache_clear(smcp_t self) {
+	SMCP_EMBEDDED_SELF_HOOK;
+
+	while(self->response_cache.count)
+		smcp_response_cache_drop_oldest_(self);
+
+	ht_destroy(&self->response_cache.index);
+}
+#endif
+
+#pragma mark -
+
 smcp_status_t
 smcp_inbound_finish_packet() {
 	smcp_t const self = smcp_get_current_instance();
@@ -449,16 +692,49 @@ smcp_inbound_finish_packet() {
 #endif
 
 	// Calculate the message-id hash (address+port+message_id)
-	fasthash_start(0);
+	{
+		fasthash_state_t state;
+		fasthash_init(&state, 0);
 #if SMCP_USE_BSD_SOCKETS
-	fasthash_feed((void*)self->inbound.saddr,self->inbound.socklen);
+		fasthash_update(&state, self->inbound.saddr, self->inbound.socklen);
 #elif CONTIKI
-	fasthash_feed((void*)&self->inbound.toaddr,sizeof(self->inbound.toaddr));
-	fasthash_feed((void*)&self->inbound.toport,sizeof(self->inbound.toport));
+		fasthash_update(&state, &self->inbound.toaddr, sizeof(self->inbound.toaddr));
+		fasthash_update(&state, &self->inbound.toport, sizeof(self->inbound.toport));
 #endif
-	fasthash_feed((const uint8_t*)&packet->msg_id,sizeof(packet->msg_id));
-	self->inbound.transaction_hash = fasthash_finish_uint32();
+		fasthash_update(&state, &packet->msg_id, sizeof(packet->msg_id));
+		self->inbound.transaction_hash = fasthash_final(&state);
+	}
+
+#if SMCP_CONF_RESPONSE_CACHE
+	if(!self->inbound.is_fake) {
+		// Check to see if this packet is a duplicate.
+		struct smcp_response_cache_entry_s* const entry = smcp_response_cache_lookup_(self);
+
+		if(entry) {
+			self->stats.response_cache_hits++;
+			self->inbound.is_dupe = true;
+
+			if(entry->response_len) {
+				// We already know the answer, so send it
+				// again without bothering the handler.
+				struct iovec iov = {
+					.iov_base = entry->response,
+					.iov_len = entry->response_len,
+				};
+				memcpy(&self->outbound.saddr, &entry->saddr, entry->socklen);
+				self->outbound.socklen = entry->socklen;
+				self->did_respond = true;
+				ret = smcp_outbound_send_iov_(self, &iov, 1);
+				goto bail;
+			}
 
+			self->response_cache.current = entry;
+		} else {
+			self->stats.response_cache_misses++;
+			self->response_cache.current = smcp_response_cache_insert_(self);
+		}
+	}
+#else
 	{	// Check to see if this packet is a duplicate.
 		unsigned int i = SMCP_CONF_DUPE_BUFFER_SIZE;
 		while(i--) {
@@ -468,40 +744,47 @@ smcp_inbound_finish_packet() {
 			}
 		}
 	}
+#endif
+
+	// Index all of the options up front, so nobody
+	// has to decode them again.
+	ret = smcp_inbound_index_options_(self);
+	require_noerr(ret, bail);
 
 	{	// Initial scan thru all of the options.
-		const uint8_t* value;
-		size_t value_len;
-		coap_option_key_t key;
+		struct smcp_inbound_option_cursor_s cursor;
+		struct smcp_inbound_option_s option;
 
-		// Reset option scanner for initial option scan.
-		smcp_inbound_reset_next_option();
+		smcp_inbound_option_cursor_init_(self, &cursor);
+		while(smcp_inbound_option_cursor_next_(self, &cursor, &option)) {
+			const uint8_t* const value = (const uint8_t*)packet + option.offset;
+			const uint8_t value_len = (uint8_t)option.len;
 
-		while((key = smcp_inbound_next_option(&value,&value_len)) != COAP_OPTION_INVALID) {
-			switch(key) {
+			switch(option.key) {
 			case COAP_OPTION_CONTENT_TYPE:
-				self->inbound.content_type = coap_decode_uint32(value,(uint8_t)value_len);
+				self->inbound.content_type = coap_decode_uint32(value,value_len);
 				break;
 
 			case COAP_OPTION_OBSERVE:
-				self->inbound.observe_value = coap_decode_uint32(value,(uint8_t)value_len);
+				self->inbound.observe_value = coap_decode_uint32(value,value_len);
 				self->inbound.has_observe_option = 1;
 				break;
 
 			case COAP_OPTION_MAX_AGE:
-				self->inbound.max_age = coap_decode_uint32(value,(uint8_t)value_len);
+				self->inbound.max_age = coap_decode_uint32(value,value_len);
 				self->inbound.max_age++;
 				if(self->inbound.max_age < 5)
 					self->inbound.max_age = 5;
 				break;
 
 			case COAP_OPTION_BLOCK2:
-				self->inbound.block2_value = coap_decode_uint32(value,(uint8_t)value_len);
+				self->inbound.block2_value = coap_decode_uint32(value,value_len);
+				self->inbound.has_block2_option = 1;
 				break;
 
 #if SMCP_USE_CASCADE_COUNT
 			case COAP_OPTION_CASCADE_COUNT:
-				self->cascade_count = coap_decode_uint32(value,(uint8_t)value_len);
+				self->cascade_count = coap_decode_uint32(value,value_len);
 				break;
 #endif
 
@@ -511,12 +794,8 @@ smcp_inbound_finish_packet() {
 		}
 	}
 
-	// Sanity check on debug builds.
-	check(((unsigned)(self->inbound.this_option-(uint8_t*)packet)==self->inbound.packet_len) || self->inbound.this_option[0]==0xFF);
-
-	// Now that we are at the end of the options, we know
-	// where the content starts.
-	self->inbound.content_ptr = (char*)self->inbound.this_option;
+	// The index left `content_ptr` at the end of the options,
+	// which is where the content starts.
 	self->inbound.content_len = self->inbound.packet_len-((uint8_t*)self->inbound.content_ptr-(uint8_t*)packet);
 
 	// Move past start-of-content marker.
@@ -528,6 +807,16 @@ smcp_inbound_finish_packet() {
 	// Be nice and reset the option scanner for the handler.
 	smcp_inbound_reset_next_option();
 
+#if SMCP_CONF_LARGE_RESPONSES
+	if(COAP_CODE_IS_REQUEST(packet->code) && !self->inbound.is_dupe) {
+		// Later blocks of a large response don't need the handler.
+		ret = smcp_large_response_serve(self);
+		if(ret == SMCP_STATUS_OK)
+			goto bail;
+		ret = SMCP_STATUS_OK;
+	}
+#endif
+
 	if(COAP_CODE_IS_REQUEST(packet->code)) {
 		// See code below.
 		ret = smcp_handle_request();
@@ -538,6 +827,7 @@ smcp_inbound_finish_packet() {
 
 	check_string(ret == SMCP_STATUS_OK, smcp_status_to_cstr(ret));
 
+#if !SMCP_CONF_RESPONSE_CACHE
 	if(	(ret == SMCP_STATUS_OK)
 		&& !self->inbound.is_fake
 		&& !self->inbound.is_dupe
@@ -547,6 +837,7 @@ smcp_inbound_finish_packet() {
 		self->dupe_index++;
 		self->dupe_index %= SMCP_CONF_DUPE_BUFFER_SIZE;
 	}
+#endif
 
 	// Check to make sure we have responded by now. If not, we need to.
 	if(!self->did_respond && (packet->tt==COAP_TRANS_TYPE_CONFIRMABLE)) {
@@ -575,10 +866,17 @@ smcp_inbound_finish_packet() {
 	}
 
 bail:
+#if SMCP_CONF_RESPONSE_CACHE
+	self->response_cache.current = NULL;
+#endif
 	self->is_processing_message = false;
 	self->force_current_outbound_code = false;
 	self->inbound.content_ptr = NULL;
 	self->inbound.content_len = 0;
+#if SMCP_CONF_BLOCK1_UPLOADS
+	free(self->block1_body);
+	self->block1_body = NULL;
+#endif
 	smcp_set_current_instance(NULL);
 	return ret;
 }
@@ -31,11 +31,16 @@
 #define __SMCP_INTERNAL_H__ 1
 
 #include <stdbool.h>
+#include <string.h>
 
 #include "smcp.h"
 #include "smcp-timer.h"
 #include "fasthash.h"
 
+#if SMCP_TRANSACTIONS_USE_HASH || SMCP_CONF_RESPONSE_CACHE || SMCP_CONF_DYNAMIC_OBSERVERS
+#include "hashtable.h"
+#endif
+
 #ifndef SMCP_FUNC_RANDOM_UINT32
 #if defined(__APPLE__)
 #define SMCP_FUNC_RANDOM_UINT32()   arc4random()
@@ -59,11 +64,261 @@ __BEGIN_DECLS
 #if SMCP_EMBEDDED
 // Embedded platforms only support one instance.
 #define smcp_set_current_instance(x)
+#define smcp_refresh_time(self)		smcp_refresh_time()
+#define smcp_forget_time(self)		smcp_forget_time()
+#define smcp_get_any_timer(self)		smcp_get_any_timer()
+#define smcp_response_cache_store(self,...)		smcp_response_cache_store(__VA_ARGS__)
+#define smcp_response_cache_clear(self)		smcp_response_cache_clear()
+#define smcp_dns_lookup(self,...)		smcp_dns_lookup(__VA_ARGS__)
+#define smcp_dns_release(self)		smcp_dns_release()
+#define smcp_transaction_dns_ready_(self)		smcp_transaction_dns_ready_()
+#define smcp_large_response_serve(self)		smcp_large_response_serve()
+#define smcp_large_response_clear(self)		smcp_large_response_clear()
+#define smcp_block1_upload_clear(self)		smcp_block1_upload_clear()
+#define smcp_peer_will_send_(self,...)		smcp_peer_will_send_(__VA_ARGS__)
+#define smcp_peer_handle_response_(self,...)		smcp_peer_handle_response_(__VA_ARGS__)
+#define smcp_peer_release_(self,...)		smcp_peer_release_(__VA_ARGS__)
+#define smcp_peer_retransmit_timeout_(self,...)		smcp_peer_retransmit_timeout_(__VA_ARGS__)
+#define smcp_observers_clear(self)		smcp_observers_clear()
+#define smcp_notification_capture_(self,...)		smcp_notification_capture_(__VA_ARGS__)
+#define smcp_notification_cache_clear(self)		smcp_notification_cache_clear()
 #else
 extern void smcp_set_current_instance(smcp_t x);
 #endif
 
 
+#if SMCP_CONF_TIMER_WHEEL
+#define SMCP_TIMER_WHEEL_BITS		(6)
+#define SMCP_TIMER_WHEEL_SLOTS		(1<<SMCP_TIMER_WHEEL_BITS)
+#define SMCP_TIMER_WHEEL_LEVELS		(4)
+#endif
+
+//!	Samples the clock and caches the result until smcp_forget_time().
+extern void smcp_refresh_time(smcp_t self);
+
+//!	Makes smcp_get_time() sample the clock directly again.
+extern void smcp_forget_time(smcp_t self);
+
+//!	Returns any one of the scheduled timers, or NULL if there are none.
+extern smcp_timer_t smcp_get_any_timer(smcp_t self);
+
+//!	Fills in the option index for the inbound packet, and finds where the content starts.
+extern smcp_status_t smcp_inbound_index_options_(smcp_t self);
+
+#if SMCP_USE_BSD_SOCKETS
+//!	Sends the packet made up of the given buffers to `outbound.saddr`.
+extern smcp_status_t smcp_outbound_send_iov_(smcp_t self, const struct iovec* iov, int iovcnt);
+
+//!	Returns the total length of the given buffers.
+static inline size_t
+smcp_iov_len_(const struct iovec* iov, int iovcnt) {
+	size_t ret = 0;
+	while(iovcnt--)
+		ret += iov++->iov_len;
+	return ret;
+}
+
+//!	Copies the given buffers one after the other into `dest`.
+static inline void
+smcp_iov_gather_(void* dest, const struct iovec* iov, int iovcnt) {
+	uint8_t* iter = dest;
+	for(; iovcnt--; iov++) {
+		memcpy(iter, iov->iov_base, iov->iov_len);
+		iter += iov->iov_len;
+	}
+}
+#endif
+
+//!	Largest block size exponent whose blocks fit in our packets.
+static inline uint8_t
+smcp_max_block_szx_(void) {
+	uint8_t szx = 6;
+
+	while(szx && ((size_t)(1 << (szx + 4)) > SMCP_MAX_CONTENT_LENGTH))
+		szx--;
+
+	return szx;
+}
+
+#if SMCP_CONF_TRANS_ENABLE_BLOCK1
+//!	Gets the Block1 option for the current request of `handler`.
+/*!	Returns false if the body fits in one packet and no Block1
+**	option is needed. */
+extern bool smcp_transaction_block1_option_(smcp_transaction_t handler, uint32_t* block1);
+
+//!	Adds the current block of the body of `handler` to the outbound request.
+extern smcp_status_t smcp_transaction_block1_append_(smcp_transaction_t handler);
+#endif
+
+#if SMCP_CONF_RESPONSE_CACHE
+//!	Remembers the outbound packet as the response to the inbound packet.
+/*!	The first buffer must hold at least the CoAP header. */
+extern void smcp_response_cache_store(smcp_t self, const struct iovec* iov, int iovcnt);
+
+//!	Frees every entry in the response cache.
+extern void smcp_response_cache_clear(smcp_t self);
+#endif
+
+#if SMCP_USE_BSD_SOCKETS
+//!	Looks up `host` with `getaddrinfo()`, blocking until it is done.
+/*!	The port of the resulting address is left as zero. */
+extern smcp_status_t smcp_resolve_host_(const char* host, struct sockaddr_in6* saddr);
+#endif
+
+#if SMCP_CONF_ASYNC_DNS
+struct smcp_dns_s;
+
+//!	Looks up `host` in the resolver cache, starting a lookup if needed.
+/*!	Returns SMCP_STATUS_WAIT_FOR_DNS while the lookup is in progress. */
+extern smcp_status_t smcp_dns_lookup(smcp_t self, const char* host, struct sockaddr_in6* saddr);
+
+//!	Stops the resolver thread and frees the resolver cache.
+extern void smcp_dns_release(smcp_t self);
+
+//!	Retries every transaction whose last send was waiting for a lookup.
+extern void smcp_transaction_dns_ready_(smcp_t self);
+#endif
+
+#if SMCP_CONF_COMMAND_QUEUE
+struct smcp_command_s;
+
+//!	Creates the wakeup descriptor for posted commands.
+extern smcp_status_t smcp_command_queue_init_(smcp_t self);
+
+//!	Drops any commands that haven't run and closes the wakeup descriptor.
+extern void smcp_command_queue_release_(smcp_t self);
+
+//!	Runs the commands posted so far. `woken` is set if the wakeup descriptor was readable.
+extern void smcp_run_commands_(smcp_t self, bool woken);
+#endif
+
+#if SMCP_CONF_LARGE_RESPONSES
+//!	A representation built by smcp_outbound_send_large(), kept for later blocks.
+struct smcp_large_response_s {
+	uint32_t				hash;	//!< Peer address and request URI.
+#if SMCP_USE_BSD_SOCKETS
+	struct sockaddr_in6		saddr;
+	socklen_t				socklen;
+#elif CONTIKI
+	uip_ipaddr_t			toaddr;
+	uint16_t				toport;
+#endif
+	smcp_timestamp_t		expiration;
+	coap_code_t				code;
+	uint16_t				options_len;
+	size_t					content_len;
+
+	//!	Encoded options, without Block2, followed by the content.
+	uint8_t*				data;
+};
+
+//!	Answers the current request from a remembered large response, if possible.
+/*!	Returns SMCP_STATUS_NOT_FOUND if the request handler needs to be called. */
+extern smcp_status_t smcp_large_response_serve(smcp_t self);
+
+//!	Forgets all remembered large responses.
+extern void smcp_large_response_clear(smcp_t self);
+#endif
+
+#if SMCP_CONF_BLOCK1_UPLOADS
+//!	A request body being put together by smcp_inbound_collect_block1().
+struct smcp_block1_upload_s {
+	uint32_t				hash;	//!< Peer address and request URI.
+#if SMCP_USE_BSD_SOCKETS
+	struct sockaddr_in6		saddr;
+	socklen_t				socklen;
+#elif CONTIKI
+	uip_ipaddr_t			toaddr;
+	uint16_t				toport;
+#endif
+	smcp_timestamp_t		expiration;
+	size_t					len;
+	size_t					size;
+	char*					data;
+};
+
+//!	Drops all partial uploads.
+extern void smcp_block1_upload_clear(smcp_t self);
+#endif
+
+#if SMCP_CONF_DYNAMIC_OBSERVERS
+//!	Frees every observer registered with the instance.
+extern void smcp_observers_clear(smcp_t self);
+#endif
+
+#if SMCP_CONF_NOTIFICATION_CACHE
+//!	A notification rendered once, for every observer that asked for the same thing.
+struct smcp_notification_s {
+	struct smcp_observable_s*	observable;	//!< NULL if the entry is empty.
+	uint32_t				hash;	//!< Observer key and the options of the observe request.
+	uint8_t					key;
+	bool					is_complete;	//!< False until the rendering has been captured.
+	smcp_timestamp_t		last_used;
+	coap_code_t				code;
+	uint16_t				options_len;
+	size_t					content_len;
+
+	//!	Encoded options, followed by the content.
+	uint8_t*				data;
+};
+
+//!	Copies the outbound packet into `notification_capture`.
+/*!	Called by smcp_outbound_send() with the length of the packet
+**	header, token and options. */
+extern void smcp_notification_capture_(smcp_t self, size_t header_len);
+
+//!	Forgets all rendered notifications.
+extern void smcp_notification_cache_clear(smcp_t self);
+#endif
+
+#if SMCP_CONF_PEER_TABLE
+//!	Round-trip estimates and congestion state for one peer.
+/*!	Follows CoCoA: a "strong" estimator fed by exchanges that needed
+**	no retransmission and a "weak" one fed by exchanges that did,
+**	measured from the first transmission. Both are blended into a
+**	single `rto`. */
+struct smcp_peer_s {
+	bool					in_use;
+#if SMCP_USE_BSD_SOCKETS
+	struct sockaddr_in6		saddr;
+#elif CONTIKI
+	uip_ipaddr_t			toaddr;
+	uint16_t				toport;
+#endif
+	cms_t					rto;
+	cms_t					strong_srtt;
+	cms_t					strong_rttvar;
+	cms_t					weak_srtt;
+	cms_t					weak_rttvar;
+	smcp_timestamp_t		last_update;	//!< When `rto` last changed, for aging.
+	smcp_timestamp_t		last_used;
+
+	uint8_t					outstanding;
+
+	//!	Transactions waiting for an NSTART slot, linked by `peer_next`.
+	smcp_transaction_t		queue;
+
+	uint32_t				strong_samples;
+	uint32_t				weak_samples;
+	uint32_t				retransmissions;
+};
+
+//!	Attaches the current transaction to the peer it is sending to.
+/*!	Returns SMCP_STATUS_WAIT_FOR_PEER, and queues the transaction,
+**	if the peer already has as many requests outstanding as
+**	smcp_set_peer_nstart() allows. */
+extern smcp_status_t smcp_peer_will_send_(smcp_t self, smcp_transaction_t handler);
+
+//!	Takes a round-trip sample and frees the NSTART slot of `handler`.
+extern void smcp_peer_handle_response_(smcp_t self, smcp_transaction_t handler);
+
+//!	Detaches `handler` from its peer, waking the next queued transaction.
+extern void smcp_peer_release_(smcp_t self, smcp_transaction_t handler);
+
+//!	How long to wait before retransmission number `retries` to `peer`.
+extern cms_t smcp_peer_retransmit_timeout_(smcp_t self, struct smcp_peer_s* peer, int retries);
+#endif
+
 #ifndef SMCP_HOOK_TIMER_NEEDS_REFRESH
 #define SMCP_HOOK_TIMER_NEEDS_REFRESH(x)	do { } while (0)
 #endif
@@ -71,6 +326,57 @@ extern void smcp_set_current_instance(smcp_t x);
 #pragma mark -
 #pragma mark Class Definitions
 
+//!	Where to find one of the options in the inbound packet.
+struct smcp_inbound_option_s {
+	coap_option_key_t		key;
+	uint16_t				offset;	//!< From the start of the packet.
+	uint16_t				len;
+};
+
+//!	A place in the inbound options, for walking through them in order.
+/*!	The first SMCP_CONF_MAX_INBOUND_OPTIONS options come from the
+**	index. Any after those are decoded from the packet as they are
+**	reached, which is what the `ptr` and `key` fields are for. */
+struct smcp_inbound_option_cursor_s {
+	uint16_t				index;	//!< How many options have been passed.
+	const uint8_t*			ptr;	//!< Where the next unindexed option starts.
+	coap_option_key_t		key;	//!< Key of the option before `ptr`.
+};
+
+//!	Points `cursor` at the first inbound option.
+extern void smcp_inbound_option_cursor_init_(
+	smcp_t self,
+	struct smcp_inbound_option_cursor_s* cursor
+);
+
+//!	Fills in `option` from `cursor` and moves past it. Returns false when there are no more.
+extern bool smcp_inbound_option_cursor_next_(
+	smcp_t self,
+	struct smcp_inbound_option_cursor_s* cursor,
+	struct smcp_inbound_option_s* option
+);
+
+#if SMCP_CONF_STAGE_OUTBOUND_OPTIONS
+//!	An option waiting to be encoded into the outbound packet.
+struct smcp_outbound_option_s {
+	coap_option_key_t		key;
+	uint16_t				offset;	//!< From the start of `outbound.option_values`.
+	uint16_t				len;
+};
+#endif
+
+#if SMCP_CONF_RESPONSE_CACHE
+struct smcp_response_cache_entry_s {
+	uint32_t				hash;
+	coap_msg_id_t			msg_id;
+	uint16_t				response_len;	//!< Zero if no response was sent.
+	smcp_timestamp_t		expiration;
+	char*					response;
+	struct sockaddr_in6		saddr;
+	socklen_t				socklen;
+};
+#endif
+
 #if SMCP_CONF_ENABLE_VHOSTS
 struct smcp_vhost_s {
 	char name[64];
@@ -91,17 +397,40 @@ struct smcp_s {
 	struct uip_udp_conn*	udp_conn;
 #endif
 
+#if SMCP_CONF_TIMER_WHEEL
+	struct {
+		smcp_timer_t		slot[SMCP_TIMER_WHEEL_LEVELS][SMCP_TIMER_WHEEL_SLOTS];
+		uint64_t			occupied[SMCP_TIMER_WHEEL_LEVELS];
+		smcp_timer_t		expired;
+		smcp_timer_t		expired_tail;
+		smcp_timestamp_t	now;
+	} timer_wheel;
+#else
 	smcp_timer_t			timers;
+#endif
 
 	smcp_transaction_t		transactions;
 	smcp_transaction_t		current_transaction;
 
+#if SMCP_TRANSACTIONS_USE_HASH
+	ht_t					transactions_by_msg_id;
+	ht_t					transactions_by_token;
+#endif
+
+	coap_msg_id_t			last_msg_id;
+
 	// Operational Flags
 	uint8_t					is_responding:1,
 							did_respond:1,
 							is_processing_message:1,
 							has_cascade_count:1,
-							force_current_outbound_code:1;
+							force_current_outbound_code:1,
+							send_queue_enabled:1,
+							has_current_time:1;
+
+	smcp_clock_func_t		clock_func;
+	void*					clock_context;
+	smcp_timestamp_t		current_time;	//!< Only valid if `has_current_time` is set.
 
 	//! Inbound packet variables.
 	struct {
@@ -109,7 +438,14 @@ struct smcp_s {
 		size_t					packet_len;
 
 		coap_option_key_t		last_option_key;
-		const uint8_t*			this_option;
+		struct smcp_inbound_option_cursor_s next_option;	//!< The option smcp_inbound_next_option() returns next.
+		uint8_t					option_count;	//!< How many options are in `option`.
+		uint64_t				option_keys;	//!< Bit `n` is set if there is an option with key `n`.
+		struct smcp_inbound_option_s	option[SMCP_CONF_MAX_INBOUND_OPTIONS];
+
+		//	Only set when there were too many options to index.
+		const uint8_t*			unindexed_ptr;	//!< Where the first option left out of `option` starts.
+		coap_option_key_t		unindexed_key;	//!< Key of the last option in `option`.
 
 		const char*				content_ptr;
 		size_t					content_len;
@@ -118,7 +454,8 @@ struct smcp_s {
 		uint8_t					was_sent_to_multicast:1,
 								is_fake:1,
 								is_dupe:1,
-								has_observe_option:1;
+								has_observe_option:1,
+								has_block2_option:1;
 
 		uint32_t				transaction_hash;
 
@@ -147,13 +484,39 @@ struct smcp_s {
 
 		coap_option_key_t		last_option_key;
 
+#if SMCP_CONF_STAGE_OUTBOUND_OPTIONS
+		//! Options added since smcp_outbound_begin(), in the order they were added.
+		struct smcp_outbound_option_s	option[SMCP_CONF_MAX_OUTBOUND_OPTIONS];
+		uint8_t					option_count;
+		uint8_t					options_encoded:1;
+		uint16_t				option_values_len;
+		size_t					options_max_len;	//!< Upper bound on the size of the encoded options.
+		uint8_t					option_values[SMCP_MAX_PACKET_LENGTH];
+#endif
+
 #if SMCP_USE_BSD_SOCKETS
 		char					packet_bytes[SMCP_MAX_PACKET_LENGTH+1];
 		struct sockaddr_in6		saddr;
 		socklen_t				socklen;
+
+		//! Content from smcp_outbound_set_content_iov(), sent after `packet_bytes`.
+		struct iovec			content_iov[SMCP_CONF_MAX_CONTENT_IOV];
+		uint8_t					content_iovcnt;
+		size_t					content_iov_len;
 #endif
 	} outbound;
 
+#if SMCP_CONF_RESPONSE_CACHE
+	//! Recently received messages, oldest first, and the responses sent for them.
+	struct {
+		struct smcp_response_cache_entry_s	entry[SMCP_CONF_RESPONSE_CACHE_SIZE];
+		uint16_t				head;
+		uint16_t				count;
+		size_t					bytes;
+		ht_t					index;
+		struct smcp_response_cache_entry_s*	current;	//!< Entry for the inbound packet.
+	} response_cache;
+#else
 	struct {
 		uint32_t hash;
 		coap_code_t code;
@@ -164,6 +527,74 @@ struct smcp_s {
 #else
 	uint16_t dupe_index;
 #endif
+#endif
+
+#if SMCP_CONF_LARGE_RESPONSES
+	struct smcp_large_response_s	large_response[SMCP_CONF_LARGE_RESPONSE_CACHE_SIZE];
+#endif
+
+#if SMCP_CONF_BLOCK1_UPLOADS
+	struct smcp_block1_upload_s	block1_upload[SMCP_CONF_BLOCK1_UPLOAD_SLOTS];
+
+	//! Complete body handed to the request handler, freed when it returns.
+	char*					block1_body;
+#endif
+
+#if SMCP_CONF_PEER_TABLE
+	struct smcp_peer_s		peer[SMCP_CONF_PEER_TABLE_SIZE];
+
+	//! Confirmable requests allowed outstanding to each peer, or zero for no limit.
+	uint8_t					peer_nstart;
+#endif
+
+#if SMCP_CONF_DYNAMIC_OBSERVERS
+	//! Every observer of every observable, by peer, token and resource.
+	ht_t					observers;
+#endif
+
+#if SMCP_CONF_NOTIFICATION_CACHE
+	struct smcp_notification_s	notification[SMCP_CONF_NOTIFICATION_CACHE_SIZE];
+
+	//! Where smcp_outbound_send() should keep a copy of the notification being rendered.
+	struct smcp_notification_s*	notification_capture;
+#endif
+
+#if SMCP_CONF_ASYNC_DNS
+	//! Resolver thread and its cache. Created on first use.
+	struct smcp_dns_s*		dns;
+#endif
+
+#if SMCP_CONF_COMMAND_QUEUE
+	//! Commands posted by other threads, newest first. Only changed atomically.
+	struct smcp_command_s*	commands;
+
+	//! Read and write ends of the wakeup descriptor. The same for an eventfd.
+	int						command_fd[2];
+#endif
+
+#if SMCP_USE_BSD_SOCKETS
+	//! Preallocated buffers for the datagrams read by smcp_process().
+	struct {
+		char					packet[SMCP_MAX_PACKET_LENGTH+1];
+		size_t					packet_len;
+		struct sockaddr_in6		saddr;
+		socklen_t				socklen;
+	} recv_buffer[SMCP_CONF_RECV_BATCH_SIZE];
+
+#if SMCP_CONF_SEND_QUEUE_SIZE
+	//! Packets waiting to be sent by smcp_flush().
+	struct {
+		char					packet[SMCP_MAX_PACKET_LENGTH];
+		size_t					packet_len;
+		struct sockaddr_in6		saddr;
+		socklen_t				socklen;
+	} send_queue[SMCP_CONF_SEND_QUEUE_SIZE];
+	uint16_t				send_queue_count;
+	smcp_timestamp_t		send_queue_deadline;
+#endif
+#endif
+
+	struct smcp_stats_s		stats;
 
 #if SMCP_CONF_ENABLE_VHOSTS
 	struct smcp_vhost_s		vhost[SMCP_MAX_VHOSTS];
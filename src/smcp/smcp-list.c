@@ -59,13 +59,82 @@
 #include "smcp-logging.h"
 #include "url-helpers.h"
 
+struct smcp_list_context_s {
+	smcp_node_t first;
+	const char* prefix;
+};
+
+//!	Writes out the link-format listing of `first` and its siblings.
+static smcp_status_t
+smcp_list_generate_(smcp_large_content_t content, void* context) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+	struct smcp_list_context_s* const list = context;
+	const char* const prefix = list->prefix;
+	smcp_node_t node = list->first;
+	SMCP_NON_RECURSIVE char link[SMCP_MAX_URI_LENGTH + 32];
+
+	while(node) {
+		smcp_node_t next;
+		const char* node_name = node->name;
+
+		if(!node_name)
+			break;
+
+		// Each link is built separately and appended whole, so a
+		// listing that gets cut short never ends in half a link.
+		link[0] = '<';
+		link[1] = 0;
+
+		if(prefix) {
+			size_t len = strlen(link);
+			if(sizeof(link)-1>len)
+				url_encode_cstr(link+len, prefix, sizeof(link) - len);
+			strlcat(link, "/", sizeof(link));
+		}
+
+		{
+			size_t len = strlen(link);
+			if(sizeof(link)-1>len)
+				url_encode_cstr(link+len, node_name, sizeof(link) - len);
+		}
+
+		if(node->children)
+			strlcat(link, "/", sizeof(link));
+
+		strlcat(link, ">", sizeof(link));
+
+		if(node->children || node->has_link_content)
+			strlcat(link, ";ct=40", sizeof(link));
+
+		if(node->is_observable)
+			strlcat(link, ";obs", sizeof(link));
+
+#if SMCP_NODE_ROUTER_USE_BTREE
+		next = bt_next((void*)node);
+#else
+		next = ll_next((void*)node);
+#endif
+
+		node = next;
+#if SMCP_ADD_NEWLINES_TO_LIST_OUTPUT
+		strlcat(link, ",\n" + (!node), sizeof(link));
+#else
+		strlcat(link, "," + (!node), sizeof(link));
+#endif
+
+		ret = smcp_large_content_append(content, link, SMCP_CSTR_LEN);
+		require_noerr(ret, bail);
+	}
+
+bail:
+	return ret;
+}
+
 smcp_status_t
 smcp_handle_list(
 	smcp_node_t		node
 ) {
 	smcp_status_t ret = 0;
-	char* replyContent;
-	size_t content_break_threshold = 256;
 	const char* prefix = node->name;
 
 	// The path "/.well-known/core" is a special case. If we get here,
@@ -141,65 +210,11 @@ smcp_handle_list(
 	smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
 	smcp_outbound_add_option_uint(COAP_OPTION_CONTENT_TYPE, COAP_CONTENT_TYPE_APPLICATION_LINK_FORMAT);
 
-	replyContent = smcp_outbound_get_content_ptr(&content_break_threshold);
-	replyContent[0] = 0;
-
-	while(node) {
-		smcp_node_t next;
-		const char* node_name = node->name;
-
-		if(!node_name)
-			break;
-
-		if((strlen(node_name) + 4) >
-				(content_break_threshold - strlen(replyContent) - 3))
-			break;
-
-		strlcat(replyContent, "<", content_break_threshold);
-
-		if(prefix) {
-			size_t len = strlen(replyContent);
-			if(content_break_threshold-1>len)
-				url_encode_cstr(replyContent+len, prefix, content_break_threshold - len);
-			strlcat(replyContent, "/", content_break_threshold);
-		}
-
-		{
-			size_t len = strlen(replyContent);
-			if(content_break_threshold-1>len)
-				url_encode_cstr(replyContent+len, node_name, content_break_threshold - len);
-		}
-
-		if(node->children)
-			strlcat(replyContent, "/", content_break_threshold);
-
-		strlcat(replyContent, ">", content_break_threshold);
-
-		if(node->children || node->has_link_content)
-			strlcat(replyContent, ";ct=40", content_break_threshold);
-
-		if(node->is_observable)
-			strlcat(replyContent, ";obs", content_break_threshold);
-
-#if SMCP_NODE_ROUTER_USE_BTREE
-		next = bt_next((void*)node);
-#else
-		next = ll_next((void*)node);
-#endif
-
-		node = next;
-#if SMCP_ADD_NEWLINES_TO_LIST_OUTPUT
-		strlcat(replyContent, ",\n" + (!node), content_break_threshold);
-#else
-		strlcat(replyContent, "," + (!node), content_break_threshold);
-#endif
+	{
+		struct smcp_list_context_s context = { node, prefix };
+		ret = smcp_outbound_send_large(&smcp_list_generate_, &context);
 	}
 
-	ret = smcp_outbound_set_content_len(strlen(replyContent));
-	require_noerr(ret,bail);
-
-	ret = smcp_outbound_send();
-
 bail:
 	return ret;
 }
@@ -83,21 +83,18 @@ smcp_node_router_handler(void* context) {
 smcp_status_t
 smcp_node_route(smcp_node_t node, smcp_request_handler_func* func, void** context) {
 	smcp_status_t ret = 0;
-	smcp_t const self = smcp_get_current_instance();
 
 	smcp_inbound_reset_next_option();
 
 	{
-		// TODO: Rewrite this to be more efficient.
-		const uint8_t* prev_option_ptr = self->inbound.this_option;
-		coap_option_key_t prev_key = 0;
 		coap_option_key_t key;
 		const uint8_t* value;
 		size_t value_len;
-		while((key=smcp_inbound_next_option(&value, &value_len))!=COAP_OPTION_INVALID) {
+
+		// Options are left unconsumed once they stop matching
+		// nodes, so that the handler can look at the rest of the path.
+		while((key=smcp_inbound_peek_option(&value, &value_len))!=COAP_OPTION_INVALID) {
 			if(key>COAP_OPTION_URI_PATH) {
-				self->inbound.this_option = prev_option_ptr;
-				self->inbound.last_option_key = prev_key;
 				break;
 			} else if(key==COAP_OPTION_URI_PATH) {
 				smcp_node_t next = smcp_node_find(
@@ -105,13 +102,9 @@ smcp_node_route(smcp_node_t node, smcp_request_handler_func* func, void** contex
 					(const char*)value,
 					(int)value_len
 				);
-				if(next) {
-					node = next;
-				} else {
-					self->inbound.this_option = prev_option_ptr;
-					self->inbound.last_option_key = prev_key;
+				if(!next)
 					break;
-				}
+				node = next;
 			} else if(key==COAP_OPTION_URI_HOST) {
 				// Skip host at the moment,
 				// because we don't do virtual hosting yet.
@@ -132,8 +125,7 @@ smcp_node_route(smcp_node_t node, smcp_request_handler_func* func, void** contex
 					goto bail;
 				}
 			}
-			prev_option_ptr = self->inbound.this_option;
-			prev_key = self->inbound.last_option_key;
+			smcp_inbound_next_option(NULL, NULL);
 		}
 	}
 
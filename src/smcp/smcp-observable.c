@@ -26,82 +26,200 @@
 **	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include "smcp-observable.h"
 #include "smcp-internal.h"
 #include "smcp-transaction.h"
+#include "ll.h"
 
-#define INVALID_OBSERVER_INDEX		(SMCP_MAX_OBSERVERS)
+#include <stdlib.h>
 
 #define SHOULD_CONFIRM_EVENT_FOR_OBSERVER(obs)		(!((obs)->seq&0x7))
 
 struct smcp_observer_s {
 	/**** All of this is private. Don't touch. ****/
 
+	struct ll_item_s item;	// In the observable's list.
 	struct smcp_observable_s *observable;
-	int8_t next;	// always +1, zero is end of list
+#if !SMCP_EMBEDDED
+	smcp_t interface;	// The instance whose request made us, which owns our transaction.
+#endif
+#if SMCP_CONF_DYNAMIC_OBSERVERS
+	uint32_t hash;
+#endif
 	uint8_t key;
+	bool render_per_observer;
+	bool confirmable;	// Whether the notification in flight is confirmable.
 	uint32_t seq;
+	smcp_timestamp_t last_notified;	// When the latest notification was (or will be) sent.
 	struct smcp_async_response_s async_response;
 	struct smcp_transaction_s transaction;
 };
 
-static struct smcp_observer_s observer_table[SMCP_MAX_OBSERVERS];
+struct smcp_observer_key_s {
+	smcp_observable_t observable;
+	uint8_t key;
+};
+
+#if SMCP_EMBEDDED
+#define OBSERVER_INTERFACE_(observer)	smcp_get_current_instance()
+#else
+#define OBSERVER_INTERFACE_(observer)	((observer)->interface)
+#endif
+
+#if !SMCP_CONF_DYNAMIC_OBSERVERS
+// Each thread gets its own table, so observables must only be used
+// from the thread that drives the instance they are attached to.
+static SMCP_THREAD_LOCAL struct smcp_observer_s observer_table[SMCP_MAX_OBSERVERS];
+#endif
+
+//!	Returns true if `item` is the observer the inbound request refers to.
+static bool
+observer_matches_inbound(const void* item, const void* key_, void* context) {
+	struct smcp_observer_s* const observer = (struct smcp_observer_s*)item;
+	const struct smcp_observer_key_s* const key = key_;
+	const struct coap_header_s* const inbound = smcp_inbound_get_packet();
+
+	return (observer->observable == key->observable)
+		&& (observer->key == key->key)
+		&& (observer->async_response.request.header.token_len == inbound->token_len)
+		&& (0 == memcmp(observer->async_response.request.header.token, inbound->token, inbound->token_len))
+		&& smcp_inbound_is_related_to_async_response(&observer->async_response);
+}
+
+#if SMCP_CONF_DYNAMIC_OBSERVERS
+static uint32_t
+observer_hash_inbound(smcp_t self, const struct smcp_observer_key_s* key) {
+	fasthash_state_t state;
+
+	fasthash_init(&state, 0);
+	fasthash_update(&state, &key->observable, sizeof(key->observable));
+	fasthash_update_byte(&state, key->key);
+#if SMCP_USE_BSD_SOCKETS
+	fasthash_update(&state, self->inbound.saddr, self->inbound.socklen);
+#elif CONTIKI
+	fasthash_update(&state, &self->inbound.toaddr, sizeof(self->inbound.toaddr));
+	fasthash_update(&state, &self->inbound.toport, sizeof(self->inbound.toport));
+#endif
+	fasthash_update(&state, self->inbound.packet->token, self->inbound.packet->token_len);
+
+	return fasthash_final(&state);
+}
+#endif
+
+//!	Finds the observer registered by the inbound request, or makes a new one if `create` is set.
+static struct smcp_observer_s*
+find_observer(smcp_t self, smcp_observable_t context, uint8_t key, bool create) {
+	struct smcp_observer_s* ret = NULL;
+	const struct smcp_observer_key_s match = { context, key };
+
+#if SMCP_CONF_DYNAMIC_OBSERVERS
+	const uint32_t hash = observer_hash_inbound(self, &match);
+
+	ret = ht_find(&self->observers, hash, &match, &observer_matches_inbound, NULL);
 
-static int8_t
-get_unused_observer_index() {
-	int8_t ret = 0;
-	for(;ret<SMCP_MAX_OBSERVERS;ret++)
-		if(observer_table[ret].async_response.request_len==0
-		&& observer_table[ret].next==0
-		&& observer_table[ret].transaction.active==0
-		)
+	if(ret || !create)
+		goto bail;
+
+	require(ht_count(&self->observers) < SMCP_MAX_OBSERVERS, bail);
+
+	ret = calloc(1, sizeof(*ret));
+	require(ret, bail);
+
+	if(!ht_insert(&self->observers, hash, ret)) {
+		free(ret);
+		ret = NULL;
+		goto bail;
+	}
+
+	ret->hash = hash;
+#else
+	int i;
+
+	for(ret = context->first_observer; ret; ret = ll_next(ret)) {
+		if(observer_matches_inbound(ret, &match, NULL))
+			goto bail;
+	}
+
+	require(create, bail);
+
+	for(i = 0; i < SMCP_MAX_OBSERVERS; i++) {
+		if(!observer_table[i].observable)
 			break;
-	if(ret==SMCP_MAX_OBSERVERS)
-		ret = -1;
+	}
+
+	require(i < SMCP_MAX_OBSERVERS, bail);
+
+	ret = &observer_table[i];
+	memset(ret, 0, sizeof(*ret));
+#endif
+
+	ret->observable = context;
+#if !SMCP_EMBEDDED
+	ret->interface = self;
+#endif
+	ret->key = key;
+	ret->seq = 0;
+	ll_prepend((void**)&context->first_observer, ret);
+
+bail:
 	return ret;
 }
 
 static void
 free_observer(struct smcp_observer_s *observer) {
 	smcp_observable_t const context = observer->observable;
-	int8_t i = observer - observer_table;
-#if SMCP_EMBEDDED
-	smcp_t const interface = smcp_get_current_instance();
-#else
-	if(!observer->observable)
-		goto bail;
-	smcp_t const interface = observer->observable->interface;
-#endif
+	smcp_t const interface = OBSERVER_INTERFACE_(observer);
+
+	require(context, bail);
+
+	// Marks the observer as free, and keeps us from coming
+	// back here while its transaction is being ended.
+	observer->observable = NULL;
 
 	smcp_transaction_end(interface, &observer->transaction);
 
-	if((context->first_observer==i+1) && (context->last_observer==i+1)) {
-		context->first_observer = context->last_observer = 0;
-	} else if(context->first_observer==i+1) {
-		context->first_observer = observer_table[i].next;
-	} else {
-		int8_t prev;
-		for(prev = context->first_observer-1; prev>=0; i = observer_table[i].next - 1) {
-			if(observer_table[prev].next == i)
-				break;
-		}
+	ll_remove((void**)&context->first_observer, observer);
 
-		observer_table[prev].next = observer_table[i].next;
+	smcp_finish_async_response(&observer->async_response);
 
-		if(context->last_observer == i+1)
-			context->last_observer = prev;
-	}
+#if SMCP_CONF_DYNAMIC_OBSERVERS
+	ht_remove(&interface->observers, observer->hash, observer);
+	free(observer);
+#endif
 
 bail:
-	smcp_finish_async_response(&observer->async_response);
 	return;
 }
 
+#if SMCP_CONF_DYNAMIC_OBSERVERS
+void
+smcp_observers_clear(smcp_t self) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	struct smcp_observer_s* observer;
+	uint32_t iter = 0;
+
+	// The table is thrown away afterwards, so the observers
+	// can be freed without taking them out of it one by one.
+	while((observer = ht_next(&self->observers, &iter))) {
+		smcp_transaction_end(self, &observer->transaction);
+		if(observer->observable)
+			ll_remove((void**)&observer->observable->first_observer, observer);
+		free(observer);
+	}
+
+	ht_destroy(&self->observers);
+}
+#endif
+
 smcp_status_t
 smcp_observable_update(smcp_observable_t context, uint8_t key) {
 	smcp_status_t ret = SMCP_STATUS_OK;
 	smcp_t const interface = smcp_get_current_instance();
-	int8_t i;
+	struct smcp_observer_s* observer;
 
 #if !SMCP_EMBEDDED
 	context->interface = interface;
@@ -111,45 +229,237 @@ smcp_observable_update(smcp_observable_t context, uint8_t key) {
 		goto bail;
 	}
 
-	for(i = context->first_observer-1; i >= 0; i = observer_table[i].next - 1) {
-		if(observer_table[i].key != key)
+	observer = find_observer(interface, context, key, interface->inbound.has_observe_option);
+
+	if(interface->inbound.has_observe_option) {
+		if(!observer)
+			goto bail;
+
+		ret = smcp_start_async_response(&observer->async_response,SMCP_ASYNC_RESPONSE_FLAG_DONT_ACK);
+
+		if(ret) {
+			// The request couldn't be kept, so we couldn't notify.
+			free_observer(observer);
+			goto bail;
+		}
+
+		ret = smcp_outbound_add_option_uint(COAP_OPTION_OBSERVE,observer->seq);
+	} else if(observer) {
+		free_observer(observer);
+	}
+
+bail:
+	return ret;
+}
+
+#if SMCP_CONF_NOTIFICATION_CACHE
+#pragma mark -
+#pragma mark Notification Cache
+
+// The first observer to be notified after a trigger calls the
+// resource handler as usual, and smcp_outbound_send() hands us a copy
+// of what it sent. Every other observer whose observe request asked
+// for the same thing (same options, apart from Observe and Block2)
+// gets that copy with its own token, message id, type and Observe
+// value instead. A trigger throws away the copies it makes stale.
+
+//!	Hashes what the (fake) inbound observe request asks for.
+static uint32_t
+notification_hash_(smcp_t self, uint8_t key) {
+	fasthash_state_t state;
+	const coap_code_t code = self->inbound.packet->code;
+	struct smcp_inbound_option_cursor_s cursor;
+	struct smcp_inbound_option_s option;
+
+	fasthash_init(&state, 0);
+	fasthash_update_byte(&state, key);
+	fasthash_update(&state, &code, sizeof(code));
+
+	smcp_inbound_option_cursor_init_(self, &cursor);
+	while(smcp_inbound_option_cursor_next_(self, &cursor, &option)) {
+		if((option.key == COAP_OPTION_OBSERVE) || (option.key == COAP_OPTION_BLOCK2))
 			continue;
-		if(smcp_inbound_is_related_to_async_response(&observer_table[i].async_response))
+
+		fasthash_update(&state, &option.key, sizeof(option.key));
+		fasthash_update(&state, (const uint8_t*)self->inbound.packet + option.offset, option.len);
+	}
+
+	return fasthash_final(&state);
+}
+
+static void
+notification_free_(struct smcp_notification_s* entry) {
+	free(entry->data);
+	memset(entry, 0, sizeof(*entry));
+}
+
+static struct smcp_notification_s*
+notification_find_(smcp_t self, const struct smcp_observer_s* observer, uint32_t hash) {
+	struct smcp_notification_s* ret = NULL;
+	int i;
+
+	for(i = 0; i < SMCP_CONF_NOTIFICATION_CACHE_SIZE; i++) {
+		struct smcp_notification_s* const entry = &self->notification[i];
+
+		if(	entry->is_complete
+			&& (entry->observable == observer->observable)
+			&& (entry->key == observer->key)
+			&& (entry->hash == hash)
+		) {
+			ret = entry;
+			ret->last_used = smcp_get_time(self);
 			break;
+		}
 	}
 
-	if(interface->inbound.has_observe_option) {
-		if(i == -1) {
-			i = get_unused_observer_index();
-			if(i == -1)
-				goto bail;
-			if(context->last_observer == 0) {
-				context->first_observer = context->last_observer = i + 1;
-			} else {
-				observer_table[context->last_observer-1].next = i +1;
-				context->last_observer = i + 1;
-			}
-			observer_table[i].key = key;
-			observer_table[i].seq = 0;
-			observer_table[i].observable = context;
+	return ret;
+}
+
+//!	Sets aside an entry for a rendering, evicting the least recently used one.
+static struct smcp_notification_s*
+notification_new_(smcp_t self, const struct smcp_observer_s* observer, uint32_t hash) {
+	struct smcp_notification_s* ret = NULL;
+	int i;
+
+	for(i = 0; i < SMCP_CONF_NOTIFICATION_CACHE_SIZE; i++) {
+		struct smcp_notification_s* const entry = &self->notification[i];
+
+		if(!entry->observable) {
+			ret = entry;
+			break;
 		}
 
-		smcp_start_async_response(&observer_table[i].async_response,SMCP_ASYNC_RESPONSE_FLAG_DONT_ACK);
+		if(!ret || (entry->last_used < ret->last_used))
+			ret = entry;
+	}
+
+	notification_free_(ret);
+	ret->observable = observer->observable;
+	ret->key = observer->key;
+	ret->hash = hash;
+	ret->last_used = smcp_get_time(self);
+
+	return ret;
+}
+
+//!	Forgets the renderings of `key` that a trigger has made stale.
+static void
+notification_invalidate_(smcp_t self, smcp_observable_t context, uint8_t key) {
+	int i;
+
+	for(i = 0; i < SMCP_CONF_NOTIFICATION_CACHE_SIZE; i++) {
+		struct smcp_notification_s* const entry = &self->notification[i];
+
+		if(	(entry->observable == context)
+			&& (	(key == SMCP_OBSERVABLE_BROADCAST_KEY)
+				|| (entry->key == SMCP_OBSERVABLE_BROADCAST_KEY)
+				|| (entry->key == key)
+			)
+		) {
+			notification_free_(entry);
+		}
+	}
+}
+
+void
+smcp_notification_capture_(smcp_t self, size_t header_len) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	struct smcp_notification_s* const entry = self->notification_capture;
+	const uint8_t* const options = self->outbound.packet->token + self->outbound.packet->token_len;
+	const uint8_t* options_end = (const uint8_t*)self->outbound.packet + header_len;
+	size_t content_len = self->outbound.content_len;
+
+	// Only the first packet the handler sends is the notification.
+	self->notification_capture = NULL;
+
+#if SMCP_USE_BSD_SOCKETS
+	if(self->outbound.content_iovcnt)
+		content_len = smcp_iov_len_(self->outbound.content_iov, self->outbound.content_iovcnt);
+#endif
+
+	// Leave out the start-of-payload marker.
+	if(content_len)
+		options_end--;
+
+	entry->data = malloc((options_end - options) + content_len);
+	require(entry->data, bail);
+
+	entry->code = self->outbound.packet->code;
+	entry->options_len = (uint16_t)(options_end - options);
+	entry->content_len = content_len;
+	memcpy(entry->data, options, entry->options_len);
+
+#if SMCP_USE_BSD_SOCKETS
+	if(self->outbound.content_iovcnt)
+		smcp_iov_gather_(entry->data + entry->options_len, self->outbound.content_iov, self->outbound.content_iovcnt);
+	else
+#endif
+	memcpy(entry->data + entry->options_len, options_end + (content_len ? 1 : 0), content_len);
+
+	entry->is_complete = true;
+	self->stats.notification_renders++;
+
+bail:
+	return;
+}
+
+void
+smcp_notification_cache_clear(smcp_t self) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	int i;
+
+	for(i = 0; i < SMCP_CONF_NOTIFICATION_CACHE_SIZE; i++)
+		notification_free_(&self->notification[i]);
+}
+
+//!	Sends a copy of `entry`. The packet already has its token, destination and Observe option.
+static smcp_status_t
+notification_send_(smcp_t self, const struct smcp_notification_s* entry) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+	const uint8_t* iter = entry->data;
+	const uint8_t* const options_end = entry->data + entry->options_len;
+	coap_option_key_t key = 0;
+
+	self->outbound.packet->code = entry->code;
+
+	while(iter < options_end) {
+		const uint8_t* value;
+		size_t value_len;
+
+		iter = coap_decode_option(iter, &key, &value, &value_len);
+
+		if(key == COAP_OPTION_OBSERVE)
+			continue;
+
+		ret = smcp_outbound_add_option(key, (const char*)value, value_len);
+		require_noerr(ret, bail);
+	}
 
-		ret = smcp_outbound_add_option_uint(COAP_OPTION_OBSERVE,observer_table[i].seq);
-	} else if(i != -1) {
-		free_observer(&observer_table[i]);
+	if(entry->content_len) {
+#if SMCP_USE_BSD_SOCKETS
+		const struct iovec iov = {
+			.iov_base = (char*)options_end,
+			.iov_len = entry->content_len,
+		};
+		ret = smcp_outbound_set_content_iov(&iov, 1);
+#else
+		ret = smcp_outbound_append_content((const char*)options_end, entry->content_len);
+#endif
+		require_noerr(ret, bail);
 	}
 
+	ret = smcp_outbound_send();
+
 bail:
 	return ret;
 }
+#endif // SMCP_CONF_NOTIFICATION_CACHE
 
 static smcp_status_t
 event_response_handler(int statuscode, struct smcp_observer_s* observer)
 {
 	if(statuscode==SMCP_STATUS_TIMEOUT) {
-		if(SHOULD_CONFIRM_EVENT_FOR_OBSERVER(observer)) {
+		if(observer->confirmable) {
 			statuscode = SMCP_STATUS_RESET;
 		} else {
 			statuscode = SMCP_STATUS_OK;
@@ -174,7 +484,7 @@ static smcp_status_t
 retry_sending_event(struct smcp_observer_s* observer)
 {
 	smcp_status_t status;
-	smcp_t const self = smcp_get_current_instance();
+	smcp_t const self = OBSERVER_INTERFACE_(observer);
 
 	status = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
 	require_noerr(status,bail);
@@ -185,7 +495,7 @@ retry_sending_event(struct smcp_observer_s* observer)
 	status = smcp_outbound_add_option_uint(COAP_OPTION_OBSERVE,observer->seq);
 	require_noerr(status,bail);
 
-	self->outbound.packet->tt = SHOULD_CONFIRM_EVENT_FOR_OBSERVER(observer)?COAP_TRANS_TYPE_CONFIRMABLE:COAP_TRANS_TYPE_NONCONFIRMABLE;
+	self->outbound.packet->tt = observer->confirmable?COAP_TRANS_TYPE_CONFIRMABLE:COAP_TRANS_TYPE_NONCONFIRMABLE;
 
 	self->inbound.has_observe_option = true;
 	self->is_responding = true;
@@ -193,6 +503,21 @@ retry_sending_event(struct smcp_observer_s* observer)
 	self->is_processing_message = true;
 	self->did_respond = false;
 
+#if SMCP_CONF_NOTIFICATION_CACHE
+	if(!observer->render_per_observer) {
+		const uint32_t hash = notification_hash_(self, observer->key);
+		const struct smcp_notification_s* const notification = notification_find_(self, observer, hash);
+
+		if(notification) {
+			self->stats.notification_replays++;
+			status = notification_send_(self, notification);
+			goto bail;
+		}
+
+		self->notification_capture = notification_new_(self, observer, hash);
+	}
+#endif
+
 #if VERBOSE_DEBUG
 	coap_dump_header(
 		SMCP_DEBUG_OUT_FILE,
@@ -203,6 +528,12 @@ retry_sending_event(struct smcp_observer_s* observer)
 #endif
 
 	status = smcp_handle_request(self);
+
+#if SMCP_CONF_NOTIFICATION_CACHE
+	// Don't keep a copy of the empty response sent below.
+	self->notification_capture = NULL;
+#endif
+
 	require(!status||status==SMCP_STATUS_NOT_FOUND||status==SMCP_STATUS_NOT_ALLOWED,bail);
 
 	if(status) {
@@ -211,57 +542,117 @@ retry_sending_event(struct smcp_observer_s* observer)
 	}
 
 bail:
+#if SMCP_CONF_NOTIFICATION_CACHE
+	self->notification_capture = NULL;
+#endif
 	self->is_processing_message = false;
 	self->did_respond = false;
 	return status;
 }
 
+//!	Starts sending a notification to `observer`, no sooner than the observable's minimum period allows.
+static smcp_status_t
+notify_observer_(smcp_t self, struct smcp_observer_s* observer) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+	const smcp_timestamp_t now = smcp_get_time(self);
+	cms_t delay = 0;
+	cms_t expiration;
+
+	if(observer->transaction.active && observer->confirmable) {
+		// The confirmable notification in flight hasn't been
+		// acknowledged. As RFC 7641 section 4.5.2 suggests, the new
+		// one takes its place and inherits its retransmission
+		// counter and timeout: the next retransmission carries the
+		// current state, under a new message ID so that it isn't
+		// taken for a duplicate. Starting over would keep an observer
+		// that never answers around for as long as we keep changing.
+		self->stats.notifications_superseded++;
+		smcp_transaction_new_msg_id(self, &observer->transaction, smcp_get_next_msg_id(self));
+		goto bail;
+	}
+
+	observer->confirmable = SHOULD_CONFIRM_EVENT_FOR_OBSERVER(observer);
+	expiration = observer->confirmable?SMCP_OBSERVER_CON_EVENT_EXPIRATION:SMCP_OBSERVER_NON_EVENT_EXPIRATION;
+
+	if(observer->observable->min_period > 0 && observer->last_notified) {
+		delay = (cms_t)(observer->last_notified + observer->observable->min_period - now);
+		if(delay < 0)
+			delay = 0;
+	}
+
+	if(observer->transaction.active) {
+		// Nothing is retransmitted for a non-confirmable
+		// notification, so the new one simply starts over.
+		self->stats.notifications_superseded++;
+	} else {
+		smcp_transaction_init(
+			&observer->transaction,
+			0, // Flags
+			(void*)&retry_sending_event,
+			(void*)&event_response_handler,
+			(void*)observer
+		);
+	}
+
+	ret = smcp_transaction_begin(self, &observer->transaction, expiration + delay);
+	require_noerr(ret, bail);
+
+	if(delay) {
+		smcp_invalidate_timer(self, &observer->transaction.timer);
+		smcp_schedule_timer(self, &observer->transaction.timer, delay);
+	}
+
+	observer->last_notified = now + delay;
+
+bail:
+	return ret;
+}
+
 smcp_status_t
 smcp_observable_trigger(smcp_observable_t context, uint8_t key, uint8_t flags)
 {
 	smcp_status_t ret = SMCP_STATUS_OK;
-	int8_t i;
-#if SMCP_EMBEDDED
-	smcp_t const interface = smcp_get_current_instance();
-#else
-	smcp_t const interface = context->interface;
-
-	if(!interface)
-		goto bail;
+	struct smcp_observer_s* observer;
+	struct smcp_observer_s* next;
+
+#if SMCP_CONF_NOTIFICATION_CACHE
+	{
+		smcp_t invalidated = NULL;
+
+		// Observers can belong to different instances, and each
+		// instance keeps its own renderings. Nothing is rendered
+		// until the loop below, so they must all be forgotten first.
+		for(observer = context->first_observer; observer; observer = ll_next(observer)) {
+			if(OBSERVER_INTERFACE_(observer) != invalidated) {
+				invalidated = OBSERVER_INTERFACE_(observer);
+				notification_invalidate_(invalidated, context, key);
+			}
+		}
+	}
 #endif
 
-	if(!context->first_observer)
-		goto bail;
+	for(observer = context->first_observer; observer; observer = next) {
+		next = ll_next(observer);
 
-	for(i = context->first_observer-1; i >= 0; i = observer_table[i].next - 1) {
-		if(	(observer_table[i].key != SMCP_OBSERVABLE_BROADCAST_KEY)
+		if(	(observer->key != SMCP_OBSERVABLE_BROADCAST_KEY)
 			&& (key != SMCP_OBSERVABLE_BROADCAST_KEY)
-			&& (observer_table[i].key != key)
+			&& (observer->key != key)
 		) {
 			continue;
 		}
 
-		observer_table[i].seq++;
+		observer->seq++;
+		observer->render_per_observer = !!(flags & SMCP_OBSERVABLE_FLAG_PER_OBSERVER);
 
-		if(observer_table[i].transaction.active) {
-			smcp_transaction_tickle(interface, &observer_table[i].transaction);
-		} else {
-			smcp_transaction_init(
-				&observer_table[i].transaction,
-				0, // Flags
-				(void*)&retry_sending_event,
-				(void*)&event_response_handler,
-				(void*)&observer_table[i]
-			);
-
-			ret = smcp_transaction_begin(
-				interface,
-				&observer_table[i].transaction,
-				SHOULD_CONFIRM_EVENT_FOR_OBSERVER(&observer_table[i])?SMCP_OBSERVER_CON_EVENT_EXPIRATION:SMCP_OBSERVER_NON_EVENT_EXPIRATION
-			);
+		if(observer->transaction.active && !observer->transaction.has_fired) {
+			// A notification is already waiting for its turn. It is
+			// rendered when it goes out, so it will carry this update.
+			OBSERVER_INTERFACE_(observer)->stats.notifications_coalesced++;
+			continue;
 		}
+
+		ret = notify_observer_(OBSERVER_INTERFACE_(observer), observer);
 	}
 
-bail:
 	return ret;
 }
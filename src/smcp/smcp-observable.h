@@ -55,12 +55,25 @@ struct smcp_observable_s {
 #if !SMCP_EMBEDDED
 	smcp_t interface;
 #endif
-	int8_t first_observer; //!^ always +1, zero is end of list
-	int8_t last_observer; //!^ always +1, zero is end of list
+
+	//!	Least time between two notifications to the same observer, in milliseconds.
+	/*!	Like the `pmin` attribute of CoRE interfaces. Triggers that come
+	**	sooner are coalesced into one notification, which is sent when
+	**	the period is over and carries whatever the state is then. Zero,
+	**	the default, sends a notification for every trigger. */
+	cms_t min_period;
+
+	struct smcp_observer_s* first_observer; //!^ Private. NULL when nobody is observing.
 };
 
 #define SMCP_OBSERVABLE_BROADCAST_KEY		(0xFF)
 
+//!	Flag for smcp_observable_trigger(): call the resource handler for each observer.
+/*!	Normally a notification is rendered once and copies of it are
+**	sent to every observer that asked for the same thing. Resources
+**	whose representation depends on who is asking need this flag. */
+#define SMCP_OBSERVABLE_FLAG_PER_OBSERVER	(1<<0)
+
 typedef struct smcp_observable_s *smcp_observable_t;
 
 //!	Hook for making a resource observable.
@@ -84,13 +97,31 @@ extern smcp_status_t smcp_observable_update(
 /*!
 **	You may use SMCP_OBSERVABLE_BROADCAST_KEY for the key to trigger
 **	all resources associated with this observable context to update.
+**
+**	Each observer has at most one notification outstanding. If the
+**	last one was confirmable and hasn't been acknowledged yet, its
+**	next retransmission carries the current state instead, keeping
+**	the retransmission count and timeout, so an observer that never
+**	answers is dropped on time. Otherwise a new notification is sent.
 */
 extern smcp_status_t smcp_observable_trigger(
 	smcp_observable_t context, //!< [IN] Pointer to observable context
 	uint8_t key,	//!< [IN] Key for this resource (must be same as used in update)
-	uint8_t flags	//!< [IN] Flags (Currently unused)
+	uint8_t flags	//!< [IN] Flags, such as SMCP_OBSERVABLE_FLAG_PER_OBSERVER
 );
 
+#if SMCP_CONF_COMMAND_QUEUE
+//!	Like smcp_observable_trigger(), but safe to call from any thread.
+/*!	The trigger is carried out by the thread running smcp_process()
+**	for `self`. See smcp_post_command(). */
+extern smcp_status_t smcp_post_observable_trigger(
+	smcp_t self,
+	smcp_observable_t context,
+	uint8_t key,
+	uint8_t flags
+);
+#endif
+
 /*!	@} */
 /*!	@} */
 
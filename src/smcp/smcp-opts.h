@@ -139,10 +139,302 @@
 #define SMCP_CONF_MAX_TIMEOUT					30
 #endif
 
+//!	@define SMCP_CONF_MAX_INBOUND_OPTIONS
+/*!	Number of options in an inbound packet that are indexed. The
+**	options are indexed once when the packet arrives, so that later
+**	lookups don't need to decode them again. Packets with more options
+**	are still handled, but the options past this many are decoded
+**	again every time they are looked at.
+*/
+#ifndef SMCP_CONF_MAX_INBOUND_OPTIONS
+#if SMCP_EMBEDDED
+#define SMCP_CONF_MAX_INBOUND_OPTIONS			(12)
+#else
+#define SMCP_CONF_MAX_INBOUND_OPTIONS			(32)
+#endif
+#endif
+
+//!	@define SMCP_CONF_ASYNC_RESPONSE_MAX_LENGTH
+/*!	Bytes each async response record sets aside for the request it
+**	answers: the header, the token and the options that are kept.
+**	Every observer has such a record, so this adds up. Requests that
+**	don't fit get 4.13 Request Entity Too Large. The default is what
+**	records have always held, so no request that fit before is
+**	turned away. With it, a record on x86-64 with BSD sockets is 112
+**	bytes. That is only 8 fewer than when the request was kept
+**	verbatim, saved by storing the two lengths in smaller fields.
+*/
+#ifndef SMCP_CONF_ASYNC_RESPONSE_MAX_LENGTH
+#define SMCP_CONF_ASYNC_RESPONSE_MAX_LENGTH		(80)
+#endif
+
+//!	@define SMCP_CONF_STAGE_OUTBOUND_OPTIONS
+/*!	If set, outbound options are collected as they are added and then
+**	encoded all at once, in order, when the content pointer is first
+**	needed. Otherwise each option is inserted into the packet as it is
+**	added, which gets slow when options are added out of order.
+*/
+#ifndef SMCP_CONF_STAGE_OUTBOUND_OPTIONS
+#define SMCP_CONF_STAGE_OUTBOUND_OPTIONS		!SMCP_EMBEDDED
+#endif
+
+//!	@define SMCP_CONF_MAX_OUTBOUND_OPTIONS
+/*!	Maximum number of options that can be staged for an outbound
+**	packet. Only relevant when SMCP_CONF_STAGE_OUTBOUND_OPTIONS is set.
+*/
+#ifndef SMCP_CONF_MAX_OUTBOUND_OPTIONS
+#define SMCP_CONF_MAX_OUTBOUND_OPTIONS			(32)
+#endif
+
+//!	@define SMCP_CONF_RESPONSE_TEMPLATE_OPTIONS_SIZE
+/*!	Number of bytes set aside in each smcp_response_template_s
+**	for its encoded options.
+*/
+#ifndef SMCP_CONF_RESPONSE_TEMPLATE_OPTIONS_SIZE
+#define SMCP_CONF_RESPONSE_TEMPLATE_OPTIONS_SIZE	(64)
+#endif
+
+//!	@define SMCP_CONF_URI_MAX_OPTIONS
+/*!	Maximum number of Uri-* options a smcp_uri_s handle can hold.
+*/
+#ifndef SMCP_CONF_URI_MAX_OPTIONS
+#define SMCP_CONF_URI_MAX_OPTIONS				(16)
+#endif
+
+//!	@define SMCP_CONF_URI_OPTIONS_SIZE
+/*!	Number of bytes set aside in each smcp_uri_s for the
+**	values of its options.
+*/
+#ifndef SMCP_CONF_URI_OPTIONS_SIZE
+#define SMCP_CONF_URI_OPTIONS_SIZE				(128)
+#endif
+
+//!	@define SMCP_CONF_LARGE_RESPONSES
+/*!	If set, smcp_outbound_send_large() builds the whole representation
+**	in a growable buffer and serves it one Block2 block at a time,
+**	keeping it around so later blocks don't need the handler.
+**	Otherwise the representation is cut off at the end of the
+**	packet. Requires malloc.
+*/
+#ifndef SMCP_CONF_LARGE_RESPONSES
+#define SMCP_CONF_LARGE_RESPONSES				!SMCP_AVOID_MALLOC
+#endif
+
+//!	@define SMCP_CONF_LARGE_RESPONSE_CACHE_SIZE
+/*!	Maximum number of large representations kept for serving
+**	later blocks.
+*/
+#ifndef SMCP_CONF_LARGE_RESPONSE_CACHE_SIZE
+#define SMCP_CONF_LARGE_RESPONSE_CACHE_SIZE		(8)
+#endif
+
+//!	@define SMCP_CONF_LARGE_RESPONSE_LIFETIME
+/*!	Milliseconds a large representation is kept after the
+**	last block was served from it.
+*/
+#ifndef SMCP_CONF_LARGE_RESPONSE_LIFETIME
+#define SMCP_CONF_LARGE_RESPONSE_LIFETIME		(10*MSEC_PER_SEC)
+#endif
+
+//!	@define SMCP_CONF_BLOCK1_UPLOADS
+/*!	If set, smcp_inbound_collect_block1() puts the blocks of a
+**	Block1 request body back together, so that request handlers
+**	can see the whole body at once. Requires malloc.
+*/
+#ifndef SMCP_CONF_BLOCK1_UPLOADS
+#define SMCP_CONF_BLOCK1_UPLOADS				!SMCP_AVOID_MALLOC
+#endif
+
+//!	@define SMCP_CONF_BLOCK1_UPLOAD_SLOTS
+/*!	Maximum number of Block1 uploads being put together at once.
+**	When all slots are taken, the one that was touched longest ago
+**	is dropped.
+*/
+#ifndef SMCP_CONF_BLOCK1_UPLOAD_SLOTS
+#define SMCP_CONF_BLOCK1_UPLOAD_SLOTS			(4)
+#endif
+
+//!	@define SMCP_CONF_BLOCK1_UPLOAD_MAX_SIZE
+/*!	Largest request body smcp_inbound_collect_block1() accepts.
+**	Bigger uploads get a 4.13 response with this in a Size1 option.
+*/
+#ifndef SMCP_CONF_BLOCK1_UPLOAD_MAX_SIZE
+#define SMCP_CONF_BLOCK1_UPLOAD_MAX_SIZE		(64*1024)
+#endif
+
+//!	@define SMCP_CONF_BLOCK1_UPLOAD_LIFETIME
+/*!	Milliseconds a partial upload is kept waiting for its next block.
+*/
+#ifndef SMCP_CONF_BLOCK1_UPLOAD_LIFETIME
+#define SMCP_CONF_BLOCK1_UPLOAD_LIFETIME		(30*MSEC_PER_SEC)
+#endif
+
+//!	@define SMCP_CONF_PEER_TABLE
+/*!	If set, each instance keeps round-trip time estimates for the
+**	peers it sends confirmable requests to, and uses them instead of
+**	COAP_ACK_TIMEOUT when deciding when to retransmit.
+*/
+#ifndef SMCP_CONF_PEER_TABLE
+#define SMCP_CONF_PEER_TABLE					!SMCP_EMBEDDED
+#endif
+
+//!	@define SMCP_CONF_PEER_TABLE_SIZE
+/*!	Number of peers remembered. When the table is full, the peer
+**	without outstanding requests that was used longest ago is
+**	forgotten.
+*/
+#ifndef SMCP_CONF_PEER_TABLE_SIZE
+#define SMCP_CONF_PEER_TABLE_SIZE				(16)
+#endif
+
+//!	@define SMCP_CONF_PEER_NSTART
+/*!	Default for smcp_set_peer_nstart(): the number of confirmable
+**	requests a transaction layer may have outstanding to a single
+**	peer. Further requests wait until one of them is acknowledged.
+**	RFC7252 calls for `1`; `0` means no limit.
+*/
+#ifndef SMCP_CONF_PEER_NSTART
+#define SMCP_CONF_PEER_NSTART					COAP_NSTART
+#endif
+
+//!	@define SMCP_CONF_PEER_MIN_RTO
+/*!	Lower bound, in milliseconds, on the retransmission timeout
+**	estimated for a peer. Keeps a quick loopback peer from being
+**	flooded with retransmissions when it is briefly slow to answer.
+*/
+#ifndef SMCP_CONF_PEER_MIN_RTO
+#define SMCP_CONF_PEER_MIN_RTO					(100)
+#endif
+
+//!	@define SMCP_CONF_DUPE_BUFFER_SIZE
+/*!	Number of recently seen messages remembered for duplicate
+**	detection. Only relevant when SMCP_CONF_RESPONSE_CACHE is not set.
+*/
 #ifndef SMCP_CONF_DUPE_BUFFER_SIZE
 #define SMCP_CONF_DUPE_BUFFER_SIZE				(16)
 #endif
 
+//!	@define SMCP_CONF_RESPONSE_CACHE
+/*!	If set, every message received is remembered (keyed by the peer's
+**	address and the message id) for EXCHANGE_LIFETIME, along with the
+**	bytes of the response that was sent for it. When a duplicate
+**	arrives, that response is sent again without calling the handler.
+**	Requires malloc and BSD sockets.
+*/
+#ifndef SMCP_CONF_RESPONSE_CACHE
+#define SMCP_CONF_RESPONSE_CACHE				(SMCP_USE_BSD_SOCKETS && !SMCP_AVOID_MALLOC)
+#endif
+
+//!	@define SMCP_CONF_RESPONSE_CACHE_SIZE
+/*!	Maximum number of messages remembered by the response cache.
+**	When it is full the oldest entry is evicted, even if it
+**	hasn't expired yet.
+*/
+#ifndef SMCP_CONF_RESPONSE_CACHE_SIZE
+#define SMCP_CONF_RESPONSE_CACHE_SIZE			(256)
+#endif
+
+//!	@define SMCP_CONF_RESPONSE_CACHE_MAX_BYTES
+/*!	Maximum number of response bytes held by the response cache.
+**	Oldest entries are evicted to stay under this limit.
+*/
+#ifndef SMCP_CONF_RESPONSE_CACHE_MAX_BYTES
+#define SMCP_CONF_RESPONSE_CACHE_MAX_BYTES		(64*1024)
+#endif
+
+//!	@define SMCP_CONF_ASYNC_DNS
+/*!	If set, host names are looked up on a separate thread instead of
+**	blocking the caller in `getaddrinfo()`. Until the answer arrives,
+**	sending to that host fails with SMCP_STATUS_WAIT_FOR_DNS, which
+**	transactions handle by trying again once the answer is in. Without
+**	SMCP_CONF_COMMAND_QUEUE the resolver thread can't wake the
+**	instance, so they just try again every 100ms. Answers are
+**	cached per-instance. Requires BSD sockets, pthreads and malloc.
+*/
+#ifndef SMCP_CONF_ASYNC_DNS
+#define SMCP_CONF_ASYNC_DNS						(SMCP_USE_BSD_SOCKETS && HAVE_PTHREAD_H && !SMCP_AVOID_MALLOC)
+#endif
+
+//!	@define SMCP_CONF_COMMAND_QUEUE
+/*!	If set, other threads can hand work to the thread running
+**	smcp_process() with smcp_post_command() and
+**	smcp_post_observable_trigger(). Posting is lock-free, and wakes
+**	the protocol thread through an eventfd, or a pipe where there is
+**	none. Requires BSD sockets and malloc.
+*/
+#ifndef SMCP_CONF_COMMAND_QUEUE
+#define SMCP_CONF_COMMAND_QUEUE					(SMCP_USE_BSD_SOCKETS && !SMCP_AVOID_MALLOC && !SMCP_EMBEDDED)
+#endif
+
+//!	@define SMCP_CONF_DNS_CACHE_SIZE
+/*!	Maximum number of host names remembered by the resolver cache.
+*/
+#ifndef SMCP_CONF_DNS_CACHE_SIZE
+#define SMCP_CONF_DNS_CACHE_SIZE				(16)
+#endif
+
+//!	@define SMCP_CONF_DNS_CACHE_TTL
+/*!	Milliseconds a successful lookup is reused for. `getaddrinfo()`
+**	doesn't tell us the record's real TTL, so this is an upper bound
+**	on how stale an address can get.
+*/
+#ifndef SMCP_CONF_DNS_CACHE_TTL
+#define SMCP_CONF_DNS_CACHE_TTL					(60*MSEC_PER_SEC)
+#endif
+
+//!	@define SMCP_CONF_DNS_NEGATIVE_TTL
+/*!	Milliseconds a failed lookup is remembered for before the
+**	host is looked up again.
+*/
+#ifndef SMCP_CONF_DNS_NEGATIVE_TTL
+#define SMCP_CONF_DNS_NEGATIVE_TTL				(5*MSEC_PER_SEC)
+#endif
+
+//!	@define SMCP_CONF_RECV_BATCH_SIZE
+/*!	Maximum number of datagrams that smcp_process() will read from
+**	the socket each time it wakes up. Uses `recvmmsg()` when available.
+**	Only relevant when SMCP_USE_BSD_SOCKETS is set.
+*/
+#ifndef SMCP_CONF_RECV_BATCH_SIZE
+#if SMCP_EMBEDDED
+#define SMCP_CONF_RECV_BATCH_SIZE				(1)
+#else
+#define SMCP_CONF_RECV_BATCH_SIZE				(8)
+#endif
+#endif
+
+//!	@define SMCP_CONF_MAX_CONTENT_IOV
+/*!	Maximum number of buffers that can be passed to
+**	smcp_outbound_set_content_iov().
+**	Only relevant when SMCP_USE_BSD_SOCKETS is set.
+*/
+#ifndef SMCP_CONF_MAX_CONTENT_IOV
+#define SMCP_CONF_MAX_CONTENT_IOV				(8)
+#endif
+
+//!	@define SMCP_CONF_SEND_QUEUE_SIZE
+/*!	Number of packets that can be held in the outbound queue when
+**	it is enabled with smcp_set_send_queue_enabled(). Queued packets are
+**	sent with `sendmmsg()` when available. Set to zero to remove
+**	support for the outbound queue entirely.
+**	Only relevant when SMCP_USE_BSD_SOCKETS is set.
+*/
+#ifndef SMCP_CONF_SEND_QUEUE_SIZE
+#if SMCP_EMBEDDED
+#define SMCP_CONF_SEND_QUEUE_SIZE				(0)
+#else
+#define SMCP_CONF_SEND_QUEUE_SIZE				(16)
+#endif
+#endif
+
+//!	@define SMCP_CONF_SEND_QUEUE_MAX_DELAY
+/*!	The longest amount of time (in milliseconds) that a packet
+**	is allowed to sit in the outbound queue before it is sent.
+*/
+#ifndef SMCP_CONF_SEND_QUEUE_MAX_DELAY
+#define SMCP_CONF_SEND_QUEUE_MAX_DELAY			(5)
+#endif
+
 #ifndef SMCP_CONF_ENABLE_VHOSTS
 #define SMCP_CONF_ENABLE_VHOSTS					!SMCP_EMBEDDED
 #endif
@@ -151,16 +443,63 @@
 #define SMCP_MAX_VHOSTS							3
 #endif
 
+#ifndef SMCP_CONF_TRANS_ENABLE_BLOCK1
+#define SMCP_CONF_TRANS_ENABLE_BLOCK1			!SMCP_EMBEDDED
+#endif
+
 #ifndef SMCP_CONF_TRANS_ENABLE_BLOCK2
 #define SMCP_CONF_TRANS_ENABLE_BLOCK2			!SMCP_EMBEDDED
 #endif
 
+//!	@define SMCP_CONF_TRANS_BLOCK2_WINDOW
+/*!	How many block requests a transaction with
+**	SMCP_TRANSACTION_BLOCK2_AUTO keeps outstanding at once, unless
+**	smcp_transaction_set_block2_window() says otherwise. The default
+**	of one fetches blocks strictly one after another.
+*/
+#ifndef SMCP_CONF_TRANS_BLOCK2_WINDOW
+#define SMCP_CONF_TRANS_BLOCK2_WINDOW			1
+#endif
+
 #ifndef SMCP_CONF_TRANS_ENABLE_OBSERVING
 #define SMCP_CONF_TRANS_ENABLE_OBSERVING		!SMCP_EMBEDDED
 #endif
 
+//!	@define SMCP_TRANSACTIONS_USE_HASH
+/*!	If set, pending transactions are indexed by message id and by
+**	token in hash tables, so matching a response to its transaction
+**	takes constant time no matter how many are outstanding.
+**	Requires malloc.
+*/
+#ifndef SMCP_TRANSACTIONS_USE_HASH
+#define SMCP_TRANSACTIONS_USE_HASH				!SMCP_AVOID_MALLOC
+#endif
+
 #ifndef SMCP_TRANSACTIONS_USE_BTREE
-#define SMCP_TRANSACTIONS_USE_BTREE				!SMCP_EMBEDDED
+#define SMCP_TRANSACTIONS_USE_BTREE				(!SMCP_EMBEDDED && !SMCP_TRANSACTIONS_USE_HASH)
+#endif
+
+#if SMCP_TRANSACTIONS_USE_HASH && SMCP_TRANSACTIONS_USE_BTREE
+#error SMCP_TRANSACTIONS_USE_HASH and SMCP_TRANSACTIONS_USE_BTREE are mutually exclusive.
+#endif
+
+//!	@define SMCP_CONF_TIMER_WHEEL
+/*!	If set, timers are kept in a hierarchical timing wheel, which
+**	makes scheduling and invalidating a timer take constant time.
+**	Otherwise they are kept in a sorted linked list, which uses
+**	considerably less memory.
+*/
+#ifndef SMCP_CONF_TIMER_WHEEL
+#define SMCP_CONF_TIMER_WHEEL					!SMCP_EMBEDDED
+#endif
+
+//!	@define SMCP_CONF_TIMER_BUDGET
+/*!	Maximum number of expired timers that smcp_handle_timers()
+**	will fire in a single call. Any left over are fired on the
+**	next call, which smcp_get_timeout() will ask for immediately.
+*/
+#ifndef SMCP_CONF_TIMER_BUDGET
+#define SMCP_CONF_TIMER_BUDGET					(64)
 #endif
 
 #ifndef SMCP_NODE_ROUTER_USE_BTREE
@@ -181,11 +520,41 @@
 /*****************************************************************************/
 #pragma mark - Observation Options
 
+//!	@define SMCP_CONF_NOTIFICATION_CACHE
+/*!	If set, a notification triggered by smcp_observable_trigger() is
+**	rendered by the resource handler only once, and copies of it are
+**	sent to every other observer that asked for the same thing.
+**	Requires malloc.
+*/
+#ifndef SMCP_CONF_NOTIFICATION_CACHE
+#define SMCP_CONF_NOTIFICATION_CACHE		!SMCP_AVOID_MALLOC
+#endif
+
+//!	@define SMCP_CONF_NOTIFICATION_CACHE_SIZE
+/*!	Number of rendered notifications kept at once. Should be at
+**	least the number of resources that are triggered together.
+*/
+#ifndef SMCP_CONF_NOTIFICATION_CACHE_SIZE
+#define SMCP_CONF_NOTIFICATION_CACHE_SIZE	(8)
+#endif
+
+//!	@define SMCP_CONF_DYNAMIC_OBSERVERS
+/*!	If set, observers are allocated as they register and indexed
+**	per instance by peer, token and resource, so that there can be
+**	many thousands of them. Otherwise they come from a small static
+**	table of SMCP_MAX_OBSERVERS entries.
+*/
+#ifndef SMCP_CONF_DYNAMIC_OBSERVERS
+#define SMCP_CONF_DYNAMIC_OBSERVERS		(!SMCP_AVOID_MALLOC && !SMCP_EMBEDDED)
+#endif
+
 #ifdef SMCP_CONF_MAX_OBSERVERS
 #define SMCP_MAX_OBSERVERS			(SMCP_CONF_MAX_OBSERVERS)
 #else
 #if SMCP_EMBEDDED
 #define SMCP_MAX_OBSERVERS			(2)
+#elif SMCP_CONF_DYNAMIC_OBSERVERS
+#define SMCP_MAX_OBSERVERS			(64*1024)
 #else
 #define SMCP_MAX_OBSERVERS			(8)
 #endif
@@ -231,6 +600,25 @@
 #define SMCP_NON_RECURSIVE
 #endif
 
+//!	@define SMCP_CONF_THREAD_SAFE
+/*!	If set, the current instance is tracked separately for each
+**	thread, allowing separate instances to be driven from
+**	separate threads.
+*/
+#ifndef SMCP_CONF_THREAD_SAFE
+#define SMCP_CONF_THREAD_SAFE	!SMCP_EMBEDDED
+#endif
+
+#ifndef SMCP_THREAD_LOCAL
+#if SMCP_CONF_THREAD_SAFE && (defined(__GNUC__) || defined(__clang__))
+#define SMCP_THREAD_LOCAL __thread
+#elif SMCP_CONF_THREAD_SAFE && (__STDC_VERSION__ >= 201112L)
+#define SMCP_THREAD_LOCAL _Thread_local
+#else
+#define SMCP_THREAD_LOCAL
+#endif
+#endif
+
 #ifndef SMCP_DEPRECATED
 #if defined(__GNUC__) || defined(__clang__)
 #define SMCP_DEPRECATED __attribute__ ((deprecated))
@@ -38,6 +38,10 @@
 #define DEBUG VERBOSE_DEBUG
 #endif
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1	// For sendmmsg()
+#endif
+
 #include "assert-macros.h"
 
 #include <stdarg.h>
@@ -108,6 +112,8 @@ smcp_outbound_begin(
 #if SMCP_USE_BSD_SOCKETS
 	self->outbound.packet = (struct coap_header_s*)self->outbound.packet_bytes;
 	self->outbound.socklen = 0;
+	self->outbound.content_iovcnt = 0;
+	self->outbound.content_iov_len = 0;
 #elif CONTIKI
 	uip_udp_conn = self->udp_conn;
 	self->outbound.packet = (struct coap_header_s*)&uip_buf[UIP_LLH_LEN + UIP_IPUDPH_LEN];
@@ -142,6 +148,13 @@ smcp_outbound_begin(
 
 	self->outbound.last_option_key = 0;
 
+#if SMCP_CONF_STAGE_OUTBOUND_OPTIONS
+	self->outbound.option_count = 0;
+	self->outbound.option_values_len = 0;
+	self->outbound.options_max_len = 0;
+	self->outbound.options_encoded = false;
+#endif
+
 	self->outbound.content_ptr = (char*)self->outbound.packet->token + self->outbound.packet->token_len;
 	*self->outbound.content_ptr++ = 0xFF;  // start-of-content marker
 	self->outbound.content_len = 0;
@@ -221,6 +234,11 @@ smcp_outbound_set_token(const uint8_t *token,uint8_t token_length) {
 		self->outbound.content_ptr = (char*)self->outbound.packet->token+self->outbound.packet->token_len;
 		self->outbound.content_len = 0;
 		*self->outbound.content_ptr++ = 0xFF;
+#if SMCP_CONF_STAGE_OUTBOUND_OPTIONS
+		// The staged options are still around, they
+		// just need to be encoded again after the token.
+		self->outbound.options_encoded = false;
+#endif
 	}
 
 	if(token_length)
@@ -261,6 +279,141 @@ smcp_outbound_set_destaddr(
 }
 #endif
 
+#if SMCP_CONF_STAGE_OUTBOUND_OPTIONS
+//!	Returns the number of bytes it takes to encode the given option.
+static size_t
+smcp_outbound_option_size_(coap_option_key_t prev_key, coap_option_key_t key, size_t len) {
+	size_t ret = 1 + len;
+	const uint16_t delta = key - prev_key;
+
+	if(delta >= 269)
+		ret += 2;
+	else if(delta >= 13)
+		ret += 1;
+
+	if(len >= 269)
+		ret += 2;
+	else if(len >= 13)
+		ret += 1;
+
+	return ret;
+}
+
+static smcp_status_t
+smcp_outbound_add_option_(
+	coap_option_key_t key, const char* value, size_t len
+) {
+	smcp_t const self = smcp_get_current_instance();
+	struct smcp_outbound_option_s* option;
+
+	if(len == SMCP_CSTR_LEN)
+		len = strlen(value);
+
+	if(	(self->outbound.option_count >= SMCP_CONF_MAX_OUTBOUND_OPTIONS)
+		|| (len > COAP_MAX_OPTION_VALUE_SIZE)
+		|| (self->outbound.option_values_len + len > sizeof(self->outbound.option_values))
+		|| (	(char*)self->outbound.packet->token
+				+ self->outbound.packet->token_len
+				+ self->outbound.options_max_len
+				+ smcp_outbound_option_size_(0, key, len)
+				- (char*)self->outbound.packet
+				+ 1
+			) > SMCP_MAX_PACKET_LENGTH
+	) {
+		// We ran out of room!
+		return SMCP_STATUS_MESSAGE_TOO_BIG;
+	}
+
+	option = &self->outbound.option[self->outbound.option_count++];
+	option->key = key;
+	option->offset = self->outbound.option_values_len;
+	option->len = (uint16_t)len;
+
+	if(len)
+		memcpy(self->outbound.option_values + self->outbound.option_values_len, value, len);
+
+	self->outbound.option_values_len += (uint16_t)len;
+	self->outbound.options_max_len += smcp_outbound_option_size_(0, key, len);
+	self->outbound.options_encoded = false;
+
+	if(key>self->outbound.last_option_key)
+		self->outbound.last_option_key = key;
+
+	return SMCP_STATUS_OK;
+}
+
+//!	Writes all of the staged options into the packet, in order.
+/*!	Any content that has already been written is moved to
+**	follow the options. */
+static void
+smcp_outbound_encode_options_(smcp_t self) {
+	struct smcp_outbound_option_s* const option = self->outbound.option;
+	uint8_t* const start = (uint8_t*)self->outbound.packet->token + self->outbound.packet->token_len;
+	coap_option_key_t prev_key = 0;
+	uint8_t* iter = start;
+	char* content_ptr;
+	size_t options_len = 0;
+	uint8_t i;
+
+	// Options are almost always added in order, which makes
+	// an insertion sort close to free. It is also stable, so
+	// repeated options keep the order they were added in.
+	for(i = 1; i < self->outbound.option_count; i++) {
+		const struct smcp_outbound_option_s tmp = option[i];
+		uint8_t j = i;
+
+		while(j && (option[j-1].key > tmp.key)) {
+			option[j] = option[j-1];
+			j--;
+		}
+		option[j] = tmp;
+	}
+
+	for(i = 0; i < self->outbound.option_count; i++) {
+		options_len += smcp_outbound_option_size_(prev_key, option[i].key, option[i].len);
+		prev_key = option[i].key;
+	}
+
+	content_ptr = (char*)start + options_len + 1;
+
+	if(content_ptr + self->outbound.content_len > (char*)self->outbound.packet + SMCP_MAX_PACKET_LENGTH)
+		self->outbound.content_len = (char*)self->outbound.packet + SMCP_MAX_PACKET_LENGTH - content_ptr;
+
+	// If the content would be overwritten by the options,
+	// get it out of the way first.
+	if(self->outbound.content_len && (content_ptr > self->outbound.content_ptr))
+		memmove(content_ptr, self->outbound.content_ptr, self->outbound.content_len);
+
+	prev_key = 0;
+	for(i = 0; i < self->outbound.option_count; i++) {
+		iter = coap_encode_option(
+			iter,
+			prev_key,
+			option[i].key,
+			self->outbound.option_values + option[i].offset,
+			option[i].len
+		);
+		prev_key = option[i].key;
+	}
+
+	*iter++ = 0xFF;  // Add end-of-options marker
+
+	if(self->outbound.content_len && (content_ptr < self->outbound.content_ptr))
+		memmove(content_ptr, self->outbound.content_ptr, self->outbound.content_len);
+
+	self->outbound.content_ptr = content_ptr;
+	self->outbound.options_encoded = true;
+
+#if OPTION_DEBUG
+	coap_dump_header(
+		SMCP_DEBUG_OUT_FILE,
+		"Option-Debug >>> ",
+		self->outbound.packet,
+		self->outbound.content_ptr-(char*)self->outbound.packet
+	);
+#endif
+}
+#else
 static smcp_status_t
 smcp_outbound_add_option_(
 	coap_option_key_t key, const char* value, size_t len
@@ -310,6 +463,7 @@ smcp_outbound_add_option_(
 
 	return SMCP_STATUS_OK;
 }
+#endif // SMCP_CONF_STAGE_OUTBOUND_OPTIONS
 
 static smcp_status_t
 smcp_outbound_add_options_up_to_key_(
@@ -352,6 +506,38 @@ smcp_outbound_add_options_up_to_key_(
 	}
 #endif
 
+#if SMCP_CONF_TRANS_ENABLE_BLOCK1
+	if(	self->current_transaction
+		&& self->current_transaction->block1_reader
+		&& COAP_CODE_IS_REQUEST(self->outbound.packet->code)
+	) {
+		uint32_t block1;
+
+		if(	self->outbound.last_option_key<COAP_OPTION_BLOCK1
+			&& key>COAP_OPTION_BLOCK1
+			&& smcp_transaction_block1_option_(self->current_transaction, &block1)
+		) {
+			const uint8_t size = (block1 > 0xFFFF) ? 3 : (block1 > 0xFF) ? 2 : 1;
+			block1 = htonl(block1);
+			ret = smcp_outbound_add_option_(
+				COAP_OPTION_BLOCK1,
+				(char*)&block1+sizeof(block1)-size,
+				size
+			);
+		}
+
+		// Tell the server how big the whole body is up front.
+		if(	self->outbound.last_option_key<COAP_OPTION_SIZE1
+			&& key>COAP_OPTION_SIZE1
+			&& !self->current_transaction->block1_offset
+			&& smcp_transaction_block1_option_(self->current_transaction, &block1)
+		) {
+			uint32_t size1 = htonl((uint32_t)self->current_transaction->block1_len);
+			ret = smcp_outbound_add_option_(COAP_OPTION_SIZE1, (char*)&size1, sizeof(size1));
+		}
+	}
+#endif
+
 	if(	self->outbound.last_option_key<COAP_OPTION_AUTHENTICATE
 		&& key>COAP_OPTION_AUTHENTICATE
 	) {
@@ -414,11 +600,10 @@ smcp_outbound_add_option_uint(coap_option_key_t key,uint32_t value) {
 }
 
 
+#if SMCP_USE_BSD_SOCKETS
 smcp_status_t
-smcp_outbound_set_destaddr_from_host_and_port(const char* addr_str,uint16_t toport) {
+smcp_resolve_host_(const char* addr_str, struct sockaddr_in6* saddr_out) {
 	smcp_status_t ret;
-
-#if SMCP_USE_BSD_SOCKETS
 	struct sockaddr_in6 saddr = {
 		.sin6_family	= AF_INET6,
 #if SOCKADDR_HAS_LENGTH_FIELD
@@ -434,15 +619,8 @@ smcp_outbound_set_destaddr_from_host_and_port(const char* addr_str,uint16_t topo
 	struct addrinfo *results = NULL;
 	struct addrinfo *iter = NULL;
 
-	// Check to see if this host is a group we know about.
-	if(strcasecmp(addr_str, "coap-alldevices")==0)
-		addr_str = COAP_MULTICAST_IP6_ALLDEVICES;
-
 	int error = getaddrinfo(addr_str, NULL, &hint, &results);
 
-	DEBUG_PRINTF("Outbound: Dest host [%s]:%d",addr_str,toport);
-	toport = htons(toport);
-
 	if(error && (inet_addr(addr_str) != INADDR_NONE)) {
 		char addr_v4mapped_str[8 + strlen(addr_str)];
 		hint.ai_family = AF_INET6;
@@ -483,26 +661,67 @@ smcp_outbound_set_destaddr_from_host_and_port(const char* addr_str,uint16_t topo
 		saddr.sin6_addr.s6_addr[11] = 0xFF;
 		memcpy(&saddr.sin6_addr.s6_addr[12], &v4addr->sin_addr.s_addr, 4);
 	} else {
-		if(saddr.sin6_addr.s6_addr[0]==0xFF) {
-			smcp_t const self = smcp_get_current_instance();
-			check(self->outbound.packet->tt != COAP_TRANS_TYPE_CONFIRMABLE);
-			if(self->outbound.packet->tt == COAP_TRANS_TYPE_CONFIRMABLE) {
-				self->outbound.packet->tt = COAP_TRANS_TYPE_NONCONFIRMABLE;
-			}
-		}
 		memcpy(&saddr, iter->ai_addr, iter->ai_addrlen);
 	}
-	saddr.sin6_port = toport;
+	saddr.sin6_port = 0;
 
-	ret = smcp_outbound_set_destaddr((struct sockaddr *)&saddr,sizeof(struct sockaddr_in6));
+	memcpy(saddr_out, &saddr, sizeof(saddr));
+	ret = SMCP_STATUS_OK;
+
+bail:
+	if(results)
+		freeaddrinfo(results);
+	return ret;
+}
+#endif
+
+//!	Resolves `addr_str` into an address we can send to.
+static smcp_status_t
+smcp_lookup_host_and_port_(
+	smcp_t self,
+	const char* addr_str,
+	uint16_t toport,
+#if SMCP_USE_BSD_SOCKETS
+	struct sockaddr_in6* saddr_out
+#elif CONTIKI
+	uip_ipaddr_t* toaddr_out
+#endif
+) {
+	smcp_status_t ret;
+
+#if SMCP_USE_BSD_SOCKETS
+	// Check to see if this host is a group we know about.
+	if(strcasecmp(addr_str, "coap-alldevices")==0)
+		addr_str = COAP_MULTICAST_IP6_ALLDEVICES;
+
+	DEBUG_PRINTF("Outbound: Dest host [%s]:%d",addr_str,toport);
+
+#if SMCP_CONF_ASYNC_DNS
+	{
+		struct in6_addr addr6;
+
+		// Address literals don't need a resolver, and answering them
+		// right away keeps them from waiting behind real lookups.
+		if((inet_pton(AF_INET6, addr_str, &addr6) != 1)
+			&& (inet_addr(addr_str) == INADDR_NONE)
+		) {
+			ret = smcp_dns_lookup(self, addr_str, saddr_out);
+		} else {
+			ret = smcp_resolve_host_(addr_str, saddr_out);
+		}
+	}
+#else
+	ret = smcp_resolve_host_(addr_str, saddr_out);
+#endif
 	require_noerr(ret, bail);
 
+	saddr_out->sin6_port = htons(toport);
+
 #elif CONTIKI
 	SMCP_NON_RECURSIVE uip_ipaddr_t toaddr;
 	memset(&toaddr, 0, sizeof(toaddr));
 
 	DEBUG_PRINTF("Outbound: Dest host [%s]:%d",addr_str,toport);
-	toport = htons(toport);
 
 	ret = uiplib_ipaddrconv(
 		addr_str,
@@ -534,25 +753,92 @@ smcp_outbound_set_destaddr_from_host_and_port(const char* addr_str,uint16_t topo
 
 	require_noerr(ret,bail);
 
-	ret = smcp_outbound_set_destaddr(&toaddr,toport);
-
-	require_noerr(ret, bail);
+	memcpy(toaddr_out, &toaddr, sizeof(toaddr));
 #endif // CONTIKI
 
 bail:
+	return ret;
+}
+
+smcp_status_t
+smcp_outbound_set_destaddr_from_host_and_port(const char* addr_str,uint16_t toport) {
+	smcp_status_t ret;
+
 #if SMCP_USE_BSD_SOCKETS
-	if(results)
-		freeaddrinfo(results);
+	struct sockaddr_in6 saddr;
+
+	ret = smcp_lookup_host_and_port_(smcp_get_current_instance(), addr_str, toport, &saddr);
+	require_noerr(ret, bail);
+
+	ret = smcp_outbound_set_destaddr((struct sockaddr *)&saddr,sizeof(struct sockaddr_in6));
+	require_noerr(ret, bail);
+#elif CONTIKI
+	SMCP_NON_RECURSIVE uip_ipaddr_t toaddr;
+
+	ret = smcp_lookup_host_and_port_(smcp_get_current_instance(), addr_str, toport, &toaddr);
+	require_noerr(ret, bail);
+
+	ret = smcp_outbound_set_destaddr(&toaddr,htons(toport));
+	require_noerr(ret, bail);
 #endif
+
+bail:
 	return ret;
 }
 
-smcp_status_t
-smcp_outbound_set_uri(
-	const char* uri, char flags
+//!	Adds a Uri option either to the outbound packet or to `handle`.
+static smcp_status_t
+smcp_uri_add_option_(
+	smcp_uri_t handle, coap_option_key_t key, const char* value, size_t len
+) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+
+	if(!handle) {
+		ret = smcp_outbound_add_option(key, value, len);
+		goto bail;
+	}
+
+	if(len == SMCP_CSTR_LEN)
+		len = strlen(value);
+
+	require_action(
+		(handle->option_count < SMCP_CONF_URI_MAX_OPTIONS)
+		&& (handle->option_values_len + len <= sizeof(handle->option_values)),
+		bail,
+		ret = SMCP_STATUS_MESSAGE_TOO_BIG
+	);
+
+	handle->option[handle->option_count].key = key;
+	handle->option[handle->option_count].offset = handle->option_values_len;
+	handle->option[handle->option_count].len = len;
+	handle->option_count++;
+
+	if(len)
+		memcpy(handle->option_values + handle->option_values_len, value, len);
+	handle->option_values_len += len;
+
+bail:
+	return ret;
+}
+
+static smcp_status_t
+smcp_uri_add_option_uint_(smcp_uri_t handle, coap_option_key_t key, uint32_t value) {
+	char bytes[4];
+	size_t len = 0;
+
+	// CoAP unsigned integers leave out their leading zero bytes.
+	for(; value; value >>= 8)
+		bytes[3 - len++] = (char)(value & 0xFF);
+
+	return smcp_uri_add_option_(handle, key, bytes + 4 - len, len);
+}
+
+//!	Parses `uri` and applies it to the outbound packet, or records it in `handle`.
+static smcp_status_t
+smcp_uri_parse_(
+	smcp_t self, smcp_uri_t handle, const char* uri, char flags
 ) {
 	smcp_status_t ret;
-	smcp_t const self = smcp_get_current_instance();
 	SMCP_NON_RECURSIVE struct url_components_s components;
 	SMCP_NON_RECURSIVE uint16_t toport;
 	SMCP_NON_RECURSIVE char* uri_copy;
@@ -590,7 +876,7 @@ smcp_outbound_set_uri(
 			// Talking to ourself.
 			components.protocol = "coap";
 			components.host = "::1";
-			toport = smcp_get_port(smcp_get_current_instance());
+			toport = smcp_get_port(self);
 			flags |= SMCP_MSG_SKIP_AUTHORITY;
 		} else if(components.port) {
 			toport = atoi(components.port);
@@ -614,19 +900,19 @@ smcp_outbound_set_uri(
 		);
 		require_action(uri!=self->proxy_url,bail,ret = SMCP_STATUS_INVALID_ARGUMENT);
 
-		ret = smcp_outbound_add_option(COAP_OPTION_PROXY_URI, uri, strlen(uri));
+		ret = smcp_uri_add_option_(handle, COAP_OPTION_PROXY_URI, uri, strlen(uri));
 		require_noerr(ret, bail);
-		ret = smcp_outbound_set_uri(self->proxy_url,flags);
+		ret = smcp_uri_parse_(self, handle, self->proxy_url, flags);
 		goto bail;
 	}
 
 	if(!(flags&SMCP_MSG_SKIP_AUTHORITY)) {
 		if(components.host && !string_contains_colons(components.host)) {
-			ret = smcp_outbound_add_option(COAP_OPTION_URI_HOST, components.host, strlen(components.host));
+			ret = smcp_uri_add_option_(handle, COAP_OPTION_URI_HOST, components.host, strlen(components.host));
 			require_noerr(ret, bail);
 		}
 		if(components.port) {
-			ret = smcp_outbound_add_option_uint(COAP_OPTION_URI_PORT, toport);
+			ret = smcp_uri_add_option_uint_(handle, COAP_OPTION_URI_PORT, toport);
 			require_noerr(ret, bail);
 		}
 	}
@@ -634,11 +920,24 @@ smcp_outbound_set_uri(
 	if(	!(flags&SMCP_MSG_SKIP_DESTADDR)
 		&& components.host && components.host[0]!=0
 	) {
-		ret = smcp_outbound_set_destaddr_from_host_and_port(components.host,toport);
+		if(handle) {
+#if SMCP_USE_BSD_SOCKETS
+			ret = smcp_lookup_host_and_port_(self, components.host, toport, &handle->saddr);
+#elif CONTIKI
+			ret = smcp_lookup_host_and_port_(self, components.host, toport, &handle->toaddr);
+			handle->toport = htons(toport);
+#endif
+			handle->has_destaddr = (ret == SMCP_STATUS_OK);
+		} else {
+			ret = smcp_outbound_set_destaddr_from_host_and_port(components.host,toport);
+		}
 		require_noerr(ret, bail);
 	}
 
 	if(components.username) {
+		// Credentials are negotiated per-request, so they can't be
+		// captured in a handle.
+		require_action(!handle, bail, ret = SMCP_STATUS_NOT_IMPLEMENTED);
 		ret = smcp_auth_outbound_set_credentials(components.username, components.password);
 		require_noerr(ret, bail);
 	}
@@ -652,11 +951,11 @@ smcp_outbound_set_uri(
 			components.path++;
 
 		while(url_path_next_component(&components.path,&component)) {
-			ret = smcp_outbound_add_option(COAP_OPTION_URI_PATH, component, SMCP_CSTR_LEN);
+			ret = smcp_uri_add_option_(handle, COAP_OPTION_URI_PATH, component, SMCP_CSTR_LEN);
 			require_noerr(ret,bail);
 		}
 		if(has_trailing_slash) {
-			ret = smcp_outbound_add_option(COAP_OPTION_URI_PATH, NULL, 0);
+			ret = smcp_uri_add_option_(handle, COAP_OPTION_URI_PATH, NULL, 0);
 			require_noerr(ret,bail);
 		}
 	}
@@ -667,7 +966,7 @@ smcp_outbound_set_uri(
 		while(url_form_next_value(&components.query,&key,NULL)) {
 			size_t len = strlen(key);
 			if(len)
-				ret = smcp_outbound_add_option(COAP_OPTION_URI_QUERY, key, len);
+				ret = smcp_uri_add_option_(handle, COAP_OPTION_URI_QUERY, key, len);
 			require_noerr(ret,bail);
 		}
 	}
@@ -683,6 +982,51 @@ bail:
 	return ret;
 }
 
+smcp_status_t
+smcp_outbound_set_uri(
+	const char* uri, char flags
+) {
+	return smcp_uri_parse_(smcp_get_current_instance(), NULL, uri, flags);
+}
+
+smcp_status_t
+smcp_uri_init(
+	smcp_t self, smcp_uri_t handle, const char* uri, char flags
+) {
+	SMCP_EMBEDDED_SELF_HOOK;
+
+	memset(handle, 0, sizeof(*handle));
+
+	return smcp_uri_parse_(self, handle, uri, flags);
+}
+
+smcp_status_t
+smcp_outbound_set_uri_handle(smcp_uri_t handle) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+	uint8_t i;
+
+	if(handle->has_destaddr) {
+#if SMCP_USE_BSD_SOCKETS
+		ret = smcp_outbound_set_destaddr((struct sockaddr *)&handle->saddr,sizeof(handle->saddr));
+#elif CONTIKI
+		ret = smcp_outbound_set_destaddr(&handle->toaddr,handle->toport);
+#endif
+		require_noerr(ret, bail);
+	}
+
+	for(i = 0; i < handle->option_count; i++) {
+		ret = smcp_outbound_add_option(
+			handle->option[i].key,
+			handle->option_values + handle->option[i].offset,
+			handle->option[i].len
+		);
+		require_noerr(ret, bail);
+	}
+
+bail:
+	return ret;
+}
+
 smcp_status_t
 smcp_outbound_append_content(const char* value,size_t len) {
 	smcp_status_t ret;
@@ -716,6 +1060,36 @@ bail:
 	return ret;
 }
 
+#if SMCP_USE_BSD_SOCKETS
+smcp_status_t
+smcp_outbound_set_content_iov(const struct iovec* iov, int iovcnt) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+	smcp_t const self = smcp_get_current_instance();
+	size_t max_len = 0;
+	size_t len;
+
+	require_action(
+		(iovcnt >= 0) && (iovcnt <= SMCP_CONF_MAX_CONTENT_IOV),
+		bail,
+		ret = SMCP_STATUS_INVALID_ARGUMENT
+	);
+
+	len = smcp_iov_len_(iov, iovcnt);
+
+	// This also finishes the options, so we know how much room is left.
+	require_action(smcp_outbound_get_content_ptr(&max_len), bail, ret = SMCP_STATUS_FAILURE);
+	require_action(len <= max_len, bail, ret = SMCP_STATUS_MESSAGE_TOO_BIG);
+
+	memcpy(self->outbound.content_iov, iov, iovcnt * sizeof(*iov));
+	self->outbound.content_iovcnt = (uint8_t)iovcnt;
+	self->outbound.content_iov_len = len;
+	self->outbound.content_len = 0;
+
+bail:
+	return ret;
+}
+#endif
+
 char*
 smcp_outbound_get_content_ptr(size_t* max_len) {
 	smcp_t const self = smcp_get_current_instance();
@@ -724,6 +1098,11 @@ smcp_outbound_get_content_ptr(size_t* max_len) {
 	if(self->outbound.packet->code)
 		smcp_outbound_add_options_up_to_key_(COAP_OPTION_INVALID);
 
+#if SMCP_CONF_STAGE_OUTBOUND_OPTIONS
+	if(!self->outbound.options_encoded)
+		smcp_outbound_encode_options_(self);
+#endif
+
 	if(max_len)
 		*max_len = SMCP_MAX_PACKET_LENGTH-(self->outbound.content_ptr-(char*)self->outbound.packet);
 
@@ -736,12 +1115,215 @@ smcp_outbound_set_content_len(size_t len) {
 	return SMCP_STATUS_OK;
 }
 
+#pragma mark -
+#pragma mark Outbound Queue
+
+#if SMCP_USE_BSD_SOCKETS && SMCP_CONF_SEND_QUEUE_SIZE
+//!	Copies the given packet into the outbound queue.
+static smcp_status_t
+smcp_send_queue_push_(smcp_t self, const struct iovec* iov, int iovcnt) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+	const size_t packet_len = smcp_iov_len_(iov, iovcnt);
+
+	require_action(
+		packet_len <= sizeof(self->send_queue[0].packet),
+		bail,
+		ret = SMCP_STATUS_MESSAGE_TOO_BIG
+	);
+
+	// Packets that a flush here fails to send were queued earlier, so
+	// their errors aren't this packet's to report. smcp_flush() has
+	// already counted and logged them.
+	if(self->send_queue_count >= SMCP_CONF_SEND_QUEUE_SIZE) {
+		self->stats.send_flush_full++;
+		(void)smcp_flush(self);
+	}
+
+	if(!self->send_queue_count)
+		self->send_queue_deadline = smcp_timestamp_from_cms(self, SMCP_CONF_SEND_QUEUE_MAX_DELAY);
+
+	smcp_iov_gather_(self->send_queue[self->send_queue_count].packet, iov, iovcnt);
+	memcpy(
+		&self->send_queue[self->send_queue_count].saddr,
+		&self->outbound.saddr,
+		self->outbound.socklen
+	);
+	self->send_queue[self->send_queue_count].packet_len = packet_len;
+	self->send_queue[self->send_queue_count].socklen = self->outbound.socklen;
+	self->send_queue_count++;
+
+	// Make sure nothing waits around for too long, even if
+	// we aren't being called from smcp_process().
+	if(smcp_get_time(self) >= self->send_queue_deadline) {
+		self->stats.send_flush_delay++;
+		(void)smcp_flush(self);
+	}
+
+bail:
+	return ret;
+}
+#endif
+
+smcp_status_t
+smcp_flush(smcp_t self) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+	SMCP_EMBEDDED_SELF_HOOK;
+
+#if SMCP_USE_BSD_SOCKETS && SMCP_CONF_SEND_QUEUE_SIZE
+	int i = 0;
+
+#if HAVE_SENDMMSG
+	struct mmsghdr msgs[SMCP_CONF_SEND_QUEUE_SIZE];
+	struct iovec iov[SMCP_CONF_SEND_QUEUE_SIZE];
+
+	memset(msgs, 0, sizeof(msgs[0])*self->send_queue_count);
+
+	for(i = 0; i < self->send_queue_count; i++) {
+		iov[i].iov_base = self->send_queue[i].packet;
+		iov[i].iov_len = self->send_queue[i].packet_len;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &self->send_queue[i].saddr;
+		msgs[i].msg_hdr.msg_namelen = self->send_queue[i].socklen;
+	}
+
+	i = 0;
+	while(i < self->send_queue_count) {
+		int sent = sendmmsg(self->fd, msgs + i, self->send_queue_count - i, 0);
+
+		self->stats.send_calls++;
+
+		if(sent <= 0) {
+			if(errno == EINTR)
+				continue;
+
+			// sendmmsg() stops at the first packet that it couldn't
+			// send, so skip it and carry on with the rest.
+			assert_printf("Dropping queued packet %d of %d, sendmmsg(): %s", i + 1, self->send_queue_count, strerror(errno));
+			self->stats.send_errors++;
+			self->stats.send_queue_errors++;
+			ret = SMCP_STATUS_ERRNO;
+			sent = 1;
+		} else {
+			self->stats.send_packets += sent;
+		}
+		i += sent;
+	}
+#else
+	for(i = 0; i < self->send_queue_count; i++) {
+		ssize_t sent_bytes = sendto(
+			self->fd,
+			self->send_queue[i].packet,
+			self->send_queue[i].packet_len,
+			0,
+			(struct sockaddr *)&self->send_queue[i].saddr,
+			self->send_queue[i].socklen
+		);
+
+		self->stats.send_calls++;
+
+		if(sent_bytes < 0) {
+			assert_printf("Dropping queued packet %d of %d, sendto(): %s", i + 1, self->send_queue_count, strerror(errno));
+			self->stats.send_errors++;
+			self->stats.send_queue_errors++;
+			ret = SMCP_STATUS_ERRNO;
+		} else {
+			self->stats.send_packets++;
+		}
+	}
+#endif
+
+	self->send_queue_count = 0;
+#endif
+
+	return ret;
+}
+
+void
+smcp_set_send_queue_enabled(smcp_t self, bool enabled) {
+	SMCP_EMBEDDED_SELF_HOOK;
+
+#if SMCP_USE_BSD_SOCKETS && SMCP_CONF_SEND_QUEUE_SIZE
+	if(!enabled)
+		smcp_flush(self);
+
+	self->send_queue_enabled = enabled;
+#else
+	(void)enabled;
+#endif
+}
+
+#pragma mark -
+
+#if SMCP_USE_BSD_SOCKETS
+smcp_status_t
+smcp_outbound_send_iov_(smcp_t self, const struct iovec* iov, int iovcnt) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+
+#if SMCP_CONF_SEND_QUEUE_SIZE
+	if(self->send_queue_enabled) {
+		ret = smcp_send_queue_push_(self, iov, iovcnt);
+	} else
+#endif
+	{
+		struct msghdr msg = {
+			.msg_name = &self->outbound.saddr,
+			.msg_namelen = self->outbound.socklen,
+			.msg_iov = (struct iovec*)iov,
+			.msg_iovlen = iovcnt,
+		};
+		ssize_t sent_bytes = sendmsg(self->fd, &msg, 0);
+
+		self->stats.send_calls++;
+
+		require_action_string(
+			(sent_bytes>=0),
+			bail, (self->stats.send_errors++, ret = SMCP_STATUS_ERRNO), strerror(errno)
+		);
+
+		require_action_string(
+			sent_bytes,
+			bail, ret = SMCP_STATUS_FAILURE, "sendmsg() returned zero."
+		);
+
+		self->stats.send_packets++;
+	}
+
+bail:
+	return ret;
+}
+#endif
+
 smcp_status_t
 smcp_outbound_send() {
 	smcp_status_t ret = SMCP_STATUS_FAILURE;
 	smcp_t const self = smcp_get_current_instance();
 	size_t header_len;
 
+#if SMCP_CONF_PEER_TABLE
+	// Only the transaction's own confirmable requests count
+	// against the peer's NSTART slots.
+	if(	self->current_transaction
+		&& !self->current_transaction->multicast
+		&& (self->outbound.packet->tt == COAP_TRANS_TYPE_CONFIRMABLE)
+		&& COAP_CODE_IS_REQUEST(self->outbound.packet->code)
+		&& (self->outbound.packet->msg_id == self->current_transaction->msg_id)
+	) {
+		ret = smcp_peer_will_send_(self, self->current_transaction);
+		require_noerr(ret,bail);
+	}
+#endif
+
+#if SMCP_CONF_TRANS_ENABLE_BLOCK1
+	if(	self->current_transaction
+		&& self->current_transaction->block1_reader
+		&& COAP_CODE_IS_REQUEST(self->outbound.packet->code)
+	) {
+		ret = smcp_transaction_block1_append_(self->current_transaction);
+		require_noerr(ret,bail);
+	}
+#endif
+
 	if(self->outbound.packet->code) {
 		ret = smcp_auth_outbound_finish();
 		require_noerr(ret,bail);
@@ -749,6 +1331,14 @@ smcp_outbound_send() {
 
 	header_len = (smcp_outbound_get_content_ptr(NULL)-(char*)self->outbound.packet);
 
+#if SMCP_USE_BSD_SOCKETS
+	// Content from smcp_outbound_set_content_iov() takes the
+	// place of anything in the packet buffer, and it follows
+	// the start-of-payload marker.
+	if(self->outbound.content_iov_len) {
+		self->outbound.content_len = 0;
+	} else
+#endif
 	// Remove the start-of-payload marker if we have no payload.
 	if(!smcp_get_current_instance()->outbound.content_len)
 		header_len--;
@@ -775,11 +1365,21 @@ smcp_outbound_send() {
 	}
 #endif
 
+#if SMCP_USE_BSD_SOCKETS
+	// With gathered content, only the header is in the packet buffer.
+	assert(self->outbound.content_iov_len || coap_verify_packet((char*)self->outbound.packet,header_len+smcp_get_current_instance()->outbound.content_len));
+#else
 	assert(coap_verify_packet((char*)self->outbound.packet,header_len+smcp_get_current_instance()->outbound.content_len));
+#endif
 
 	if(self->current_transaction)
 		self->current_transaction->sent_code = self->outbound.packet->code;
 
+#if SMCP_CONF_NOTIFICATION_CACHE
+	if(self->notification_capture && self->is_responding)
+		smcp_notification_capture_(self, header_len);
+#endif
+
 #if defined(SMCP_DEBUG_OUTBOUND_DROP_PERCENT)
 	if(SMCP_DEBUG_OUTBOUND_DROP_PERCENT*SMCP_RANDOM_MAX>SMCP_FUNC_RANDOM_UINT32()) {
 		DEBUG_PRINTF("Dropping outbound packet for debugging!");
@@ -796,25 +1396,26 @@ smcp_outbound_send() {
 
 	require_string(smcp_get_current_instance()->outbound.socklen,bail,"Destaddr not set");
 
-	ssize_t sent_bytes = sendto(
-		smcp_get_current_instance()->fd,
-		smcp_get_current_instance()->outbound.packet_bytes,
-		header_len +
-		smcp_get_current_instance()->outbound.content_len,
-		0,
-		(struct sockaddr *)&smcp_get_current_instance()->outbound.saddr,
-		smcp_get_current_instance()->outbound.socklen
-	);
+	{
+		struct iovec iov[1 + SMCP_CONF_MAX_CONTENT_IOV];
+		const int iovcnt = 1 + self->outbound.content_iovcnt;
 
-	require_action_string(
-		(sent_bytes>=0),
-		bail, ret = SMCP_STATUS_ERRNO, strerror(errno)
-	);
+		iov[0].iov_base = self->outbound.packet_bytes;
+		iov[0].iov_len = header_len + self->outbound.content_len;
+		memcpy(&iov[1], self->outbound.content_iov, self->outbound.content_iovcnt * sizeof(iov[0]));
 
-	require_action_string(
-		sent_bytes,
-		bail, ret = SMCP_STATUS_FAILURE, "sendto() returned zero."
-	);
+		// The caller's buffers are only good until we return.
+		self->outbound.content_iovcnt = 0;
+		self->outbound.content_iov_len = 0;
+
+		ret = smcp_outbound_send_iov_(self, iov, iovcnt);
+		require_noerr(ret, bail);
+
+#if SMCP_CONF_RESPONSE_CACHE
+		if(self->is_responding && self->is_processing_message)
+			smcp_response_cache_store(self, iov, iovcnt);
+#endif
+	}
 
 #elif CONTIKI
 	uip_slen = header_len +	smcp_get_current_instance()->outbound.content_len;
@@ -928,3 +1529,142 @@ smcp_outbound_quick_response(coap_code_t code, const char* body) {
 		smcp_outbound_append_content(body, SMCP_CSTR_LEN);
 	return smcp_outbound_send();
 }
+
+#pragma mark -
+#pragma mark Response Templates
+
+smcp_response_template_t
+smcp_response_template_init(smcp_response_template_t self, coap_code_t code) {
+	require(self, bail);
+
+	memset(self, 0, sizeof(*self));
+	self->code = code;
+
+bail:
+	return self;
+}
+
+smcp_status_t
+smcp_response_template_add_option(
+	smcp_response_template_t self,
+	coap_option_key_t key,
+	const char* value,
+	size_t len
+) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+
+	if(len == SMCP_CSTR_LEN)
+		len = strlen(value);
+
+	// Inserting an option can add up to two bytes to the
+	// option after it, on top of its own header.
+	require_action(
+		self->options_len + len + 7 <= sizeof(self->options),
+		bail,
+		ret = SMCP_STATUS_MESSAGE_TOO_BIG
+	);
+
+	// Templates are only built once, so there is no
+	// harm in letting the options come in any order.
+	self->options_len += coap_insert_option(
+		self->options,
+		self->options + self->options_len,
+		key,
+		(const uint8_t*)value,
+		len
+	);
+
+	if(key > self->last_option_key)
+		self->last_option_key = key;
+
+bail:
+	return ret;
+}
+
+smcp_status_t
+smcp_response_template_add_option_uint(
+	smcp_response_template_t self,
+	coap_option_key_t key,
+	uint32_t value
+) {
+	uint8_t size = 4;
+
+	while(size && !(value >> (8*(size-1))))
+		size--;
+
+	value = htonl(value);
+
+	return smcp_response_template_add_option(self, key, (char*)&value + sizeof(value) - size, size);
+}
+
+void
+smcp_response_template_set_content(
+	smcp_response_template_t self,
+	const char* content,
+	size_t len
+) {
+	if(len == SMCP_CSTR_LEN)
+		len = strlen(content);
+
+	self->content = content;
+	self->content_len = len;
+}
+
+smcp_status_t
+smcp_outbound_send_template(smcp_response_template_t tmpl) {
+	smcp_status_t ret;
+	smcp_t const self = smcp_get_current_instance();
+	char* iter;
+
+	// This takes care of the msg_id, token, type and destination.
+	ret = smcp_outbound_begin_response(tmpl->code);
+	require_noerr(ret, bail);
+
+	iter = (char*)self->outbound.packet->token + self->outbound.packet->token_len;
+
+	require_action(
+		(iter - (char*)self->outbound.packet) + tmpl->options_len + 1 + tmpl->content_len <= SMCP_MAX_PACKET_LENGTH,
+		bail,
+		ret = SMCP_STATUS_MESSAGE_TOO_BIG
+	);
+
+	memcpy(iter, tmpl->options, tmpl->options_len);
+	iter += tmpl->options_len;
+	*iter++ = 0xFF;  // start-of-content marker
+
+	self->outbound.content_ptr = iter;
+	self->outbound.content_len = tmpl->content_len;
+
+	if(tmpl->content_len)
+		memcpy(iter, tmpl->content, tmpl->content_len);
+
+	// The options in the template are final, so make sure
+	// that nothing else gets added to them automatically.
+	self->outbound.last_option_key = COAP_OPTION_INVALID;
+#if SMCP_CONF_STAGE_OUTBOUND_OPTIONS
+	self->outbound.options_encoded = true;
+#endif
+
+	ret = smcp_outbound_send();
+
+bail:
+	return ret;
+}
+
+smcp_status_t
+smcp_response_template_request_handler(void* context) {
+	coap_option_key_t key;
+
+	if(smcp_inbound_get_code() != COAP_METHOD_GET)
+		return SMCP_STATUS_NOT_ALLOWED;
+
+	// The template only covers this exact resource, so if there
+	// is any path left over the request is for something else.
+	while((key = smcp_inbound_peek_option(NULL, NULL)) < COAP_OPTION_URI_PATH)
+		smcp_inbound_next_option(NULL, NULL);
+
+	if(key == COAP_OPTION_URI_PATH)
+		return SMCP_STATUS_NOT_FOUND;
+
+	return smcp_outbound_send_template((smcp_response_template_t)context);
+}
@@ -0,0 +1,398 @@
+/*	@file smcp-peer.c
+**	@brief Per-peer retransmission timeouts and request limits.
+**
+**	Copyright (C) 2011,2012 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Retransmission timeouts are estimated the way CoCoA does it
+// (draft-ietf-core-cocoa): exchanges answered on the first try feed a
+// "strong" RTT estimator, exchanges that needed one or two
+// retransmissions feed a "weak" one, measured from the first
+// transmission since we can't tell which copy was answered. Each new
+// estimate is blended into the peer's overall RTO, the weak ones with
+// less weight. The backoff factor depends on the RTO, and an RTO that
+// hasn't been updated for a while drifts back towards the default.
+//
+// A transaction takes one of the peer's NSTART slots when it sends a
+// confirmable request, and gives it back when the request is answered
+// or the transaction ends. Transactions that find no free slot queue
+// on the peer and are tickled, in order, as slots come free.
+//
+// Peers with outstanding or queued requests are never evicted, so
+// `handler->peer` stays valid while a transaction holds a slot.
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef VERBOSE_DEBUG
+#define VERBOSE_DEBUG 0
+#endif
+
+#ifndef DEBUG
+#define DEBUG VERBOSE_DEBUG
+#endif
+
+#include "assert-macros.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "smcp-internal.h"
+#include "smcp-helpers.h"
+#include "smcp-logging.h"
+#include "smcp.h"
+
+#if SMCP_CONF_PEER_TABLE
+
+#define PEER_DEFAULT_RTO_		((cms_t)(COAP_ACK_TIMEOUT * MSEC_PER_SEC))
+#define PEER_MAX_RTO_			((cms_t)32 * MSEC_PER_SEC)
+
+static bool
+smcp_peer_matches_(smcp_t self, const struct smcp_peer_s* peer) {
+#if SMCP_USE_BSD_SOCKETS
+	const struct sockaddr_in6* const saddr = &self->outbound.saddr;
+
+	return (peer->saddr.sin6_port == saddr->sin6_port)
+		&& (peer->saddr.sin6_scope_id == saddr->sin6_scope_id)
+		&& (0 == memcmp(&peer->saddr.sin6_addr, &saddr->sin6_addr, sizeof(saddr->sin6_addr)));
+#elif CONTIKI
+	return (peer->toport == self->udp_conn->rport)
+		&& uip_ipaddr_cmp(&peer->toaddr, &self->udp_conn->ripaddr);
+#else
+	return false;
+#endif
+}
+
+//!	Finds the peer the outbound packet is addressed to, adding it if needed.
+static struct smcp_peer_s*
+smcp_peer_lookup_(smcp_t self) {
+	struct smcp_peer_s* ret = NULL;
+	int i;
+
+	for(i = 0; i < SMCP_CONF_PEER_TABLE_SIZE; i++) {
+		struct smcp_peer_s* const peer = &self->peer[i];
+
+		if(!peer->in_use) {
+			if(!ret || ret->in_use)
+				ret = peer;
+			continue;
+		}
+
+		if(smcp_peer_matches_(self, peer))
+			return peer;
+
+		if(peer->outstanding || peer->queue)
+			continue;
+
+		if(!ret || (ret->in_use && (peer->last_used < ret->last_used)))
+			ret = peer;
+	}
+
+	// Every peer is busy. The caller falls back to the defaults.
+	require(ret, bail);
+
+	memset(ret, 0, sizeof(*ret));
+	ret->in_use = true;
+#if SMCP_USE_BSD_SOCKETS
+	memcpy(&ret->saddr, &self->outbound.saddr, sizeof(ret->saddr));
+#elif CONTIKI
+	uip_ipaddr_copy(&ret->toaddr, &self->udp_conn->ripaddr);
+	ret->toport = self->udp_conn->rport;
+#endif
+	ret->rto = PEER_DEFAULT_RTO_;
+	ret->last_update = smcp_get_time(self);
+
+bail:
+	return ret;
+}
+
+static void
+smcp_peer_estimate_(cms_t* srtt, cms_t* rttvar, cms_t rtt, bool first) {
+	if(first) {
+		*srtt = rtt;
+		*rttvar = rtt / 2;
+	} else {
+		*rttvar = (3 * *rttvar + ((*srtt > rtt) ? (*srtt - rtt) : (rtt - *srtt))) / 4;
+		*srtt = (7 * *srtt + rtt) / 8;
+	}
+}
+
+static void
+smcp_peer_rtt_sample_(
+	smcp_t self,
+	struct smcp_peer_s* peer,
+	cms_t rtt,
+	int transmissions
+) {
+	if(rtt < 0)
+		rtt = 0;
+
+	if(transmissions == 1) {
+		smcp_peer_estimate_(&peer->strong_srtt, &peer->strong_rttvar, rtt, !peer->strong_samples++);
+		peer->rto = (peer->rto + peer->strong_srtt + 4 * peer->strong_rttvar) / 2;
+	} else if(transmissions <= 3) {
+		smcp_peer_estimate_(&peer->weak_srtt, &peer->weak_rttvar, rtt, !peer->weak_samples++);
+		peer->rto = (3 * peer->rto + peer->weak_srtt + peer->weak_rttvar) / 4;
+	} else {
+		// Too many copies in flight to say anything useful.
+		return;
+	}
+
+	if(peer->rto < SMCP_CONF_PEER_MIN_RTO)
+		peer->rto = SMCP_CONF_PEER_MIN_RTO;
+	if(peer->rto > PEER_MAX_RTO_)
+		peer->rto = PEER_MAX_RTO_;
+
+	peer->last_update = smcp_get_time(self);
+
+	DEBUG_PRINTF("Peer %p: rtt=%dms (%d tx), rto now %dms", peer, (int)rtt, transmissions, (int)peer->rto);
+}
+
+static void
+smcp_peer_free_slot_(smcp_t self, struct smcp_peer_s* peer) {
+	smcp_transaction_t next = peer->queue;
+
+	peer->outstanding--;
+
+	if(next) {
+		peer->queue = next->peer_next;
+		next->peer_next = NULL;
+		next->is_queued_for_peer = false;
+		smcp_transaction_tickle(self, next);
+	}
+}
+
+smcp_status_t
+smcp_peer_will_send_(smcp_t self, smcp_transaction_t handler) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	smcp_status_t ret = SMCP_STATUS_OK;
+	struct smcp_peer_s* peer = handler->peer;
+
+	if(peer && !smcp_peer_matches_(self, peer)) {
+		// The resend callback picked a different destination.
+		smcp_peer_release_(self, handler);
+		peer = NULL;
+	}
+
+	if(!peer) {
+		peer = smcp_peer_lookup_(self);
+		require(peer, bail);
+		handler->peer = peer;
+	}
+
+	peer->last_used = smcp_get_time(self);
+
+	if(handler->has_peer_slot) {
+		if(handler->attemptCount)
+			peer->retransmissions++;
+		goto bail;
+	}
+
+	if(self->peer_nstart && (peer->outstanding >= self->peer_nstart)) {
+		if(!handler->is_queued_for_peer) {
+			smcp_transaction_t* tail = &peer->queue;
+			while(*tail)
+				tail = &(*tail)->peer_next;
+			*tail = handler;
+			handler->peer_next = NULL;
+			handler->is_queued_for_peer = true;
+		}
+		ret = SMCP_STATUS_WAIT_FOR_PEER;
+		goto bail;
+	}
+
+	peer->outstanding++;
+	handler->has_peer_slot = true;
+
+bail:
+	return ret;
+}
+
+void
+smcp_peer_handle_response_(smcp_t self, smcp_transaction_t handler) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	struct smcp_peer_s* const peer = handler->peer;
+
+	require(peer && handler->has_peer_slot, bail);
+
+	if(self->inbound.packet->tt >= COAP_TRANS_TYPE_ACK) {
+		// Answers to the extra requests of a Block2 window carry
+		// their own message ids, and those hold no slot.
+		require(smcp_inbound_get_msg_id() == handler->msg_id, bail);
+
+		smcp_peer_rtt_sample_(
+			self,
+			peer,
+			(cms_t)(smcp_get_time(self) - handler->sent_time),
+			handler->attemptCount
+		);
+	}
+
+	handler->has_peer_slot = false;
+	smcp_peer_free_slot_(self, peer);
+
+bail:
+	return;
+}
+
+void
+smcp_peer_release_(smcp_t self, smcp_transaction_t handler) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	struct smcp_peer_s* const peer = handler->peer;
+
+	require(peer, bail);
+
+	if(handler->is_queued_for_peer) {
+		smcp_transaction_t* iter = &peer->queue;
+		while(*iter && (*iter != handler))
+			iter = &(*iter)->peer_next;
+		if(*iter)
+			*iter = handler->peer_next;
+		handler->peer_next = NULL;
+		handler->is_queued_for_peer = false;
+	}
+
+	if(handler->has_peer_slot) {
+		handler->has_peer_slot = false;
+		smcp_peer_free_slot_(self, peer);
+	}
+
+	handler->peer = NULL;
+
+bail:
+	return;
+}
+
+cms_t
+smcp_peer_retransmit_timeout_(smcp_t self, struct smcp_peer_s* peer, int retries) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	const smcp_timestamp_t now = smcp_get_time(self);
+	cms_t ret;
+
+	// Estimates go stale when a peer hasn't been heard from in a while.
+	if((peer->rto < MSEC_PER_SEC) && (now - peer->last_update > 16 * peer->rto)) {
+		peer->rto *= 2;
+		peer->last_update = now;
+	} else if((peer->rto > 3 * MSEC_PER_SEC) && (now - peer->last_update > 4 * peer->rto)) {
+		peer->rto = (peer->rto + PEER_DEFAULT_RTO_) / 2;
+		peer->last_update = now;
+	}
+
+	// Somewhere between RTO and 1.5*RTO.
+	ret = peer->rto;
+	ret *= 512 + (SMCP_FUNC_RANDOM_UINT32() % 256);
+	ret /= 512;
+
+	while(retries--) {
+#if defined(COAP_MAX_ACK_RETRANSMIT_DURATION)
+		if(ret >= COAP_MAX_ACK_RETRANSMIT_DURATION*MSEC_PER_SEC)
+			break;
+#endif
+		if(peer->rto < MSEC_PER_SEC)
+			ret *= 3;
+		else if(peer->rto > 3 * MSEC_PER_SEC)
+			ret += ret / 2;
+		else
+			ret *= 2;
+	}
+
+#if defined(COAP_MAX_ACK_RETRANSMIT_DURATION)
+	if(ret > COAP_MAX_ACK_RETRANSMIT_DURATION*MSEC_PER_SEC)
+		ret = COAP_MAX_ACK_RETRANSMIT_DURATION*MSEC_PER_SEC;
+#endif
+
+	return ret;
+}
+
+void
+smcp_set_peer_nstart(smcp_t self, uint8_t nstart) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	int i;
+
+	self->peer_nstart = nstart;
+
+	// A higher limit lets queued transactions go right away.
+	for(i = 0; i < SMCP_CONF_PEER_TABLE_SIZE; i++) {
+		struct smcp_peer_s* const peer = &self->peer[i];
+		int woken = 0;
+
+		while(peer->queue && (!nstart || (peer->outstanding + woken < nstart))) {
+			smcp_transaction_t next = peer->queue;
+
+			peer->queue = next->peer_next;
+			next->peer_next = NULL;
+			next->is_queued_for_peer = false;
+			smcp_transaction_tickle(self, next);
+			woken++;
+		}
+	}
+}
+
+int
+smcp_get_peer_stats(
+	smcp_t self,
+	struct smcp_peer_stats_s* stats,
+	int count
+) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	int ret = 0;
+	int i;
+
+	for(i = 0; (i < SMCP_CONF_PEER_TABLE_SIZE) && (ret < count); i++) {
+		const struct smcp_peer_s* const peer = &self->peer[i];
+		struct smcp_peer_stats_s* const item = &stats[ret];
+		smcp_transaction_t iter;
+
+		if(!peer->in_use)
+			continue;
+
+		memset(item, 0, sizeof(*item));
+#if SMCP_USE_BSD_SOCKETS
+		memcpy(&item->saddr, &peer->saddr, sizeof(item->saddr));
+#elif CONTIKI
+		uip_ipaddr_copy(&item->toaddr, &peer->toaddr);
+		item->toport = peer->toport;
+#endif
+		item->rto = peer->rto;
+		if(peer->strong_samples) {
+			item->srtt = peer->strong_srtt;
+			item->rttvar = peer->strong_rttvar;
+		}
+		item->outstanding = peer->outstanding;
+		for(iter = peer->queue; iter; iter = iter->peer_next)
+			item->queued++;
+		item->strong_samples = peer->strong_samples;
+		item->weak_samples = peer->weak_samples;
+		item->retransmissions = peer->retransmissions;
+		ret++;
+	}
+
+	return ret;
+}
+
+#endif // SMCP_CONF_PEER_TABLE
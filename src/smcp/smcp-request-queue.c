@@ -0,0 +1,346 @@
+/*	@file smcp-request-queue.c
+**	@brief Queue of client requests with bounded concurrency.
+**
+**	Copyright (C) 2011,2012 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef VERBOSE_DEBUG
+#define VERBOSE_DEBUG 0
+#endif
+
+#ifndef DEBUG
+#define DEBUG VERBOSE_DEBUG
+#endif
+
+#include "assert-macros.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "smcp-internal.h"
+#include "smcp-helpers.h"
+#include "smcp-logging.h"
+#include "smcp.h"
+#include "smcp-request-queue.h"
+
+#if SMCP_EMBEDDED
+#define QUEUE_INTERFACE_(queue)		smcp_get_current_instance()
+#else
+#define QUEUE_INTERFACE_(queue)		((queue)->interface)
+#endif
+
+static void smcp_request_queue_pump_(smcp_request_queue_t queue);
+
+static bool
+smcp_request_same_peer_(smcp_request_t lhs, smcp_request_t rhs) {
+	if(lhs->uri == rhs->uri)
+		return true;
+
+	if(!lhs->uri->has_destaddr || !rhs->uri->has_destaddr)
+		return false;
+
+#if SMCP_USE_BSD_SOCKETS
+	return (lhs->uri->saddr.sin6_port == rhs->uri->saddr.sin6_port)
+		&& (0 == memcmp(
+			&lhs->uri->saddr.sin6_addr,
+			&rhs->uri->saddr.sin6_addr,
+			sizeof(lhs->uri->saddr.sin6_addr)
+		));
+#elif CONTIKI
+	return (lhs->uri->toport == rhs->uri->toport)
+		&& uip_ipaddr_cmp(&lhs->uri->toaddr, &rhs->uri->toaddr);
+#else
+	return false;
+#endif
+}
+
+static bool
+smcp_request_queue_peer_is_busy_(smcp_request_queue_t queue, smcp_request_t request) {
+	smcp_request_t iter;
+	uint16_t count = 0;
+
+	if(!queue->max_per_peer)
+		return false;
+
+	for(iter = queue->in_flight; iter; iter = ll_next(iter)) {
+		if(smcp_request_same_peer_(iter, request) && (++count >= queue->max_per_peer))
+			return true;
+	}
+
+	return false;
+}
+
+//!	Takes `request` out of the queue and tells the caller how it went.
+static void
+smcp_request_finish_(
+	smcp_request_queue_t queue,
+	smcp_request_t request,
+	smcp_status_t status
+) {
+	smcp_t const self = QUEUE_INTERFACE_(queue);
+
+	if(request->in_flight) {
+		ll_remove((void**)&queue->in_flight, request);
+		request->in_flight = false;
+		queue->stats.in_flight--;
+	}
+
+	if(status > 0) {
+		const cms_t latency = (cms_t)(smcp_get_time(self) - request->enqueued);
+
+		queue->stats.completed++;
+		queue->stats.latency_total += latency;
+		if(latency > queue->stats.latency_max)
+			queue->stats.latency_max = latency;
+	} else if(status == SMCP_STATUS_TIMEOUT) {
+		queue->stats.timeouts++;
+	} else {
+		queue->stats.failures++;
+	}
+
+	request->queue = NULL;
+
+	if(request->callback)
+		(*request->callback)(request, status, request->context);
+}
+
+static smcp_status_t
+smcp_request_resend_(void* context) {
+	smcp_request_t const request = context;
+	smcp_status_t ret;
+
+	ret = smcp_outbound_begin(
+		smcp_get_current_instance(),
+		request->method,
+		COAP_TRANS_TYPE_CONFIRMABLE
+	);
+	require_noerr(ret, bail);
+
+	ret = smcp_outbound_set_uri_handle(request->uri);
+	require_noerr(ret, bail);
+
+	if(request->payload_len && (request->content_type != COAP_CONTENT_TYPE_UNKNOWN)) {
+		ret = smcp_outbound_add_option_uint(COAP_OPTION_CONTENT_TYPE, request->content_type);
+		require_noerr(ret, bail);
+	}
+
+#if !SMCP_CONF_TRANS_ENABLE_BLOCK1
+	// Otherwise the transaction adds the body itself, a block at a time.
+	if(request->payload_len) {
+		ret = smcp_outbound_append_content(request->payload, request->payload_len);
+		require_noerr(ret, bail);
+	}
+#endif
+
+	ret = smcp_outbound_send();
+
+bail:
+	return ret;
+}
+
+static smcp_status_t
+smcp_request_response_(int statuscode, void* context) {
+	smcp_request_t const request = context;
+	smcp_request_queue_t const queue = request->queue;
+
+	// Cancelled requests have already been accounted for.
+	require(queue, bail);
+
+	// The callback is free to free the request, and the transaction
+	// inside it, so the transaction has to be over before then. Once
+	// it is no longer current, the transaction code won't touch it
+	// again after we return.
+	smcp_transaction_end(QUEUE_INTERFACE_(queue), &request->transaction);
+
+	smcp_request_finish_(queue, request, statuscode);
+	smcp_request_queue_pump_(queue);
+
+bail:
+	return SMCP_STATUS_OK;
+}
+
+static smcp_status_t
+smcp_request_start_(smcp_request_queue_t queue, smcp_request_t request) {
+	smcp_t const self = QUEUE_INTERFACE_(queue);
+	smcp_status_t ret;
+
+	smcp_transaction_init(
+		&request->transaction,
+		0,
+		&smcp_request_resend_,
+		&smcp_request_response_,
+		request
+	);
+
+#if SMCP_CONF_TRANS_ENABLE_BLOCK1
+	if(request->payload_len)
+		smcp_transaction_set_block1_buffer(&request->transaction, request->payload, request->payload_len);
+#endif
+
+	memset(&request->item, 0, sizeof(request->item));
+	ll_prepend((void**)&queue->in_flight, request);
+	request->in_flight = true;
+	queue->stats.in_flight++;
+
+	ret = smcp_transaction_begin(self, &request->transaction, request->timeout);
+
+	if(ret)
+		smcp_request_finish_(queue, request, ret);
+
+	return ret;
+}
+
+static void
+smcp_request_queue_pump_(smcp_request_queue_t queue) {
+	smcp_request_t iter = queue->queued;
+
+	while(iter && (!queue->max_in_flight || (queue->stats.in_flight < queue->max_in_flight))) {
+		smcp_request_t const next = ll_next(iter);
+
+		if(smcp_request_queue_peer_is_busy_(queue, iter)) {
+			iter = next;
+			continue;
+		}
+
+		ll_remove((void**)&queue->queued, iter);
+		queue->stats.queued--;
+
+		if(smcp_request_start_(queue, iter)) {
+			// The callback could have changed the queue under us.
+			iter = queue->queued;
+		} else {
+			iter = next;
+		}
+	}
+}
+
+smcp_request_queue_t
+smcp_request_queue_init(
+	smcp_t self,
+	smcp_request_queue_t queue,
+	uint16_t max_in_flight,
+	uint16_t max_per_peer
+) {
+	SMCP_EMBEDDED_SELF_HOOK;
+
+	memset(queue, 0, sizeof(*queue));
+#if !SMCP_EMBEDDED
+	queue->interface = self;
+#endif
+	queue->max_in_flight = max_in_flight;
+	queue->max_per_peer = max_per_peer;
+
+	return queue;
+}
+
+smcp_request_t
+smcp_request_init(
+	smcp_request_t request,
+	coap_code_t method,
+	smcp_uri_t uri,
+	smcp_request_done_func callback,
+	void* context
+) {
+	memset(request, 0, sizeof(*request));
+	request->method = method;
+	request->uri = uri;
+	request->callback = callback;
+	request->context = context;
+	request->content_type = COAP_CONTENT_TYPE_UNKNOWN;
+	request->timeout = -1;
+
+	return request;
+}
+
+smcp_status_t
+smcp_request_queue_add(
+	smcp_request_queue_t queue,
+	smcp_request_t request
+) {
+	smcp_t const self = QUEUE_INTERFACE_(queue);
+	smcp_status_t ret = SMCP_STATUS_OK;
+
+	require_action(request->uri, bail, ret = SMCP_STATUS_BAD_ARGUMENT);
+	require_action(!request->queue, bail, ret = SMCP_STATUS_BAD_ARGUMENT);
+
+	request->queue = queue;
+	request->in_flight = false;
+	request->enqueued = smcp_get_time(self);
+
+	memset(&request->item, 0, sizeof(request->item));
+	ll_push((void**)&queue->queued, request);
+
+	if(++queue->stats.queued > queue->stats.max_queued)
+		queue->stats.max_queued = queue->stats.queued;
+
+	smcp_request_queue_pump_(queue);
+
+bail:
+	return ret;
+}
+
+void
+smcp_request_queue_cancel(
+	smcp_request_queue_t queue,
+	smcp_request_t request
+) {
+	require(request->queue == queue, bail);
+
+	request->queue = NULL;
+
+	if(request->in_flight) {
+		ll_remove((void**)&queue->in_flight, request);
+		request->in_flight = false;
+		queue->stats.in_flight--;
+		smcp_transaction_end(QUEUE_INTERFACE_(queue), &request->transaction);
+		smcp_request_queue_pump_(queue);
+	} else {
+		ll_remove((void**)&queue->queued, request);
+		queue->stats.queued--;
+	}
+
+bail:
+	return;
+}
+
+void
+smcp_request_queue_clear(smcp_request_queue_t queue) {
+	while(queue->queued)
+		smcp_request_queue_cancel(queue, queue->queued);
+
+	while(queue->in_flight)
+		smcp_request_queue_cancel(queue, queue->in_flight);
+}
+
+const struct smcp_request_queue_stats_s*
+smcp_request_queue_get_stats(smcp_request_queue_t queue) {
+	return &queue->stats;
+}
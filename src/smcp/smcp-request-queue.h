@@ -0,0 +1,180 @@
+/*!	@file smcp-request-queue.h
+**	@author Robert Quattlebaum <darco@deepdarc.com>
+**	@brief Queue of client requests with bounded concurrency
+**
+**	Copyright (C) 2011,2012 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __SMCP_REQUEST_QUEUE_H__
+#define __SMCP_REQUEST_QUEUE_H__ 1
+
+#include "smcp.h"
+#include "smcp-transaction.h"
+#include "ll.h"
+
+#if SMCP_EMBEDDED
+#define smcp_request_queue_init(self,...)		smcp_request_queue_init(__VA_ARGS__)
+#endif
+
+__BEGIN_DECLS
+
+/*!	@addtogroup smcp
+**	@{
+*/
+
+/*!	@defgroup smcp-request-queue Request Queue
+**	@{
+**	@brief Sending many requests without flooding the network.
+**
+**	Requests added to a queue are sent in order, with at most
+**	`max_in_flight` of them outstanding at once, and at most
+**	`max_per_peer` outstanding to any one destination. A request
+**	whose peer is busy doesn't hold up requests for other peers
+**	behind it.
+*/
+
+struct smcp_request_s;
+typedef struct smcp_request_s* smcp_request_t;
+
+//!	Called exactly once when a request finishes.
+/*!	`status` is the CoAP code of the response, with the response
+**	available through the inbound API, or a negative
+**	smcp_status_t such as SMCP_STATUS_TIMEOUT. Only the first
+**	block of a Block2 response is delivered.
+**
+**	The request is no longer used by the queue by the time this is
+**	called, so it may be freed here. It must not be added to a queue
+**	again until this has returned. */
+typedef void (*smcp_request_done_func)(
+	smcp_request_t request,
+	smcp_status_t status,
+	void* context
+);
+
+struct smcp_request_s {
+	struct ll_item_s			item;
+
+	//	Set by smcp_request_init(). The rest are optional.
+	coap_code_t					method;
+	smcp_uri_t					uri;
+	smcp_request_done_func		callback;
+	void*						context;
+
+	//!	Sent as the request body. Must stay valid until the request finishes.
+	const char*					payload;
+	size_t						payload_len;
+	coap_content_type_t			content_type;
+
+	//!	Milliseconds to wait for a response, or negative for the default.
+	cms_t						timeout;
+
+	//	Private.
+	struct smcp_request_queue_s* queue;
+	struct smcp_transaction_s	transaction;
+	smcp_timestamp_t			enqueued;
+	bool						in_flight;
+};
+
+struct smcp_request_queue_stats_s {
+	//!	Requests waiting to be sent.
+	uint32_t	queued;
+
+	//!	Most requests ever waiting at once.
+	uint32_t	max_queued;
+
+	//!	Requests sent and not yet finished.
+	uint32_t	in_flight;
+
+	//!	Requests that got a response.
+	uint32_t	completed;
+
+	//!	Requests that got no response in time.
+	uint32_t	timeouts;
+
+	//!	Requests that failed for any other reason.
+	uint32_t	failures;
+
+	//!	Sum and maximum of the milliseconds from smcp_request_queue_add()
+	//!	to the response, over all completed requests.
+	uint64_t	latency_total;
+	cms_t		latency_max;
+};
+
+struct smcp_request_queue_s {
+#if !SMCP_EMBEDDED
+	smcp_t		interface;
+#endif
+	uint16_t	max_in_flight;
+	uint16_t	max_per_peer;
+	smcp_request_t queued;
+	smcp_request_t in_flight;
+	struct smcp_request_queue_stats_s stats;
+};
+
+typedef struct smcp_request_queue_s* smcp_request_queue_t;
+
+//!	Sets up an empty queue. Zero for either limit means no limit.
+extern smcp_request_queue_t smcp_request_queue_init(
+	smcp_t self,
+	smcp_request_queue_t queue,
+	uint16_t max_in_flight,
+	uint16_t max_per_peer
+);
+
+//!	Fills in the required parts of a request and clears the rest.
+/*!	`uri` must stay valid until the request finishes. */
+extern smcp_request_t smcp_request_init(
+	smcp_request_t request,
+	coap_code_t method,
+	smcp_uri_t uri,
+	smcp_request_done_func callback,
+	void* context
+);
+
+//!	Adds `request` to the end of the queue, sending it right away if there is room.
+extern smcp_status_t smcp_request_queue_add(
+	smcp_request_queue_t queue,
+	smcp_request_t request
+);
+
+//!	Drops a queued or outstanding request without calling its callback.
+extern void smcp_request_queue_cancel(
+	smcp_request_queue_t queue,
+	smcp_request_t request
+);
+
+//!	Cancels every request in the queue.
+extern void smcp_request_queue_clear(smcp_request_queue_t queue);
+
+extern const struct smcp_request_queue_stats_s* smcp_request_queue_get_stats(
+	smcp_request_queue_t queue
+);
+
+/*!	@} */
+/*!	@} */
+
+__END_DECLS
+
+#endif
@@ -52,6 +52,10 @@
 #include <string.h>
 #include "smcp-internal.h"
 
+#if HAVE_CLOCK_GETTIME
+#include <time.h>
+#endif
+
 #ifndef SMCP_MAX_TIMEOUT
 #define SMCP_MAX_TIMEOUT    (SMCP_CONF_MAX_TIMEOUT * MSEC_PER_SEC)
 #endif
@@ -109,6 +113,283 @@ convert_timeval_to_cms(const struct timeval* tv) {
 }
 
 
+#pragma mark -
+#pragma mark Time
+
+smcp_timestamp_t
+smcp_get_monotonic_time(void) {
+#if CONTIKI
+	return (smcp_timestamp_t)clock_time() * MSEC_PER_SEC / CLOCK_SECOND;
+#elif HAVE_CLOCK_GETTIME && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (smcp_timestamp_t)ts.tv_sec * MSEC_PER_SEC + ts.tv_nsec / 1000000;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (smcp_timestamp_t)tv.tv_sec * MSEC_PER_SEC + tv.tv_usec / USEC_PER_MSEC;
+#endif
+}
+
+static smcp_timestamp_t
+smcp_sample_time_(smcp_t self) {
+	if(self->clock_func)
+		return (*self->clock_func)(self->clock_context);
+	return smcp_get_monotonic_time();
+}
+
+void
+smcp_set_clock(
+	smcp_t self, smcp_clock_func_t func, void* context
+) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	self->clock_func = func;
+	self->clock_context = context;
+}
+
+smcp_timestamp_t
+smcp_get_time(smcp_t self) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	if(self->has_current_time)
+		return self->current_time;
+	return smcp_sample_time_(self);
+}
+
+void
+smcp_refresh_time(smcp_t self) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	self->current_time = smcp_sample_time_(self);
+	self->has_current_time = true;
+}
+
+void
+smcp_forget_time(smcp_t self) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	self->has_current_time = false;
+}
+
+smcp_timestamp_t
+smcp_timestamp_from_cms(smcp_t self, cms_t cms) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	return smcp_get_time(self) + cms;
+}
+
+cms_t
+smcp_timestamp_to_cms(smcp_t self, smcp_timestamp_t timestamp) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	smcp_timestamp_t ret = timestamp - smcp_get_time(self);
+
+	if(ret < 0)
+		ret = 0;
+	else if(ret > INT32_MAX)
+		ret = INT32_MAX;
+
+	return (cms_t)ret;
+}
+
+#if SMCP_CONF_TIMER_WHEEL
+#pragma mark -
+#pragma mark Timer Wheel
+
+// Timers are hashed into SMCP_TIMER_WHEEL_LEVELS wheels of
+// SMCP_TIMER_WHEEL_SLOTS slots each, indexed by millisecond. The level
+// is the most significant base-64 digit in which the fire time differs
+// from the wheel's current time, and the slot is that digit of the fire
+// time. As the current time advances, the slots it passes over are
+// emptied and their timers placed again, trickling down toward level
+// zero until they land on the expired list.
+
+#if SMCP_TIMER_WHEEL_SLOTS != 64
+#error The timer wheel occupancy bitmaps assume 64 slots per level.
+#endif
+
+#define SMCP_TIMER_WHEEL_MASK		(SMCP_TIMER_WHEEL_SLOTS-1)
+#define SMCP_TIMER_WHEEL_SPAN		((uint64_t)1<<(SMCP_TIMER_WHEEL_BITS*SMCP_TIMER_WHEEL_LEVELS))
+
+static int
+ctz64_(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_ctzll(x);
+#else
+	int ret = 0;
+	while(!(x&1)) {
+		x >>= 1;
+		ret++;
+	}
+	return ret;
+#endif
+}
+
+static uint64_t
+rotl64_(uint64_t x, int n) {
+	n &= 63;
+	return n?((x<<n)|(x>>(64-n))):x;
+}
+
+static uint64_t
+rotr64_(uint64_t x, int n) {
+	n &= 63;
+	return n?((x>>n)|(x<<(64-n))):x;
+}
+
+static void
+smcp_timer_wheel_place_(smcp_t self, smcp_timer_t timer) {
+	const uint64_t now = self->timer_wheel.now;
+	const uint64_t expires = timer->fire_date;
+
+	timer->ll.next = NULL;
+	timer->ll.prev = NULL;
+
+	if(expires <= now) {
+		// Keep the expired list in firing order. New arrivals are
+		// almost always the latest, so search from the tail.
+		smcp_timer_t iter = self->timer_wheel.expired_tail;
+
+		while(iter && (iter->fire_date > timer->fire_date))
+			iter = (smcp_timer_t)iter->ll.prev;
+
+		if(iter) {
+			ll_insert_after(iter, timer);
+		} else {
+			ll_prepend((void**)&self->timer_wheel.expired, timer);
+		}
+
+		if(iter == self->timer_wheel.expired_tail)
+			self->timer_wheel.expired_tail = timer;
+
+		timer->list = &self->timer_wheel.expired;
+	} else {
+		const uint64_t diff = expires ^ now;
+		int level = 0;
+		int slot;
+
+		while((level < SMCP_TIMER_WHEEL_LEVELS-1)
+			&& (diff >> (SMCP_TIMER_WHEEL_BITS*(level+1)))
+		) {
+			level++;
+		}
+
+		if((diff >> (SMCP_TIMER_WHEEL_BITS*(level+1))) && (expires - now >= SMCP_TIMER_WHEEL_SPAN)) {
+			// Too far out for the wheel. Park it in the slot that
+			// will be passed over last; it will be placed again then.
+			slot = ((now >> (SMCP_TIMER_WHEEL_BITS*level)) - 1) & SMCP_TIMER_WHEEL_MASK;
+		} else {
+			slot = (expires >> (SMCP_TIMER_WHEEL_BITS*level)) & SMCP_TIMER_WHEEL_MASK;
+		}
+
+		timer->list = &self->timer_wheel.slot[level][slot];
+		ll_prepend((void**)timer->list, timer);
+		self->timer_wheel.occupied[level] |= ((uint64_t)1<<slot);
+	}
+}
+
+static void
+smcp_timer_wheel_remove_(smcp_t self, smcp_timer_t timer) {
+	smcp_timer_t* const list = timer->list;
+
+	if(!list)
+		return;
+
+	if(list == &self->timer_wheel.expired) {
+		if(self->timer_wheel.expired_tail == timer)
+			self->timer_wheel.expired_tail = (smcp_timer_t)timer->ll.prev;
+		ll_remove((void**)list, timer);
+	} else {
+		const int index = (int)(list - &self->timer_wheel.slot[0][0]);
+
+		ll_remove((void**)list, timer);
+
+		if(!*list) {
+			self->timer_wheel.occupied[index/SMCP_TIMER_WHEEL_SLOTS] &=
+				~((uint64_t)1<<(index&SMCP_TIMER_WHEEL_MASK));
+		}
+	}
+
+	timer->list = NULL;
+}
+
+//!	Moves every timer that is due at or before `target` onto the expired list.
+static void
+smcp_timer_wheel_advance_(smcp_t self, smcp_timestamp_t target_) {
+	const uint64_t now = self->timer_wheel.now;
+	const uint64_t target = target_;
+	smcp_timer_t todo = NULL;
+	int level;
+
+	if(target <= now)
+		return;
+
+	for(level = 0; level < SMCP_TIMER_WHEEL_LEVELS; level++) {
+		const int shift = SMCP_TIMER_WHEEL_BITS*level;
+		const uint64_t steps = (target >> shift) - (now >> shift);
+		uint64_t pending;
+
+		// If this digit didn't change, none of the higher ones did.
+		if(!steps)
+			break;
+
+		if(steps >= SMCP_TIMER_WHEEL_SLOTS) {
+			pending = ~(uint64_t)0;
+		} else {
+			// The `steps` slots following the current one.
+			pending = rotl64_(((uint64_t)1<<steps)-1, (int)((now >> shift) + 1));
+		}
+
+		pending &= self->timer_wheel.occupied[level];
+		self->timer_wheel.occupied[level] &= ~pending;
+
+		while(pending) {
+			smcp_timer_t* const list = &self->timer_wheel.slot[level][ctz64_(pending)];
+			pending &= pending - 1;
+
+			while(*list) {
+				smcp_timer_t timer = *list;
+				ll_remove((void**)list, timer);
+				timer->ll.next = NULL;
+				timer->ll.prev = NULL;
+				ll_prepend((void**)&todo, timer);
+			}
+		}
+	}
+
+	self->timer_wheel.now = target;
+
+	while(todo) {
+		smcp_timer_t timer = todo;
+		ll_remove((void**)&todo, timer);
+		smcp_timer_wheel_place_(self, timer);
+	}
+}
+
+//!	Returns the earliest time at which the wheel might have something to do.
+static uint64_t
+smcp_timer_wheel_next_(smcp_t self) {
+	uint64_t ret = UINT64_MAX;
+	int level;
+
+	if(self->timer_wheel.expired)
+		return self->timer_wheel.now;
+
+	for(level = 0; level < SMCP_TIMER_WHEEL_LEVELS; level++) {
+		const int shift = SMCP_TIMER_WHEEL_BITS*level;
+		const uint64_t occupied = self->timer_wheel.occupied[level];
+		uint64_t when;
+
+		if(!occupied)
+			continue;
+
+		// Bit n of the rotated mask is the slot n+1 steps ahead.
+		when = (self->timer_wheel.now >> shift)
+			+ ctz64_(rotr64_(occupied, (int)((self->timer_wheel.now >> shift) + 1))) + 1;
+		when <<= shift;
+
+		if(when < ret)
+			ret = when;
+	}
+
+	return ret;
+}
+#else
 static ll_compare_result_t
 smcp_timer_compare_func(
 	const void* lhs_, const void* rhs_, void* context
@@ -116,21 +397,17 @@ smcp_timer_compare_func(
 	const smcp_timer_t lhs = (smcp_timer_t)lhs_;
 	const smcp_timer_t rhs = (smcp_timer_t)rhs_;
 
-	if(lhs->fire_date.tv_sec > rhs->fire_date.tv_sec)
-		return 1;
-
-	if(lhs->fire_date.tv_sec < rhs->fire_date.tv_sec)
-		return -1;
-
-	if(lhs->fire_date.tv_usec > rhs->fire_date.tv_usec)
+	if(lhs->fire_date > rhs->fire_date)
 		return 1;
 
-	if(lhs->fire_date.tv_usec < rhs->fire_date.tv_usec)
+	if(lhs->fire_date < rhs->fire_date)
 		return -1;
 
 	return 0;
 }
+#endif
 
+#pragma mark -
 
 smcp_timer_t
 smcp_timer_init(
@@ -153,9 +430,48 @@ smcp_timer_is_scheduled(
 	smcp_t self, smcp_timer_t timer
 ) {
 	SMCP_EMBEDDED_SELF_HOOK;
+#if SMCP_CONF_TIMER_WHEEL
+	return timer->list != NULL;
+#else
 	return timer->ll.next || timer->ll.prev || (self->timers == timer);
+#endif
+}
+
+smcp_timer_t
+smcp_get_any_timer(smcp_t self) {
+	SMCP_EMBEDDED_SELF_HOOK;
+#if SMCP_CONF_TIMER_WHEEL
+	int level;
+
+	if(self->timer_wheel.expired)
+		return self->timer_wheel.expired;
+
+	for(level = 0; level < SMCP_TIMER_WHEEL_LEVELS; level++) {
+		if(self->timer_wheel.occupied[level])
+			return self->timer_wheel.slot[level][ctz64_(self->timer_wheel.occupied[level])];
+	}
+
+	return NULL;
+#else
+	return self->timers;
+#endif
 }
 
+#if SMCP_DEBUG_TIMERS || VERBOSE_DEBUG
+static size_t
+smcp_timer_count_(smcp_t self) {
+#if SMCP_CONF_TIMER_WHEEL
+	size_t ret = ll_count(self->timer_wheel.expired);
+	int i;
+	for(i = 0; i < SMCP_TIMER_WHEEL_LEVELS*SMCP_TIMER_WHEEL_SLOTS; i++)
+		ret += ll_count(self->timer_wheel.slot[0][i]);
+	return ret;
+#else
+	return ll_count(self->timers);
+#endif
+}
+#endif
+
 smcp_status_t
 smcp_schedule_timer(
 	smcp_t	self,
@@ -169,34 +485,39 @@ smcp_schedule_timer(
 	assert(timer!=NULL);
 
 	// Make sure we aren't already part of the list.
-	require(!timer->ll.next, bail);
-	require(!timer->ll.prev, bail);
-	require(self->timers != timer, bail);
+	require(!smcp_timer_is_scheduled(self, timer), bail);
 
 	DEBUG_PRINTF("Timer:%p: Scheduling to fire in %dms ...",timer,cms);
 #if SMCP_DEBUG_TIMERS
-	size_t previousTimerCount = ll_count(self->timers);
+	size_t previousTimerCount = smcp_timer_count_(self);
 #endif
 
 	if(cms<0)
 		cms = 0;
 
-	convert_cms_to_timeval(&timer->fire_date, cms);
+	timer->fire_date = smcp_timestamp_from_cms(self, cms);
+
+#if SMCP_CONF_TIMER_WHEEL
+	if(!self->timer_wheel.now)
+		self->timer_wheel.now = smcp_get_time(self);
 
+	smcp_timer_wheel_place_(self, timer);
+#else
 	ll_sorted_insert(
 		    (void**)&self->timers,
 		timer,
 		&smcp_timer_compare_func,
 		NULL
 	);
+#endif
 
 	ret = SMCP_STATUS_OK;
 
 	DEBUG_PRINTF("Timer:%p(CTX=%p): Scheduled.",timer,timer->context);
-	DEBUG_PRINTF("%p: Timers in play = %d",self,(int)ll_count(self->timers));
+	DEBUG_PRINTF("%p: Timers in play = %d",self,(int)smcp_timer_count_(self));
 
 #if SMCP_DEBUG_TIMERS
-	assert((ll_count(self->timers)) == previousTimerCount+1);
+	assert(smcp_timer_count_(self) == previousTimerCount+1);
 #endif
 
 bail:
@@ -210,37 +531,52 @@ smcp_invalidate_timer(
 ) {
 	SMCP_EMBEDDED_SELF_HOOK;
 #if SMCP_DEBUG_TIMERS
-	size_t previousTimerCount = ll_count(self->timers);
+	size_t previousTimerCount = smcp_timer_count_(self);
 	assert(previousTimerCount>=1);
 #endif
 
 	DEBUG_PRINTF("Timer:%p: Invalidating...",timer);
 	DEBUG_PRINTF("Timer:%p: (CTX=%p)",timer,timer->context);
 
+#if SMCP_CONF_TIMER_WHEEL
+	smcp_timer_wheel_remove_(self, timer);
+#else
 	ll_remove((void**)&self->timers, (void*)timer);
+#endif
 
 #if SMCP_DEBUG_TIMERS
-	assert((ll_count(self->timers)) == previousTimerCount-1);
+	assert(smcp_timer_count_(self) == previousTimerCount-1);
 #endif
 	timer->ll.next = NULL;
 	timer->ll.prev = NULL;
 	if(timer->cancel)
 		(*timer->cancel)(self,timer->context);
 	DEBUG_PRINTF("Timer:%p: Invalidated.",timer);
-	DEBUG_PRINTF("%p: Timers in play = %d",self,(int)ll_count(self->timers));
+	DEBUG_PRINTF("%p: Timers in play = %d",self,(int)smcp_timer_count_(self));
 }
 
 #if SMCP_DEBUG_TIMERS || VERBOSE_DEBUG
+static void
+smcp_dump_timer_list_(smcp_t self, smcp_timer_t iter) {
+	for(;iter;iter = (void*)iter->ll.next) {
+		DEBUG_PRINTF("\t* [%p] expires-in:%dms context:%p",iter,smcp_timestamp_to_cms(self, iter->fire_date),iter->context);
+	}
+}
+
 void
 smcp_dump_all_timers(smcp_t self) {
-	smcp_timer_t iter;
-
-	if(self->timers) {
+	if(smcp_get_any_timer(self)) {
 		DEBUG_PRINTF("smcp(%p): Current Timers:",self);
-
-		for(iter = self->timers;iter;iter = (void*)iter->ll.next) {
-			DEBUG_PRINTF("\t* [%p] expires-in:%dms context:%p",iter,convert_timeval_to_cms(&iter->fire_date),iter->context);
+#if SMCP_CONF_TIMER_WHEEL
+		{
+			int i;
+			smcp_dump_timer_list_(self, self->timer_wheel.expired);
+			for(i = 0; i < SMCP_TIMER_WHEEL_LEVELS*SMCP_TIMER_WHEEL_SLOTS; i++)
+				smcp_dump_timer_list_(self, self->timer_wheel.slot[0][i]);
 		}
+#else
+		smcp_dump_timer_list_(self, self->timers);
+#endif
 	} else {
 		DEBUG_PRINTF("smcp(%p): No timers active.",self);
 	}
@@ -252,8 +588,23 @@ smcp_get_timeout(smcp_t self) {
 	cms_t ret = SMCP_MAX_TIMEOUT;
 	SMCP_EMBEDDED_SELF_HOOK;
 
+#if SMCP_CONF_TIMER_WHEEL
+	{
+		const uint64_t next = smcp_timer_wheel_next_(self);
+		if(next != UINT64_MAX) {
+			const uint64_t now = smcp_get_time(self);
+			ret = (next <= now)?0:(cms_t)MIN(next - now, (uint64_t)ret);
+		}
+	}
+#else
 	if(self->timers)
-		ret = MIN(ret, convert_timeval_to_cms(&self->timers->fire_date));
+		ret = MIN(ret, smcp_timestamp_to_cms(self, self->timers->fire_date));
+#endif
+
+#if SMCP_USE_BSD_SOCKETS && SMCP_CONF_SEND_QUEUE_SIZE
+	if(self->send_queue_count)
+		ret = MIN(ret, smcp_timestamp_to_cms(self, self->send_queue_deadline));
+#endif
 
 	ret = MAX(ret, 0);
 
@@ -266,17 +617,38 @@ smcp_get_timeout(smcp_t self) {
 	return ret;
 }
 
+//!	Returns the next timer that is due to fire, if any.
+static smcp_timer_t
+smcp_next_expired_timer_(smcp_t self) {
+#if SMCP_CONF_TIMER_WHEEL
+	return self->timer_wheel.expired;
+#else
+	if(self->timers && (self->timers->fire_date <= smcp_get_time(self)))
+		return self->timers;
+	return NULL;
+#endif
+}
+
 void
 smcp_handle_timers(smcp_t self) {
+	int budget;
 	SMCP_EMBEDDED_SELF_HOOK;
-	if(	self->timers
-		&& (convert_timeval_to_cms(&self->timers->fire_date) <= 0)
-	) {
+
+#if SMCP_CONF_TIMER_WHEEL
+	smcp_timer_wheel_advance_(self, smcp_get_time(self));
+#endif
+
+	// Fire everything that is due, up to a limit so that a flood
+	// of expiring timers can't starve the socket.
+	for(budget = SMCP_CONF_TIMER_BUDGET; budget > 0; budget--) {
 		SMCP_NON_RECURSIVE smcp_timer_t timer;
 		SMCP_NON_RECURSIVE smcp_timer_callback_t callback;
 		SMCP_NON_RECURSIVE void* context;
 
-		timer = self->timers;
+		timer = smcp_next_expired_timer_(self);
+		if(!timer)
+			break;
+
 		callback = timer->callback;
 		context = timer->context;
 
@@ -291,3 +663,298 @@ smcp_handle_timers(smcp_t self) {
 	smcp_dump_all_timers(self);
 #endif
 }
+
+#if SMCP_TIMER_SELF_TEST
+
+// Drives the timers of a bare instance on a virtual clock:
+//
+//	cc -DHAVE_CONFIG_H -I.. -DSMCP_TIMER_SELF_TEST=1 smcp-timer.c -o timertest
+//
+// The clock only ever advances by what smcp_get_timeout() asks for,
+// unless the test is told to jump, so every timer must fire at exactly
+// its deadline. It starts just short of the point where every digit of
+// the timer wheel rolls over.
+
+#define SELF_TEST_START			(((smcp_timestamp_t)3<<24) - 1000)
+#define SELF_TEST_ITEMS			(2000)
+#define SELF_TEST_MAX_STEPS		(1<<22)
+
+struct self_test_timer_s {
+	struct smcp_timer_s timer;
+	smcp_timestamp_t fire_date;
+	bool scheduled;
+	int fired;
+	int cancelled;
+};
+
+static smcp_timestamp_t gSelfTestNow;
+static smcp_timestamp_t gSelfTestLastFired;
+static bool gSelfTestExact;
+static int gSelfTestFailures;
+
+static smcp_timestamp_t
+self_test_clock(void* context) {
+	return gSelfTestNow;
+}
+
+static void
+self_test_fire(smcp_t self, void* context) {
+	struct self_test_timer_s* const item = context;
+
+	if(!item->scheduled) {
+		printf("Timer %p fired when it wasn't scheduled!\n", item);
+		gSelfTestFailures++;
+	} else if(item->fire_date > gSelfTestNow) {
+		printf("Timer %p fired %dms early!\n", item, (int)(item->fire_date - gSelfTestNow));
+		gSelfTestFailures++;
+	} else if(gSelfTestExact && (item->fire_date != gSelfTestNow)) {
+		printf("Timer %p fired %dms late!\n", item, (int)(gSelfTestNow - item->fire_date));
+		gSelfTestFailures++;
+	} else if(item->fire_date < gSelfTestLastFired) {
+		printf("Timer %p fired out of order!\n", item);
+		gSelfTestFailures++;
+	}
+
+	gSelfTestLastFired = item->fire_date;
+	item->scheduled = false;
+	item->fired++;
+}
+
+static void
+self_test_cancel(smcp_t self, void* context) {
+	struct self_test_timer_s* const item = context;
+	item->cancelled++;
+}
+
+static int
+self_test_schedule(smcp_t self, struct self_test_timer_s* item, cms_t cms) {
+	smcp_timer_init(&item->timer, &self_test_fire, &self_test_cancel, item);
+	item->fire_date = gSelfTestNow + cms;
+	item->scheduled = true;
+
+	if(smcp_schedule_timer(self, &item->timer, cms) != SMCP_STATUS_OK) {
+		printf("Unable to schedule timer %p!\n", item);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+self_test_remove(smcp_t self, struct self_test_timer_s* item) {
+	const int cancelled = item->cancelled;
+
+	smcp_invalidate_timer(self, &item->timer);
+	item->scheduled = false;
+
+	if(item->cancelled != cancelled + 1) {
+		printf("Timer %p wasn't cancelled!\n", item);
+		return -1;
+	}
+
+	if(smcp_timer_is_scheduled(self, &item->timer)) {
+		printf("Timer %p still scheduled after removal!\n", item);
+		return -1;
+	}
+
+	return 0;
+}
+
+//!	Fires everything that is due, checking that nothing due is left over.
+static int
+self_test_handle(smcp_t self, struct self_test_timer_s* items, int count) {
+	int i;
+
+	for(i = 0; smcp_get_timeout(self) == 0; i++) {
+		if(i > count) {
+			printf("Timeout stuck at zero!\n");
+			return -1;
+		}
+		smcp_handle_timers(self);
+	}
+
+	for(i = 0; i < count; i++) {
+		if(items[i].scheduled && (items[i].fire_date <= gSelfTestNow)) {
+			printf("Timer %d is %dms overdue!\n", i, (int)(gSelfTestNow - items[i].fire_date));
+			return -1;
+		}
+	}
+
+	return gSelfTestFailures ? -1 : 0;
+}
+
+//!	Advances the clock until nothing is left scheduled.
+/*!	If `lcg` isn't NULL, the clock sometimes jumps past deadlines,
+**	and timers are removed and scheduled again along the way. */
+static int
+self_test_run(smcp_t self, struct self_test_timer_s* items, int count, unsigned int* lcg) {
+	int steps;
+
+	for(steps = 0; steps < SELF_TEST_MAX_STEPS; steps++) {
+		smcp_timestamp_t earliest = INT64_MAX;
+		cms_t timeout;
+		int i;
+
+		for(i = 0; i < count; i++) {
+			if(items[i].scheduled && (items[i].fire_date < earliest))
+				earliest = items[i].fire_date;
+		}
+
+		if(earliest == INT64_MAX)
+			return 0;
+
+		// The timeout may be early, but never late.
+		timeout = smcp_get_timeout(self);
+		if(timeout > earliest - gSelfTestNow) {
+			printf("Timeout of %dms overshoots the next timer, due in %dms!\n",
+				timeout, (int)(earliest - gSelfTestNow));
+			return -1;
+		}
+
+		gSelfTestExact = true;
+		gSelfTestNow += timeout;
+
+		if(lcg) {
+			*lcg = *lcg * 1664525 + 1013904223;
+			if(((*lcg >> 8) & 7) == 0) {
+				gSelfTestExact = false;
+				gSelfTestNow += (*lcg >> 12) % (1<<20);
+			} else if(((*lcg >> 8) & 7) == 1) {
+				// Whole turns of a level, to land exactly on its slots.
+				gSelfTestExact = false;
+				gSelfTestNow += (cms_t)(1 + (*lcg >> 12) % 64) << (6*((*lcg >> 20) % 3));
+			}
+		}
+
+		if(self_test_handle(self, items, count))
+			return -1;
+
+		if(lcg) {
+			int n;
+
+			*lcg = *lcg * 1664525 + 1013904223;
+			n = (*lcg >> 8) % count;
+
+			if(items[n].scheduled) {
+				if(self_test_remove(self, &items[n]))
+					return -1;
+			} else if(((*lcg >> 4) & 7) == 0) {
+				*lcg = *lcg * 1664525 + 1013904223;
+				if(self_test_schedule(self, &items[n], (*lcg >> 8) % (1<<(6*(1+n%5)))))
+					return -1;
+			}
+		}
+	}
+
+	printf("Timers never ran out!\n");
+	return -1;
+}
+
+int
+main(void) {
+	static struct smcp_s instance;
+	static struct self_test_timer_s items[SELF_TEST_ITEMS];
+	static const cms_t delays[] = {
+		0, 1, 63, 64, 65,
+		4095, 4096, 4097,
+		262143, 262144, 262145,
+		(1<<24) - 1, (1<<24), (1<<24) + 1,
+		(1<<26) + 3,
+	};
+	const int delay_count = sizeof(delays)/sizeof(*delays);
+	smcp_t const self = &instance;
+	unsigned int lcg = 1;
+	int i;
+
+	smcp_set_clock(self, &self_test_clock, NULL);
+	gSelfTestNow = SELF_TEST_START;
+
+	printf("Cascade/wraparound test...");
+	fflush(stdout);
+	for(i = 0; i < delay_count; i++) {
+		if(self_test_schedule(self, &items[i], delays[i]))
+			return -1;
+	}
+	if(self_test_run(self, items, delay_count, NULL))
+		return -1;
+	for(i = 0; i < delay_count; i++) {
+		if(items[i].fired != 1) {
+			printf("Timer for %dms fired %d times!\n", delays[i], items[i].fired);
+			return -1;
+		}
+	}
+	printf("OK\n");
+
+	printf("Cascaded removal test...");
+	fflush(stdout);
+	memset(items, 0, sizeof(items));
+	for(i = 0; i < 4; i++) {
+		if(self_test_schedule(self, &items[i], (1<<24) + 1000))
+			return -1;
+	}
+	// Close enough that both have trickled down from the top level.
+	while(gSelfTestNow < items[0].fire_date - 10) {
+		gSelfTestNow += MIN(smcp_get_timeout(self), (cms_t)(items[0].fire_date - 10 - gSelfTestNow));
+		if(self_test_handle(self, items, 4))
+			return -1;
+	}
+	if(self_test_remove(self, &items[1]) || self_test_remove(self, &items[2]))
+		return -1;
+	if(self_test_run(self, items, 4, NULL))
+		return -1;
+	if((items[0].fired != 1) || items[1].fired || items[2].fired || (items[3].fired != 1)) {
+		printf("Removed timers fired, or the rest didn't!\n");
+		return -1;
+	}
+	printf("OK\n");
+
+	printf("Budget test...");
+	fflush(stdout);
+	memset(items, 0, sizeof(items));
+	for(i = 0; i < 3*SMCP_CONF_TIMER_BUDGET + 5; i++) {
+		if(self_test_schedule(self, &items[i], 10))
+			return -1;
+	}
+	gSelfTestNow += 10;
+	for(i = 0; i < 4; i++) {
+		int fired = 0;
+		int n;
+
+		smcp_handle_timers(self);
+
+		for(n = 0; n < 3*SMCP_CONF_TIMER_BUDGET + 5; n++)
+			fired += items[n].fired;
+
+		if(fired != MIN((i + 1)*SMCP_CONF_TIMER_BUDGET, 3*SMCP_CONF_TIMER_BUDGET + 5)) {
+			printf("%d timers fired after %d passes!\n", fired, i + 1);
+			return -1;
+		}
+
+		if((i < 3) && (smcp_get_timeout(self) != 0)) {
+			printf("Timeout isn't zero with timers still due!\n");
+			return -1;
+		}
+	}
+	if(smcp_get_any_timer(self)) {
+		printf("Timers left over!\n");
+		return -1;
+	}
+	printf("OK\n");
+
+	printf("Random test...");
+	fflush(stdout);
+	memset(items, 0, sizeof(items));
+	for(i = 0; i < SELF_TEST_ITEMS; i++) {
+		lcg = lcg * 1664525 + 1013904223;
+		// Spread over every level of the wheel, and past its end.
+		if(self_test_schedule(self, &items[i], (lcg >> 8) % (1<<(6*(1+i%5)))))
+			return -1;
+	}
+	if(self_test_run(self, items, SELF_TEST_ITEMS, &lcg))
+		return -1;
+	printf("OK\n");
+
+	return gSelfTestFailures ? -1 : 0;
+}
+
+#endif
@@ -44,6 +44,10 @@
 #define smcp_invalidate_timer(self,...)		smcp_invalidate_timer(__VA_ARGS__)
 #define smcp_handle_timers(self,...)		smcp_handle_timers(__VA_ARGS__)
 #define smcp_timer_is_scheduled(self,...)		smcp_timer_is_scheduled(__VA_ARGS__)
+#define smcp_set_clock(self,...)		smcp_set_clock(__VA_ARGS__)
+#define smcp_get_time(self)		smcp_get_time()
+#define smcp_timestamp_from_cms(self,...)		smcp_timestamp_from_cms(__VA_ARGS__)
+#define smcp_timestamp_to_cms(self,...)		smcp_timestamp_to_cms(__VA_ARGS__)
 #endif
 
 __BEGIN_DECLS
@@ -55,14 +59,25 @@ __BEGIN_DECLS
 **	@{
 */
 
+//!	Milliseconds on a monotonic clock. The epoch is arbitrary.
+typedef int64_t smcp_timestamp_t;
+
+//!	Clock callback for smcp_set_clock().
+/*!	Must return the current time in milliseconds. The values
+**	must never decrease and must never be negative. */
+typedef smcp_timestamp_t (*smcp_clock_func_t)(void* context);
+
 typedef void (*smcp_timer_callback_t)(smcp_t, void*);
 
 typedef struct smcp_timer_s {
 	struct ll_item_s		ll;
-	struct timeval			fire_date;
+	smcp_timestamp_t		fire_date;
 	void*					context;
 	smcp_timer_callback_t	callback;
 	smcp_timer_callback_t	cancel;
+#if SMCP_CONF_TIMER_WHEEL
+	struct smcp_timer_s**	list;		//!< List we are on, if scheduled.
+#endif
 } *smcp_timer_t;
 
 extern smcp_timer_t smcp_timer_init(
@@ -83,7 +98,41 @@ extern cms_t smcp_get_timeout(smcp_t self);
 extern void smcp_handle_timers(smcp_t self);
 extern bool smcp_timer_is_scheduled(smcp_t self, smcp_timer_t timer);
 
-//!< Converts `cms` into an absolute time.
+/*!	@defgroup smcp_time Time
+**	@{
+**	All of the timer and expiration math in SMCP is done on a
+**	monotonic millisecond clock, so it isn't affected by changes
+**	to the wall clock. While smcp_process() is running, the time
+**	is sampled only once (after waiting for packets) and the
+**	cached value is used for everything else.
+*/
+
+//!	Replaces the clock used by this instance.
+/*!	Useful for benchmarks and simulations that want to run on
+**	virtual time. Should be called before anything is scheduled.
+**	Passing NULL restores the default monotonic clock.
+*/
+extern void smcp_set_clock(
+	smcp_t self,
+	smcp_clock_func_t func,
+	void* context
+);
+
+//!	Returns the current time according to this instance.
+extern smcp_timestamp_t smcp_get_time(smcp_t self);
+
+//!	Returns the absolute time `cms` milliseconds from now.
+extern smcp_timestamp_t smcp_timestamp_from_cms(smcp_t self, cms_t cms);
+
+//!	Returns the number of milliseconds until `timestamp`, or zero if it has passed.
+extern cms_t smcp_timestamp_to_cms(smcp_t self, smcp_timestamp_t timestamp);
+
+//!	The default clock. Uses `CLOCK_MONOTONIC` where available.
+extern smcp_timestamp_t smcp_get_monotonic_time(void);
+
+/*!	@} */
+
+//!< Converts `cms` into an absolute wall-clock time.
 extern void convert_cms_to_timeval(
 	struct timeval* tv, //!< [OUT] Pointer to timeval struct.
 	cms_t cms //!< [IN] Time from now, in milliseconds
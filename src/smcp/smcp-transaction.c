@@ -27,6 +27,10 @@
 **	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include <stdio.h>
 #include "smcp.h"
 #include "smcp-internal.h"
@@ -37,6 +41,30 @@
 static struct smcp_transaction_s smcp_transaction_pool[SMCP_CONF_MAX_TRANSACTIONS];
 #endif // SMCP_AVOID_MALLOC
 
+#if SMCP_TRANSACTIONS_USE_HASH
+// Message ids and tokens both come from smcp_get_next_msg_id(), whose
+// low bits cycle through every value, so they make fine hashes as-is.
+
+static bool
+smcp_transaction_index_(smcp_t self, smcp_transaction_t handler) {
+	if(!ht_insert(&self->transactions_by_msg_id, handler->msg_id, handler))
+		return false;
+
+	if(!ht_insert(&self->transactions_by_token, handler->token, handler)) {
+		ht_remove(&self->transactions_by_msg_id, handler->msg_id, handler);
+		return false;
+	}
+
+	return true;
+}
+
+static void
+smcp_transaction_unindex_(smcp_t self, smcp_transaction_t handler) {
+	ht_remove(&self->transactions_by_msg_id, handler->msg_id, handler);
+	ht_remove(&self->transactions_by_token, handler->token, handler);
+}
+#endif
+
 #if SMCP_TRANSACTIONS_USE_BTREE
 static bt_compare_result_t
 smcp_transaction_compare(
@@ -71,7 +99,15 @@ smcp_transaction_t
 smcp_transaction_find_via_msg_id(smcp_t self, coap_msg_id_t msg_id) {
 	SMCP_EMBEDDED_SELF_HOOK;
 
-#if SMCP_TRANSACTIONS_USE_BTREE
+#if SMCP_TRANSACTIONS_USE_HASH
+	return (smcp_transaction_t)ht_find(
+		&self->transactions_by_msg_id,
+		msg_id,
+		NULL,
+		NULL,
+		NULL
+	);
+#elif SMCP_TRANSACTIONS_USE_BTREE
 	return (smcp_transaction_t)bt_find(
 		(void*)&self->transactions,
 		(void*)(uintptr_t)msg_id,
@@ -91,11 +127,20 @@ smcp_transaction_t
 smcp_transaction_find_via_token(smcp_t self, coap_msg_id_t token) {
 	SMCP_EMBEDDED_SELF_HOOK;
 
+#if SMCP_TRANSACTIONS_USE_HASH
+	smcp_transaction_t ret = (smcp_transaction_t)ht_find(
+		&self->transactions_by_token,
+		token,
+		NULL,
+		NULL,
+		NULL
+	);
+#elif SMCP_TRANSACTIONS_USE_BTREE
 	// Ouch. Linear search.
-#if SMCP_TRANSACTIONS_USE_BTREE
 	smcp_transaction_t ret = bt_first(self->transactions);
 	while(ret && (ret->token != token)) ret = bt_next(ret);
 #else
+	// Ouch. Linear search.
 	smcp_transaction_t ret = self->transactions;
 	while(ret && (ret->token != token)) ret = ll_next((void*)ret);
 #endif
@@ -122,6 +167,10 @@ smcp_internal_delete_transaction_(
 	// Remove the timer associated with this handler.
 	smcp_invalidate_timer(self, &handler->timer);
 
+#if SMCP_CONF_PEER_TABLE
+	smcp_peer_release_(self, handler);
+#endif
+
 	handler->active = 0;
 
 	// Fire the callback to signal that this handler is now invalidated.
@@ -142,9 +191,17 @@ smcp_internal_delete_transaction_(
 }
 
 static cms_t
-calc_retransmit_timeout(int retries) {
+calc_retransmit_timeout(smcp_t self, smcp_transaction_t handler, int retries) {
 	cms_t ret = COAP_ACK_TIMEOUT * MSEC_PER_SEC;
 
+#if SMCP_CONF_PEER_TABLE
+	if(handler->peer) {
+		ret = smcp_peer_retransmit_timeout_(self, handler->peer, retries);
+		DEBUG_PRINTF("Will try attempt #%d in %dms",retries,ret);
+		return ret;
+	}
+#endif
+
 	ret <<= retries;
 
 	ret *= 512 + (SMCP_FUNC_RANDOM_UINT32() % (int)(512*(COAP_ACK_RANDOM_FACTOR-1.0f)));
@@ -167,7 +224,9 @@ smcp_transaction_new_msg_id(
 	SMCP_EMBEDDED_SELF_HOOK;
 	require(handler->active,bail);
 
-#if SMCP_TRANSACTIONS_USE_BTREE
+#if SMCP_TRANSACTIONS_USE_HASH
+	ht_remove(&self->transactions_by_msg_id, handler->msg_id, handler);
+#elif SMCP_TRANSACTIONS_USE_BTREE
 	bt_remove(
 		(void**)&self->transactions,
 		handler,
@@ -181,7 +240,13 @@ smcp_transaction_new_msg_id(
 
 	handler->msg_id = msg_id;
 
-#if SMCP_TRANSACTIONS_USE_BTREE
+#if SMCP_TRANSACTIONS_USE_HASH
+	if(!ht_insert(&self->transactions_by_msg_id, handler->msg_id, handler)) {
+		// The index couldn't grow. Leave the transaction findable by
+		// token, so that it can at least still receive separate responses.
+		assert_printf("Unable to index transaction %p", handler);
+	}
+#elif SMCP_TRANSACTIONS_USE_BTREE
 	bt_insert(
 		(void**)&self->transactions,
 		handler,
@@ -195,6 +260,295 @@ bail:
 	return;
 }
 
+#if SMCP_CONF_TRANS_ENABLE_BLOCK1
+#define BLOCK1_SIZE_(handler)	((size_t)1 << ((handler)->block1_szx + 4))
+
+static smcp_status_t
+smcp_transaction_block1_read_buffer_(
+	void* context,
+	size_t offset,
+	char* buffer,
+	size_t len
+) {
+	memcpy(buffer, (const char*)context + offset, len);
+	return SMCP_STATUS_OK;
+}
+
+void
+smcp_transaction_set_block1_buffer(
+	smcp_transaction_t transaction,
+	const char* body,
+	size_t len
+) {
+	smcp_transaction_set_block1_reader(
+		transaction,
+		&smcp_transaction_block1_read_buffer_,
+		(void*)body,
+		len
+	);
+}
+
+void
+smcp_transaction_set_block1_reader(
+	smcp_transaction_t transaction,
+	smcp_block1_read_func reader,
+	void* context,
+	size_t len
+) {
+	transaction->block1_reader = reader;
+	transaction->block1_context = context;
+	transaction->block1_len = len;
+}
+
+bool
+smcp_transaction_block1_option_(smcp_transaction_t handler, uint32_t* block1) {
+	const size_t block_size = BLOCK1_SIZE_(handler);
+
+	if(!handler->block1_offset && (handler->block1_len <= block_size))
+		return false;
+
+	*block1 = (uint32_t)((handler->block1_offset / block_size) << 4) | handler->block1_szx;
+
+	if(handler->block1_offset + block_size < handler->block1_len)
+		*block1 |= (1<<3);
+
+	return true;
+}
+
+smcp_status_t
+smcp_transaction_block1_append_(smcp_transaction_t handler) {
+	smcp_status_t ret;
+	const size_t len = MIN(handler->block1_len - handler->block1_offset, BLOCK1_SIZE_(handler));
+	size_t max_len = 0;
+	char* content = smcp_outbound_get_content_ptr(&max_len);
+
+	require_action(content && (len <= max_len), bail, ret = SMCP_STATUS_MESSAGE_TOO_BIG);
+
+	ret = (*handler->block1_reader)(handler->block1_context, handler->block1_offset, content, len);
+	require_noerr(ret, bail);
+
+	ret = smcp_outbound_set_content_len(len);
+
+bail:
+	return ret;
+}
+
+//!	Looks at the response to one block of the request body.
+/*!	Sets `statuscode` to zero when another block should be sent
+**	instead of calling the response handler. */
+static void
+smcp_transaction_block1_receive_(
+	smcp_t self,
+	smcp_transaction_t handler,
+	int* statuscode
+) {
+	const uint8_t* value = NULL;
+	size_t value_len = 0;
+	uint8_t szx = handler->block1_szx;
+
+	// Servers can ask for smaller blocks in any response.
+	if(smcp_inbound_find_option(COAP_OPTION_BLOCK1, &value, &value_len)) {
+		const uint8_t server_szx = coap_decode_uint32(value, (uint8_t)value_len) & 0x7;
+		if(server_szx != 7)
+			szx = MIN(szx, server_szx);
+	}
+
+	if(*statuscode == COAP_RESULT_231_CONTINUE) {
+		const size_t next_offset = handler->block1_offset + BLOCK1_SIZE_(handler);
+
+		if(next_offset < handler->block1_len) {
+			// A smaller block size still divides the offset evenly.
+			handler->block1_offset = next_offset;
+			handler->block1_szx = szx;
+			*statuscode = 0;
+		}
+	} else if(*statuscode == COAP_RESULT_413_REQUEST_ENTITY_TOO_LARGE) {
+		if(smcp_inbound_find_option(COAP_OPTION_SIZE1, &value, &value_len)) {
+			const uint32_t size_hint = coap_decode_uint32(value, (uint8_t)value_len);
+
+			while(szx && (((uint32_t)1 << (szx + 4)) > size_hint))
+				szx--;
+		}
+
+		// Start over with smaller blocks, if that could help.
+		if(szx < handler->block1_szx) {
+			handler->block1_offset = 0;
+			handler->block1_szx = szx;
+			*statuscode = 0;
+		}
+	}
+}
+#endif // SMCP_CONF_TRANS_ENABLE_BLOCK1
+
+#if SMCP_CONF_TRANS_ENABLE_BLOCK2
+#define BLOCK2_SIZE_(block2)	((uint32_t)1 << (((block2) & 0x7) + 4))
+#define BLOCK2_OFFSET_(block2)	(((block2) >> 4) * BLOCK2_SIZE_(block2))
+
+static void
+smcp_transaction_block2_reset_(smcp_transaction_t handler) {
+	handler->next_block2 = 0;
+	handler->block2_offset = 0;
+	handler->block2_requested_end = 0;
+	handler->block2_total = 0;
+	handler->block2_etag_len = 0;
+}
+
+//!	True if the block we are about to ask for was already asked for by the window.
+static bool
+smcp_transaction_block2_in_flight_(smcp_transaction_t handler) {
+	return (handler->flags & SMCP_TRANSACTION_BLOCK2_AUTO)
+		&& handler->next_block2
+		&& !handler->attemptCount
+		&& (BLOCK2_OFFSET_(handler->next_block2) < handler->block2_requested_end);
+}
+
+//!	Asks for the blocks following `next_block2`, as far as the window allows.
+/*!	These extra requests are never retransmitted. If one of them is
+**	lost, its block is asked for again once it becomes the next one. */
+static void
+smcp_transaction_block2_fill_window_(smcp_t self, smcp_transaction_t handler) {
+	const uint32_t next_block2 = handler->next_block2;
+	uint32_t block2;
+	uint8_t i;
+
+	if(!(handler->flags & SMCP_TRANSACTION_BLOCK2_AUTO) || !next_block2)
+		return;
+
+	handler->block2_requested_end = MAX(
+		handler->block2_requested_end,
+		BLOCK2_OFFSET_(next_block2) + BLOCK2_SIZE_(next_block2)
+	);
+
+	for(i = 1; i < handler->block2_window; i++) {
+		block2 = next_block2 + ((uint32_t)i << 4);
+
+		if(handler->block2_total && (BLOCK2_OFFSET_(block2) >= handler->block2_total))
+			break;
+
+		if(BLOCK2_OFFSET_(block2) < handler->block2_requested_end)
+			continue;
+
+		handler->next_block2 = block2;
+		self->outbound.next_tid = smcp_get_next_msg_id(self);
+		self->is_processing_message = false;
+		self->is_responding = false;
+		self->did_respond = false;
+
+		if(handler->resendCallback(handler->context) != SMCP_STATUS_OK)
+			break;
+
+		handler->block2_requested_end = BLOCK2_OFFSET_(block2) + BLOCK2_SIZE_(block2);
+	}
+
+	handler->next_block2 = next_block2;
+}
+
+//!	Checks an inbound response against the transfer so far.
+/*!	Returns SMCP_STATUS_DUPE for responses that should be ignored,
+**	like a block from the window that got ahead of the one we are
+**	waiting for. Otherwise `statuscode` is updated with what the
+**	response handler should be told, which is zero if it doesn't
+**	need to be called for this block. */
+static smcp_status_t
+smcp_transaction_block2_receive_(
+	smcp_t self,
+	smcp_transaction_t handler,
+	int* statuscode,
+	bool* more_blocks
+) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+	const uint32_t block2 = self->inbound.block2_value;
+	const uint8_t* value = NULL;
+	size_t value_len = 0;
+
+	*more_blocks = false;
+
+	if(!self->inbound.has_block2_option) {
+		// Either the whole representation or an error. Of the
+		// piggy-backed responses, only the one to the request we
+		// keep retransmitting is interesting.
+		if(	(self->inbound.packet->tt == COAP_TRANS_TYPE_ACK)
+			&& (smcp_inbound_get_msg_id() != handler->msg_id)
+		) {
+			ret = SMCP_STATUS_DUPE;
+		}
+		goto bail;
+	}
+
+	if(BLOCK2_OFFSET_(block2) != handler->block2_offset) {
+		ret = SMCP_STATUS_DUPE;
+		goto bail;
+	}
+
+	smcp_inbound_find_option(COAP_OPTION_ETAG, &value, &value_len);
+	value_len = MIN(value_len, sizeof(handler->block2_etag));
+
+	if(!handler->block2_offset) {
+		memcpy(handler->block2_etag, value, value_len);
+		handler->block2_etag_len = (uint8_t)value_len;
+	} else if(	(value_len != handler->block2_etag_len)
+		|| (0 != memcmp(handler->block2_etag, value, value_len))
+	) {
+		// The representation changed in the middle of the
+		// transfer, so what we have so far is useless.
+		smcp_transaction_block2_reset_(handler);
+		*statuscode = SMCP_STATUS_ETAG_MISMATCH;
+		*more_blocks = true;
+		goto bail;
+	}
+
+	if(smcp_inbound_find_option(COAP_OPTION_SIZE, &value, &value_len))
+		handler->block2_total = coap_decode_uint32(value, (uint8_t)value_len);
+
+	if(handler->block2_buffer) {
+		if(handler->block2_offset + self->inbound.content_len > handler->block2_buffer_size) {
+			*statuscode = SMCP_STATUS_MESSAGE_TOO_BIG;
+			goto bail;
+		}
+		memcpy(
+			handler->block2_buffer + handler->block2_offset,
+			self->inbound.content_ptr,
+			self->inbound.content_len
+		);
+	}
+
+	handler->block2_offset += self->inbound.content_len;
+
+	if(block2 & (1<<3)) {
+		*more_blocks = true;
+		handler->next_block2 = block2 + (1<<4);
+
+		// Nothing to hand over until we have all of it.
+		if(handler->block2_buffer)
+			*statuscode = 0;
+	} else if(handler->block2_buffer) {
+		self->inbound.content_ptr = handler->block2_buffer;
+		self->inbound.content_len = handler->block2_offset;
+	}
+
+bail:
+	return ret;
+}
+
+void
+smcp_transaction_set_block2_buffer(
+	smcp_transaction_t transaction,
+	char* buffer,
+	size_t size
+) {
+	transaction->block2_buffer = buffer;
+	transaction->block2_buffer_size = size;
+}
+
+void
+smcp_transaction_set_block2_window(
+	smcp_transaction_t transaction,
+	uint8_t window
+) {
+	transaction->block2_window = window ? window : 1;
+}
+#endif // SMCP_CONF_TRANS_ENABLE_BLOCK2
+
 static void
 smcp_internal_transaction_timeout_(
 	smcp_t			self,
@@ -202,7 +556,7 @@ smcp_internal_transaction_timeout_(
 ) {
 	smcp_status_t status = SMCP_STATUS_TIMEOUT;
 	void* context = handler->context;
-	cms_t cms = convert_timeval_to_cms(&handler->expiration);
+	cms_t cms = smcp_timestamp_to_cms(self, handler->expiration);
 
 	self->current_transaction = handler;
 	if((cms > 0) || !handler->has_fired) {
@@ -226,14 +580,39 @@ smcp_internal_transaction_timeout_(
 			self->is_responding = false;
 			self->did_respond = false;
 
+#if SMCP_CONF_PEER_TABLE
+			if(!handler->attemptCount)
+				handler->sent_time = smcp_get_time(self);
+#endif
+
+#if SMCP_CONF_TRANS_ENABLE_BLOCK2
+			if(smcp_transaction_block2_in_flight_(handler))
+				status = SMCP_STATUS_OK;
+			else
+#endif
 			status = handler->resendCallback(context);
 
+			handler->waiting_for_dns = (status == SMCP_STATUS_WAIT_FOR_DNS);
+
 			if(status == SMCP_STATUS_OK) {
 				handler->has_fired = true;
-				cms = MIN(cms,calc_retransmit_timeout(handler->attemptCount++));
+				cms = MIN(cms,calc_retransmit_timeout(self, handler, handler->attemptCount++));
+#if SMCP_CONF_TRANS_ENABLE_BLOCK2
+				smcp_transaction_block2_fill_window_(self, handler);
+#endif
 			} else if(status == SMCP_STATUS_WAIT_FOR_DNS) {
+				// Tickled by smcp_transaction_dns_ready_() when the
+				// answer comes in, if the resolver can tell us.
 				cms = 100;
 				status = SMCP_STATUS_OK;
+			} else if(status == SMCP_STATUS_WAIT_FOR_PEER) {
+				// We are queued on the peer and will be tickled when
+				// it has a slot for us. Until then the timer only
+				// watches for the expiration.
+				if(cms > 0)
+					status = SMCP_STATUS_OK;
+				else
+					status = SMCP_STATUS_TIMEOUT;
 			}
 		} else {
 			handler->has_fired = true;
@@ -256,10 +635,10 @@ smcp_internal_transaction_timeout_(
 		handler->last_observe = 0;
 #endif
 #if SMCP_CONF_TRANS_ENABLE_BLOCK2
-		handler->next_block2 = 0;
+		smcp_transaction_block2_reset_(handler);
 #endif
 		smcp_transaction_new_msg_id(self,handler,smcp_get_next_msg_id(self));
-		convert_cms_to_timeval(&handler->expiration, SMCP_OBSERVATION_DEFAULT_MAX_AGE);
+		handler->expiration = smcp_timestamp_from_cms(self, SMCP_OBSERVATION_DEFAULT_MAX_AGE);
 
 		if(handler->resendCallback) {
 			// In this case we will be reattempting for a given duration.
@@ -340,6 +719,9 @@ smcp_transaction_init(
 	handler->callback = callback;
 	handler->context = context;
 	handler->flags = flags;
+#if SMCP_CONF_TRANS_ENABLE_BLOCK2
+	handler->block2_window = SMCP_CONF_TRANS_BLOCK2_WINDOW;
+#endif
 
 bail:
 	return handler;
@@ -359,6 +741,25 @@ smcp_transaction_tickle(
 	return 0;
 }
 
+#if SMCP_CONF_ASYNC_DNS
+void
+smcp_transaction_dns_ready_(smcp_t self) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	smcp_transaction_t iter;
+
+#if SMCP_TRANSACTIONS_USE_BTREE
+	for(iter = bt_first(self->transactions); iter; iter = bt_next(iter)) {
+#else
+	for(iter = self->transactions; iter; iter = ll_next((void*)iter)) {
+#endif
+		if(iter->waiting_for_dns) {
+			iter->waiting_for_dns = false;
+			smcp_transaction_tickle(self, iter);
+		}
+	}
+}
+#endif
+
 smcp_status_t
 smcp_transaction_begin(
 	smcp_t self,
@@ -366,12 +767,27 @@ smcp_transaction_begin(
 	cms_t expiration
 ) {
 	SMCP_EMBEDDED_SELF_HOOK;
+	smcp_status_t ret = SMCP_STATUS_OK;
 
 	require(handler!=NULL, bail);
 
 	DEBUG_PRINTF("smcp_transaction_begin: %p",handler);
 
-#if SMCP_TRANSACTIONS_USE_BTREE
+	// Restarting an active transaction, so its timer may still be pending.
+	if(handler->active && smcp_timer_is_scheduled(self, &handler->timer))
+		smcp_invalidate_timer(self, &handler->timer);
+
+#if SMCP_CONF_PEER_TABLE
+	if(handler->active)
+		smcp_peer_release_(self, handler);
+#endif
+
+#if SMCP_TRANSACTIONS_USE_HASH
+	if(handler->active) {
+		ll_remove((void**)&self->transactions,(void*)handler);
+		smcp_transaction_unindex_(self, handler);
+	}
+#elif SMCP_TRANSACTIONS_USE_BTREE
 	bt_remove(
 		(void**)&self->transactions,
 		(void*)handler,
@@ -393,12 +809,16 @@ smcp_transaction_begin(
 #if SMCP_CONF_TRANS_ENABLE_OBSERVING
 	handler->last_observe = 0;
 #endif
+#if SMCP_CONF_TRANS_ENABLE_BLOCK1
+	handler->block1_offset = 0;
+	handler->block1_szx = smcp_max_block_szx_();
+#endif
 #if SMCP_CONF_TRANS_ENABLE_BLOCK2
-	handler->next_block2 = 0;
+	smcp_transaction_block2_reset_(handler);
 #endif
 	handler->active = 1;
 	handler->has_fired = false;
-	convert_cms_to_timeval(&handler->expiration, expiration);
+	handler->expiration = smcp_timestamp_from_cms(self, expiration);
 
 	if(handler->resendCallback) {
 		// In this case we will be reattempting for a given duration.
@@ -428,7 +848,19 @@ smcp_transaction_begin(
 		expiration
 	);
 
-#if SMCP_TRANSACTIONS_USE_BTREE
+#if SMCP_TRANSACTIONS_USE_HASH
+	if(!smcp_transaction_index_(self, handler)) {
+		// Without an index entry no response could ever find
+		// this transaction, so don't pretend it started.
+		smcp_invalidate_timer(self, &handler->timer);
+		handler->active = 0;
+		ret = SMCP_STATUS_MALLOC_FAILURE;
+		goto bail;
+	}
+	ll_prepend((void**)&self->transactions,(void*)handler);
+	DEBUG_PRINTF(CSTR("%p: Total Pending Transactions: %d"), self,
+		(int)ht_count(&self->transactions_by_msg_id));
+#elif SMCP_TRANSACTIONS_USE_BTREE
 	bt_insert(
 		(void**)&self->transactions,
 		handler,
@@ -446,7 +878,7 @@ smcp_transaction_begin(
 
 
 bail:
-	return 0;
+	return ret;
 }
 
 smcp_status_t
@@ -468,7 +900,11 @@ smcp_transaction_end(
 
 	if(transaction->active) {
 		transaction->active = 0; // Maybe we should remove this line? May be hiding bad behavior.
-#if SMCP_TRANSACTIONS_USE_BTREE
+#if SMCP_TRANSACTIONS_USE_HASH
+		ll_remove((void**)&self->transactions,(void*)transaction);
+		smcp_transaction_unindex_(self, transaction);
+		smcp_internal_delete_transaction_(transaction,self);
+#elif SMCP_TRANSACTIONS_USE_BTREE
 		bt_remove(
 			(void**)&self->transactions,
 			(void*)transaction,
@@ -497,7 +933,10 @@ smcp_handle_response() {
 		self,
 		smcp_inbound_get_msg_id()
 	);
-#if SMCP_TRANSACTIONS_USE_BTREE
+#if SMCP_TRANSACTIONS_USE_HASH
+	DEBUG_PRINTF("%p: Total Pending Transactions: %d", self,
+		(int)ht_count(&self->transactions_by_msg_id));
+#elif SMCP_TRANSACTIONS_USE_BTREE
 	DEBUG_PRINTF("%p: Total Pending Transactions: %d", self,
 		(int)bt_count((void**)&self->transactions));
 #else
@@ -516,6 +955,18 @@ smcp_handle_response() {
 			handler = smcp_transaction_find_via_msg_id(self,msg_id);
 			if(handler && smcp_inbound_get_packet()->code && token!=handler->token)
 				handler = NULL;
+#if SMCP_CONF_TRANS_ENABLE_BLOCK2
+			if(	!handler
+				&& smcp_inbound_get_packet()->code
+				&& (self->inbound.packet->token_len == sizeof(coap_msg_id_t))
+			) {
+				// Could be the answer to one of the extra
+				// requests sent to fill a Block2 window.
+				handler = smcp_transaction_find_via_token(self,token);
+				if(handler && !(handler->flags&SMCP_TRANSACTION_BLOCK2_AUTO))
+					handler = NULL;
+			}
+#endif
 		}
 	}
 
@@ -523,6 +974,11 @@ smcp_handle_response() {
 		// TODO: Verify source address and port!
 	}
 
+#if SMCP_CONF_PEER_TABLE
+	if(handler)
+		smcp_peer_handle_response_(self, handler);
+#endif
+
 	self->current_transaction = handler;
 
 	if(!handler) {
@@ -601,7 +1057,7 @@ smcp_handle_response() {
 					cms = SMCP_OBSERVATION_DEFAULT_MAX_AGE;
 			}
 
-			convert_cms_to_timeval(&handler->expiration, cms);
+			handler->expiration = smcp_timestamp_from_cms(self, cms);
 
 			if(	(handler->flags&SMCP_TRANSACTION_KEEPALIVE)
 				&& cms>SMCP_OBSERVATION_KEEPALIVE_INTERVAL
@@ -618,13 +1074,47 @@ smcp_handle_response() {
 #endif // #if SMCP_CONF_TRANS_ENABLE_OBSERVING
 		{
 			smcp_response_handler_func callback = handler->callback;
-			if(!(handler->flags&SMCP_TRANSACTION_ALWAYS_INVALIDATE) && !(handler->flags&SMCP_TRANSACTION_OBSERVE)) {
+			int statuscode = (self->inbound.packet->tt==COAP_TRANS_TYPE_RESET)?SMCP_STATUS_RESET:self->inbound.packet->code;
+			bool more_blocks = false;
+
+#if SMCP_CONF_TRANS_ENABLE_BLOCK1
+			if(handler->block1_reader && (statuscode >= 0)) {
+				smcp_transaction_block1_receive_(self, handler, &statuscode);
+				if(!statuscode) {
+					DEBUG_PRINTF("Inbound: Sending next block of the request body...");
+					handler->attemptCount = 0;
+					smcp_transaction_new_msg_id(self, handler, smcp_get_next_msg_id(self));
+					smcp_invalidate_timer(self, &handler->timer);
+					smcp_schedule_timer(
+						self,
+						&handler->timer,
+						0
+					);
+					goto bail;
+				}
+			}
+#endif
+
+#if SMCP_CONF_TRANS_ENABLE_BLOCK2
+			if((handler->flags&SMCP_TRANSACTION_BLOCK2_AUTO) && (statuscode >= 0)) {
+				ret = smcp_transaction_block2_receive_(self, handler, &statuscode, &more_blocks);
+				if(ret == SMCP_STATUS_DUPE) {
+					DEBUG_PRINTF("Inbound: Ignoring block we aren't waiting for.");
+					ret = SMCP_STATUS_OK;
+					goto bail;
+				}
+			} else {
+				more_blocks = (self->inbound.block2_value&(1<<3))
+					&& (handler->flags&SMCP_TRANSACTION_ALWAYS_INVALIDATE);
+			}
+#endif
+
+			if(!(handler->flags&SMCP_TRANSACTION_ALWAYS_INVALIDATE) && !(handler->flags&SMCP_TRANSACTION_OBSERVE) && !more_blocks) {
 				handler->callback = NULL;
 			}
-			ret = (*callback)(
-				(self->inbound.packet->tt==COAP_TRANS_TYPE_RESET)?SMCP_STATUS_RESET:self->inbound.packet->code,
-				handler->context
-			);
+
+			if(statuscode)
+				ret = (*callback)(statuscode, handler->context);
 
 			if(self->current_transaction != handler) {
 				handler = NULL;
@@ -635,9 +1125,10 @@ smcp_handle_response() {
 			handler->waiting_for_async_response = false;
 #if SMCP_CONF_TRANS_ENABLE_BLOCK2
 			if(handler->active && msg_id==handler->msg_id) {
-				if(!ret && (self->inbound.block2_value&(1<<3)) && (handler->flags&SMCP_TRANSACTION_ALWAYS_INVALIDATE)) {
+				if(!ret && more_blocks) {
 					DEBUG_PRINTF("Inbound: Preparing to request next block...");
-					handler->next_block2 = self->inbound.block2_value + (1<<4);
+					if(!(handler->flags&SMCP_TRANSACTION_BLOCK2_AUTO))
+						handler->next_block2 = self->inbound.block2_value + (1<<4);
 					smcp_transaction_new_msg_id(self, handler, smcp_get_next_msg_id(self));
 					smcp_invalidate_timer(self, &handler->timer);
 					smcp_schedule_timer(
@@ -652,7 +1143,7 @@ smcp_handle_response() {
 					handler = NULL;
 				} else {
 					cms_t cms = self->inbound.max_age*1000;
-					handler->next_block2 = 0;
+					smcp_transaction_block2_reset_(handler);
 
 					smcp_invalidate_timer(self, &handler->timer);
 
@@ -663,7 +1154,7 @@ smcp_handle_response() {
 							cms = SMCP_OBSERVATION_DEFAULT_MAX_AGE;
 					}
 
-					convert_cms_to_timeval(&handler->expiration, cms);
+					handler->expiration = smcp_timestamp_from_cms(self, cms);
 
 					if(	(handler->flags&SMCP_TRANSACTION_KEEPALIVE)
 						&& cms>SMCP_OBSERVATION_KEEPALIVE_INTERVAL
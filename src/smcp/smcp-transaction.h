@@ -68,6 +68,14 @@ typedef smcp_status_t (*smcp_response_handler_func)(
 	void* context
 );
 
+//!	Copies `len` bytes of a request body, starting at `offset`, into `buffer`.
+typedef smcp_status_t (*smcp_block1_read_func)(
+	void* context,
+	size_t offset,
+	char* buffer,
+	size_t len
+);
+
 struct smcp_transaction_s {
 #if SMCP_TRANSACTIONS_USE_BTREE
 	struct bt_item_s			bt_item;
@@ -84,7 +92,7 @@ struct smcp_transaction_s {
 	// not observable, the expiration is when the transaction should
 	// be "timed out". If it is observable, it is when the
 	// max-age expires and we need to restart observing.
-	struct timeval				expiration;
+	smcp_timestamp_t			expiration;
 	struct smcp_timer_s			timer;
 
 	coap_msg_id_t				token;
@@ -98,6 +106,30 @@ struct smcp_transaction_s {
 
 #if SMCP_CONF_TRANS_ENABLE_BLOCK2
 	uint32_t					next_block2;
+
+	// The rest are only used with SMCP_TRANSACTION_BLOCK2_AUTO.
+	uint32_t					block2_offset;
+	uint32_t					block2_requested_end;
+	uint32_t					block2_total;
+	char*						block2_buffer;
+	size_t						block2_buffer_size;
+	uint8_t						block2_window;
+	uint8_t						block2_etag_len;
+	uint8_t						block2_etag[8];	// The largest ETag CoAP allows
+#endif
+
+#if SMCP_CONF_TRANS_ENABLE_BLOCK1
+	smcp_block1_read_func		block1_reader;
+	void*						block1_context;
+	size_t						block1_len;
+	size_t						block1_offset;
+	uint8_t						block1_szx;
+#endif
+
+#if SMCP_CONF_PEER_TABLE
+	struct smcp_peer_s*			peer;
+	struct smcp_transaction_s*	peer_next;	// Queued for an NSTART slot
+	smcp_timestamp_t			sent_time;	// First transmission of `msg_id`
 #endif
 
 	coap_code_t					sent_code;
@@ -109,7 +141,10 @@ struct smcp_transaction_s {
 								active:1,
 								needs_to_close_observe:1,
 								multicast:1,
-								has_fired:1;
+								has_fired:1,
+								has_peer_slot:1,
+								is_queued_for_peer:1,
+								waiting_for_dns:1;
 };
 
 typedef struct smcp_transaction_s* smcp_transaction_t;
@@ -119,6 +154,7 @@ enum {
 	SMCP_TRANSACTION_OBSERVE = (1 << 1),
 	SMCP_TRANSACTION_KEEPALIVE = (1 << 2),		//!< Send keep-alive packets when observing
 	SMCP_TRANSACTION_NO_AUTO_END = (1 << 3),
+	SMCP_TRANSACTION_BLOCK2_AUTO = (1 << 4),	//!< Fetch every block of a Block2 response
 	SMCP_TRANSACTION_DELAY_START = (1 << 8),
 };
 
@@ -152,6 +188,66 @@ extern void smcp_transaction_new_msg_id(
 	coap_msg_id_t msg_id
 );
 
+#if SMCP_CONF_TRANS_ENABLE_BLOCK1
+//!	Sends `body` as the content of the request, in Block1 blocks if it doesn't fit in one.
+/*!	Every request the resend callback sends then carries the
+**	current block, added by smcp_outbound_send(). The resend
+**	callback must not add any content of its own.
+**
+**	Blocks are sent one at a time, each one retransmitted like any
+**	other request until the server answers it with 2.31 Continue.
+**	When the server answers with 4.13 and a Block1 option asking
+**	for smaller blocks, the upload starts over with that size. The
+**	response handler only sees the response to the last block, or
+**	the first error.
+**
+**	`body` must stay valid until the transaction is finished. Call
+**	this after smcp_transaction_init() and before
+**	smcp_transaction_begin(). */
+extern void smcp_transaction_set_block1_buffer(
+	smcp_transaction_t transaction,
+	const char* body,
+	size_t len
+);
+
+//!	Like smcp_transaction_set_block1_buffer(), but reads the body with `reader` as needed.
+/*!	`reader` may be asked for the same part of the body more than
+**	once, when a block has to be sent again. */
+extern void smcp_transaction_set_block1_reader(
+	smcp_transaction_t transaction,
+	smcp_block1_read_func reader,
+	void* context,
+	size_t len
+);
+#endif
+
+#if SMCP_CONF_TRANS_ENABLE_BLOCK2
+//!	Collects the blocks of a SMCP_TRANSACTION_BLOCK2_AUTO response into `buffer`.
+/*!	Without a buffer, the response handler is called once for every
+**	block as it arrives, in order. With one, it is called only once,
+**	after the last block, and smcp_inbound_get_content_ptr() returns
+**	the whole representation. If the representation is bigger than
+**	`size`, the handler gets SMCP_STATUS_MESSAGE_TOO_BIG instead.
+**
+**	Call this after smcp_transaction_init() and before
+**	smcp_transaction_begin(). */
+extern void smcp_transaction_set_block2_buffer(
+	smcp_transaction_t transaction,
+	char* buffer,
+	size_t size
+);
+
+//!	Sets how many block requests a SMCP_TRANSACTION_BLOCK2_AUTO transaction may have outstanding.
+/*!	The default is SMCP_CONF_TRANS_BLOCK2_WINDOW. Blocks are always
+**	handed over in order; a window larger than one just asks for the
+**	following blocks before the current one has arrived, which saves
+**	round trips on slow links. */
+extern void smcp_transaction_set_block2_window(
+	smcp_transaction_t transaction,
+	uint8_t window
+);
+#endif
+
 /*!	@} */
 /*!	@} */
 
@@ -48,6 +48,74 @@
 
 #define BAD_KEY_INDEX		(255)
 
+struct smcp_variable_node_list_s {
+	smcp_variable_node_t node;
+	bool needs_prefix;
+	const char* prefix_name;
+};
+
+//!	Writes out the link-format listing of every variable in the node.
+static smcp_status_t
+smcp_variable_node_list_generate_(smcp_large_content_t content, void* context) {
+	struct smcp_variable_node_list_s* const list = context;
+	smcp_variable_node_t const node = list->node;
+	smcp_status_t ret = SMCP_STATUS_OK;
+	SMCP_NON_RECURSIVE char buffer[SMCP_VARIABLE_MAX_VALUE_LENGTH+1];
+	SMCP_NON_RECURSIVE char encoded[3*SMCP_VARIABLE_MAX_VALUE_LENGTH+3];
+	uint8_t key_index;
+
+	for(key_index=0;key_index<BAD_KEY_INDEX;key_index++) {
+		if(node->func(node,SMCP_VAR_GET_KEY,key_index,buffer))
+			break;
+
+		ret = smcp_large_content_append(content, "<", 1);
+		require_noerr(ret,bail);
+
+		if(list->needs_prefix) {
+			url_encode_cstr(encoded, list->prefix_name, sizeof(encoded));
+			ret = smcp_large_content_append(content, encoded, SMCP_CSTR_LEN);
+			require_noerr(ret,bail);
+			ret = smcp_large_content_append(content, "/", 1);
+			require_noerr(ret,bail);
+		}
+
+		url_encode_cstr(encoded, buffer, sizeof(encoded));
+		ret = smcp_large_content_append(content, encoded, SMCP_CSTR_LEN);
+		require_noerr(ret,bail);
+
+		ret = smcp_large_content_append(content, ">", 1);
+		require_noerr(ret,bail);
+
+		if(0==node->func(node,SMCP_VAR_GET_VALUE,key_index,buffer)) {
+			quoted_cstr(encoded, buffer, sizeof(encoded));
+			ret = smcp_large_content_append(content, ";v=", 3);
+			require_noerr(ret,bail);
+			ret = smcp_large_content_append(content, encoded, SMCP_CSTR_LEN);
+			require_noerr(ret,bail);
+		}
+
+		if(0==node->func(node,SMCP_VAR_GET_LF_TITLE,key_index,buffer)) {
+			quoted_cstr(encoded, buffer, sizeof(encoded));
+			ret = smcp_large_content_append(content, ";title=", 7);
+			require_noerr(ret,bail);
+			ret = smcp_large_content_append(content, encoded, SMCP_CSTR_LEN);
+			require_noerr(ret,bail);
+		}
+
+		// Observation flag
+		if(0==node->func(node,SMCP_VAR_GET_OBSERVABLE,key_index,NULL)) {
+			ret = smcp_large_content_append(content, ";obs", 4);
+			require_noerr(ret,bail);
+		}
+
+		ret = smcp_large_content_append(content, ",", 1);
+		require_noerr(ret,bail);
+	}
+
+bail:
+	return ret;
+}
+
 smcp_status_t
 smcp_variable_node_request_handler(
 	smcp_variable_node_t		node
@@ -172,7 +240,7 @@ smcp_variable_node_request_handler(
 	} else if(method == COAP_METHOD_GET) {
 
 		if(key_index==BAD_KEY_INDEX) {
-			char* content_end_ptr;
+			struct smcp_variable_node_list_s list = { node, needs_prefix, prefix_name };
 
 			ret = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
 			require_noerr(ret,bail);
@@ -182,63 +250,7 @@ smcp_variable_node_request_handler(
 			ret = smcp_observable_update(&node->observable, SMCP_OBSERVABLE_BROADCAST_KEY);
 			check_string(ret==0,smcp_status_to_cstr(ret));
 
-			content_ptr = smcp_outbound_get_content_ptr(&content_len);
-			content_end_ptr = content_ptr+content_len;
-
-			for(key_index=0;key_index<BAD_KEY_INDEX;key_index++) {
-				ret = node->func(node,SMCP_VAR_GET_KEY,key_index,buffer);
-				if(ret) break;
-
-				if(content_ptr+2>=content_end_ptr) {
-					// No more room for content.
-					break;
-				}
-
-				*content_ptr++ = '<';
-				if(needs_prefix) {
-					content_ptr += url_encode_cstr(content_ptr, prefix_name, (content_end_ptr-content_ptr)-1);
-					content_ptr = stpncpy(content_ptr,"/",MIN(1,(content_end_ptr-content_ptr)-1));
-				}
-				content_ptr += url_encode_cstr(content_ptr, buffer, (content_end_ptr-content_ptr)-1);
-				*content_ptr++ = '>';
-
-				ret = node->func(node,SMCP_VAR_GET_VALUE,key_index,buffer);
-
-				if(content_ptr+4>=content_end_ptr) {
-					// No more room for content.
-					break;
-				}
-
-				if(!ret) {
-					strcpy(content_ptr,";v=");
-					content_ptr += 3;
-					content_ptr += quoted_cstr(content_ptr, buffer, (content_end_ptr-content_ptr)-1);
-				}
-
-				ret = node->func(node,SMCP_VAR_GET_LF_TITLE,key_index,buffer);
-
-				if(content_ptr+8>=content_end_ptr) {
-					// No more room for content.
-					break;
-				}
-
-				if(!ret) {
-					strcpy(content_ptr,";title=");
-					content_ptr += 7;
-					content_ptr += quoted_cstr(content_ptr, buffer, (content_end_ptr-content_ptr)-1);
-				}
-
-				// Observation flag
-				if(0==node->func(node,SMCP_VAR_GET_OBSERVABLE,key_index,NULL)) {
-					content_ptr = stpncpy(content_ptr,";obs",MIN(4,(content_end_ptr-content_ptr)-1));
-				}
-
-				*content_ptr++ = ',';
-			}
-			ret = smcp_outbound_set_content_len(content_len-(content_end_ptr-content_ptr));
-			require_noerr(ret,bail);
-
-			ret = smcp_outbound_send();
+			ret = smcp_outbound_send_large(&smcp_variable_node_list_generate_, &list);
 		} else {
 			size_t replyContentLength = 0;
 			char *replyContent;
@@ -266,9 +278,7 @@ smcp_variable_node_request_handler(
 				ret = node->func(node,SMCP_VAR_GET_VALUE,key_index,buffer);
 				require_noerr(ret,bail);
 
-				fasthash_start(0);
-				fasthash_feed((const uint8_t*)buffer,strlen(buffer));
-				etag = fasthash_finish_uint32();
+				etag = fasthash32(buffer, strlen(buffer), 0);
 
 				smcp_outbound_add_option_uint(COAP_OPTION_CONTENT_TYPE, SMCP_CONTENT_TYPE_APPLICATION_FORM_URLENCODED);
 
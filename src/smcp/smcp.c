@@ -40,6 +40,10 @@
 
 #define __APPLE_USE_RFC_3542 1
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1	// For recvmmsg()
+#endif
+
 #include "assert-macros.h"
 
 #if CONTIKI
@@ -89,7 +93,7 @@ extern uint16_t uip_slen;
 #if SMCP_EMBEDDED
 struct smcp_s smcp_global_instance;
 #else
-static smcp_t smcp_current_instance;
+static SMCP_THREAD_LOCAL smcp_t smcp_current_instance;
 void
 smcp_set_current_instance(smcp_t x) {
 	smcp_current_instance = (x);
@@ -106,13 +110,18 @@ smcp_get_current_instance() {
 #if !SMCP_EMBEDDED
 smcp_t
 smcp_create(uint16_t port) {
+	return smcp_create_with_flags(port, 0);
+}
+
+smcp_t
+smcp_create_with_flags(uint16_t port, int flags) {
 	smcp_t ret = NULL;
 
 	ret = (smcp_t)calloc(1, sizeof(struct smcp_s));
 
 	require(ret != NULL, bail);
 
-	ret = smcp_init(ret, port);
+	ret = smcp_init_with_flags(ret, port, flags);
 
 bail:
 	return ret;
@@ -122,6 +131,13 @@ bail:
 smcp_t
 smcp_init(
 	smcp_t self, uint16_t port
+) {
+	return smcp_init_with_flags(self, port, 0);
+}
+
+smcp_t
+smcp_init_with_flags(
+	smcp_t self, uint16_t port, int flags
 ) {
 	SMCP_EMBEDDED_SELF_HOOK;
 
@@ -149,6 +165,9 @@ smcp_init(
 
 	self->mcfd = -1;
 	self->fd = -1;
+#if SMCP_CONF_COMMAND_QUEUE
+	self->command_fd[0] = self->command_fd[1] = -1;
+#endif
 	errno = 0;
 
 	self->fd = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
@@ -163,10 +182,26 @@ smcp_init(
 		strerror(prev_errno)
 	);
 
+	if(flags & SMCP_INIT_FLAG_REUSE_PORT) {
+#ifdef SO_REUSEPORT
+		int value = 1;
+		require_action_string(
+			0 == setsockopt(self->fd, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value)),
+			bail,
+			{ smcp_release(self); self = NULL; },
+			"Unable to set SO_REUSEPORT"
+		);
+#else
+		require_action_string(false, bail,
+			{ smcp_release(self); self = NULL; }, "SO_REUSEPORT is not supported");
+#endif
+	}
+
 	// Keep attempting to bind until we find a port that works.
 	while(bind(self->fd, (struct sockaddr*)&saddr, sizeof(saddr)) != 0) {
-		// We should only continue trying if errno == EADDRINUSE.
-		require_action_string(errno == EADDRINUSE, bail,
+		// We should only continue trying if errno == EADDRINUSE,
+		// and only if we weren't asked to share a specific port.
+		require_action_string((errno == EADDRINUSE) && !(flags & SMCP_INIT_FLAG_REUSE_PORT), bail,
 			{ DEBUG_PRINTF(CSTR("errno=%d"), errno); smcp_release(
 				    self); self = NULL; }, "Failed to bind socket");
 		port++;
@@ -190,6 +225,7 @@ smcp_init(
 #endif
 
 #elif CONTIKI
+	(void)flags;
 	self->udp_conn = udp_new(NULL, 0, NULL);
 	uip_udp_bind(self->udp_conn, htons(port));
 	self->udp_conn->rport = 0;
@@ -243,6 +279,18 @@ smcp_init(
 	}
 #endif
 
+#if SMCP_CONF_COMMAND_QUEUE
+	require_action(
+		SMCP_STATUS_OK == smcp_command_queue_init_(self),
+		bail,
+		{ smcp_release(self); self = NULL; }
+	);
+#endif
+
+#if SMCP_CONF_PEER_TABLE
+	self->peer_nstart = SMCP_CONF_PEER_NSTART;
+#endif
+
 	self->is_processing_message = false;
 
 bail:
@@ -259,14 +307,51 @@ smcp_release(smcp_t self) {
 		smcp_transaction_end(self, self->transactions);
 	}
 
+#if SMCP_CONF_DYNAMIC_OBSERVERS
+	smcp_observers_clear(self);
+#endif
+
+#if SMCP_TRANSACTIONS_USE_HASH
+	ht_destroy(&self->transactions_by_msg_id);
+	ht_destroy(&self->transactions_by_token);
+#endif
+
+#if SMCP_CONF_RESPONSE_CACHE
+	smcp_response_cache_clear(self);
+#endif
+
+#if SMCP_CONF_LARGE_RESPONSES
+	smcp_large_response_clear(self);
+#endif
+
+#if SMCP_CONF_NOTIFICATION_CACHE
+	smcp_notification_cache_clear(self);
+#endif
+
+#if SMCP_CONF_BLOCK1_UPLOADS
+	smcp_block1_upload_clear(self);
+#endif
+
+#if SMCP_CONF_ASYNC_DNS
+	smcp_dns_release(self);
+#endif
+
+#if SMCP_CONF_COMMAND_QUEUE
+	smcp_command_queue_release_(self);
+#endif
+
 	// Delete all timers
-	while(self->timers) {
-		smcp_timer_t timer = self->timers;
-		if(timer->cancel)
-			timer->cancel(self, timer->context);
-		smcp_invalidate_timer(self, timer);
+	{
+		smcp_timer_t timer;
+		while((timer = smcp_get_any_timer(self))) {
+			if(timer->cancel)
+				timer->cancel(self, timer->context);
+			smcp_invalidate_timer(self, timer);
+		}
 	}
 
+	smcp_flush(self);
+
 #if SMCP_USE_BSD_SOCKETS
 	if(self->fd>=0)
 		close(self->fd);
@@ -336,16 +421,114 @@ smcp_set_default_request_handler(smcp_t self,smcp_request_handler_func request_h
 
 #pragma mark -
 
+const struct smcp_stats_s*
+smcp_get_stats(smcp_t self) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	return &self->stats;
+}
+
+void
+smcp_reset_stats(smcp_t self) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	memset(&self->stats, 0, sizeof(self->stats));
+}
+
+#if SMCP_USE_BSD_SOCKETS
+//!	Reads up to SMCP_CONF_RECV_BATCH_SIZE datagrams into `recv_buffer`.
+/*!	Returns the number of datagrams read, or -1 on error. */
+static int
+smcp_recv_batch_(smcp_t self) {
+	int count = 0;
+
+#if HAVE_RECVMMSG && (SMCP_CONF_RECV_BATCH_SIZE > 1)
+	struct mmsghdr msgs[SMCP_CONF_RECV_BATCH_SIZE];
+	struct iovec iov[SMCP_CONF_RECV_BATCH_SIZE];
+	int i;
+
+	memset(msgs, 0, sizeof(msgs));
+
+	for(i = 0; i < SMCP_CONF_RECV_BATCH_SIZE; i++) {
+		iov[i].iov_base = self->recv_buffer[i].packet;
+		iov[i].iov_len = SMCP_MAX_PACKET_LENGTH;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &self->recv_buffer[i].saddr;
+		msgs[i].msg_hdr.msg_namelen = sizeof(self->recv_buffer[i].saddr);
+	}
+
+	count = recvmmsg(self->fd, msgs, SMCP_CONF_RECV_BATCH_SIZE, MSG_DONTWAIT, NULL);
+
+	for(i = 0; i < count; i++) {
+		self->recv_buffer[i].packet_len = msgs[i].msg_len;
+		self->recv_buffer[i].socklen = msgs[i].msg_hdr.msg_namelen;
+	}
+#else
+	while(count < SMCP_CONF_RECV_BATCH_SIZE) {
+		ssize_t len;
+
+		self->recv_buffer[count].socklen = sizeof(self->recv_buffer[count].saddr);
+
+		len = recvfrom(
+			self->fd,
+			(void*)self->recv_buffer[count].packet,
+			SMCP_MAX_PACKET_LENGTH,
+			MSG_DONTWAIT,
+			(struct sockaddr*)&self->recv_buffer[count].saddr,
+			&self->recv_buffer[count].socklen
+		);
+
+		if(len < 0) {
+			if(count == 0)
+				count = -1;
+			break;
+		}
+
+		self->recv_buffer[count++].packet_len = len;
+	}
+#endif
+
+	if(count < 0) {
+		// Somebody else may have beaten us to the packet.
+		if((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+			errno = 0;
+			count = 0;
+		}
+		goto bail;
+	}
+
+	self->stats.recv_calls++;
+	self->stats.recv_packets += count;
+	self->stats.recv_batch_hist[count]++;
+	if(self->stats.recv_batch_max < (uint32_t)count)
+		self->stats.recv_batch_max = count;
+
+bail:
+	return count;
+}
+#endif
+
 smcp_status_t
 smcp_process(
 	smcp_t self, cms_t cms
 ) {
 	SMCP_EMBEDDED_SELF_HOOK;
 	smcp_status_t ret = 0;
+	smcp_status_t flush_status = SMCP_STATUS_OK;
 
 #if SMCP_USE_BSD_SOCKETS
 	int tmp;
-	struct pollfd pollee = { self->fd, POLLIN | POLLHUP, 0 };
+	struct pollfd pollee[] = {
+		{ self->fd, POLLIN | POLLHUP, 0 },
+#if SMCP_CONF_COMMAND_QUEUE
+		{ self->command_fd[0], POLLIN, 0 },
+#endif
+	};
+
+	smcp_refresh_time(self);
+
+	// Don't leave anything sitting in the outbound
+	// queue while we wait for packets.
+	flush_status = smcp_flush(self);
 
 	if(cms >= 0)
 		cms = MIN(cms, smcp_get_timeout(self));
@@ -354,7 +537,10 @@ smcp_process(
 
 	errno = 0;
 
-	tmp = poll(&pollee, 1, cms);
+	tmp = poll(pollee, sizeof(pollee)/sizeof(*pollee), cms);
+
+	// We may have been waiting for a while.
+	smcp_refresh_time(self);
 
 	// Ensure that poll did not fail with an error.
 	require_action_string(errno == 0,
@@ -363,44 +549,65 @@ smcp_process(
 		strerror(errno)
 	);
 
-	if(tmp > 0) {
-		char packet[SMCP_MAX_PACKET_LENGTH+1];
-		size_t packet_length = SMCP_MAX_PACKET_LENGTH;
-		struct sockaddr_in6 packet_saddr;
-		socklen_t packet_saddr_len = sizeof(packet_saddr);
+	if((tmp > 0) && pollee[0].revents) {
+		int i;
+		int count = smcp_recv_batch_(self);
 
-		packet_length = recvfrom(
-			self->fd,
-			(void*)packet,
-			packet_length,
-			0,
-			(struct sockaddr*)&packet_saddr,
-			&packet_saddr_len
-		);
+		require_action(count >= 0, bail, ret = SMCP_STATUS_ERRNO);
 
-		require_action(packet_length > 0, bail, ret = SMCP_STATUS_ERRNO);
+		// A bad packet shouldn't keep us from handling the rest
+		// of the batch, so we only remember the first error.
+		for(i = 0; i < count; i++) {
+			smcp_status_t status;
 
-		packet[packet_length] = 0;
+			status = smcp_inbound_start_packet(
+				self,
+				self->recv_buffer[i].packet,
+				self->recv_buffer[i].packet_len
+			);
 
-		ret = smcp_inbound_start_packet(self, packet, packet_length);
-		require(ret==SMCP_STATUS_OK,bail);
+			if(status == SMCP_STATUS_OK)
+				status = smcp_inbound_set_srcaddr(
+					(struct sockaddr*)&self->recv_buffer[i].saddr,
+					self->recv_buffer[i].socklen
+				);
 
-		ret = smcp_inbound_set_srcaddr((struct sockaddr*)&packet_saddr,packet_saddr_len);
-		require(ret==SMCP_STATUS_OK,bail);
+			// TODO: Call `smcp_inbound_set_destaddr()`, too!
 
-		// TODO: Call `smcp_inbound_set_destaddr()`, too!
+			if(status == SMCP_STATUS_OK)
+				status = smcp_inbound_finish_packet();
 
-		ret = smcp_inbound_finish_packet();
-		require(ret==SMCP_STATUS_OK,bail);
+			if(ret == SMCP_STATUS_OK)
+				ret = status;
+		}
+
+		require_noerr(ret, bail);
 	}
 #else
 	(void)cms;
+	smcp_refresh_time(self);
 #endif
 
 	smcp_set_current_instance(self);
+
+#if SMCP_CONF_COMMAND_QUEUE
+	smcp_run_commands_(self, (tmp > 0) && pollee[1].revents);
+#endif
+
 	smcp_handle_timers(self);
 
 bail:
+	if(flush_status == SMCP_STATUS_OK)
+		flush_status = smcp_flush(self);
+	else
+		smcp_flush(self);
+
+	// Queued packets were reported as sent, so this is the only
+	// place where their failures can show up.
+	if(ret == SMCP_STATUS_OK)
+		ret = flush_status;
+
+	smcp_forget_time(self);
 	smcp_set_current_instance(NULL);
 	self->is_responding = false;
 	return ret;
@@ -434,24 +641,17 @@ bail:
 smcp_status_t
 smcp_vhost_route(smcp_request_handler_func* func, void** context) {
 	smcp_t const self = smcp_get_current_instance();
-	coap_option_key_t key;
 
 	if(self->vhost_count) {
 		const uint8_t* value;
 		size_t value_len = 0;
 
-		smcp_inbound_reset_next_option();
-
-		while((key = smcp_inbound_next_option(&value,&value_len))!=COAP_OPTION_INVALID) {
-			if(key >= COAP_OPTION_URI_HOST)
-				break;
-		}
+		if(smcp_inbound_find_option(COAP_OPTION_URI_HOST, &value, &value_len)) {
+			int i;
 
-		if(value_len>(sizeof(self->vhost[0].name)-1))
-			return SMCP_STATUS_INVALID_ARGUMENT;
+			if(value_len>(sizeof(self->vhost[0].name)-1))
+				return SMCP_STATUS_INVALID_ARGUMENT;
 
-		if(key == COAP_OPTION_URI_HOST) {
-			int i;
 			for(i=0;i<self->vhost_count;i++) {
 				if(strncmp(self->vhost[i].name,(const char*)value,value_len) && self->vhost[i].name[value_len]==0) {
 					*func = self->vhost[i].func;
@@ -476,9 +676,14 @@ smcp_outbound_set_async_response(struct smcp_async_response_s* x) {
 	smcp_t const self = smcp_get_current_instance();
 	self->inbound.packet = &x->request.header;
 	self->inbound.packet_len = x->request_len;
-	self->inbound.content_ptr = (char*)x->request.header.token + x->request.header.token_len;
 	self->inbound.last_option_key = 0;
-	self->inbound.this_option = x->request.header.token;
+
+	ret = smcp_inbound_index_options_(self);
+	require_noerr(ret, bail);
+
+	smcp_inbound_option_cursor_init_(self, &self->inbound.next_option);
+
+	self->inbound.content_ptr = (char*)x->request.header.token + x->request.header.token_len;
 	self->outbound.packet->tt = x->request.header.tt;
 	self->inbound.is_fake = true;
 	self->is_processing_message = true;
@@ -500,22 +705,71 @@ bail:
 	return ret;
 }
 
+//!	Returns true if an async response has no use for the request option `key`.
+static bool
+async_response_drops_option_(coap_option_key_t key) {
+	switch(key) {
+	// These describe the content, which isn't kept.
+	case COAP_OPTION_CONTENT_TYPE:
+	case COAP_OPTION_BLOCK1:
+	case COAP_OPTION_SIZE1:
+	// Preconditions have already been checked.
+	case COAP_OPTION_IF_MATCH:
+	case COAP_OPTION_IF_NONE_MATCH:
+		return true;
+	default:
+		return false;
+	}
+}
+
+//!	Returns how many bytes coap_encode_option() will write.
+static size_t
+encoded_option_len_(coap_option_key_t prev_key, coap_option_key_t key, size_t len) {
+	const uint16_t delta = key - prev_key;
+
+	return 1 + len
+		+ ((delta >= 269) ? 2 : (delta >= 13) ? 1 : 0)
+		+ ((len >= 269) ? 2 : (len >= 13) ? 1 : 0);
+}
+
 smcp_status_t
 smcp_start_async_response(struct smcp_async_response_s* x,int flags) {
 	smcp_status_t ret = 0;
 	smcp_t const self = smcp_get_current_instance();
+	const struct coap_header_s* const packet = smcp_inbound_get_packet();
+	coap_option_key_t prev_key = 0;
+	struct smcp_inbound_option_cursor_s cursor;
+	struct smcp_inbound_option_s option;
+	size_t len;
 
 	require_action_string(x!=NULL,bail,ret=SMCP_STATUS_INVALID_ARGUMENT,"NULL async_response arg");
 
-	require_action_string(
-		smcp_inbound_get_packet_length()-smcp_inbound_get_content_len()<=sizeof(x->request),
-		bail,
-		(smcp_outbound_quick_response(COAP_RESULT_413_REQUEST_ENTITY_TOO_LARGE,NULL),ret=SMCP_STATUS_FAILURE),
-		"Request too big for async response"
-	);
+	len = (const uint8_t*)packet->token + packet->token_len - (const uint8_t*)packet;
+	memcpy(x->request.bytes, packet, len);
+
+	smcp_inbound_option_cursor_init_(self, &cursor);
+	while(smcp_inbound_option_cursor_next_(self, &cursor, &option)) {
+		if(async_response_drops_option_(option.key))
+			continue;
 
-	x->request_len = smcp_inbound_get_packet_length()-smcp_inbound_get_content_len();
-	memcpy(x->request.bytes,smcp_inbound_get_packet(),x->request_len);
+		require_action_string(
+			len + encoded_option_len_(prev_key, option.key, option.len) <= sizeof(x->request),
+			bail,
+			(smcp_outbound_quick_response(COAP_RESULT_413_REQUEST_ENTITY_TOO_LARGE,NULL),ret=SMCP_STATUS_FAILURE),
+			"Request too big for async response"
+		);
+
+		len = coap_encode_option(
+			x->request.bytes + len,
+			prev_key,
+			option.key,
+			(const uint8_t*)packet + option.offset,
+			option.len
+		) - x->request.bytes;
+		prev_key = option.key;
+	}
+
+	x->request_len = (uint16_t)len;
 
 	assert(coap_verify_packet((const char*)x->request.bytes, x->request_len));
 
@@ -579,18 +833,18 @@ smcp_inbound_is_related_to_async_response(struct smcp_async_response_s* x)
 
 coap_msg_id_t
 smcp_get_next_msg_id(smcp_t self) {
-	static coap_msg_id_t next_msg_id;
+	SMCP_EMBEDDED_SELF_HOOK;
 
-	if(!next_msg_id)
-		next_msg_id = SMCP_FUNC_RANDOM_UINT32();
+	if(!self->last_msg_id)
+		self->last_msg_id = SMCP_FUNC_RANDOM_UINT32();
 
 #if DEBUG
-	next_msg_id++;
+	self->last_msg_id++;
 #else
-	next_msg_id = next_msg_id*23873 + 41;
+	self->last_msg_id = self->last_msg_id*23873 + 41;
 #endif
 
-	return next_msg_id;
+	return self->last_msg_id;
 }
 
 #if !SMCP_EMBEDDED || DEBUG
@@ -623,6 +877,9 @@ const char* smcp_status_to_cstr(int x) {
 
 	case SMCP_STATUS_RESET: return "Transaction Reset"; break;
 	case SMCP_STATUS_URI_PARSE_FAILURE: return "URI Parse Failure"; break;
+	case SMCP_STATUS_ETAG_MISMATCH: return "ETag Mismatch"; break;
+	case SMCP_STATUS_RESPONDED: return "Already Responded"; break;
+	case SMCP_STATUS_WAIT_FOR_PEER: return "Wait For Peer"; break;
 
 	case SMCP_STATUS_ERRNO:
 #if SMCP_USE_BSD_SOCKETS
@@ -632,7 +889,7 @@ const char* smcp_status_to_cstr(int x) {
 #endif
 	default:
 		{
-			static char cstr[30];
+			static SMCP_THREAD_LOCAL char cstr[30];
 			sprintf(cstr, "Unknown Status (%d)", x);
 			return cstr;
 		}
@@ -89,6 +89,7 @@
 #if SMCP_USE_BSD_SOCKETS
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
 #define SMCP_SOCKET_ARGS	struct sockaddr* saddr, socklen_t socklen
 #elif defined(CONTIKI)
 #define SMCP_SOCKET_ARGS	const uip_ipaddr_t *toaddr, uint16_t toport
@@ -133,6 +134,9 @@ enum {
 	SMCP_STATUS_ASYNC_RESPONSE		= -24,
 	SMCP_STATUS_UNAUTHORIZED		= -25,
 	SMCP_STATUS_BAD_PACKET			= -26,
+	SMCP_STATUS_ETAG_MISMATCH		= -27,	//!< The representation changed during a block transfer.
+	SMCP_STATUS_RESPONDED			= -28,	//!< The request was already answered.
+	SMCP_STATUS_WAIT_FOR_PEER		= -29,	//!< The peer already has as many requests outstanding as NSTART allows.
 };
 
 typedef int smcp_status_t;
@@ -166,6 +170,7 @@ typedef smcp_callback_func smcp_inbound_resend_func;
 // as possible, these macros do all of the work for us.
 #define SMCP_EMBEDDED_SELF_HOOK 	smcp_t const self = smcp_get_current_instance()
 #define smcp_init(self,...)		smcp_init(__VA_ARGS__)
+#define smcp_init_with_flags(self,...)		smcp_init_with_flags(__VA_ARGS__)
 #define smcp_release(self)		smcp_release()
 #define smcp_get_next_msg_id(self)		smcp_get_next_msg_id()
 #define smcp_get_port(self)		smcp_get_port()
@@ -181,6 +186,13 @@ typedef smcp_callback_func smcp_inbound_resend_func;
 #define smcp_inbound_start_packet(self,...)		smcp_inbound_start_packet(__VA_ARGS__)
 #define smcp_vhost_add(self,...)		smcp_vhost_add(__VA_ARGS__)
 #define smcp_set_default_request_handler(self,...)		smcp_set_default_request_handler(__VA_ARGS__)
+#define smcp_get_stats(self)		smcp_get_stats()
+#define smcp_reset_stats(self)		smcp_reset_stats()
+#define smcp_get_peer_stats(self,...)		smcp_get_peer_stats(__VA_ARGS__)
+#define smcp_set_peer_nstart(self,...)		smcp_set_peer_nstart(__VA_ARGS__)
+#define smcp_flush(self)		smcp_flush()
+#define smcp_set_send_queue_enabled(self,...)		smcp_set_send_queue_enabled(__VA_ARGS__)
+#define smcp_uri_init(self,...)		smcp_uri_init(__VA_ARGS__)
 #else
 #define SMCP_EMBEDDED_SELF_HOOK
 #endif
@@ -196,6 +208,23 @@ typedef smcp_callback_func smcp_inbound_resend_func;
 //! Initializes an SMCP instance
 extern smcp_t smcp_init(smcp_t self, uint16_t port);
 
+//!	Allow several instances to bind to the same port.
+/*!	Used to shard a server across several threads, each with its
+**	own instance. Each instance gets its own socket, bound with
+**	`SO_REUSEPORT`. On Linux the kernel picks the socket for each
+**	datagram by hashing the source and destination addresses and
+**	ports, so all of the packets from a given peer end up on the
+**	same instance for as long as the set of instances is unchanged.
+**	That keeps duplicate detection and transactions consistent.
+**
+**	With this flag, initialization fails if `port` is already in
+**	use by a socket that doesn't also use this flag. Without it,
+**	the next free port is used instead. */
+#define SMCP_INIT_FLAG_REUSE_PORT		(1<<0)
+
+//! Initializes an SMCP instance using the given `SMCP_INIT_FLAG_*` flags.
+extern smcp_t smcp_init_with_flags(smcp_t self, uint16_t port, int flags);
+
 //! Releases an SMCP instance, closing all ports and ending all transactions.
 extern void smcp_release(smcp_t self);
 
@@ -207,10 +236,14 @@ extern struct smcp_s smcp_global_instance;
 #define smcp_get_current_instance() (&smcp_global_instance)
 #else
 //! Used from inside of callbacks to obtain a reference to the current instance.
+/*!	When SMCP_CONF_THREAD_SAFE is set, each thread has its own current instance. */
 extern smcp_t smcp_get_current_instance();
 
 //! Allocates and initializes an SMCP instance.
 extern smcp_t smcp_create(uint16_t port);
+
+//! Allocates and initializes an SMCP instance using the given `SMCP_INIT_FLAG_*` flags.
+extern smcp_t smcp_create_with_flags(uint16_t port, int flags);
 #endif
 
 //!	Sets the URL to use as a CoAP proxy.
@@ -257,15 +290,41 @@ extern smcp_status_t smcp_vhost_add(
 **	@brief Functions supporting non-blocking asynchronous IO.
 */
 
-//!	Processes one event and (if using BSD sockets) processes one packet if available.
+//!	Processes one event and (if using BSD sockets) processes any packets that are available.
 /*!	This function must be called periodically for SMCP to handle events and packets.
 **	When using with BSD sockets, smcp_process() will wait for `cms` milliseconds
-**	to see if a packet arrives. */
+**	to see if a packet arrives. If packets are waiting, up to
+**	SMCP_CONF_RECV_BATCH_SIZE of them are read and handled in one call. */
 extern smcp_status_t smcp_process(smcp_t self, cms_t cms);
 
 //!	Maximum amount of time that can pass before smcp_process() must be called again.
 extern cms_t smcp_get_timeout(smcp_t self);
 
+//!	Sends any packets that are waiting in the outbound queue.
+/*!	smcp_process() calls this automatically, so you only need to call
+**	it when you have sent packets from outside of smcp_process()
+**	and you don't want to wait for the next call. */
+extern smcp_status_t smcp_flush(smcp_t self);
+
+//!	Enables or disables the outbound queue.
+/*!	When enabled, smcp_outbound_send() copies each packet into a queue
+**	instead of sending it immediately. The queue is sent all at once
+**	(using `sendmmsg()` where available) when it fills up, at the end of
+**	smcp_process(), or when smcp_flush() is called. No packet waits
+**	longer than SMCP_CONF_SEND_QUEUE_MAX_DELAY, provided that
+**	smcp_process() is called as smcp_get_timeout() asks.
+**
+**	Since queued packets are sent later, smcp_outbound_send() can't
+**	report when the socket refuses one. Such failures are counted in
+**	`send_queue_errors` and returned by smcp_flush(), and so by the
+**	smcp_process() call that flushed them. When smcp_outbound_send()
+**	has to flush the queue itself, to make room or because a packet
+**	has waited long enough, the failures are only counted and logged.
+**
+**	Disabled by default. Disabling the queue flushes it. Has no effect
+**	if SMCP_CONF_SEND_QUEUE_SIZE is zero. */
+extern void smcp_set_send_queue_enabled(smcp_t self, bool enabled);
+
 #if SMCP_USE_BSD_SOCKETS
 //!	Gets the file descriptor for the UDP socket.
 /*!	Useful for implementing asynchronous operation using select(),
@@ -276,6 +335,163 @@ extern int smcp_get_fd(smcp_t self);
 extern struct uip_udp_conn* smcp_get_udp_conn(smcp_t self);
 #endif
 
+#if SMCP_CONF_COMMAND_QUEUE
+//!	A function to be run on the thread that calls smcp_process().
+typedef void (*smcp_command_func)(smcp_t self, void* context);
+
+//!	Asks the thread running smcp_process() to call `func`. Safe to call from any thread.
+/*!	This is how other threads should touch an instance, for example to
+**	finish an async response: `func` can call smcp_outbound_begin(),
+**	smcp_outbound_set_async_response() and smcp_outbound_send() just
+**	as it could from a request handler.
+**
+**	Commands run in the order they were posted, in batches, the next
+**	time smcp_process() is called. Commands still waiting when the
+**	instance is released are dropped without being run. */
+extern smcp_status_t smcp_post_command(smcp_t self, smcp_command_func func, void* context);
+
+//!	Gets the file descriptor that becomes readable when commands are posted.
+/*!	Event loops that wait with select() or poll() instead of
+**	smcp_process() need to watch this as well as smcp_get_fd(). */
+extern int smcp_get_command_fd(smcp_t self);
+#endif
+
+/*!	@} */
+
+#pragma mark -
+#pragma mark Statistics
+
+/*!	@defgroup smcp-stats Statistics
+**	@{
+**	@brief Counters describing what an instance has been up to.
+*/
+
+struct smcp_stats_s {
+	//!	Number of times smcp_process() read from the socket.
+	uint32_t	recv_calls;
+
+	//!	Total number of datagrams read from the socket.
+	uint32_t	recv_packets;
+
+	//!	Largest number of datagrams read by a single call.
+	uint32_t	recv_batch_max;
+
+	//!	Histogram of datagrams read per call, indexed by batch size.
+	uint32_t	recv_batch_hist[SMCP_CONF_RECV_BATCH_SIZE+1];
+
+	//!	Number of packets handed to the socket.
+	uint32_t	send_packets;
+
+	//!	Number of system calls made to send those packets.
+	uint32_t	send_calls;
+
+	//!	Number of packets that the socket refused to send.
+	uint32_t	send_errors;
+
+	//!	How many of those had been queued, so that smcp_outbound_send()
+	//!	had already returned SMCP_STATUS_OK for them.
+	uint32_t	send_queue_errors;
+
+	//!	Number of times the outbound queue was flushed because it was full.
+	uint32_t	send_flush_full;
+
+	//!	Number of times the outbound queue was flushed because
+	//!	SMCP_CONF_SEND_QUEUE_MAX_DELAY had elapsed.
+	uint32_t	send_flush_delay;
+
+	//!	Number of inbound messages found in the response cache.
+	uint32_t	response_cache_hits;
+
+	//!	Number of inbound messages not found in the response cache.
+	uint32_t	response_cache_misses;
+
+	//!	Number of response cache entries dropped to make room
+	//!	before they had expired.
+	uint32_t	response_cache_evictions;
+
+	//!	Number of host name lookups answered from the resolver cache.
+	uint32_t	dns_cache_hits;
+
+	//!	Number of host name lookups handed to the resolver thread.
+	uint32_t	dns_cache_misses;
+
+	//!	Number of blocks of large responses served without calling the handler.
+	uint32_t	large_response_hits;
+
+	//!	Number of notifications rendered by a resource handler and kept for other observers.
+	uint32_t	notification_renders;
+
+	//!	Number of notifications sent from a kept copy without calling the handler.
+	uint32_t	notification_replays;
+
+	//!	Number of triggers folded into a notification that was already waiting to be sent.
+	uint32_t	notifications_coalesced;
+
+	//!	Number of unacknowledged notifications replaced by a newer one.
+	uint32_t	notifications_superseded;
+
+	//!	Number of commands posted from other threads that have been run.
+	uint32_t	commands_run;
+
+	//!	Largest number of posted commands run in a single batch.
+	uint32_t	command_batch_max;
+};
+
+//!	Returns the statistics counters for the given instance.
+extern const struct smcp_stats_s* smcp_get_stats(smcp_t self);
+
+//!	Resets all of the statistics counters to zero.
+extern void smcp_reset_stats(smcp_t self);
+
+#if SMCP_CONF_PEER_TABLE
+//!	What the transaction layer knows about one of the peers it talks to.
+struct smcp_peer_stats_s {
+#if SMCP_USE_BSD_SOCKETS
+	struct sockaddr_in6	saddr;
+#elif defined(CONTIKI)
+	uip_ipaddr_t		toaddr;
+	uint16_t			toport;
+#endif
+
+	//!	Current retransmission timeout, in milliseconds.
+	cms_t		rto;
+
+	//!	Smoothed round-trip time and its variation, in milliseconds.
+	//!	Zero until the first exchange without retransmissions.
+	cms_t		srtt;
+	cms_t		rttvar;
+
+	//!	Confirmable requests waiting for an acknowledgement.
+	uint8_t		outstanding;
+
+	//!	Transactions waiting for smcp_set_peer_nstart() to allow them to send.
+	uint8_t		queued;
+
+	//!	Round-trip samples taken from exchanges without (strong)
+	//!	and with (weak) retransmissions.
+	uint32_t	strong_samples;
+	uint32_t	weak_samples;
+
+	//!	Number of requests sent again because no acknowledgement came in time.
+	uint32_t	retransmissions;
+};
+
+//!	Sets how many confirmable requests may be outstanding to any one peer.
+/*!	Transactions that would go over the limit wait, in order, until
+**	one of the peer's requests is answered or ends. Zero means no
+**	limit. The default is SMCP_CONF_PEER_NSTART, which is `1` as
+**	RFC7252 asks. */
+extern void smcp_set_peer_nstart(smcp_t self, uint8_t nstart);
+
+//!	Copies the stats of up to `count` peers into `stats`.
+/*!	Returns the number of entries filled in. */
+extern int smcp_get_peer_stats(
+	smcp_t self,
+	struct smcp_peer_stats_s* stats,
+	int count
+);
+#endif
+
 /*!	@} */
 
 #pragma mark -
@@ -380,6 +596,10 @@ extern coap_option_key_t smcp_inbound_peek_option(const uint8_t** ptr, size_t* l
 //!	Reset the option pointer to the start of the options.
 extern void smcp_inbound_reset_next_option();
 
+//!	Finds the first option with the given key, without moving the option pointer.
+/*!	Returns false if the inbound packet doesn't have that option. */
+extern bool smcp_inbound_find_option(coap_option_key_t key, const uint8_t** ptr, size_t* len);
+
 //!	Compares the key and value of the current option to specific c-string values.
 extern bool smcp_inbound_option_strequal(coap_option_key_t key,const char* str);
 
@@ -450,6 +670,51 @@ extern smcp_status_t smcp_outbound_set_destaddr(
 **	defined, this function will automatically use the proxy. */
 extern smcp_status_t smcp_outbound_set_uri(const char* uri,char flags);
 
+//!	A URI that has already been parsed and resolved.
+/*!	Parsing a URI, splitting it into options and looking up its host
+**	is by far the most expensive part of building a request. Clients
+**	that send to the same URI over and over again (retransmits,
+**	polling, block transfers) can do that work once with
+**	smcp_uri_init() and then apply the result to each outbound
+**	packet with smcp_outbound_set_uri_handle().
+**
+**	The host is only looked up when the handle is initialized,
+**	so a handle must be initialized again to pick up changes
+**	in DNS. */
+struct smcp_uri_s {
+	bool				has_destaddr;
+#if SMCP_USE_BSD_SOCKETS
+	struct sockaddr_in6	saddr;
+#elif defined(CONTIKI)
+	uip_ipaddr_t		toaddr;
+	uint16_t			toport;
+#endif
+	uint8_t				option_count;
+	uint16_t			option_values_len;
+	struct {
+		coap_option_key_t	key;
+		uint16_t			offset;
+		uint16_t			len;
+	} option[SMCP_CONF_URI_MAX_OPTIONS];
+	char				option_values[SMCP_CONF_URI_OPTIONS_SIZE];
+};
+
+typedef struct smcp_uri_s* smcp_uri_t;
+
+//!	Parses and resolves `uri` into `handle`.
+/*!	Takes the same flags as smcp_outbound_set_uri(). Returns
+**	SMCP_STATUS_WAIT_FOR_DNS if the host lookup hasn't finished yet,
+**	and SMCP_STATUS_NOT_IMPLEMENTED for URIs that carry credentials. */
+extern smcp_status_t smcp_uri_init(
+	smcp_t self,
+	smcp_uri_t handle,
+	const char* uri,
+	char flags
+);
+
+//!	Sets the destination and Uri options of the outbound packet from `handle`.
+extern smcp_status_t smcp_outbound_set_uri_handle(smcp_uri_t handle);
+
 /*!	After the following function is called you cannot add any more options
 **	without loosing the content. */
 extern char* smcp_outbound_get_content_ptr(
@@ -461,6 +726,19 @@ extern smcp_status_t smcp_outbound_set_content_len(size_t len);
 
 extern smcp_status_t smcp_outbound_append_content(const char* value,size_t len);
 
+#if SMCP_USE_BSD_SOCKETS
+//!	Uses the given buffers as the content, without copying them.
+/*!	This replaces any content that was added before, and no other
+**	content may be added after it. The `iov` array itself is copied,
+**	but the buffers it points to are only read by smcp_outbound_send(),
+**	so they must stay valid until it returns. Nothing refers to them
+**	after that: retransmissions build the packet again by calling the
+**	transaction's resend callback, and any copies that SMCP keeps (in the
+**	outbound queue or the response cache) are made before it returns.
+*/
+extern smcp_status_t smcp_outbound_set_content_iov(const struct iovec* iov, int iovcnt);
+#endif
+
 #if !SMCP_AVOID_PRINTF
 extern smcp_status_t smcp_outbound_set_content_formatted(const char* fmt, ...);
 
@@ -498,6 +776,151 @@ extern smcp_status_t smcp_outbound_set_var_content_unsigned_long_int(unsigned lo
 
 /*!	@} */
 
+#pragma mark -
+#pragma mark Response Templates
+
+/*!	@defgroup smcp-template Response Templates
+**	@{
+**	@brief Canned responses for resources that always answer the same way.
+**
+**	A response template holds a result code, its options already
+**	encoded, and optionally some content. Sending one just copies
+**	it into the outbound packet after filling in the message id,
+**	token and type, so none of the options are encoded again.
+**
+**	To serve a template from the node router, set the node's
+**	`request_handler` to smcp_response_template_request_handler()
+**	and its `context` to the template.
+*/
+
+struct smcp_response_template_s {
+	coap_code_t			code;
+	coap_option_key_t	last_option_key;
+	uint8_t				options_len;
+	uint8_t				options[SMCP_CONF_RESPONSE_TEMPLATE_OPTIONS_SIZE];
+	const char*			content;
+	size_t				content_len;
+};
+
+typedef struct smcp_response_template_s* smcp_response_template_t;
+
+//!	Sets up an empty template for a response with the given result code.
+extern smcp_response_template_t smcp_response_template_init(
+	smcp_response_template_t self,
+	coap_code_t code
+);
+
+//!	Adds an option to the template.
+extern smcp_status_t smcp_response_template_add_option(
+	smcp_response_template_t self,
+	coap_option_key_t key,
+	const char* value,
+	size_t len
+);
+
+//!	Adds an option with a CoAP-encoded unsigned integer value to the template.
+extern smcp_status_t smcp_response_template_add_option_uint(
+	smcp_response_template_t self,
+	coap_option_key_t key,
+	uint32_t value
+);
+
+//!	Sets the content of the template.
+/*!	The content is not copied, so it must stay around for as long as
+**	the template is in use. */
+extern void smcp_response_template_set_content(
+	smcp_response_template_t self,
+	const char* content,
+	size_t len
+);
+
+//!	Sends the given template as the response to the current inbound packet.
+/*!	No other options may be added to a template response. */
+extern smcp_status_t smcp_outbound_send_template(smcp_response_template_t tmpl);
+
+//!	Request handler that answers GET requests with the template passed as `context`.
+extern smcp_status_t smcp_response_template_request_handler(void* context);
+
+/*!	@} */
+
+#pragma mark -
+#pragma mark Large Responses
+
+/*!	@defgroup smcp-large Large Responses
+**	@{
+**	@brief Responses that don't fit in a single packet.
+**
+**	Instead of writing its content into the outbound packet, a
+**	handler passes a generator to smcp_outbound_send_large(). The
+**	generator appends the whole representation, however big, to a
+**	growable buffer. The client is then sent whichever Block2 block
+**	it asked for.
+**
+**	The representation is remembered for a little while, keyed by
+**	the client's address and the URI it asked for. Requests for
+**	later blocks of the same URI from the same client are answered
+**	from there without calling the request handler again.
+*/
+
+struct smcp_large_content_s;
+typedef struct smcp_large_content_s* smcp_large_content_t;
+
+//!	Appends `len` bytes of `value` to the representation being generated.
+/*!	Returns SMCP_STATUS_MESSAGE_TOO_BIG when the content can't grow
+**	any more, at which point the generator should stop. */
+extern smcp_status_t smcp_large_content_append(
+	smcp_large_content_t content,
+	const char* value,
+	size_t len
+);
+
+//!	Generates a complete representation using smcp_large_content_append().
+typedef smcp_status_t (*smcp_large_content_func)(
+	smcp_large_content_t content,
+	void* context
+);
+
+//!	Sends the response to the current request, splitting it into blocks if needed.
+/*!	Call this after smcp_outbound_begin_response() and after adding
+**	all other options. Don't add Block2 or ETag yourself: they are
+**	added here, and the ETag is a hash of the content.
+**
+**	When SMCP_CONF_LARGE_RESPONSES isn't set, whatever doesn't fit
+**	in the packet is silently dropped. */
+extern smcp_status_t smcp_outbound_send_large(
+	smcp_large_content_func generator,
+	void* context
+);
+
+/*!	@} */
+
+#pragma mark -
+#pragma mark Large Requests
+
+/*!	@defgroup smcp-block1 Large Requests
+**	@{
+**	@brief Request bodies that arrive in several Block1 blocks.
+*/
+
+//!	Puts the blocks of a Block1 request body back together.
+/*!	Call this first thing in a request handler that wants the whole
+**	body at once. When it returns SMCP_STATUS_OK, the body is
+**	complete and smcp_inbound_get_content_ptr() and
+**	smcp_inbound_get_content_len() cover all of it. Requests without
+**	a Block1 option are let through untouched.
+**
+**	Every block but the last is stored away and answered with
+**	2.31 Continue, and this returns SMCP_STATUS_RESPONDED. It also
+**	answers with 4.08 when a block is missing, and with 4.13 when
+**	the body is bigger than SMCP_CONF_BLOCK1_UPLOAD_MAX_SIZE. In
+**	all of these cases the handler should just return the status.
+**
+**	When SMCP_CONF_BLOCK1_UPLOADS isn't set, requests with a Block1
+**	option get SMCP_STATUS_NOT_IMPLEMENTED. */
+extern smcp_status_t smcp_inbound_collect_block1(void);
+
+/*!	@} */
+
 #pragma mark -
 #pragma mark Asynchronous response support API
 
@@ -507,20 +930,24 @@ extern smcp_status_t smcp_outbound_set_var_content_unsigned_long_int(unsigned lo
 
 #define SMCP_ASYNC_RESPONSE_FLAG_DONT_ACK		(1<<0)
 
+//!	What is needed to answer a request later.
+/*!	Only the header, the token and the options a handler may still
+**	look at are kept. The content of the request, and options that
+**	only describe it or its preconditions, are left out. */
 struct smcp_async_response_s {
 #if SMCP_USE_BSD_SOCKETS
 	struct sockaddr_in6		saddr;
-	socklen_t				socklen;
+	uint8_t					socklen;
 #elif CONTIKI
 	uip_ipaddr_t			toaddr;
 	uint16_t				toport;	// Always in network order.
 #endif
 
+	uint16_t request_len;
 	union {
 		struct coap_header_s header;
-		uint8_t bytes[80];
+		uint8_t bytes[SMCP_CONF_ASYNC_RESPONSE_MAX_LENGTH];
 	} request;
-	size_t request_len;
 };
 
 typedef struct smcp_async_response_s* smcp_async_response_t;
@@ -64,6 +64,8 @@ bool send_get_request(
 
 static int retries = 0;
 static const char *url_data;
+static struct smcp_uri_s url_handle;
+static bool has_url_handle;
 static char next_data[128];
 static size_t next_len = ((size_t)(-1));
 static int redirect_count;
@@ -72,6 +74,11 @@ static int last_observe_value = -1;
 static int last_block = -1;
 static coap_content_type_t request_accept_type = -1;
 
+// The blocks of the representation being read, which is only
+// printed once it is complete.
+static char* get_data;
+static size_t get_data_size;
+
 static struct smcp_transaction_s transaction;
 
 static smcp_status_t
@@ -79,6 +86,14 @@ get_response_handler(int statuscode, void* context) {
 	const char* content = smcp_inbound_get_content_ptr();
 	size_t content_length = smcp_inbound_get_content_len();
 
+	if(statuscode == SMCP_STATUS_ETAG_MISMATCH) {
+		// The resource changed while we were reading it. The
+		// transaction starts over from the first block, and
+		// nothing of the old representation has been printed.
+		get_data_size = 0;
+		return SMCP_STATUS_OK;
+	}
+
 	if(statuscode>=0) {
 		if(content_length>(smcp_inbound_get_packet_length()-4)) {
 			fprintf(stderr, "INTERNAL ERROR: CONTENT_LENGTH LARGER THAN PACKET_LENGTH-4! (content_length=%lu, packet_length=%lu)\n",content_length,smcp_inbound_get_packet_length());
@@ -133,6 +148,7 @@ get_response_handler(int statuscode, void* context) {
 		size_t value_len;
 		bool last_block = true;
 		int32_t observe_value = -1;
+		char* new_data;
 
 		while((key=smcp_inbound_next_option(&value, &value_len))!=COAP_OPTION_INVALID) {
 
@@ -146,15 +162,27 @@ get_response_handler(int statuscode, void* context) {
 
 		}
 
-		fwrite(content, content_length, 1, stdout);
+		new_data = realloc(get_data, get_data_size + content_length);
+		if(!new_data) {
+			fprintf(stderr, "get: Out of memory\n");
+			get_data_size = 0;
+			gRet = ERRORCODE_UNKNOWN;
+			goto bail;
+		}
+		get_data = new_data;
+		memcpy(get_data + get_data_size, content, content_length);
+		get_data_size += content_length;
 
 		if(last_block) {
+			fwrite(get_data, get_data_size, 1, stdout);
+
 			// Only print a newline if the content doesn't already print one.
-			if(content_length && (content[content_length - 1] != '\n'))
+			if(get_data[get_data_size - 1] != '\n')
 				printf("\n");
-		}
 
-		fflush(stdout);
+			get_data_size = 0;
+			fflush(stdout);
+		}
 
 		last_observe_value = observe_value;
 	}
@@ -175,7 +203,12 @@ resend_get_request(void* context) {
 	status = smcp_outbound_begin(smcp_get_current_instance(),COAP_METHOD_GET, get_tt);
 	require_noerr(status,bail);
 
-	status = smcp_outbound_set_uri(url_data, 0);
+	// Without a handle, the string form parses the URL again on
+	// every send, and waits for the host name to resolve if need be.
+	if(has_url_handle)
+		status = smcp_outbound_set_uri_handle(&url_handle);
+	else
+		status = smcp_outbound_set_uri(url_data, 0);
 	require_noerr(status,bail);
 
 	if(request_accept_type!=COAP_CONTENT_TYPE_UNKNOWN) {
@@ -204,12 +237,15 @@ send_get_request(
 ) {
 	bool ret = false;
 	smcp_status_t status = 0;
-	int flags = SMCP_TRANSACTION_ALWAYS_INVALIDATE;
+	int flags = SMCP_TRANSACTION_ALWAYS_INVALIDATE | SMCP_TRANSACTION_BLOCK2_AUTO;
 	gRet = ERRORCODE_INPROGRESS;
 
 	retries = 0;
 	url_data = url;
 
+	// Parse and resolve the URL once for all of the retransmits.
+	has_url_handle = (smcp_uri_init(smcp, &url_handle, url_data, 0) == SMCP_STATUS_OK);
+
 	if(get_observe)
 		flags |= SMCP_TRANSACTION_OBSERVE;
 	if(get_keep_alive)
@@ -260,6 +296,7 @@ tool_cmd_get(
 	get_timeout = 30*1000; // Default timeout is 30 seconds.
 	last_observe_value = -1;
 	last_block = -1;
+	get_data_size = 0;
 	request_accept_type = COAP_CONTENT_TYPE_UNKNOWN;
 	observe_once = false;
 	observe_ignore_first = false;
@@ -356,5 +393,9 @@ bail:
 	smcp_transaction_end(smcp,&transaction);
 	signal(SIGINT, previous_sigint_handler);
 	url_data = NULL;
+	has_url_handle = false;
+	free(get_data);
+	get_data = NULL;
+	get_data_size = 0;
 	return gRet;
 }
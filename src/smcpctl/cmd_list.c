@@ -255,6 +255,13 @@ list_response_handler(
 		return SMCP_STATUS_TRANSACTION_INVALIDATED;
 	}
 
+	if(statuscode == SMCP_STATUS_ETAG_MISMATCH) {
+		// The listing changed while we were reading it. The
+		// transaction starts over from the first block.
+		list_data_size = 0;
+		return SMCP_STATUS_OK;
+	}
+
 	if(statuscode>=0) {
 		if(content_length>(smcp_inbound_get_packet_length()-4)) {
 			fprintf(stderr, "INTERNAL ERROR: CONTENT_LENGTH LARGER THAN PACKET_LENGTH-4! (content_length=%lu, packet_length=%lu)\n",content_length,smcp_inbound_get_packet_length());
@@ -391,7 +398,7 @@ send_list_request(
 ) {
 	bool ret = false;
 	smcp_status_t status = 0;
-	int flags = SMCP_TRANSACTION_ALWAYS_INVALIDATE;
+	int flags = SMCP_TRANSACTION_ALWAYS_INVALIDATE | SMCP_TRANSACTION_BLOCK2_AUTO;
 	tid = smcp_get_next_msg_id(smcp);
 	gRet = ERRORCODE_INPROGRESS;
 //	if(!next)
@@ -52,6 +52,8 @@ signal_interrupt(int sig) {
 
 struct post_request_s {
 	char* url;
+	struct smcp_uri_s uri;
+	bool has_uri;
 	char* content;
 	size_t content_len;
 	coap_content_type_t content_type;
@@ -125,7 +127,12 @@ resend_post_request(struct post_request_s *request) {
 	status = smcp_outbound_add_option_uint(COAP_OPTION_CONTENT_TYPE, request->content_type);
 	require_noerr(status, bail);
 
-	status = smcp_outbound_set_uri(request->url, 0);
+	// Without a handle, the string form parses the URL again on
+	// every send, and waits for the host name to resolve if need be.
+	if(request->has_uri)
+		status = smcp_outbound_set_uri_handle(&request->uri);
+	else
+		status = smcp_outbound_set_uri(request->url, 0);
 	require_noerr(status, bail);
 
 	status = smcp_outbound_append_content(request->content, request->content_len);
@@ -162,6 +169,8 @@ send_post_request(
 	request = calloc(1,sizeof(*request));
 	require(request!=NULL,bail);
 	request->url = strdup(url);
+	// Parse and resolve the URL once for all of the retransmits.
+	request->has_uri = (smcp_uri_init(smcp, &request->uri, url, 0) == SMCP_STATUS_OK);
 	request->content = calloc(1,content_len);
 	memcpy(request->content,content,content_len);
 	request->content_len = content_len;
@@ -289,7 +289,6 @@ cgi_node_async_resend_response(void* context) {
 	smcp_status_t ret = 0;
 	cgi_node_request_t request = context;
 	size_t block_len = (1<<((request->block2&0x7)+4));
-	size_t max_len;
 
 //	printf("Resending async response. . .\n");
 
@@ -317,12 +316,12 @@ cgi_node_async_resend_response(void* context) {
 			require_noerr(ret,bail);
 		}
 
-		char *content = smcp_outbound_get_content_ptr(&max_len);
-		require_noerr(ret,bail);
-
-		memcpy(content,request->stdout_buffer,MIN(request->stdout_buffer_len,block_len));
+		const struct iovec iov = {
+			.iov_base = request->stdout_buffer,
+			.iov_len = MIN(request->stdout_buffer_len,block_len),
+		};
 
-		ret = smcp_outbound_set_content_len(MIN(request->stdout_buffer_len,block_len));
+		ret = smcp_outbound_set_content_iov(&iov, 1);
 		require_noerr(ret,bail);
 	}
 
@@ -687,7 +686,6 @@ cgi_node_request_handler(
 
 		if(request->stdout_buffer_len>=block_len || request->fd_cmd_stdout<=-1) {
 			// We have data!
-			size_t max_len;
 
 			ret = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
 			require_noerr(ret,bail);
@@ -700,12 +698,12 @@ cgi_node_request_handler(
 				require_noerr(ret,bail);
 			}
 
-			char *content = smcp_outbound_get_content_ptr(&max_len);
-			require_noerr(ret,bail);
-
-			memcpy(content,request->stdout_buffer,MIN(request->stdout_buffer_len,block_len));
+			const struct iovec iov = {
+				.iov_base = request->stdout_buffer,
+				.iov_len = MIN(request->stdout_buffer_len,block_len),
+			};
 
-			ret = smcp_outbound_set_content_len(MIN(request->stdout_buffer_len,block_len));
+			ret = smcp_outbound_set_content_iov(&iov, 1);
 			require_noerr(ret,bail);
 
 			ret = smcp_outbound_send();
@@ -52,8 +52,13 @@
 #include <libgen.h>
 #include <syslog.h>
 
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
 #include <smcp/smcp.h>
 #include <smcp/smcp-node-router.h>
+#include <smcp/smcp-variable_node.h>
 //#include <smcp/smcp-pairing.h>
 #include <missing/fgetln.h>
 //#include <smcp/smcp-timer_node.h>
@@ -101,10 +106,17 @@ static arg_list_item_t option_list[] = {
 	{ 'd', "debug", NULL, "Enable debugging mode"	},
 	{ 'p', "port",	NULL, "Port number"				},
 	{ 'c', "config",NULL, "Config File"				},
+	{ 'w', "workers",NULL, "Number of worker threads"	},
 	{ 0 }
 };
 
+#define SMCPD_MAX_WORKERS	64
+
 static smcp_t smcp;
+static smcp_t gWorker[SMCPD_MAX_WORKERS];
+static int gWorkerCount = 1;
+static volatile bool gStopWorkers;
+static char* gProxyURL;
 static struct smcp_node_s root_node;
 static int gRet;
 
@@ -310,6 +322,131 @@ strlinelen(const char* line) {
 	return ret;
 }
 
+#pragma mark -
+#pragma mark Workers
+
+#if HAVE_PTHREAD_H
+static pthread_t gWorkerThread[SMCPD_MAX_WORKERS];
+
+static void*
+worker_thread_main(void* context) {
+	smcp_t instance = context;
+
+	while(!gStopWorkers)
+		smcp_process(instance, 1000);
+
+	return NULL;
+}
+#endif
+
+//!	Returns true if `node`, or any node below it, can be observed.
+/*!	Observables belong to the instance whose thread uses them, so
+**	they can't be shared between workers. Nodes from modules need to
+**	set `is_observable` for this to find them. */
+static bool
+node_tree_has_observables(smcp_node_t node) {
+	smcp_node_t child;
+
+	if(	node->is_observable
+		|| (node->request_handler == (smcp_request_handler_func)&smcp_variable_node_request_handler)
+	) {
+		return true;
+	}
+
+#if SMCP_NODE_ROUTER_USE_BTREE
+	for(child = bt_first(node->children); child; child = bt_next(child))
+#else
+	for(child = node->children; child; child = ll_next(child))
+#endif
+	{
+		if(node_tree_has_observables(child))
+			return true;
+	}
+
+	return false;
+}
+
+//!	Starts additional instances on the same port, each on its own thread.
+/*!	gWorker[0] is always the primary instance, which is handled
+**	by the main loop along with any async IO modules. */
+static int
+start_workers(void) {
+	int ret = -1;
+	int i;
+
+	gWorker[0] = smcp;
+
+	if(gWorkerCount <= 1)
+		goto done;
+
+#if HAVE_PTHREAD_H
+	if(async_io_module_count) {
+		// Nodes backed by async IO modules keep per-request state and
+		// are driven from the main loop, so they can't be shared.
+		syslog(LOG_WARNING,"Configuration uses asynchronous IO modules, which can't be shared between workers. Using a single worker.");
+		gWorkerCount = 1;
+		goto done;
+	}
+
+	if(node_tree_has_observables(&root_node)) {
+		// Each observable keeps its observers for a single instance.
+		syslog(LOG_WARNING,"Configuration has observable nodes, which can't be shared between workers. Using a single worker.");
+		gWorkerCount = 1;
+		goto done;
+	}
+
+	for(i = 1; i < gWorkerCount; i++) {
+		gWorker[i] = smcp_create_with_flags(smcp_get_port(smcp), SMCP_INIT_FLAG_REUSE_PORT);
+
+		if(!gWorker[i]) {
+			syslog(LOG_CRIT,"Unable to initialize SMCP instance for worker %d.",i);
+			gWorkerCount = i;
+			goto bail;
+		}
+
+		smcp_set_default_request_handler(gWorker[i], &smcp_node_router_handler, &root_node);
+		smcp_set_proxy_url(gWorker[i], gProxyURL);
+		smcp_set_send_queue_enabled(gWorker[i], true);
+
+		if(0 != pthread_create(&gWorkerThread[i], NULL, &worker_thread_main, gWorker[i])) {
+			syslog(LOG_CRIT,"Unable to start thread for worker %d.",i);
+			smcp_release(gWorker[i]);
+			gWorker[i] = NULL;
+			gWorkerCount = i;
+			goto bail;
+		}
+	}
+
+	syslog(LOG_NOTICE,"Started %d workers.",gWorkerCount);
+#else
+	syslog(LOG_WARNING,"Built without thread support. Using a single worker.");
+	gWorkerCount = 1;
+#endif
+
+done:
+	ret = 0;
+bail:
+	return ret;
+}
+
+static void
+stop_workers(void) {
+	int i;
+
+	gStopWorkers = true;
+
+	for(i = 1; i < gWorkerCount; i++) {
+#if HAVE_PTHREAD_H
+		pthread_join(gWorkerThread[i], NULL);
+#endif
+		smcp_release(gWorker[i]);
+		gWorker[i] = NULL;
+	}
+	gWorkerCount = 1;
+}
+
+#pragma mark -
+
 static int
 read_configuration(smcp_t smcp,const char* filename) {
 	int ret = 1;
@@ -363,6 +500,8 @@ read_configuration(smcp_t smcp,const char* filename) {
 				goto bail;
 			}
 			smcp_set_proxy_url(smcp,arg);
+			free(gProxyURL);
+			gProxyURL = strdup(arg);
 		} else if(strcaseequal(cmd,"Pair")) {
 			char* src_arg = get_next_arg(line,&line);
 			char* dest_arg = get_next_arg(line,&line);
@@ -485,6 +624,7 @@ main(
 	HANDLE_LONG_ARGUMENT("port") port = strtol(argv[++i], NULL, 0);
 	HANDLE_LONG_ARGUMENT("config") config_file = argv[++i];
 	HANDLE_LONG_ARGUMENT("debug") debug_mode++;
+	HANDLE_LONG_ARGUMENT("workers") gWorkerCount = strtol(argv[++i], NULL, 0);
 
 	HANDLE_LONG_ARGUMENT("help") {
 		print_arg_list_help(
@@ -499,6 +639,7 @@ main(
 	HANDLE_SHORT_ARGUMENT('p') port = strtol(argv[++i], NULL, 0);
 	HANDLE_SHORT_ARGUMENT('d') debug_mode++;
 	HANDLE_SHORT_ARGUMENT('c') config_file = argv[++i];
+	HANDLE_SHORT_ARGUMENT('w') gWorkerCount = strtol(argv[++i], NULL, 0);
 	HANDLE_SHORT_ARGUMENT2('h', '?') {
 		print_arg_list_help(
 			option_list,
@@ -525,7 +666,16 @@ main(
 	syslog(LOG_NOTICE,"Built with libcurl support.");
 #endif
 
-	smcp = smcp_create(port);
+	if((gWorkerCount < 1) || (gWorkerCount > SMCPD_MAX_WORKERS)) {
+		syslog(LOG_CRIT,"Worker count must be between 1 and %d.",SMCPD_MAX_WORKERS);
+		gRet = ERRORCODE_BADARG;
+		goto bail;
+	}
+
+	if(gWorkerCount > 1)
+		smcp = smcp_create_with_flags(port, SMCP_INIT_FLAG_REUSE_PORT);
+	else
+		smcp = smcp_create(port);
 
 	if(!smcp) {
 		syslog(LOG_CRIT,"Unable to initialize SMCP instance.");
@@ -539,11 +689,17 @@ main(
 	// Set up the node router.
 	smcp_set_default_request_handler(smcp, &smcp_node_router_handler, &root_node);
 
-	smcp_set_proxy_url(smcp,getenv("COAP_PROXY_URL"));
+	if(getenv("COAP_PROXY_URL"))
+		gProxyURL = strdup(getenv("COAP_PROXY_URL"));
+	smcp_set_proxy_url(smcp,gProxyURL);
+
+	smcp_set_send_queue_enabled(smcp, true);
 
 	if(0!=read_configuration(smcp,config_file)) {
 		syslog(LOG_NOTICE,"Error processing configuration file!");
 		gRet = ERRORCODE_BADCONFIG;
+	} else if(0!=start_workers()) {
+		gRet = ERRORCODE_UNKNOWN;
 	} else {
 		syslog(LOG_NOTICE,"Daemon started. Listening on port %d.",smcp_get_port(smcp));
 	}
@@ -569,6 +725,10 @@ main(
 		max_fd = MAX(smcp_get_fd(smcp),max_fd);
 		FD_SET(smcp_get_fd(smcp),&read_fd_set);
 		FD_SET(smcp_get_fd(smcp),&error_fd_set);
+#if SMCP_CONF_COMMAND_QUEUE
+		max_fd = MAX(smcp_get_command_fd(smcp),max_fd);
+		FD_SET(smcp_get_command_fd(smcp),&read_fd_set);
+#endif
 
 		timeout.tv_sec = cms_timeout/1000;
 		timeout.tv_usec = (cms_timeout%1000)*1000;
@@ -586,9 +746,17 @@ main(
 			gRet = ERRORCODE_UNKNOWN;
 		}
 
+		// Modules may have sent asynchronous responses.
+		smcp_flush(smcp);
+
 		if(gRet == ERRORCODE_SIGHUP) {
 			gRet = 0;
-			read_configuration(smcp,config_file);
+			if(gWorkerCount > 1) {
+				// The workers are still using the node tree.
+				syslog(LOG_WARNING,"Can't reload configuration while running multiple workers.");
+			} else {
+				read_configuration(smcp,config_file);
+			}
 		}
 	}
 
@@ -603,9 +771,14 @@ bail:
 		if(gPIDFilename)
 			unlink(gPIDFilename);
 
+		stop_workers();
+
 		smcp_release(smcp);
 
 		syslog(LOG_NOTICE,"Stopped.");
 	}
+
+	free(gProxyURL);
+
 	return gRet;
 }